@@ -27,13 +27,13 @@
  *
  */
 
-#include "sched.mdh"
-#include "sched.pro"
-
-/* node in sched list */
+/* node in sched list, needed in prototypes for statics */
 
 typedef struct schedcmd  *Schedcmd;
 
+#include "sched.mdh"
+#include "sched.pro"
+
 /* Flags for each scheduled event */
 enum schedflags {
     /* Trash zle if necessary when event is activated */
@@ -41,24 +41,153 @@ enum schedflags {
 };
 
 struct schedcmd {
-    struct schedcmd *next;
     char *cmd;			/* command to run */
-    time_t time;		/* when to run it */
+    time_t time;		/* when to run it, for display */
+    long nsec;			/* fraction of a second, if given */
+    struct timespec when;	/* when to run it by zgettime_monotonic() */
+    zlong seq;			/* order of scheduling, for equal times */
+    int idx;			/* position in schedheap */
     int flags;			/* flags as above */
 };
 
-/* the list of sched jobs pending */
+/*
+ * The sched jobs pending, as a binary heap ordered by when they
+ * are due:  schedheap[0] is next, and the children of the entry at
+ * i are at 2*i+1 and 2*i+2.  Adding and removing entries take a time
+ * proportional to the log of the number of entries; the list shown
+ * to the user is sorted from this.
+ */
+
+static Schedcmd *schedheap;
+static int schedcount, schedsize;
 
-static struct schedcmd *schedcmds;
+/* count of events scheduled, to keep the order of ones at the same time */
+static zlong schedseq;
 
 /* flag that timed event is running (via addtimedfn())*/
 static int schedcmdtimed;
 
+/* Whether sch1 is due before sch2 */
+
+/**/
+static int
+schedbefore(Schedcmd sch1, Schedcmd sch2)
+{
+    int cmp = ztimespeccmp(&sch1->when, &sch2->when);
+
+    return cmp ? cmp < 0 : sch1->seq < sch2->seq;
+}
+
+/* Put sch at position i of the heap */
+
+/**/
+static void
+schedset(int i, Schedcmd sch)
+{
+    schedheap[i] = sch;
+    sch->idx = i;
+}
+
+/* Move the entry at i up the heap to where it belongs */
+
+/**/
+static void
+schedup(int i)
+{
+    Schedcmd sch = schedheap[i];
+
+    while (i > 0 && schedbefore(sch, schedheap[(i - 1) / 2])) {
+	schedset(i, schedheap[(i - 1) / 2]);
+	i = (i - 1) / 2;
+    }
+    schedset(i, sch);
+}
+
+/* Move the entry at i down the heap to where it belongs */
+
+/**/
+static void
+scheddown(int i)
+{
+    Schedcmd sch = schedheap[i];
+
+    for (;;) {
+	int c = 2 * i + 1;
+
+	if (c >= schedcount)
+	    break;
+	if (c + 1 < schedcount && schedbefore(schedheap[c + 1], schedheap[c]))
+	    c++;
+	if (!schedbefore(schedheap[c], sch))
+	    break;
+	schedset(i, schedheap[c]);
+	i = c;
+    }
+    schedset(i, sch);
+}
+
+/* Add a new entry to the heap */
+
+/**/
+static void
+schedpush(Schedcmd sch)
+{
+    if (schedcount == schedsize) {
+	int newsize = schedsize ? 2 * schedsize : 16;
+
+	schedheap = (Schedcmd *)zrealloc(schedheap, newsize * sizeof(Schedcmd));
+	schedsize = newsize;
+    }
+    sch->seq = schedseq++;
+    schedset(schedcount++, sch);
+    schedup(sch->idx);
+}
+
+/* Take the entry at position i out of the heap */
+
+/**/
+static void
+schedremove(int i)
+{
+    Schedcmd last = schedheap[--schedcount];
+
+    if (i == schedcount)
+	return;
+    schedset(i, last);
+    if (i > 0 && schedbefore(last, schedheap[(i - 1) / 2]))
+	schedup(i);
+    else
+	scheddown(i);
+}
+
+/* qsort() comparison for entries in the order they are due */
+
+/**/
+static int
+schedcmp(const void *p1, const void *p2)
+{
+    return schedbefore(*(Schedcmd *)p1, *(Schedcmd *)p2) ? -1 : 1;
+}
+
+/* Return the entries in the order they are due, on the heap */
+
+/**/
+static Schedcmd *
+schedsorted(void)
+{
+    Schedcmd *list = (Schedcmd *)zhalloc((schedcount + 1) * sizeof(Schedcmd));
+
+    memcpy(list, schedheap, schedcount * sizeof(Schedcmd));
+    qsort(list, schedcount, sizeof(Schedcmd), schedcmp);
+    list[schedcount] = NULL;
+    return list;
+}
+
 /* Use addtimedfn() to add a timed event for sched's use */
 
 /**/
 static void
-schedaddtimed(time_t t)
+schedaddtimed(void)
 {
     /*
      * The following code shouldn't be necessary and indicates
@@ -69,7 +198,7 @@ schedaddtimed(time_t t)
     if (schedcmdtimed)
 	scheddeltimed();
     schedcmdtimed = 1;
-    addtimedfn(checksched, schedcmds->time);
+    addtimedfn(checksched, &schedheap[0]->when);
 }
 
 /* Use deltimedfn() to remove the sched timed event */
@@ -92,25 +221,25 @@ scheddeltimed(void)
 static void
 checksched(void)
 {
-    time_t t;
-    struct schedcmd *sch;
+    struct timespec now;
+    Schedcmd sch;
 
-    if(!schedcmds)
+    if (!schedcount)
 	return;
-    t = time(NULL);
+    zgettime_monotonic(&now);
     /*
-     * List is ordered, so we only need to consider the
-     * head element.
+     * The heap is ordered, so we only need to consider the
+     * top element.
      */
-    while (schedcmds && schedcmds->time <= t) {
+    while (schedcount && ztimespeccmp(&schedheap[0]->when, &now) <= 0) {
 	/*
 	 * Remove the entry to be executed from the list
 	 * before execution:  this makes quite sure that
 	 * the entry hasn't been monkeyed with when we
 	 * free it.
 	 */
-	sch = schedcmds;
-	schedcmds = sch->next;
+	sch = schedheap[0];
+	schedremove(0);
 	/*
 	 * Delete from the timed function list now in case
 	 * the called code reschedules.
@@ -134,27 +263,50 @@ checksched(void)
 	 * up a timed event; if it has, that'll be up to date since
 	 * we haven't changed the list here.
 	 */
-	if (schedcmds && !schedcmdtimed) {
+	if (schedcount && !schedcmdtimed) {
 	    /*
 	     * We've already delete the function from the list.
 	     */
 	    DPUTS(timedfns && firstnode(timedfns),
 		  "BUG: already timed fn (1)");
-	    schedaddtimed(schedcmds->time);
+	    schedaddtimed();
 	}
     }
 }
 
+/*
+ * Read a fraction of a second after a decimal point at *sp,
+ * returning it in nanoseconds and moving *sp past it.
+ */
+
+/**/
+static long
+schedfraction(char **sp)
+{
+    char *s = *sp;
+    long nsec = 0, mult = 100000000L;
+
+    if (*s == '.') {
+	for (s++; idigit(*s); s++) {
+	    nsec += (*s - '0') * mult;
+	    mult /= 10;
+	}
+    }
+    *sp = s;
+    return nsec;
+}
+
 /**/
 static int
 bin_sched(char *nam, char **argv, UNUSED(Options ops), UNUSED(int func))
 {
     char *s, **argptr;
     time_t t;
-    long h, m, sec;
+    long h, m, sec, nsec = 0;
     struct tm *tm;
-    struct schedcmd *sch, *sch2, *schl;
-    int sn, flags = 0;
+    struct timespec now, mnow;
+    Schedcmd sch, *list;
+    int sn, flags = 0, frac = 0;
 
     /* If the argument begins with a -, remove the specified item from the
     schedule. */
@@ -167,20 +319,20 @@ bin_sched(char *nam, char **argv, UNUSED(Options ops), UNUSED(int func))
 		zwarnnam("sched", "usage for delete: sched -<item#>.");
 		return 1;
 	    }
-	    for (schl = NULL, sch = schedcmds, sn--;
-		 sch && sn; sch = (schl = sch)->next, sn--);
-	    if (!sch) {
+	    if (sn > schedcount) {
 		zwarnnam("sched", "not that many entries");
 		return 1;
 	    }
-	    if (schl)
-		schl->next = sch->next;
+	    /* the next one due is easy; otherwise sort to find it */
+	    sch = (sn == 1) ? schedheap[0] : schedsorted()[sn - 1];
+	    if (sch->idx)
+		schedremove(sch->idx);
 	    else {
 		scheddeltimed();
-		schedcmds = sch->next;
-		if (schedcmds) {
+		schedremove(0);
+		if (schedcount) {
 		    DPUTS(timedfns && firstnode(timedfns), "BUG: already timed fn (2)");
-		    schedaddtimed(schedcmds->time);
+		    schedaddtimed();
 		}
 	    }
 	    zsfree(sch->cmd);
@@ -204,7 +356,7 @@ bin_sched(char *nam, char **argv, UNUSED(Options ops), UNUSED(int func))
 
     /* given no arguments, display the schedule list */
     if (!*argptr) {
-	for (sn = 1, sch = schedcmds; sch; sch = sch->next, sn++) {
+	for (sn = 1, list = schedsorted(); (sch = *list); list++, sn++) {
 	    char tbuf[60], *flagstr, *endstr;
 	    time_t t;
 	    struct tm *tmp;
@@ -233,6 +385,7 @@ bin_sched(char *nam, char **argv, UNUSED(Options ops), UNUSED(int func))
     /* The first argument specifies the time to schedule the command for.  The
     remaining arguments form the command. */
     s = *argptr++;
+    zgettime(&now);
     if (*s == '+') {
 	/*
 	 * + introduces a relative time.  The rest of the argument may be an
@@ -243,21 +396,32 @@ bin_sched(char *nam, char **argv, UNUSED(Options ops), UNUSED(int func))
 	zlong zl = zstrtol(s + 1, &s, 10);
 	if (*s == ':') {
 	    m = (long)zstrtol(s + 1, &s, 10);
-	    if (*s == ':')
+	    if (*s == ':') {
 		sec = (long)zstrtol(s + 1, &s, 10);
-	    else
+		frac = (*s == '.');
+		nsec = schedfraction(&s);
+	    } else
 		sec = 0;
 	    if (*s) {
 		zwarnnam("sched", "bad time specifier");
 		return 1;
 	    }
-	    t = time(NULL) + (long)zl * 3600 + m * 60 + sec;
-	} else if (!*s) {
+	    t = now.tv_sec + (long)zl * 3600 + m * 60 + sec;
+	    nsec += now.tv_nsec;
+	} else if (!*s || *s == '.') {
 	    /*
-	     * Alternatively, it may simply be a number of seconds.
+	     * Alternatively, it may simply be a number of seconds,
+	     * possibly with a fraction.
 	     * This is here for consistency with absolute times.
 	     */
-	    t = time(NULL) + (time_t)zl;
+	    frac = (*s == '.');
+	    nsec = schedfraction(&s);
+	    if (*s) {
+		zwarnnam("sched", "bad time specifier");
+		return 1;
+	    }
+	    t = now.tv_sec + (time_t)zl;
+	    nsec += now.tv_nsec;
 	} else {
 	    zwarnnam("sched", "bad time specifier");
 	    return 1;
@@ -281,7 +445,7 @@ bin_sched(char *nam, char **argv, UNUSED(Options ops), UNUSED(int func))
 		zwarnnam("sched", "bad time specifier");
 		return 1;
 	    }
-	    t = time(NULL);
+	    t = now.tv_sec;
 	    tm = localtime(&t);
 	    t -= tm->tm_sec + tm->tm_min * 60 + tm->tm_hour * 3600;
 	    if (*s == 'p' || *s == 'P')
@@ -291,45 +455,57 @@ bin_sched(char *nam, char **argv, UNUSED(Options ops), UNUSED(int func))
 	     * If the specified time is before the current time, it must refer
 	     * to tomorrow.
 	     */
-	    if (t < time(NULL))
+	    if (t < now.tv_sec)
 		t += 3600 * 24;
-	} else if (!*s) {
+	} else if (!*s || *s == '.') {
 	    /*
 	     * Otherwise, it must be a raw time specifier.
 	     */
 	    t = (long)zl;
+	    frac = (*s == '.');
+	    nsec = schedfraction(&s);
+	    if (*s) {
+		zwarnnam("sched", "bad time specifier");
+		return 1;
+	    }
 	} else {
 	    zwarnnam("sched", "bad time specifier");
 	    return 1;
 	}
     }
-    /* The time has been calculated; now add the new entry to the linked list
-    of scheduled commands. */
+    if (nsec >= 1000000000L) {
+	t++;
+	nsec -= 1000000000L;
+    }
+    /*
+     * The time has been calculated; now add the new entry to the heap
+     * of scheduled commands.  We wait for it by a clock that doesn't
+     * change if the time of day is reset, so work out how far ahead
+     * it is by that.
+     */
     sch = (struct schedcmd *) zalloc(sizeof *sch);
     sch->time = t;
+    /* only show the fraction of a second if one was given */
+    sch->nsec = frac ? nsec : 0;
+    zgettime_monotonic(&mnow);
+    sch->when.tv_sec = mnow.tv_sec + (t - now.tv_sec);
+    nsec = mnow.tv_nsec + (nsec - now.tv_nsec);
+    if (nsec < 0) {
+	sch->when.tv_sec--;
+	nsec += 1000000000L;
+    } else if (nsec >= 1000000000L) {
+	sch->when.tv_sec++;
+	nsec -= 1000000000L;
+    }
+    sch->when.tv_nsec = nsec;
     sch->cmd = zjoin(argptr, ' ', 0);
     sch->flags = flags;
-    /* Insert into list in time order */
-    if (schedcmds) {
-	if (sch->time < schedcmds->time) {
-	    scheddeltimed();
-	    sch->next = schedcmds;
-	    schedcmds = sch;
-	    DPUTS(timedfns && firstnode(timedfns), "BUG: already timed fn (3)");
-	    schedaddtimed(t);
-	} else {
-	    for (sch2 = schedcmds;
-		 sch2->next && sch2->next->time < sch->time;
-		 sch2 = sch2->next)
-		;
-	    sch->next = sch2->next;
-	    sch2->next = sch;
-	}
-    } else {
-	sch->next = NULL;
-	schedcmds = sch;
-	DPUTS(timedfns && firstnode(timedfns), "BUG: already timed fn (4)");
-	schedaddtimed(t);
+    schedpush(sch);
+    if (!sch->idx) {
+	/* This is the next due, so the timed event needs updating */
+	scheddeltimed();
+	DPUTS(timedfns && firstnode(timedfns), "BUG: already timed fn (3)");
+	schedaddtimed();
     }
     return 0;
 }
@@ -339,20 +515,19 @@ bin_sched(char *nam, char **argv, UNUSED(Options ops), UNUSED(int func))
 static char **
 schedgetfn(UNUSED(Param pm))
 {
-    int i;
-    struct schedcmd *sch;
+    Schedcmd sch, *list;
     char **ret, **aptr;
 
-    for (i = 0, sch = schedcmds; sch; sch = sch->next, i++)
-	;
-
-    aptr = ret = zhalloc(sizeof(char **) * (i+1));
-    for (sch = schedcmds; sch; sch = sch->next, aptr++) {
+    aptr = ret = zhalloc(sizeof(char **) * (schedcount+1));
+    for (list = schedsorted(); (sch = *list); list++, aptr++) {
 	char tbuf[40], *flagstr;
 	time_t t;
 
 	t = sch->time;
-	sprintf(tbuf, "%ld", t);
+	if (sch->nsec)
+	    sprintf(tbuf, "%ld.%09ld", (long)t, sch->nsec);
+	else
+	    sprintf(tbuf, "%ld", (long)t);
 	if (sch->flags & SCHEDFLAG_TRASH_ZLE)
 	    flagstr = "-o";
 	else
@@ -420,15 +595,18 @@ boot_(Module m)
 int
 cleanup_(Module m)
 {
-    struct schedcmd *sch, *schn;
+    int i;
 
-    if (schedcmds)
+    if (schedcount)
 	scheddeltimed();
-    for (sch = schedcmds; sch; sch = schn) {
-	schn = sch->next;
-	zsfree(sch->cmd);
-	zfree(sch, sizeof(*sch));
+    for (i = 0; i < schedcount; i++) {
+	zsfree(schedheap[i]->cmd);
+	zfree(schedheap[i], sizeof(struct schedcmd));
     }
+    if (schedheap)
+	zfree(schedheap, schedsize * sizeof(Schedcmd));
+    schedheap = NULL;
+    schedcount = schedsize = 0;
     delprepromptfn(&checksched);
     return setfeatureenables(m, &module_features, NULL);
 }
@@ -47,10 +47,109 @@ static const struct gsu_scalar gdbm_gsu =
 { gdbmgetfn, gdbmsetfn, gdbmunsetfn };
 
 static struct builtin bintab[] = {
-    BUILTIN("ztie", 0, bin_ztie, 1, -1, 0, "d:f:", NULL),
+    BUILTIN("zgdbmsync", 0, bin_zgdbmsync, 1, -1, 0, NULL, NULL),
+    BUILTIN("ztie", 0, bin_ztie, 1, -1, 0, "cd:f:", NULL),
     BUILTIN("zuntie", 0, bin_zuntie, 1, -1, 0, NULL, NULL),
 };
 
+/*
+ * What the tmpdata of a tied hash points to.  With ztie -c, values
+ * read are remembered in the cache, and values set or unset are kept
+ * there until the database is synced: by zgdbmsync, by zuntie, or
+ * before the keys are scanned.
+ */
+
+struct gdbmtie {
+    GDBM_FILE dbf;
+    HashTable cache;		/* NULL unless ztie -c */
+    int dirty;			/* cache has changes not yet written */
+};
+
+typedef struct gdbmtie *Gdbmtie;
+
+/* A value in the cache; val is NULL if the key isn't in the database */
+
+struct gdbmcachenode {
+    struct hashnode node;
+    char *val;
+    int dirty;			/* val not yet written to the database */
+};
+
+typedef struct gdbmcachenode *Gdbmcachenode;
+
+/* The database being synced by gdbmwritenode() */
+
+static GDBM_FILE syncdbf;
+
+/**/
+static void
+freegdbmcachenode(HashNode hn)
+{
+    zsfree(hn->nam);
+    zsfree(((Gdbmcachenode) hn)->val);
+    zfree(hn, sizeof(struct gdbmcachenode));
+}
+
+/**/
+static HashTable
+newgdbmcache(void)
+{
+    HashTable ht = newhashtable(37, "gdbmcache", NULL);
+
+    ht->hash        = hasher;
+    ht->emptytable  = emptyhashtable;
+    ht->filltable   = NULL;
+    ht->cmpnodes    = strcmp;
+    ht->addnode     = addhashnode;
+    ht->getnode     = gethashnode2;
+    ht->getnode2    = gethashnode2;
+    ht->removenode  = removehashnode;
+    ht->disablenode = NULL;
+    ht->enablenode  = NULL;
+    ht->freenode    = freegdbmcachenode;
+    ht->printnode   = NULL;
+
+    return ht;
+}
+
+/* Write a cached value back to syncdbf if it was changed */
+
+/**/
+static void
+gdbmwritenode(HashNode hn, UNUSED(int flags))
+{
+    Gdbmcachenode cn = (Gdbmcachenode) hn;
+    datum key, content;
+
+    if (!cn->dirty)
+	return;
+    key.dptr = hn->nam;
+    key.dsize = strlen(key.dptr) + 1;
+    if (cn->val) {
+	content.dptr = cn->val;
+	content.dsize = strlen(content.dptr) + 1;
+	(void)gdbm_store(syncdbf, key, content, GDBM_REPLACE);
+    } else
+	(void)gdbm_delete(syncdbf, key);
+    cn->dirty = 0;
+}
+
+/* Write all changes in the cache of a tied hash to the file */
+
+/**/
+static void
+gdbmsync(HashTable ht)
+{
+    Gdbmtie tie = (Gdbmtie) ht->tmpdata;
+
+    if (!tie->cache || !tie->dirty)
+	return;
+    syncdbf = tie->dbf;
+    scanhashtable(tie->cache, 0, 0, 0, gdbmwritenode, 0);
+    gdbm_sync(tie->dbf);
+    tie->dirty = 0;
+}
+
 /**/
 static int
 bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
@@ -58,8 +157,9 @@ bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
     char *resource_name, *pmname;
     GDBM_FILE dbf = NULL;
     Param tied_param;
+    Gdbmtie tie;
 
-    if(!OPT_ISSET(ops,'d')) {
+    if(!OPT_ISSET(ops,'d') || strcmp(OPT_ARG(ops,'d'), "db/gdbm")) {
         zwarnnam(nam, "you must pass `-d db/gdbm' to ztie", NULL);
 	return 1;
     }
@@ -81,13 +181,20 @@ bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
 	return 1;
     }
 
-    dbf = gdbm_open(resource_name, 0, GDBM_WRCREAT | GDBM_SYNC, 0666, 0);
+    /* With a cache, the file is synced when the cache is written */
+    dbf = gdbm_open(resource_name, 0,
+		    GDBM_WRCREAT | (OPT_ISSET(ops,'c') ? 0 : GDBM_SYNC),
+		    0666, 0);
     if(!dbf) {
         zwarnnam(nam, "error opening database file %s", resource_name);
 	return 1;
     }
 
-    tied_param->u.hash->tmpdata = (void *)dbf;
+    tie = (Gdbmtie) zalloc(sizeof(struct gdbmtie));
+    tie->dbf = dbf;
+    tie->cache = OPT_ISSET(ops,'c') ? newgdbmcache() : NULL;
+    tie->dirty = 0;
+    tied_param->u.hash->tmpdata = (void *)tie;
 
     return 0;
 }
@@ -97,7 +204,7 @@ static int
 bin_zuntie(char *nam, char **args, Options ops, UNUSED(int func))
 {
     Param pm;
-    GDBM_FILE dbf;
+    Gdbmtie tie;
 
     pm = (Param) paramtab->getnode(paramtab, args[0]);
     if(!pm) {
@@ -105,34 +212,68 @@ bin_zuntie(char *nam, char **args, Options ops, UNUSED(int func))
 	return 1;
     }
 
-    dbf = (GDBM_FILE)(pm->u.hash->tmpdata);
-    gdbm_close(dbf);
-/*    free(pm->u.hash->tmpdata); */
+    gdbmsync(pm->u.hash);
+    tie = (Gdbmtie)(pm->u.hash->tmpdata);
+    gdbm_close(tie->dbf);
+    if (tie->cache)
+	deletehashtable(tie->cache);
+    zfree(tie, sizeof(struct gdbmtie));
     paramtab->removenode(paramtab, pm->node.nam);
 
     return 0;
 }
 
+/* zgdbmsync: write changes to tied hashes that are cached */
+
+/**/
+static int
+bin_zgdbmsync(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    Param pm;
+    int ret = 0;
+
+    for (; *args; args++) {
+	pm = (Param) paramtab->getnode(paramtab, *args);
+	if (!pm || PM_TYPE(pm->node.flags) != PM_HASHED ||
+	    pm->u.hash->getnode != getgdbmnode) {
+	    zwarnnam(nam, "not a tied gdbm hash: %s", *args);
+	    ret = 1;
+	    continue;
+	}
+	gdbmsync(pm->u.hash);
+    }
+    return ret;
+}
+
 /**/
 static char *
 gdbmgetfn(Param pm)
 {
     datum key, content;
-    int ret;
-    GDBM_FILE dbf;
+    Gdbmtie tie;
+    Gdbmcachenode cn = NULL;
+    char *val;
 
     key.dptr = pm->node.nam;
     key.dsize = strlen(key.dptr) + 1;
 
-    dbf = (GDBM_FILE)(pm->u.hash->tmpdata);
-    ret = gdbm_exists(dbf, key);
-    if(ret) {
-        content = gdbm_fetch(dbf, key);
-    } else {
-        content.dptr = dupstring("");
+    tie = (Gdbmtie)(pm->u.hash->tmpdata);
+    if (tie->cache &&
+	(cn = (Gdbmcachenode) tie->cache->getnode2(tie->cache, key.dptr)))
+	return dupstring(cn->val ? cn->val : "");
+
+    content = gdbm_fetch(tie->dbf, key);
+    if (tie->cache) {
+	cn = (Gdbmcachenode) zshcalloc(sizeof(struct gdbmcachenode));
+	cn->val = content.dptr ? ztrdup(content.dptr) : NULL;
+	tie->cache->addnode(tie->cache, ztrdup(key.dptr), cn);
     }
+    if (!content.dptr)
+	return dupstring("");
+    val = dupstring(content.dptr);
+    free(content.dptr);
 
-    return content.dptr;
+    return val;
 }
 
 /**/
@@ -140,29 +281,56 @@ static void
 gdbmsetfn(Param pm, char *val)
 {
     datum key, content;
-    GDBM_FILE dbf;
+    Gdbmtie tie;
+    Gdbmcachenode cn;
 
     key.dptr = pm->node.nam;
     key.dsize = strlen(key.dptr) + 1;
+
+    tie = (Gdbmtie)(pm->u.hash->tmpdata);
+    if (tie->cache) {
+	if ((cn = (Gdbmcachenode) tie->cache->getnode2(tie->cache, key.dptr)))
+	    zsfree(cn->val);
+	else {
+	    cn = (Gdbmcachenode) zshcalloc(sizeof(struct gdbmcachenode));
+	    tie->cache->addnode(tie->cache, ztrdup(key.dptr), cn);
+	}
+	cn->val = val;
+	cn->dirty = tie->dirty = 1;
+	return;
+    }
+
     content.dptr = val;
     content.dsize = strlen(content.dptr) + 1;
-
-    dbf = (GDBM_FILE)(pm->u.hash->tmpdata);
-    (void)gdbm_store(dbf, key, content, GDBM_REPLACE);
+    (void)gdbm_store(tie->dbf, key, content, GDBM_REPLACE);
+    zsfree(val);
 }
 
 /**/
 static void
-gdbmunsetfn(Param pm, int um)
+gdbmunsetfn(Param pm, UNUSED(int um))
 {
     datum key;
-    GDBM_FILE dbf;
+    Gdbmtie tie;
+    Gdbmcachenode cn;
 
     key.dptr = pm->node.nam;
     key.dsize = strlen(key.dptr) + 1;
 
-    dbf = (GDBM_FILE)(pm->u.hash->tmpdata);
-    (void)gdbm_delete(dbf, key);
+    tie = (Gdbmtie)(pm->u.hash->tmpdata);
+    if (tie->cache) {
+	if ((cn = (Gdbmcachenode) tie->cache->getnode2(tie->cache, key.dptr)))
+	    zsfree(cn->val);
+	else {
+	    cn = (Gdbmcachenode) zshcalloc(sizeof(struct gdbmcachenode));
+	    tie->cache->addnode(tie->cache, ztrdup(key.dptr), cn);
+	}
+	cn->val = NULL;
+	cn->dirty = tie->dirty = 1;
+	return;
+    }
+
+    (void)gdbm_delete(tie->dbf, key);
 }
 
 /**/
@@ -190,28 +358,44 @@ static void
 scangdbmkeys(HashTable ht, ScanFunc func, int flags)
 {
     Param pm = NULL;
-    datum key, content;
-    GDBM_FILE dbf;
+    datum key, content, next;
+    Gdbmtie tie;
+    Gdbmcachenode cn;
+    int wantvals = (func != scancountparams &&
+		    ((flags & (SCANPM_WANTVALS|SCANPM_MATCHVAL)) ||
+		     !(flags & SCANPM_WANTKEYS)));
 
-    dbf = (GDBM_FILE)(ht->tmpdata);
+    /* The keys come from the file, so it needs to be up to date */
+    gdbmsync(ht);
+    tie = (Gdbmtie)(ht->tmpdata);
 
     pm = (Param) hcalloc(sizeof(struct param));
 
     pm->node.flags = PM_SCALAR;
     pm->gsu.s = &nullsetscalar_gsu;
 
-    key = gdbm_firstkey(dbf);
+    key = gdbm_firstkey(tie->dbf);
 
     while(key.dptr) {
-	content = gdbm_fetch(dbf, key);
-
-	pm->node.nam = key.dptr;
-	pm->u.str = content.dptr;
-	pm->gsu.s = &nullsetscalar_gsu;
+	pm->node.nam = dupstring(key.dptr);
+	pm->u.str = "";
+	/* Only fetch values that are wanted, and not already cached */
+	if (wantvals) {
+	    if (tie->cache &&
+		(cn = (Gdbmcachenode)
+		 tie->cache->getnode2(tie->cache, key.dptr)) && cn->val)
+		pm->u.str = dupstring(cn->val);
+	    else if ((content = gdbm_fetch(tie->dbf, key)).dptr) {
+		pm->u.str = dupstring(content.dptr);
+		free(content.dptr);
+	    }
+	}
 
 	func(&pm->node, flags);
 
-        key = gdbm_nextkey(dbf, key);
+	next = gdbm_nextkey(tie->dbf, key);
+	free(key.dptr);
+	key = next;
     }
 
 }
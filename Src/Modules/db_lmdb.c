@@ -0,0 +1,364 @@
+/*
+ * db_lmdb.c - bindings for lmdb
+ *
+ * This file is part of zsh, the Z shell.
+ *
+ * Copyright (c) 2026 The Zsh Development Group
+ * All rights reserved.
+ *
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and to distribute modified versions of this software for any
+ * purpose, provided that the above copyright notice and the following
+ * two paragraphs appear in all copies of this software.
+ *
+ * In no event shall the Zsh Development Group be liable to any party for
+ * direct, indirect, special, incidental, or consequential damages arising
+ * out of the use of this software and its documentation, even if the Zsh
+ * Development Group have been advised of the possibility of such damage.
+ *
+ * The Zsh Development Group specifically disclaim any warranties,
+ * including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose.  The software
+ * provided hereunder is on an "as is" basis, and the Zsh Development
+ * Group have no obligation to provide maintenance, support, updates,
+ * enhancements, or modifications.
+ *
+ */
+
+#include "db_lmdb.mdh"
+#include "db_lmdb.pro"
+
+#if defined(HAVE_LMDB_H) && defined(HAVE_LIBLMDB)
+
+#include <lmdb.h>
+
+/*
+ * The largest size the database file may grow to.  lmdb maps all of
+ * it, but only reserves address space, not memory or disk.
+ */
+#define LMDB_MAPSIZE ((size_t)1 << 30)
+
+static const struct gsu_scalar lmdb_gsu =
+{ lmdbgetfn, lmdbsetfn, lmdbunsetfn };
+
+static struct builtin bintab[] = {
+    BUILTIN("ztie", 0, bin_ztie, 1, -1, 0, "d:f:r", NULL),
+    BUILTIN("zuntie", 0, bin_zuntie, 1, -1, 0, NULL, NULL),
+};
+
+/*
+ * What the tmpdata of a tied hash points to.  Lookups share one
+ * read-only transaction, which is only reset between them, so other
+ * shells see a consistent database without paying for a new
+ * transaction every time.
+ */
+
+struct lmdbtie {
+    MDB_env *env;
+    MDB_dbi dbi;
+    MDB_txn *rtxn;		/* reset when not in use */
+    int rdonly;			/* ztie -r */
+};
+
+typedef struct lmdbtie *Lmdbtie;
+
+/* Start the read transaction of a tied hash; NULL on failure */
+
+/**/
+static void *
+lmdbreadtxn(HashTable ht)
+{
+    Lmdbtie tie = (Lmdbtie) ht->tmpdata;
+
+    if (mdb_txn_renew(tie->rtxn))
+	return NULL;
+    return tie->rtxn;
+}
+
+/**/
+static int
+bin_ztie(char *nam, char **args, Options ops, UNUSED(int func))
+{
+    char *resource_name, *pmname;
+    Param tied_param;
+    Lmdbtie tie;
+    MDB_env *env = NULL;
+    MDB_txn *txn = NULL;
+    MDB_dbi dbi;
+    int rdonly = OPT_ISSET(ops,'r'), ret;
+
+    if(!OPT_ISSET(ops,'d') || strcmp(OPT_ARG(ops,'d'), "db/lmdb")) {
+        zwarnnam(nam, "you must pass `-d db/lmdb' to ztie", NULL);
+	return 1;
+    }
+    if(!OPT_ISSET(ops,'f')) {
+        zwarnnam(nam, "you must pass `-f' with a filename to ztie", NULL);
+	return 1;
+    }
+
+    resource_name = OPT_ARG(ops, 'f');
+
+    /* The file is the database, with a lock file beside it */
+    if ((ret = mdb_env_create(&env)) ||
+	(ret = mdb_env_set_mapsize(env, LMDB_MAPSIZE)) ||
+	(ret = mdb_env_open(env, unmeta(resource_name),
+			    MDB_NOSUBDIR | (rdonly ? MDB_RDONLY : 0),
+			    0666)) ||
+	(ret = mdb_txn_begin(env, NULL, rdonly ? MDB_RDONLY : 0, &txn)) ||
+	(ret = mdb_dbi_open(txn, NULL, 0, &dbi)) ||
+	(ret = mdb_txn_commit(txn))) {
+	if (txn && ret != MDB_SUCCESS)
+	    mdb_txn_abort(txn);
+	if (env)
+	    mdb_env_close(env);
+        zwarnnam(nam, "error opening database file %s: %s", resource_name,
+		 mdb_strerror(ret));
+	return 1;
+    }
+    txn = NULL;
+    if ((ret = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn))) {
+	mdb_env_close(env);
+        zwarnnam(nam, "error opening database file %s: %s", resource_name,
+		 mdb_strerror(ret));
+	return 1;
+    }
+    mdb_txn_reset(txn);
+
+    pmname = ztrdup(*args);
+    if (!(tied_param = createspecialhash(pmname, &getlmdbnode, &scanlmdbkeys,
+					 rdonly ? PM_READONLY : 0))) {
+	mdb_txn_abort(txn);
+	mdb_env_close(env);
+        zwarnnam(nam, "cannot create the requested parameter name", NULL);
+	return 1;
+    }
+
+    tie = (Lmdbtie) zalloc(sizeof(struct lmdbtie));
+    tie->env = env;
+    tie->dbi = dbi;
+    tie->rtxn = txn;
+    tie->rdonly = rdonly;
+    tied_param->u.hash->tmpdata = (void *)tie;
+
+    return 0;
+}
+
+/**/
+static int
+bin_zuntie(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    Param pm;
+    Lmdbtie tie;
+
+    pm = (Param) paramtab->getnode(paramtab, args[0]);
+    if(!pm || PM_TYPE(pm->node.flags) != PM_HASHED ||
+       pm->u.hash->getnode != getlmdbnode) {
+        zwarnnam(nam, "cannot untie %s", args[0]);
+	return 1;
+    }
+
+    tie = (Lmdbtie)(pm->u.hash->tmpdata);
+    mdb_txn_abort(tie->rtxn);
+    mdb_env_close(tie->env);
+    zfree(tie, sizeof(struct lmdbtie));
+    pm->node.flags &= ~PM_READONLY;
+    paramtab->removenode(paramtab, pm->node.nam);
+
+    return 0;
+}
+
+/**/
+static char *
+lmdbgetfn(Param pm)
+{
+    MDB_val key, content;
+    MDB_txn *txn;
+    Lmdbtie tie = (Lmdbtie)(pm->u.hash->tmpdata);
+    char *val;
+
+    key.mv_data = pm->node.nam;
+    key.mv_size = strlen(pm->node.nam) + 1;
+
+    if (!(txn = (MDB_txn *)lmdbreadtxn(pm->u.hash)))
+	return dupstring("");
+    /*
+     * The value is in the map itself; this is the only copy, straight
+     * onto the heap, since it's only valid during the transaction.
+     * Values are stored metafied, with the terminating null.
+     */
+    if (mdb_get(txn, tie->dbi, &key, &content) || !content.mv_size)
+	val = dupstring("");
+    else
+	val = dupstrpfx((char *)content.mv_data, content.mv_size - 1);
+    mdb_txn_reset(txn);
+
+    return val;
+}
+
+/* Store or (if val is NULL) delete a key in its own transaction */
+
+/**/
+static void
+lmdbwrite(Param pm, char *val)
+{
+    MDB_val key, content;
+    MDB_txn *txn;
+    Lmdbtie tie = (Lmdbtie)(pm->u.hash->tmpdata);
+    int ret;
+
+    if (tie->rdonly) {
+	zerr("read-only database: %s", pm->node.nam);
+	return;
+    }
+    key.mv_data = pm->node.nam;
+    key.mv_size = strlen(pm->node.nam) + 1;
+
+    if ((ret = mdb_txn_begin(tie->env, NULL, 0, &txn))) {
+	zerr("can't write database: %s", mdb_strerror(ret));
+	return;
+    }
+    if (val) {
+	content.mv_data = val;
+	content.mv_size = strlen(val) + 1;
+	ret = mdb_put(txn, tie->dbi, &key, &content, 0);
+    } else if ((ret = mdb_del(txn, tie->dbi, &key, NULL)) == MDB_NOTFOUND)
+	ret = MDB_SUCCESS;
+    if (ret != MDB_SUCCESS) {
+	mdb_txn_abort(txn);
+	zerr("can't write database: %s", mdb_strerror(ret));
+    } else if ((ret = mdb_txn_commit(txn)))
+	zerr("can't write database: %s", mdb_strerror(ret));
+}
+
+/**/
+static void
+lmdbsetfn(Param pm, char *val)
+{
+    lmdbwrite(pm, val);
+    zsfree(val);
+}
+
+/**/
+static void
+lmdbunsetfn(Param pm, UNUSED(int um))
+{
+    lmdbwrite(pm, NULL);
+}
+
+/**/
+static HashNode
+getlmdbnode(HashTable ht, const char *name)
+{
+    Param pm = NULL;
+
+    pm = (Param) hcalloc(sizeof(struct param));
+    pm->node.nam = dupstring(name);
+    pm->node.flags = PM_SCALAR;
+    pm->gsu.s = &lmdb_gsu;
+    pm->u.hash = ht;
+
+    return &pm->node;
+}
+
+/**/
+static void
+scanlmdbkeys(HashTable ht, ScanFunc func, int flags)
+{
+    Param pm = NULL;
+    MDB_val key, content;
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    Lmdbtie tie = (Lmdbtie)(ht->tmpdata);
+    int wantvals = (func != scancountparams &&
+		    ((flags & (SCANPM_WANTVALS|SCANPM_MATCHVAL)) ||
+		     !(flags & SCANPM_WANTKEYS)));
+    int op;
+
+    if (!(txn = (MDB_txn *)lmdbreadtxn(ht)))
+	return;
+    if (mdb_cursor_open(txn, tie->dbi, &cursor)) {
+	mdb_txn_reset(txn);
+	return;
+    }
+
+    pm = (Param) hcalloc(sizeof(struct param));
+
+    pm->node.flags = PM_SCALAR;
+    pm->gsu.s = &nullsetscalar_gsu;
+
+    /*
+     * The whole scan is one transaction, so it sees the database
+     * as it was when it started.
+     */
+    for (op = MDB_FIRST; !mdb_cursor_get(cursor, &key, &content, op);
+	 op = MDB_NEXT) {
+	if (!key.mv_size)
+	    continue;
+	pm->node.nam = dupstrpfx((char *)key.mv_data, key.mv_size - 1);
+	if (wantvals && content.mv_size)
+	    pm->u.str = dupstrpfx((char *)content.mv_data,
+				  content.mv_size - 1);
+	else
+	    pm->u.str = "";
+
+	func(&pm->node, flags);
+    }
+    mdb_cursor_close(cursor);
+    mdb_txn_reset(txn);
+}
+
+#else
+# error no lmdb
+#endif /* have lmdb */
+
+static struct features module_features = {
+    bintab, sizeof(bintab)/sizeof(*bintab),
+    NULL, 0,
+    NULL, 0,
+    NULL, 0,
+    0
+};
+
+/**/
+int
+setup_(UNUSED(Module m))
+{
+    return 0;
+}
+
+/**/
+int
+features_(Module m, char ***features)
+{
+    *features = featuresarray(m, &module_features);
+    return 0;
+}
+
+/**/
+int
+enables_(Module m, int **enables)
+{
+    return handlefeatures(m, &module_features, enables);
+}
+
+/**/
+int
+boot_(UNUSED(Module m))
+{
+    return 0;
+}
+
+/**/
+int
+cleanup_(UNUSED(Module m))
+{
+    return setfeatureenables(m, &module_features, NULL);
+}
+
+/**/
+int
+finish_(UNUSED(Module m))
+{
+    return 0;
+}
@@ -29,8 +29,12 @@
 
 #include "files.mdh"
 
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+
 typedef int (*MoveFunc) _((char const *, char const *));
-typedef int (*RecurseFunc) _((char *, char *, struct stat const *, void *));
+typedef int (*RecurseFunc) _((char *, int, char *, struct stat const *, void *));
 
 #ifndef STDC_HEADERS
 extern int link _((const char *, const char *));
@@ -39,6 +43,7 @@ extern int rename _((const char *, const char *));
 #endif
 
 struct recursivecmd;
+struct cpmagic;
 
 #include "files.pro"
 
@@ -352,22 +357,374 @@ domove(char *nam, MoveFunc movefn, char *p, char *q, int flags)
 
 /* general recursion */
 
+/*
+ * Where the system has the *at() functions, the tree is walked with
+ * a file descriptor open on each directory on the way down, and the
+ * functions called for each file are given the descriptor of its
+ * directory and its name.  The shell's own directory never changes.
+ * Otherwise we chdir() down the tree and the descriptor is REC_CWD.
+ */
+
+#if defined(HAVE_OPENAT) && defined(HAVE_FDOPENDIR) && \
+    defined(HAVE_FSTATAT) && defined(HAVE_UNLINKAT) && \
+    defined(HAVE_FCHOWNAT) && defined(HAVE_FACCESSAT) && \
+    defined(HAVE_READLINKAT)
+# define RECURSE_AT
+#endif
+
+#ifdef RECURSE_AT
+# define REC_CWD AT_FDCWD
+# define rec_lstat(D, P, S)	fstatat(D, P, S, AT_SYMLINK_NOFOLLOW)
+# define rec_stat(D, P, S)	fstatat(D, P, S, 0)
+# define rec_open(D, P, F)	openat(D, P, F)
+# define rec_readlink(D, P, B, L)	readlinkat(D, P, B, L)
+# define rec_access(D, P, M)	faccessat(D, P, M, 0)
+# define rec_unlink(D, P)	unlinkat(D, P, 0)
+# define rec_rmdir(D, P)	unlinkat(D, P, AT_REMOVEDIR)
+# define rec_chown(D, P, U, G)	fchownat(D, P, U, G, 0)
+# define rec_lchown(D, P, U, G)	fchownat(D, P, U, G, AT_SYMLINK_NOFOLLOW)
+# ifndef O_DIRECTORY
+#  define O_DIRECTORY 0
+# endif
+# ifndef O_NOFOLLOW
+#  define O_NOFOLLOW 0
+# endif
+#else
+# define REC_CWD (-1)
+# define rec_lstat(D, P, S)	lstat(P, S)
+# define rec_stat(D, P, S)	stat(P, S)
+# define rec_open(D, P, F)	open(P, F)
+# define rec_readlink(D, P, B, L)	readlink(P, B, L)
+# define rec_access(D, P, M)	access(P, M)
+# define rec_unlink(D, P)	unlink(P)
+# define rec_rmdir(D, P)	rmdir(P)
+# define rec_chown(D, P, U, G)	chown(P, U, G)
+# define rec_lchown(D, P, U, G)	lchown(P, U, G)
+#endif
+
+/*
+ * With opt_parallel, a directory with at least RECURSE_PAR_MIN
+ * subdirectories has them shared out between the shell and up to
+ * RECURSE_PAR_MAX forked processes.  Only the shell does this, so
+ * there is never more than one set of processes.
+ */
+#define RECURSE_PAR_MIN	4
+#define RECURSE_PAR_MAX	8
+
 struct recursivecmd {
     char *nam;
     int opt_noerr;
     int opt_recurse;
     int opt_safe;
+    int opt_parallel;
     RecurseFunc dirpre_func;
     RecurseFunc dirpost_func;
     RecurseFunc leaf_func;
     void *magic;
 };
 
+#ifdef RECURSE_AT
+
+/*
+ * The functions for each way of walking the tree are only declared
+ * in the branch that compiles them.
+ */
+
+static int recursivecmd_doone_at _((struct recursivecmd const *reccmd,
+				    char *arg, int dfd, char *rp));
+static int recursivecmd_dorec_at _((struct recursivecmd const *reccmd,
+				    char *arg, int dfd, char *rp,
+				    struct stat const *sp));
+
+/*
+ * Open the directory path for -s without following symbolic links
+ * anywhere in it.  Return the descriptor, or -1 with errno set.
+ */
+
+static int
+recursivecmd_safeopen(char *path)
+{
+    int dfd = open(*path == '/' ? "/" : ".",
+		   O_RDONLY | O_DIRECTORY | O_NOCTTY), fd;
+    char *p = path, *q, c;
+
+    while (dfd >= 0) {
+	while (*p == '/')
+	    p++;
+	if (!*p)
+	    return dfd;
+	for (q = p; *q && *q != '/'; q++)
+	    ;
+	c = *q;
+	*q = '\0';
+	fd = openat(dfd, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOCTTY);
+	if (fd < 0 && errno == ELOOP)
+	    errno = ENOTDIR;
+	*q = c;
+	close(dfd);
+	dfd = fd;
+	p = q;
+    }
+    return -1;
+}
+
 /**/
 static int
 recursivecmd(char *nam, int opt_noerr, int opt_recurse, int opt_safe,
-    char **args, RecurseFunc dirpre_func, RecurseFunc dirpost_func,
-    RecurseFunc leaf_func, void *magic)
+    int opt_parallel, char **args, RecurseFunc dirpre_func,
+    RecurseFunc dirpost_func, RecurseFunc leaf_func, void *magic)
+{
+    int err = 0, len;
+    char *rp, *s;
+    struct recursivecmd reccmd;
+
+    reccmd.nam = nam;
+    reccmd.opt_noerr = opt_noerr;
+    reccmd.opt_recurse = opt_recurse;
+    reccmd.opt_safe = opt_safe;
+    reccmd.opt_parallel = opt_parallel && opt_recurse;
+    reccmd.dirpre_func = dirpre_func;
+    reccmd.dirpost_func = dirpost_func;
+    reccmd.leaf_func = leaf_func;
+    reccmd.magic = magic;
+    for(; !errflag && !(err & 2) && *args; args++) {
+	rp = ztrdup(*args);
+	unmetafy(rp, &len);
+	s = NULL;
+	if (opt_safe) {
+	    s = strrchr(rp, '/');
+	    if (s && !s[1]) {
+		while (*s == '/' && s > rp)
+		    *s-- = '\0';
+		while (*s != '/' && s > rp)
+		    s--;
+	    }
+	}
+	if (s && s[1]) {
+	    int dfd;
+
+	    *s = '\0';
+	    if ((dfd = recursivecmd_safeopen(s > rp ? rp : "/")) >= 0) {
+		err |= recursivecmd_doone_at(&reccmd, *args, dfd, s + 1);
+		close(dfd);
+	    } else {
+		err |= 1;
+		if(!opt_noerr)
+		    zwarnnam(nam, "%s: %e", *args, errno);
+	    }
+	} else
+	    err |= recursivecmd_doone_at(&reccmd, *args, REC_CWD, rp);
+	zfree(rp, len + 1);
+    }
+    return !!err;
+}
+
+static int
+recursivecmd_doone_at(struct recursivecmd const *reccmd,
+    char *arg, int dfd, char *rp)
+{
+    struct stat st, *sp = NULL;
+
+    if(reccmd->opt_recurse && !rec_lstat(dfd, rp, &st)) {
+	if(S_ISDIR(st.st_mode))
+	    return recursivecmd_dorec_at(reccmd, arg, dfd, rp, &st);
+	sp = &st;
+    }
+    return reccmd->leaf_func(arg, dfd, rp, sp, reccmd->magic);
+}
+
+/*
+ * Do the entries of a directory, given as a list of names each
+ * preceded by a byte which is 1 if it is known to be a directory.
+ * Those directories with an index in dirs for which (index % nw)
+ * is in [wfrom, wto) are done, and other entries only if all is set.
+ */
+
+static int
+recursivecmd_dolist(struct recursivecmd const *reccmd, char *arg, int dfd,
+    char *files, int fileslen, int nw, int wfrom, int wto, int all)
+{
+    int err = 0, arglen = strlen(arg) + 1, ind = 0;
+    char *fn;
+
+    for (fn = files; !errflag && !(err & 2) && fn < files + fileslen;) {
+	int isdir = *fn++, l = strlen(fn) + 1;
+
+	if (isdir ? (ind % nw >= wfrom && ind % nw < wto) : all) {
+	    VARARR(char, narg, arglen + l);
+
+	    strcpy(narg,arg);
+	    narg[arglen-1] = '/';
+	    strcpy(narg + arglen, fn);
+	    unmetafy(fn, NULL);
+	    err |= recursivecmd_doone_at(reccmd, narg, dfd, fn);
+	}
+	if (isdir)
+	    ind++;
+	fn += l;
+    }
+    return err;
+}
+
+/*
+ * Do the entries of a directory with ndirs subdirectories, sharing
+ * the subdirectories out between forked processes if that's allowed.
+ */
+
+static int
+recursivecmd_dofiles(struct recursivecmd const *reccmd, char *arg, int dfd,
+    char *files, int fileslen, int ndirs)
+{
+    struct recursivecmd subcmd;
+    pid_t pids[RECURSE_PAR_MAX];
+    int nw, np = 0, err = 0, pipefd[2];
+    long ncpu = 1;
+    char c;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    nw = (int)ncpu - 1;
+    if (nw > RECURSE_PAR_MAX)
+	nw = RECURSE_PAR_MAX;
+    if (nw > ndirs - 1)
+	nw = ndirs - 1;
+    if (!reccmd->opt_parallel || ndirs < RECURSE_PAR_MIN || nw < 1 ||
+	pipe(pipefd) < 0)
+	return recursivecmd_dolist(reccmd, arg, dfd, files, fileslen,
+				   1, 0, 1, 1);
+
+    /*
+     * Each process writes a byte with its error bits to the pipe when
+     * it's finished.  We read them back rather than waiting for the
+     * processes, which the shell's SIGCHLD handler may get to first.
+     */
+    subcmd = *reccmd;
+    subcmd.opt_parallel = 0;
+    fflush(stdout);
+    fflush(stderr);
+    for (np = 0; np < nw; np++) {
+	pid_t pid = fork();
+
+	if (pid == -1)
+	    break;
+	if (!pid) {
+	    close(pipefd[0]);
+	    signal_default(SIGINT);
+	    signal_default(SIGQUIT);
+	    c = (char)recursivecmd_dolist(&subcmd, arg, dfd, files, fileslen,
+					  nw + 1, np, np + 1, 0);
+	    if (write(pipefd[1], &c, 1) < 0)
+		_exit(1);
+	    _exit(0);
+	}
+	pids[np] = pid;
+    }
+    close(pipefd[1]);
+
+    /* The shell does the rest, including any processes that failed. */
+    err = recursivecmd_dolist(&subcmd, arg, dfd, files, fileslen,
+			      nw + 1, np, nw + 1, 1);
+
+    for (nw = 0; nw < np; ) {
+	int ret = read(pipefd[0], &c, 1);
+
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret <= 0)
+	    break;
+	err |= c;
+	nw++;
+    }
+    /* A process that didn't report back was killed. */
+    if (nw < np)
+	err |= 1;
+    close(pipefd[0]);
+    while (np--)
+	waitpid(pids[np], NULL, 0);
+    return err;
+}
+
+static int
+recursivecmd_dorec_at(struct recursivecmd const *reccmd,
+    char *arg, int dfd, char *rp, struct stat const *sp)
+{
+    DIR *d;
+    int err, err1, fd, ndirs = 0;
+    struct stat st;
+    struct dirent *de;
+    char *files = NULL;
+    int fileslen = 0;
+
+    err1 = reccmd->dirpre_func(arg, dfd, rp, sp, reccmd->magic);
+    if(err1 & 2)
+	return 2;
+
+    /*
+     * Check it's still the directory we were given, in case it has
+     * been replaced by something else in the meantime.
+     */
+    d = NULL;
+    if ((fd = openat(dfd, rp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+		     O_NOCTTY)) >= 0 && !fstat(fd, &st)) {
+	if (st.st_dev != sp->st_dev || st.st_ino != sp->st_ino)
+	    errno = ENOTDIR;
+	else
+	    d = fdopendir(fd);
+    }
+    if (!d) {
+	int e = errno;
+
+	if (fd >= 0)
+	    close(fd);
+	errno = e;
+	if(!reccmd->opt_noerr)
+	    zwarnnam(reccmd->nam, "%s: %e", arg, errno);
+	return 1;
+    }
+    err = err1;
+
+    while (!errflag && (de = readdir(d))) {
+	char *fn = de->d_name;
+	int l;
+
+	if (fn[0] == '.' && (!fn[1] || (fn[1] == '.' && !fn[2])))
+	    continue;
+	fn = metafy(fn, -1, META_USEHEAP);
+	l = strlen(fn) + 2;
+	files = hrealloc(files, fileslen, fileslen + l);
+#ifdef DT_DIR
+	if ((files[fileslen] = (de->d_type == DT_DIR)))
+	    ndirs++;
+#else
+	files[fileslen] = 0;
+#endif
+	strcpy(files + fileslen + 1, fn);
+	fileslen += l;
+    }
+    err |= recursivecmd_dofiles(reccmd, arg, dirfd(d), files, fileslen,
+				ndirs);
+    closedir(d);
+    hrealloc(files, fileslen, 0);
+    if (err & 2)
+	return 2;
+    return err | reccmd->dirpost_func(arg, dfd, rp, sp, reccmd->magic);
+}
+
+#else /* !RECURSE_AT */
+
+static int recursivecmd_doone _((struct recursivecmd const *reccmd,
+				 char *arg, char *rp, struct dirsav *ds,
+				 int first));
+static int recursivecmd_dorec _((struct recursivecmd const *reccmd,
+				 char *arg, char *rp, struct stat const *sp,
+				 struct dirsav *ds, int first));
+
+/**/
+static int
+recursivecmd(char *nam, int opt_noerr, int opt_recurse, int opt_safe,
+    UNUSED(int opt_parallel), char **args, RecurseFunc dirpre_func,
+    RecurseFunc dirpost_func, RecurseFunc leaf_func, void *magic)
 {
     int err = 0, len;
     char *rp, *s;
@@ -378,6 +735,7 @@ recursivecmd(char *nam, int opt_noerr, int opt_recurse, int opt_safe,
     reccmd.opt_noerr = opt_noerr;
     reccmd.opt_recurse = opt_recurse;
     reccmd.opt_safe = opt_safe;
+    reccmd.opt_parallel = 0;
     reccmd.dirpre_func = dirpre_func;
     reccmd.dirpost_func = dirpost_func;
     reccmd.leaf_func = leaf_func;
@@ -435,7 +793,6 @@ recursivecmd(char *nam, int opt_noerr, int opt_recurse, int opt_safe,
     return !!err;
 }
 
-/**/
 static int
 recursivecmd_doone(struct recursivecmd const *reccmd,
     char *arg, char *rp, struct dirsav *ds, int first)
@@ -447,10 +804,9 @@ recursivecmd_doone(struct recursivecmd const *reccmd,
 	    return recursivecmd_dorec(reccmd, arg, rp, &st, ds, first);
 	sp = &st;
     }
-    return reccmd->leaf_func(arg, rp, sp, reccmd->magic);
+    return reccmd->leaf_func(arg, REC_CWD, rp, sp, reccmd->magic);
 }
 
-/**/
 static int
 recursivecmd_dorec(struct recursivecmd const *reccmd,
     char *arg, char *rp, struct stat const *sp, struct dirsav *ds, int first)
@@ -462,7 +818,7 @@ recursivecmd_dorec(struct recursivecmd const *reccmd,
     char *files = NULL;
     int fileslen = 0;
 
-    err1 = reccmd->dirpre_func(arg, rp, sp, reccmd->magic);
+    err1 = reccmd->dirpre_func(arg, REC_CWD, rp, sp, reccmd->magic);
     if(err1 & 2)
 	return 2;
 
@@ -512,12 +868,14 @@ recursivecmd_dorec(struct recursivecmd const *reccmd,
 		     errno);
 	return 2;
     }
-    return err | reccmd->dirpost_func(arg, rp, sp, reccmd->magic);
+    return err | reccmd->dirpost_func(arg, REC_CWD, rp, sp, reccmd->magic);
 }
 
+#endif /* !RECURSE_AT */
+
 /**/
 static int
-recurse_donothing(UNUSED(char *arg), UNUSED(char *rp), UNUSED(struct stat const *sp), UNUSED(void *magic))
+recurse_donothing(UNUSED(char *arg), UNUSED(int dfd), UNUSED(char *rp), UNUSED(struct stat const *sp), UNUSED(void *magic))
 {
     return 0;
 }
@@ -533,14 +891,14 @@ struct rmmagic {
 
 /**/
 static int
-rm_leaf(char *arg, char *rp, struct stat const *sp, void *magic)
+rm_leaf(char *arg, int dfd, char *rp, struct stat const *sp, void *magic)
 {
     struct rmmagic *rmm = magic;
     struct stat st;
 
     if(!rmm->opt_unlinkdir || !rmm->opt_force) {
 	if(!sp) {
-	    if(!lstat(rp, &st))
+	    if(!rec_lstat(dfd, rp, &st))
 		sp = &st;
 	}
 	if(sp) {
@@ -560,7 +918,7 @@ rm_leaf(char *arg, char *rp, struct stat const *sp, void *magic)
 		    return 0;
 	    } else if(!rmm->opt_force &&
 		    !S_ISLNK(sp->st_mode) &&
-		    access(rp, W_OK)) {
+		    rec_access(dfd, rp, W_OK)) {
 		nicezputs(rmm->nam, stderr);
 		fputs(": remove `", stderr);
 		nicezputs(arg, stderr);
@@ -572,7 +930,7 @@ rm_leaf(char *arg, char *rp, struct stat const *sp, void *magic)
 	    }
 	}
     }
-    if(unlink(rp) && !rmm->opt_force) {
+    if(rec_unlink(dfd, rp) && !rmm->opt_force) {
 	zwarnnam(rmm->nam, "%s: %e", arg, errno);
 	return 1;
     }
@@ -581,7 +939,7 @@ rm_leaf(char *arg, char *rp, struct stat const *sp, void *magic)
 
 /**/
 static int
-rm_dirpost(char *arg, char *rp, UNUSED(struct stat const *sp), void *magic)
+rm_dirpost(char *arg, int dfd, char *rp, UNUSED(struct stat const *sp), void *magic)
 {
     struct rmmagic *rmm = magic;
 
@@ -594,7 +952,7 @@ rm_dirpost(char *arg, char *rp, UNUSED(struct stat const *sp), void *magic)
 	if(!ask())
 	    return 0;
     }
-    if(rmdir(rp) && !rmm->opt_force) {
+    if(rec_rmdir(dfd, rp) && !rmm->opt_force) {
 	zwarnnam(rmm->nam, "%s: %e", arg, errno);
 	return 1;
     }
@@ -615,6 +973,8 @@ bin_rm(char *nam, char **args, Options ops, UNUSED(int func))
     err = recursivecmd(nam, OPT_ISSET(ops,'f'), 
 		       OPT_ISSET(ops,'r') && !OPT_ISSET(ops,'d'),
 		       OPT_ISSET(ops,'s'),
+		       /* nothing is asked when forcing */
+		       rmm.opt_force,
 	args, recurse_donothing, rm_dirpost, rm_leaf, &rmm);
     return OPT_ISSET(ops,'f') ? 0 : err;
 }
@@ -629,11 +989,11 @@ struct chownmagic {
 
 /**/
 static int
-chown_dochown(char *arg, char *rp, UNUSED(struct stat const *sp), void *magic)
+chown_dochown(char *arg, int dfd, char *rp, UNUSED(struct stat const *sp), void *magic)
 {
     struct chownmagic *chm = magic;
 
-    if(chown(rp, chm->uid, chm->gid)) {
+    if(rec_chown(dfd, rp, chm->uid, chm->gid)) {
 	zwarnnam(chm->nam, "%s: %e", arg, errno);
 	return 1;
     }
@@ -642,11 +1002,11 @@ chown_dochown(char *arg, char *rp, UNUSED(struct stat const *sp), void *magic)
 
 /**/
 static int
-chown_dolchown(char *arg, char *rp, UNUSED(struct stat const *sp), void *magic)
+chown_dolchown(char *arg, int dfd, char *rp, UNUSED(struct stat const *sp), void *magic)
 {
     struct chownmagic *chm = magic;
 
-    if(lchown(rp, chm->uid, chm->gid)) {
+    if(rec_lchown(dfd, rp, chm->uid, chm->gid)) {
 	zwarnnam(chm->nam, "%s: %e", arg, errno);
 	return 1;
     }
@@ -737,11 +1097,440 @@ bin_chown(char *nam, char **args, Options ops, int func)
 	    chm.gid = -1;
     }
     free(uspec);
-    return recursivecmd(nam, 0, OPT_ISSET(ops,'R'), OPT_ISSET(ops,'s'),
+    return recursivecmd(nam, 0, OPT_ISSET(ops,'R'), OPT_ISSET(ops,'s'), 1,
 	args + 1, OPT_ISSET(ops, 'h') ? chown_dolchown : chown_dochown, recurse_donothing,
 	OPT_ISSET(ops, 'h') ? chown_dolchown : chown_dochown, &chm);
 }
 
+/* cp builtin */
+
+/* Buffer used when the kernel can't copy the data itself */
+#define CP_BUFSIZE	65536
+
+struct cpmagic {
+    char *nam;
+    int srclen;		/* length of the source argument */
+    char *dest;		/* what the source argument is copied to */
+    int opt_force;
+    int opt_interact;
+    int opt_preserve;
+    int opt_recurse;
+};
+
+/*
+ * Copy len bytes at offset off of sfd to the same place in dfd, or
+ * to end of file if len is negative, in which case the offsets of
+ * the fds are used.  Return 0, or -1 with errno set.
+ */
+
+/**/
+static int
+cp_range(int sfd, int dfd, off_t off, off_t len)
+{
+    char *buf = NULL;
+    ssize_t n;
+    int kernel = 1;
+
+    if (len >= 0 && lseek(sfd, off, SEEK_SET) < 0)
+	return -1;
+    if (len >= 0 && lseek(dfd, off, SEEK_SET) < 0)
+	return -1;
+    while (len) {
+	size_t chunk = (len < 0 || len > 1024 * 1024) ? 1024 * 1024 :
+	    (size_t)len;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (kernel) {
+	    n = copy_file_range(sfd, NULL, dfd, NULL, chunk, 0);
+	    if (n < 0 && errno != EINTR) {
+		if (errno != EINVAL && errno != EXDEV && errno != ENOSYS &&
+#ifdef EOPNOTSUPP
+		    errno != EOPNOTSUPP &&
+#endif
+		    errno != EBADF)
+		    return -1;
+		kernel = 0;
+	    } else if (!n && len < 0) {
+		/*
+		 * Files in /proc and the like claim to be empty: check
+		 * by reading instead.
+		 */
+		kernel = 0;
+	    }
+	    if (kernel) {
+		if (n > 0 && len > 0)
+		    len -= n;
+		else if (!n)
+		    break;
+		continue;
+	    }
+	}
+#else
+	kernel = 0;
+#endif
+	if (!buf)
+	    buf = zhalloc(CP_BUFSIZE);
+	if (chunk > CP_BUFSIZE)
+	    chunk = CP_BUFSIZE;
+	if ((n = read(sfd, buf, chunk)) < 0) {
+	    if (errno == EINTR && !errflag)
+		continue;
+	    return -1;
+	}
+	if (!n)
+	    break;
+	if (write_loop(dfd, buf, n) < 0)
+	    return -1;
+	if (len > 0)
+	    len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Copy the contents of sfd, described by sp, to dfd.  Try a reflink
+ * first, then copy the parts with data in them if the file has holes,
+ * then everything.  Return 0, or -1 with errno set.
+ */
+
+/**/
+static int
+cp_data(int sfd, int dfd, struct stat const *sp)
+{
+#ifdef FICLONE
+    if (!ioctl(dfd, FICLONE, sfd))
+	return 0;
+#endif
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if ((off_t)sp->st_blocks * 512 < sp->st_size) {
+	off_t data = 0, hole;
+
+	while ((data = lseek(sfd, data, SEEK_DATA)) >= 0) {
+	    if ((hole = lseek(sfd, data, SEEK_HOLE)) < 0 ||
+		cp_range(sfd, dfd, data, hole - data) < 0)
+		return -1;
+	    data = hole;
+	}
+	if (errno == ENXIO)
+	    /* The rest is a hole. */
+	    return ftruncate(dfd, sp->st_size);
+	if (lseek(sfd, 0, SEEK_SET) < 0 || lseek(dfd, 0, SEEK_SET) < 0)
+	    return -1;
+    }
+#endif
+    return cp_range(sfd, dfd, 0, -1);
+}
+
+/*
+ * Give the file path (or, if fd is not -1, the file open on fd) the
+ * ownership, permissions and times in sp.  It's not an error if we
+ * can't change the ownership.
+ */
+
+/**/
+static int
+cp_preserve(char *path, int fd, struct stat const *sp)
+{
+    int ret, islink = S_ISLNK(sp->st_mode);
+
+#ifdef HAVE_FCHOWN
+    if (fd >= 0)
+	ret = fchown(fd, sp->st_uid, sp->st_gid);
+    else
+#endif
+    if (islink)
+	ret = lchown(path, sp->st_uid, sp->st_gid);
+    else
+	ret = chown(path, sp->st_uid, sp->st_gid);
+    (void)ret;
+    if (!islink) {
+#ifdef HAVE_FCHMOD
+	if (fd >= 0)
+	    ret = fchmod(fd, sp->st_mode & 07777);
+	else
+#endif
+	    ret = chmod(path, sp->st_mode & 07777);
+	if (ret < 0)
+	    return -1;
+    }
+#ifdef HAVE_UTIMENSAT
+    {
+	struct timespec ts[2];
+
+	ts[0].tv_sec = sp->st_atime;
+	ts[1].tv_sec = sp->st_mtime;
+# ifdef GET_ST_ATIME_NSEC
+	ts[0].tv_nsec = GET_ST_ATIME_NSEC(*sp);
+# else
+	ts[0].tv_nsec = 0;
+# endif
+# ifdef GET_ST_MTIME_NSEC
+	ts[1].tv_nsec = GET_ST_MTIME_NSEC(*sp);
+# else
+	ts[1].tv_nsec = 0;
+# endif
+	return utimensat(AT_FDCWD, path, ts, islink ? AT_SYMLINK_NOFOLLOW : 0);
+    }
+#elif defined(HAVE_UTIMES)
+    if (!islink) {
+	struct timeval tv[2];
+
+	tv[0].tv_sec = sp->st_atime;
+	tv[0].tv_usec = 0;
+	tv[1].tv_sec = sp->st_mtime;
+	tv[1].tv_usec = 0;
+	return utimes(path, tv);
+    }
+#endif
+    return 0;
+}
+
+/* Work out where the file arg goes. */
+
+/**/
+static char *
+cp_destname(struct cpmagic *cpm, char *arg)
+{
+    return dyncat(cpm->dest, arg + cpm->srclen);
+}
+
+/**/
+static int
+cp_leaf(char *arg, int dfd, char *rp, struct stat const *sp, void *magic)
+{
+    struct cpmagic *cpm = magic;
+    struct stat st, dst;
+    char *q = cp_destname(cpm, arg), *qbuf = dupstring(q);
+    int sfd, ofd, exists, ret = 0;
+
+    unmetafy(qbuf, NULL);
+    /* Without -r, symbolic links are followed. */
+    if (!sp) {
+	if (rec_stat(dfd, rp, &st)) {
+	    zwarnnam(cpm->nam, "%s: %e", arg, errno);
+	    return 1;
+	}
+	sp = &st;
+    }
+    if (S_ISDIR(sp->st_mode)) {
+	zwarnnam(cpm->nam, "%s: %e", arg, EISDIR);
+	return 1;
+    }
+    if ((exists = !lstat(qbuf, &dst))) {
+	if (dst.st_dev == sp->st_dev && dst.st_ino == sp->st_ino) {
+	    zwarnnam(cpm->nam, "%s and %s are the same file", arg, q);
+	    return 1;
+	}
+	if (S_ISDIR(dst.st_mode)) {
+	    zwarnnam(cpm->nam, "%s: cannot overwrite directory", q);
+	    return 1;
+	}
+	if (cpm->opt_interact) {
+	    nicezputs(cpm->nam, stderr);
+	    fputs(": replace `", stderr);
+	    nicezputs(q, stderr);
+	    fputs("'? ", stderr);
+	    fflush(stderr);
+	    if (!ask())
+		return 0;
+	}
+    }
+
+    if (S_ISLNK(sp->st_mode)) {
+	VARARR(char, lbuf, PATH_MAX + 1);
+	int len = rec_readlink(dfd, rp, lbuf, PATH_MAX);
+
+	if (len < 0) {
+	    zwarnnam(cpm->nam, "%s: %e", arg, errno);
+	    return 1;
+	}
+	lbuf[len] = '\0';
+	if ((exists && unlink(qbuf)) || symlink(lbuf, qbuf)) {
+	    zwarnnam(cpm->nam, "%s: %e", q, errno);
+	    return 1;
+	}
+	if (cpm->opt_preserve)
+	    cp_preserve(qbuf, -1, sp);
+	return 0;
+    }
+#ifdef HAVE_MKFIFO
+    if (S_ISFIFO(sp->st_mode) && cpm->opt_recurse) {
+	if ((exists && unlink(qbuf)) || mkfifo(qbuf, sp->st_mode & 07777) ||
+	    (cpm->opt_preserve && cp_preserve(qbuf, -1, sp))) {
+	    zwarnnam(cpm->nam, "%s: %e", q, errno);
+	    return 1;
+	}
+	return 0;
+    }
+#endif
+    if (!S_ISREG(sp->st_mode) && cpm->opt_recurse) {
+	zwarnnam(cpm->nam, "%s: not a regular file", arg);
+	return 1;
+    }
+
+    if ((sfd = rec_open(dfd, rp, O_RDONLY | O_NOCTTY)) < 0) {
+	zwarnnam(cpm->nam, "%s: %e", arg, errno);
+	return 1;
+    }
+    ofd = open(qbuf, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY,
+	       sp->st_mode & 0777);
+    if (ofd < 0 && exists && cpm->opt_force && !unlink(qbuf))
+	ofd = open(qbuf, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY,
+		   sp->st_mode & 0777);
+    if (ofd < 0 || cp_data(sfd, ofd, sp) < 0 ||
+	(cpm->opt_preserve && cp_preserve(qbuf, ofd, sp) < 0)) {
+	zwarnnam(cpm->nam, "%s: %e", q, errno);
+	ret = 1;
+    }
+    close(sfd);
+    if (ofd >= 0 && close(ofd) < 0 && !ret) {
+	zwarnnam(cpm->nam, "%s: %e", q, errno);
+	ret = 1;
+    }
+    return ret;
+}
+
+/**/
+static int
+cp_dirpre(char *arg, UNUSED(int dfd), UNUSED(char *rp), struct stat const *sp, void *magic)
+{
+    struct cpmagic *cpm = magic;
+    char *q = cp_destname(cpm, arg), *qbuf = dupstring(q);
+    struct stat st;
+
+    unmetafy(qbuf, NULL);
+    /* We need to be able to put things in it until we're finished. */
+    if (mkdir(qbuf, (sp->st_mode & 07777) | S_IRWXU) &&
+	(errno != EEXIST || stat(qbuf, &st) || !S_ISDIR(st.st_mode))) {
+	zwarnnam(cpm->nam, "%s: %e", q, errno == EEXIST ? ENOTDIR : errno);
+	/* Don't copy what's in it. */
+	return 2;
+    }
+    return 0;
+}
+
+/**/
+static int
+cp_dirpost(char *arg, UNUSED(int dfd), UNUSED(char *rp), struct stat const *sp, void *magic)
+{
+    struct cpmagic *cpm = magic;
+    char *q = cp_destname(cpm, arg), *qbuf = dupstring(q);
+    int ret = 0;
+
+    unmetafy(qbuf, NULL);
+    if (cpm->opt_preserve)
+	ret = cp_preserve(qbuf, -1, sp);
+    else if ((sp->st_mode & S_IRWXU) != S_IRWXU) {
+	mode_t mask = umask(0);
+
+	umask(mask);
+	ret = chmod(qbuf, sp->st_mode & 07777 & ~mask);
+    }
+    if (ret < 0) {
+	zwarnnam(cpm->nam, "%s: %e", q, errno);
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Check whether the directory dest is the directory sp or inside it.
+ * dest need not exist yet, but its parent must.
+ */
+
+/**/
+static int
+cp_inside(char *dest, struct stat const *sp)
+{
+    char *buf = dupstring(unmeta(dest)), *ptr;
+    struct stat st, pst;
+
+    if (stat(buf, &st)) {
+	if ((ptr = strrchr(buf, '/')))
+	    *++ptr = '\0';
+	else
+	    buf = "";
+	buf = dyncat(buf, ".");
+	if (stat(buf, &st))
+	    return 0;
+    }
+    for (;;) {
+	if (st.st_dev == sp->st_dev && st.st_ino == sp->st_ino)
+	    return 1;
+	buf = dyncat(buf, "/..");
+	if (stat(buf, &pst) ||
+	    (pst.st_dev == st.st_dev && pst.st_ino == st.st_ino))
+	    return 0;
+	st = pst;
+    }
+}
+
+/* Copy src to dest, which is not an existing directory to copy it into. */
+
+/**/
+static int
+docopy(struct cpmagic *cpm, char *src, char *dest)
+{
+    char *args[2];
+    struct stat st;
+
+    if (cpm->opt_recurse && !stat(unmeta(src), &st) && S_ISDIR(st.st_mode) &&
+	cp_inside(dest, &st)) {
+	zwarnnam(cpm->nam, "%s: cannot copy a directory into itself", src);
+	return 1;
+    }
+#ifndef RECURSE_AT
+    /* The walk changes directory. */
+    if (cpm->opt_recurse && *dest != '/') {
+	char *cwd = zgetcwd();
+
+	dest = zhtricat(cwd, "/", dest);
+    }
+#endif
+    args[0] = src;
+    args[1] = NULL;
+    cpm->srclen = strlen(src);
+    cpm->dest = dest;
+    return recursivecmd(cpm->nam, 0, cpm->opt_recurse, 0,
+			!cpm->opt_interact, args,
+			cp_dirpre, cp_dirpost, cp_leaf, cpm);
+}
+
+/**/
+static int
+bin_cp(char *nam, char **args, Options ops, UNUSED(int func))
+{
+    struct cpmagic cpm;
+    struct stat st;
+    char **a, *ptr;
+    int err = 0;
+
+    cpm.nam = nam;
+    cpm.opt_force = OPT_ISSET(ops,'f');
+    cpm.opt_interact = OPT_ISSET(ops,'i') && !OPT_ISSET(ops,'f');
+    cpm.opt_preserve = OPT_ISSET(ops,'p');
+    cpm.opt_recurse = OPT_ISSET(ops,'r') || OPT_ISSET(ops,'R');
+
+    for(a = args; a[1]; a++) ;
+    if(stat(unmeta(*a), &st) || !S_ISDIR(st.st_mode)) {
+	if(a > args+1) {
+	    zwarnnam(nam, "last of many arguments must be a directory");
+	    return 1;
+	}
+	return docopy(&cpm, args[0], args[1]);
+    }
+    for(; args < a; args++) {
+	char *src = dupstring(*args);
+
+	/* Trailing slashes don't count for the name in the directory. */
+	for (ptr = src + strlen(src) - 1; ptr > src && *ptr == '/'; ptr--)
+	    *ptr = '\0';
+	ptr = strrchr(src, '/');
+	err |= docopy(&cpm, src, zhtricat(*a, "/", ptr ? ptr + 1 : src));
+    }
+    return err;
+}
+
 /* module paraphernalia */
 
 #ifdef HAVE_LSTAT
@@ -755,6 +1544,7 @@ static struct builtin bintab[] = {
      * fully compatible. */
     BUILTIN("chgrp", 0, bin_chown, 2, -1, BIN_CHGRP, "hRs",    NULL),
     BUILTIN("chown", 0, bin_chown, 2, -1, BIN_CHOWN, "hRs",    NULL),
+    BUILTIN("cp",    0, bin_cp,    2, -1, 0,         "fipRr", NULL),
     BUILTIN("ln",    0, bin_ln,    1, -1, BIN_LN,    LN_OPTS, NULL),
     BUILTIN("mkdir", 0, bin_mkdir, 1, -1, 0,         "pm:",   NULL),
     BUILTIN("mv",    0, bin_ln,    2, -1, BIN_MV,    "fi",    NULL),
@@ -764,6 +1554,7 @@ static struct builtin bintab[] = {
     /* The "safe" zsh-only names */
     BUILTIN("zf_chgrp", 0, bin_chown, 2, -1, BIN_CHGRP, "hRs",    NULL),
     BUILTIN("zf_chown", 0, bin_chown, 2, -1, BIN_CHOWN, "hRs",    NULL),
+    BUILTIN("zf_cp",    0, bin_cp,    2, -1, 0,         "fipRr", NULL),
     BUILTIN("zf_ln",    0, bin_ln,    1, -1, BIN_LN,    LN_OPTS, NULL),
     BUILTIN("zf_mkdir", 0, bin_mkdir, 1, -1, 0,         "pm:",   NULL),
     BUILTIN("zf_mv",    0, bin_ln,    2, -1, BIN_MV,    "fi",    NULL),
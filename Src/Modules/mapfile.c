@@ -206,8 +206,53 @@ get_contents(char *fname)
     return val;
 }
 
+/*
+ * Check whether get_contents() would find something to read, without
+ * reading it: that waits until the value is wanted, so ${+mapfile[...]}
+ * and ${(t)mapfile[...]} don't read the whole file.
+ */
+
+/**/
+static int
+has_contents(char *fname)
+{
+    int fd, ret;
+    struct stat sbuf;
+
+    unmetafy(fname = ztrdup(fname), &fd);
+    if ((fd = open(fname, O_RDONLY | O_NOCTTY)) < 0) {
+	free(fname);
+	return 0;
+    }
+#ifdef USE_MMAP
+    /* mmap() fails on anything else, and on empty files */
+    ret = !fstat(fd, &sbuf) && S_ISREG(sbuf.st_mode) && sbuf.st_size > 0;
+#else
+    ret = 1;
+#endif
+    close(fd);
+    free(fname);
+    return ret;
+}
+
+/*
+ * Read the file when the value is wanted.  This isn't remembered in
+ * u.str since we may be on a later heap than the parameter.
+ */
+
+/**/
+static char *
+getpmmapfilecontents(Param pm)
+{
+    char *contents;
+
+    if (pm->u.str)
+	return pm->u.str;
+    return (contents = get_contents(pm->node.nam)) ? contents : "";
+}
+
 static const struct gsu_scalar mapfile_gsu =
-{ strgetfn, setpmmapfile, unsetpmmapfile };
+{ getpmmapfilecontents, setpmmapfile, unsetpmmapfile };
 
 static struct paramdef partab[] = {
     SPECIALPMDEF("mapfile", 0, &mapfiles_gsu, getpmmapfile, scanpmmapfile)
@@ -217,7 +262,6 @@ static struct paramdef partab[] = {
 static HashNode
 getpmmapfile(UNUSED(HashTable ht), const char *name)
 {
-    char *contents;
     Param pm = NULL;
 
     pm = (Param) hcalloc(sizeof(struct param));
@@ -226,9 +270,9 @@ getpmmapfile(UNUSED(HashTable ht), const char *name)
     pm->gsu.s = &mapfile_gsu;
     pm->node.flags |= (partab[0].pm->node.flags & PM_READONLY);
 
-    /* Set u.str to contents of file given by name */
-    if ((contents = get_contents(pm->node.nam)))
-	pm->u.str = contents;
+    /* u.str gets the contents of the file given by name when wanted */
+    if (has_contents(pm->node.nam))
+	pm->u.str = NULL;
     else {
 	pm->u.str = "";
 	pm->node.flags |= PM_UNSET;
@@ -897,8 +897,12 @@ scanpmoptions(UNUSED(HashTable ht), ScanFunc func, int flags)
 	for (hn = optiontab->nodes[i]; hn; hn = hn->next) {
 	    int optno = ((Optname) hn)->optno, ison;
 	    pm.node.nam = hn->nam;
-	    ison = optno < 0 ? !opts[-optno] : opts[optno];
-	    pm.u.str = dupstring(ison ? "on" : "off");
+	    if (func != scancountparams &&
+		((flags & (SCANPM_WANTVALS|SCANPM_MATCHVAL)) ||
+		 !(flags & SCANPM_WANTKEYS))) {
+		ison = optno < 0 ? !opts[-optno] : opts[optno];
+		pm.u.str = dupstring(ison ? "on" : "off");
+	    }
 	    func(&pm.node, flags);
 	}
 }
@@ -1097,6 +1101,7 @@ histwgetfn(UNUSED(Param pm))
             pushnode(l, getdata(n));
 
     while (he) {
+	histentwords(he);
 	for (iw = he->nwords - 1; iw >= 0; iw--) {
 	    h = he->node.nam + he->words[iw * 2];
 	    e = he->node.nam + he->words[iw * 2 + 1];
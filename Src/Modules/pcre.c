@@ -40,6 +40,53 @@
 static pcre *pcre_pattern;
 static pcre_extra *pcre_hints;
 
+/*
+ * Use the just-in-time compiler when studying patterns, if the
+ * library has it.
+ */
+#ifdef PCRE_STUDY_JIT_COMPILE
+# define ZPCRE_STUDY_OPTS PCRE_STUDY_JIT_COMPILE
+# define zpcre_free_study(x) pcre_free_study(x)
+#else
+# define ZPCRE_STUDY_OPTS 0
+# define zpcre_free_study(x) pcre_free(x)
+#endif
+
+/*
+ * Patterns compiled for the -pcre-match condition are kept, and
+ * studied since they are likely to be used again.  The least recently
+ * used entry is replaced when the cache is full.
+ */
+
+#define ZPCRE_CACHE_SIZE 16
+
+struct zpcre_cache {
+    char *pat;			/* unmetafied pattern, NULL if unused */
+    int opts;			/* options passed to pcre_compile() */
+    unsigned long used;		/* when last used */
+    pcre *re;
+    pcre_extra *hints;
+};
+
+static struct zpcre_cache zpcre_cache[ZPCRE_CACHE_SIZE];
+static unsigned long zpcre_clock;
+
+/**/
+static void
+zpcre_free_cache(void)
+{
+    struct zpcre_cache *pc;
+
+    for (pc = zpcre_cache; pc < zpcre_cache + ZPCRE_CACHE_SIZE; pc++)
+	if (pc->pat) {
+	    zsfree(pc->pat);
+	    pc->pat = NULL;
+	    pcre_free(pc->re);
+	    if (pc->hints)
+		zpcre_free_study(pc->hints);
+	}
+}
+
 /**/
 static int
 zpcre_utf8_enabled(void)
@@ -88,8 +135,10 @@ bin_pcre_compile(char *nam, char **args, Options ops, UNUSED(int func))
     if (zpcre_utf8_enabled())
 	pcre_opts |= PCRE_UTF8;
 
-    pcre_hints = NULL;  /* Is this necessary? */
-    
+    if (pcre_hints)
+	zpcre_free_study(pcre_hints);
+    pcre_hints = NULL;
+
     if (pcre_pattern)
 	pcre_free(pcre_pattern);
 
@@ -124,7 +173,9 @@ bin_pcre_study(char *nam, UNUSED(char **args), UNUSED(Options ops), UNUSED(int f
 	return 1;
     }
     
-    pcre_hints = pcre_study(pcre_pattern, 0, &pcre_error);
+    if (pcre_hints)
+	zpcre_free_study(pcre_hints);
+    pcre_hints = pcre_study(pcre_pattern, ZPCRE_STUDY_OPTS, &pcre_error);
     if (pcre_error != NULL)
     {
 	zwarnnam(nam, "error while studying regex: %s", pcre_error);
@@ -333,14 +384,60 @@ bin_pcre_match(char *nam, char **args, Options ops, UNUSED(int func))
     return return_value;
 }
 
+/*
+ * Find pat compiled with opts in the cache, compiling and adding
+ * it if necessary.  Returns NULL after printing a warning if it
+ * doesn't compile.
+ */
+
+static struct zpcre_cache *
+zpcre_cache_compile(char *pat, int opts, char *mpat)
+{
+    struct zpcre_cache *pc, *oldest = zpcre_cache;
+    const char *pcre_err;
+    int pcre_errptr;
+    pcre *re;
+
+    for (pc = zpcre_cache; pc < zpcre_cache + ZPCRE_CACHE_SIZE; pc++) {
+	if (pc->pat && pc->opts == opts && !strcmp(pc->pat, pat)) {
+	    pc->used = ++zpcre_clock;
+	    return pc;
+	}
+	if (!pc->pat || (oldest->pat && pc->used < oldest->used))
+	    oldest = pc;
+    }
+    if (!(re = pcre_compile(pat, opts, &pcre_err, &pcre_errptr, NULL))) {
+	zwarn("failed to compile regexp /%s/: %s", mpat, pcre_err);
+	return NULL;
+    }
+    if (oldest->pat) {
+	zsfree(oldest->pat);
+	pcre_free(oldest->re);
+	if (oldest->hints)
+	    zpcre_free_study(oldest->hints);
+    }
+    oldest->pat = ztrdup(pat);
+    oldest->opts = opts;
+    oldest->used = ++zpcre_clock;
+    oldest->re = re;
+#ifdef HAVE_PCRE_STUDY
+    /* Failing to study isn't an error; we just don't get the hints. */
+    oldest->hints = pcre_study(re, ZPCRE_STUDY_OPTS, &pcre_err);
+#else
+    oldest->hints = NULL;
+#endif
+    return oldest;
+}
+
 /**/
 static int
 cond_pcre_match(char **a, int id)
 {
+    struct zpcre_cache *pc;
     pcre *pcre_pat;
-    const char *pcre_err;
+    pcre_extra *pcre_extra_hints;
     char *lhstr, *rhre, *lhstr_plain, *rhre_plain, *avar=NULL;
-    int r = 0, pcre_opts = 0, pcre_errptr, capcnt, *ov, ovsize;
+    int r = 0, pcre_opts = 0, capcnt, *ov, ovsize;
     int return_value = 0;
 
     if (zpcre_utf8_enabled())
@@ -361,15 +458,16 @@ cond_pcre_match(char **a, int id)
 
     switch(id) {
 	 case CPCRE_PLAIN:
-		pcre_pat = pcre_compile(rhre_plain, pcre_opts, &pcre_err, &pcre_errptr, NULL);
-		if (pcre_pat == NULL) {
-		    zwarn("failed to compile regexp /%s/: %s", rhre, pcre_err);
+		if (!(pc = zpcre_cache_compile(rhre_plain, pcre_opts, rhre)))
 		    break;
-		}
-                pcre_fullinfo(pcre_pat, NULL, PCRE_INFO_CAPTURECOUNT, &capcnt);
+		pcre_pat = pc->re;
+		pcre_extra_hints = pc->hints;
+                pcre_fullinfo(pcre_pat, pcre_extra_hints,
+			      PCRE_INFO_CAPTURECOUNT, &capcnt);
     		ovsize = (capcnt+1)*3;
 		ov = zalloc(ovsize*sizeof(int));
-    		r = pcre_exec(pcre_pat, NULL, lhstr_plain, strlen(lhstr_plain), 0, 0, ov, ovsize);
+    		r = pcre_exec(pcre_pat, pcre_extra_hints, lhstr_plain,
+			      strlen(lhstr_plain), 0, 0, ov, ovsize);
 		/* r < 0 => error; r==0 match but not enough size in ov
 		 * r > 0 => (r-1) substrings found; r==1 => no substrings
 		 */
@@ -400,8 +498,6 @@ cond_pcre_match(char **a, int id)
 	free(lhstr_plain);
     if(rhre_plain)
 	free(rhre_plain);
-    if (pcre_pat)
-	pcre_free(pcre_pat);
     if (ov)
 	zfree(ov, ovsize*sizeof(int));
 
@@ -483,5 +579,8 @@ cleanup_(Module m)
 int
 finish_(UNUSED(Module m))
 {
+#if defined(HAVE_PCRE_COMPILE) && defined(HAVE_PCRE_EXEC)
+    zpcre_free_cache();
+#endif
     return 0;
 }
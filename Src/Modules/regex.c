@@ -49,11 +49,65 @@ zregex_regerrwarn(int r, regex_t *re, char *msg)
     zfree(errbuf, errbufsz);
 }
 
+/*
+ * Compiled regular expressions are kept for reuse, since a script
+ * usually tests the same few expressions over and over.  The least
+ * recently used entry is replaced when the cache is full.
+ */
+
+#define ZREGEX_CACHE_SIZE 16
+
+struct zregex_cache {
+    char *pat;			/* unmetafied expression, NULL if unused */
+    int flags;			/* flags passed to regcomp() */
+    unsigned long used;		/* when last used */
+    regex_t re;
+};
+
+static struct zregex_cache zregex_cache[ZREGEX_CACHE_SIZE];
+static unsigned long zregex_clock;
+
+/*
+ * Return the compiled form of pat, or NULL after printing a warning
+ * if it doesn't compile.
+ */
+
+static regex_t *
+zregex_compile(char *pat, int flags)
+{
+    struct zregex_cache *rc, *oldest = zregex_cache;
+    int r;
+
+    for (rc = zregex_cache; rc < zregex_cache + ZREGEX_CACHE_SIZE; rc++) {
+	if (rc->pat && rc->flags == flags && !strcmp(rc->pat, pat)) {
+	    rc->used = ++zregex_clock;
+	    return &rc->re;
+	}
+	if (!rc->pat || (oldest->pat && rc->used < oldest->used))
+	    oldest = rc;
+    }
+    if (oldest->pat) {
+	zsfree(oldest->pat);
+	oldest->pat = NULL;
+	regfree(&oldest->re);
+    }
+    /* Compile in place: a regex_t can't portably be copied. */
+    if ((r = regcomp(&oldest->re, pat, flags))) {
+	zregex_regerrwarn(r, &oldest->re, "failed to compile regex");
+	regfree(&oldest->re);
+	return NULL;
+    }
+    oldest->pat = ztrdup(pat);
+    oldest->flags = flags;
+    oldest->used = ++zregex_clock;
+    return &oldest->re;
+}
+
 /**/
 static int
 zcond_regex_match(char **a, int id)
 {
-    regex_t re;
+    regex_t *re;
     regmatch_t *m, *matches = NULL;
     size_t matchessz = 0;
     char *lhstr, *lhstr_zshmeta, *rhre, *rhre_zshmeta, *s, **arr, **x;
@@ -74,38 +128,35 @@ zcond_regex_match(char **a, int id)
 	rcflags |= REG_EXTENDED;
 	if (!isset(CASEMATCH))
 	    rcflags |= REG_ICASE;
-	r = regcomp(&re, rhre, rcflags);
-	if (r) {
-	    zregex_regerrwarn(r, &re, "failed to compile regex");
+	if (!(re = zregex_compile(rhre, rcflags)))
 	    break;
-	}
-	/* re.re_nsub is number of parenthesized groups, we also need
+	/* re->re_nsub is number of parenthesized groups, we also need
 	 * 1 for the 0 offset, which is the entire matched portion
 	 */
-	if ((int)re.re_nsub < 0) {
+	if ((int)re->re_nsub < 0) {
 	    zwarn("INTERNAL ERROR: regcomp() returned "
-		    "negative subpattern count %d", (int)re.re_nsub);
+		    "negative subpattern count %d", (int)re->re_nsub);
 	    break;
 	}
-	matchessz = (re.re_nsub + 1) * sizeof(regmatch_t);
+	matchessz = (re->re_nsub + 1) * sizeof(regmatch_t);
 	matches = zalloc(matchessz);
-	r = regexec(&re, lhstr, re.re_nsub+1, matches, reflags);
+	r = regexec(re, lhstr, re->re_nsub+1, matches, reflags);
 	if (r == REG_NOMATCH)
 	    ; /* We do nothing when we fail to match. */
 	else if (r == 0) {
 	    return_value = 1;
 	    if (isset(BASHREMATCH)) {
 		start = 0;
-		nelem = re.re_nsub + 1;
+		nelem = re->re_nsub + 1;
 	    } else {
 		start = 1;
-		nelem = re.re_nsub;
+		nelem = re->re_nsub;
 	    }
 	    arr = NULL; /* bogus gcc warning of used uninitialised */
 	    /* entire matched portion + re_nsub substrings + NULL */
 	    if (nelem) {
 		arr = x = (char **) zalloc(sizeof(char *) * (nelem + 1));
-		for (m = matches + start, n = start; n <= (int)re.re_nsub; ++n, ++m, ++x) {
+		for (m = matches + start, n = start; n <= (int)re->re_nsub; ++n, ++m, ++x) {
 		    *x = metafy(lhstr + m->rm_so, m->rm_eo - m->rm_so, META_DUP);
 		}
 		*x = NULL;
@@ -175,7 +226,7 @@ zcond_regex_match(char **a, int id)
 	    }
 	}
 	else
-	    zregex_regerrwarn(r, &re, "regex matching error");
+	    zregex_regerrwarn(r, re, "regex matching error");
 	break;
     default:
 	DPUTS(1, "bad regex option");
@@ -185,7 +236,6 @@ zcond_regex_match(char **a, int id)
 
     if (matches)
 	zfree(matches, matchessz);
-    regfree(&re);
 CLEAN_BASEMETA:
     free(lhstr);
     free(rhre);
@@ -246,5 +296,13 @@ cleanup_(Module m)
 int
 finish_(UNUSED(Module m))
 {
+    struct zregex_cache *rc;
+
+    for (rc = zregex_cache; rc < zregex_cache + ZREGEX_CACHE_SIZE; rc++)
+	if (rc->pat) {
+	    zsfree(rc->pat);
+	    regfree(&rc->re);
+	    rc->pat = NULL;
+	}
     return 0;
 }
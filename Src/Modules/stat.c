@@ -42,6 +42,24 @@ static char *statelts[] = { "device", "inode", "mode", "nlink",
 				"link", NULL };
 #define HNAMEKEY "name"
 
+#ifdef HAVE_STATX
+# include <sys/sysmacros.h>
+
+/*
+ * The statx() mask needed for each element, so that when only one is
+ * picked the kernel needn't fetch the rest.  The device numbers and
+ * block size are always returned.
+ */
+static unsigned int statxmask[] = {
+    0, STATX_INO, STATX_TYPE|STATX_MODE, STATX_NLINK, STATX_UID,
+    STATX_GID, 0, STATX_SIZE, STATX_ATIME, STATX_MTIME, STATX_CTIME,
+    0, STATX_BLOCKS, STATX_TYPE
+};
+
+/* Set once statx() has turned out not to be supported by the kernel */
+static int nostatx;
+#endif
+
 /**/
 static void
 statmodeprint(mode_t mode, char *outbuf, int flags)
@@ -317,6 +335,47 @@ statprint(struct stat *sbuf, char *outbuf, char *fname, int iwhich, int flags)
 }
 
 
+/*
+ * Stat fname (unmetafied) into sbuf, following symbolic links unless
+ * lstatflag is set.  If iwhich is an element, only that element needs
+ * to be valid in sbuf.
+ */
+
+/**/
+static int
+statfile(char *fname, int lstatflag, int iwhich, struct stat *sbuf)
+{
+#ifdef HAVE_STATX
+    if (iwhich > -1 && !nostatx) {
+	struct statx stx;
+
+	if (!statx(AT_FDCWD, fname, lstatflag ? AT_SYMLINK_NOFOLLOW : 0,
+		   statxmask[iwhich], &stx)) {
+	    memset(sbuf, 0, sizeof(*sbuf));
+	    sbuf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	    sbuf->st_ino = stx.stx_ino;
+	    sbuf->st_mode = stx.stx_mode;
+	    sbuf->st_nlink = stx.stx_nlink;
+	    sbuf->st_uid = stx.stx_uid;
+	    sbuf->st_gid = stx.stx_gid;
+	    sbuf->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	    sbuf->st_size = stx.stx_size;
+	    sbuf->st_atime = stx.stx_atime.tv_sec;
+	    sbuf->st_mtime = stx.stx_mtime.tv_sec;
+	    sbuf->st_ctime = stx.stx_ctime.tv_sec;
+	    sbuf->st_blksize = stx.stx_blksize;
+	    sbuf->st_blocks = stx.stx_blocks;
+	    return 0;
+	}
+	if (errno != ENOSYS)
+	    return -1;
+	nostatx = 1;
+    }
+#endif
+    return lstatflag ? lstat(fname, sbuf) : stat(fname, sbuf);
+}
+
+
 /*
  *
  * Options:
@@ -338,6 +397,9 @@ statprint(struct stat *sbuf, char *outbuf, char *fname, int iwhich, int flags)
  *        fewer frills when -A is used.
  *  -H hash:  as for -A array, but returns a hash with the keys being those
  *        from stat -l
+ *  -k:   with -H and +type, the keys are the file names instead and any
+ *        number of files may be given; a file that can't be stat'd is
+ *        reported and left out, but the rest are still assigned
  *  -F fmt: specify a $TIME-like format for printing times; the default
  *        is the (CTIME-like) "%a %b %e %k:%M:%S %Z %Y".  This option implies
  *        -s as it is not useful for numerical times.
@@ -392,7 +454,7 @@ bin_stat(char *name, char **args, Options ops, UNUSED(int func))
 	    flags |= STF_PICK;
 	} else {
 	    for (; *arg; arg++) {
-		if (strchr("glLnNorstT", *arg))
+		if (strchr("gklLnNorstT", *arg))
 		    ops->ind[STOUC(*arg)] = 1;
 		else if (*arg == 'A') {
 		    if (arg[1]) {
@@ -478,6 +540,12 @@ bin_stat(char *name, char **args, Options ops, UNUSED(int func))
 	return 0;
     }
 
+    if (OPT_ISSET(ops,'k') &&
+	(!hashnam || !(flags & STF_PICK) || OPT_ISSET(ops,'f'))) {
+	zwarnnam(name, "-k requires -H, a stat element and file names");
+	return 1;
+    }
+
     if (!*args && !OPT_ISSET(ops,'f')) {
 	zwarnnam(name, "no files given");
 	return 1;
@@ -515,17 +583,19 @@ bin_stat(char *name, char **args, Options ops, UNUSED(int func))
 	    flags |= STF_NAME;
     }
 
-    if (OPT_ISSET(ops,'N') || OPT_ISSET(ops,'f'))
+    if (OPT_ISSET(ops,'N') || OPT_ISSET(ops,'f') || OPT_ISSET(ops,'k'))
 	flags &= ~STF_FILE;
     if (OPT_ISSET(ops,'T') || OPT_ISSET(ops,'H'))
 	flags &= ~STF_NAME;
 
     if (hashnam) {
-    	if (nargs > 1) {
+	if (OPT_ISSET(ops,'k'))
+	    arrsize = nargs;
+	else if (nargs > 1) {
 	    zwarnnam(name, "only one file allowed with -H");
 	    return 1;
-	}
-	arrsize = (flags & STF_PICK) ? 1 : ST_COUNT;
+	} else
+	    arrsize = (flags & STF_PICK) ? 1 : ST_COUNT;
 	if (flags & STF_FILE)
 	    arrsize++;
 	hashptr = hash = (char **)zshcalloc((arrsize+1)*2*sizeof(char *));
@@ -542,8 +612,7 @@ bin_stat(char *name, char **args, Options ops, UNUSED(int func))
     for (; OPT_ISSET(ops,'f') || *args; args++) {
 	char outbuf[PATH_MAX + 9]; /* "link   " + link name + NULL */
 	int rval = OPT_ISSET(ops,'f') ? fstat(fd, &statbuf) :
-	    OPT_ISSET(ops,'L') ? lstat(unmeta(*args), &statbuf) :
-	    stat(unmeta(*args), &statbuf);
+	    statfile(unmeta(*args), OPT_ISSET(ops,'L'), iwhich, &statbuf);
 	if (rval) {
 	    if (OPT_ISSET(ops,'f'))
 		sprintf(outbuf, "%d", fd);
@@ -571,7 +640,8 @@ bin_stat(char *name, char **args, Options ops, UNUSED(int func))
 		*arrptr++ = metafy(outbuf, -1, META_DUP);
 	    else if (hashnam) {
 		/* STF_NAME explicitly turned off for ops.ind['H'] above */
-	    	*hashptr++ = ztrdup(statelts[iwhich]);
+		*hashptr++ = ztrdup(OPT_ISSET(ops,'k') ? *args :
+				    statelts[iwhich]);
 		*hashptr++ = metafy(outbuf, -1, META_DUP);
 	    } else
 		printf("%s\n", outbuf);
@@ -607,7 +677,8 @@ bin_stat(char *name, char **args, Options ops, UNUSED(int func))
     }
 
     if (hashnam) {
-    	if (ret)
+	/* with -k, the files that could be stat'd are still assigned */
+	if (ret && !OPT_ISSET(ops,'k'))
 	    freearray(hash);
 	else {
 	    sethparam(hashnam, hash);
@@ -36,9 +36,23 @@
 #if defined(HAVE_POLL) && !defined(POLLIN)
 # undef HAVE_POLL
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
 
 #define SYSREAD_BUFSIZE	8192
 
+/* Buffer for zsystem copy when the data has to pass through us */
+#define SYSCOPY_BUFSIZE	65536
+/* Most we ask the kernel to move at once */
+#define SYSCOPY_CHUNK	(1024 * 1024)
+
+/* Ways of copying data, best first */
+#define COPY_RANGE	0	/* copy_file_range() between regular files */
+#define COPY_SENDFILE	1	/* sendfile() from a regular file */
+#define COPY_SPLICE	2	/* splice() to or from a pipe */
+#define COPY_RW		3	/* read() and write() */
+
 /**/
 static int
 getposint(char *instr, char *nam)
@@ -495,6 +509,255 @@ bin_zsystem_flock(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
 }
 
 
+/*
+ * Move up to len bytes from infd to outfd using the given method,
+ * adding the number moved to *moved.  Return 1 if anything was
+ * moved, 0 at end of file, or -1 with errno set; ENOSYS means the
+ * method isn't available here.
+ */
+
+/**/
+static int
+copy_chunk(int method, int infd, int outfd, size_t len, char *buf,
+	   zlong *moved)
+{
+    ssize_t ret;
+    char *ptr;
+
+    switch (method) {
+    case COPY_RANGE:
+#ifdef HAVE_COPY_FILE_RANGE
+	ret = copy_file_range(infd, NULL, outfd, NULL, len, 0);
+	break;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+
+    case COPY_SENDFILE:
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+	ret = sendfile(outfd, infd, NULL, len);
+	break;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+
+    case COPY_SPLICE:
+#ifdef HAVE_SPLICE
+	ret = splice(infd, NULL, outfd, NULL, len, SPLICE_F_MOVE);
+	break;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+
+    default:
+	if (len > SYSCOPY_BUFSIZE)
+	    len = SYSCOPY_BUFSIZE;
+	if ((ret = read(infd, buf, len)) <= 0)
+	    break;
+	for (ptr = buf; ret > 0; ) {
+	    ssize_t wret = write(outfd, ptr, ret);
+	    if (wret < 0) {
+		if (errno == EINTR && !errflag &&
+		    !retflag && !breaks && !contflag)
+		    continue;
+		return -1;
+	    }
+	    ptr += wret;
+	    ret -= wret;
+	    *moved += wret;
+	}
+	return 1;
+    }
+
+    if (ret <= 0)
+	return (int)ret;
+    *moved += ret;
+    return 1;
+}
+
+/*
+ * Wait up to timeout milliseconds for infd to have data and outfd to
+ * have room.  Return 1 if they do, 0 on timeout, -1 on error.
+ */
+
+/**/
+static int
+copy_wait(int infd, int outfd, int timeout)
+{
+#ifdef HAVE_POLL
+    struct pollfd pfd[2];
+    int ret;
+
+    pfd[0].fd = infd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = outfd;
+    pfd[1].events = POLLOUT;
+    while ((ret = poll(pfd, 1, timeout)) < 0 ||
+	   (ret && (ret = poll(pfd + 1, 1, timeout)) < 0)) {
+	if (errno != EINTR || errflag || retflag || breaks || contflag)
+	    return -1;
+    }
+    return ret;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Copy data from one fd to another, moving it within the kernel
+ * where the system allows.  Return values are as for sysread:
+ *	0	Copied to end of file, or the number of bytes asked for
+ *	1	Error in parameters to command
+ *	2	Error reading or writing, ERRNO set by system
+ *	4	Timeout
+ */
+
+/**/
+static int
+bin_zsystem_copy(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    int infd, outfd, method, ret = 0, timeout = -1, anypipe;
+    zlong count = -1, moved = 0;
+    char *countvar = NULL, *buf = NULL;
+    struct stat inst, outst;
+
+    while (*args && **args == '-') {
+	int opt;
+	char *optptr = *args + 1, *optarg, *eptr;
+	mnumber to_mn;
+	args++;
+	if (!*optptr || !strcmp(optptr, "-"))
+	    break;
+	while ((opt = *optptr)) {
+	    switch (opt) {
+	    case 'c':
+	    case 'n':
+	    case 't':
+		if (optptr[1]) {
+		    optarg = optptr + 1;
+		    optptr += strlen(optarg) - 1;
+		} else if (!*args) {
+		    zwarnnam(nam, "copy: option %c requires an argument", opt);
+		    return 1;
+		} else {
+		    optarg = *args++;
+		}
+		if (opt == 'c') {
+		    /* variable for count of bytes copied */
+		    if (!isident(optarg)) {
+			zwarnnam(nam, "not an identifier: %s", optarg);
+			return 1;
+		    }
+		    countvar = optarg;
+		} else if (opt == 'n') {
+		    /* maximum number of bytes */
+		    count = zstrtol(optarg, &eptr, 10);
+		    if (*eptr || count < 0) {
+			zwarnnam(nam, "integer expected: %s", optarg);
+			return 1;
+		    }
+		} else {
+		    /* timeout in seconds */
+		    to_mn = matheval(optarg);
+		    if (errflag)
+			return 1;
+		    if (to_mn.type == MN_FLOAT)
+			timeout = (int) (1000 * to_mn.u.d);
+		    else
+			timeout = 1000 * (int)to_mn.u.l;
+		    if (timeout < 0) {
+			zwarnnam(nam, "copy: invalid timeout: %s", optarg);
+			return 1;
+		    }
+		}
+		break;
+
+	    default:
+		zwarnnam(nam, "copy: unknown option: %c", *optptr);
+		return 1;
+	    }
+	    optptr++;
+	}
+    }
+
+    if (!args[0] || !args[1]) {
+	zwarnnam(nam, "copy: not enough arguments");
+	return 1;
+    }
+    if (args[2]) {
+	zwarnnam(nam, "copy: too many arguments");
+	return 1;
+    }
+    if ((infd = getposint(args[0], nam)) < 0 ||
+	(outfd = getposint(args[1], nam)) < 0)
+	return 1;
+    if (countvar)
+	setiparam(countvar, 0);
+
+    if (fstat(infd, &inst) < 0 || fstat(outfd, &outst) < 0)
+	return 2;
+    anypipe = S_ISFIFO(inst.st_mode) || S_ISFIFO(outst.st_mode);
+    if (S_ISREG(inst.st_mode))
+	method = S_ISREG(outst.st_mode) ? COPY_RANGE : COPY_SENDFILE;
+    else
+	method = anypipe ? COPY_SPLICE : COPY_RW;
+
+    while (count < 0 || moved < count) {
+	zlong left = count < 0 ? SYSCOPY_CHUNK : count - moved;
+	size_t len = left < SYSCOPY_CHUNK ? (size_t)left : SYSCOPY_CHUNK;
+	int res;
+
+	if (timeout >= 0 && (res = copy_wait(infd, outfd, timeout)) <= 0) {
+	    ret = res ? 2 : 4;
+	    break;
+	}
+	if (method == COPY_RW && !buf)
+	    buf = zhalloc(SYSCOPY_BUFSIZE);
+	if ((res = copy_chunk(method, infd, outfd, len, buf, &moved)) > 0)
+	    continue;
+	if (res < 0 && errno == EINTR &&
+	    !errflag && !retflag && !breaks && !contflag)
+	    continue;
+	/*
+	 * If the kernel can't do it this way, try the next.  Some
+	 * files, such as those in /proc, claim to be empty to
+	 * copy_file_range() and sendfile().
+	 */
+	if (method != COPY_RW &&
+	    (res < 0 ? (errno == EINVAL || errno == ENOSYS ||
+#ifdef EXDEV
+			errno == EXDEV ||
+#endif
+#ifdef EOPNOTSUPP
+			errno == EOPNOTSUPP ||
+#endif
+#if defined(ENOTSUP) && ENOTSUP != EOPNOTSUPP
+			errno == ENOTSUP ||
+#endif
+			0) :
+	     (!moved && method != COPY_SPLICE))) {
+	    if (method == COPY_RANGE)
+		method = COPY_SENDFILE;
+	    else if (method == COPY_SENDFILE && anypipe)
+		method = COPY_SPLICE;
+	    else
+		method = COPY_RW;
+	    continue;
+	}
+	if (res < 0)
+	    ret = 2;
+	break;
+    }
+
+    if (countvar)
+	setiparam(countvar, moved);
+    return ret;
+}
+
+
 /*
  * Return status zero if the zsystem feature is supported, else 1.
  * Operates silently for future-proofing.
@@ -514,7 +777,8 @@ bin_zsystem_supports(char *nam, char **args,
     }
 
     /* stupid but logically this should work... */
-    if (!strcmp(*args, "supports"))
+    if (!strcmp(*args, "supports") || !strcmp(*args, "resetstats") ||
+	!strcmp(*args, "copy"))
 	return 0;
 #ifdef HAVE_FCNTL_H
     if (!strcmp(*args, "flock"))
@@ -524,6 +788,27 @@ bin_zsystem_supports(char *nam, char **args,
 }
 
 
+/*
+ * Reset the counts in $sysstats.  Those describing the current state
+ * of the heap are left alone.
+ */
+/**/
+static int
+bin_zsystem_resetstats(char *nam, char **args,
+		       UNUSED(Options ops), UNUSED(int func))
+{
+    if (args[0]) {
+	zwarnnam(nam, "resetstats: too many arguments");
+	return 1;
+    }
+    memset(&runstats, 0, sizeof(runstats));
+    patcachehits = patcachemisses = 0;
+    heapstats.created = heapstats.reused = 0;
+    heapstats.peak_bytes = heapstats.bytes;
+    return 0;
+}
+
+
 /**/
 static int
 bin_zsystem(char *nam, char **args, Options ops, int func)
@@ -533,6 +818,10 @@ bin_zsystem(char *nam, char **args, Options ops, int func)
 	return bin_zsystem_flock(nam, args+1, ops, func);
     } else if (!strcmp(*args, "supports")) {
 	return bin_zsystem_supports(nam, args+1, ops, func);
+    } else if (!strcmp(*args, "resetstats")) {
+	return bin_zsystem_resetstats(nam, args+1, ops, func);
+    } else if (!strcmp(*args, "copy")) {
+	return bin_zsystem_copy(nam, args+1, ops, func);
     }
     zwarnnam(nam, "unknown subcommand: %s", *args);
     return 1;
@@ -612,11 +901,87 @@ scanpmsysparams(UNUSED(HashTable ht), ScanFunc func, int flags)
 }
 
 
+/* Functions for the sysstats special parameter. */
+
+static const struct sysstat {
+    const char *name;
+    zlong *valp;
+} sysstattab[] = {
+    { "heap_arenas", &heapstats.arenas },
+    { "heap_bytes", &heapstats.bytes },
+    { "heap_peak_bytes", &heapstats.peak_bytes },
+    { "heap_created", &heapstats.created },
+    { "heap_reused", &heapstats.reused },
+    { "heap_retained", &heapstats.retained },
+    { "heap_retained_bytes", &heapstats.retained_bytes },
+    { "heap_pushes", &runstats.heap_pushes },
+    { "heap_pops", &runstats.heap_pops },
+    { "forks", &runstats.forks },
+    { "pattern_compiles", &runstats.pattern_compiles },
+    { "pattern_cache_hits", &patcachehits },
+    { "pattern_cache_misses", &patcachemisses },
+    { "hash_lookups", &runstats.hash_lookups },
+    { "hash_expansions", &runstats.hash_expansions },
+    { "output_bytes", &runstats.output_bytes },
+    { "refreshes", &runstats.refreshes },
+    { NULL, NULL }
+};
+
+/**/
+static void
+fillpmsysstats(Param pm, const char *name)
+{
+    const struct sysstat *st;
+    char buf[DIGBUFSIZE];
+
+    pm->node.nam = dupstring(name);
+    pm->node.flags = PM_SCALAR | PM_READONLY;
+    pm->gsu.s = &nullsetscalar_gsu;
+    for (st = sysstattab; st->name; st++) {
+	if (!strcmp(name, st->name)) {
+	    convbase(buf, *st->valp, 10);
+	    pm->u.str = dupstring(buf);
+	    return;
+	}
+    }
+    pm->u.str = dupstring("");
+    pm->node.flags |= PM_UNSET;
+}
+
+
+/**/
+static HashNode
+getpmsysstats(UNUSED(HashTable ht), const char *name)
+{
+    Param pm;
+
+    pm = (Param) hcalloc(sizeof(struct param));
+    fillpmsysstats(pm, name);
+    return &pm->node;
+}
+
+
+/**/
+static void
+scanpmsysstats(UNUSED(HashTable ht), ScanFunc func, int flags)
+{
+    const struct sysstat *st;
+    struct param spm;
+
+    for (st = sysstattab; st->name; st++) {
+	fillpmsysstats(&spm, st->name);
+	func(&spm.node, flags);
+    }
+}
+
+
 static struct paramdef partab[] = {
     SPECIALPMDEF("errnos", PM_ARRAY|PM_READONLY,
 		 &errnos_gsu, NULL, NULL),
     SPECIALPMDEF("sysparams", PM_READONLY,
-		 NULL, getpmsysparams, scanpmsysparams)
+		 NULL, getpmsysparams, scanpmsysparams),
+    SPECIALPMDEF("sysstats", PM_READONLY,
+		 NULL, getpmsysstats, scanpmsysstats)
 };
 
 static struct features module_features = {
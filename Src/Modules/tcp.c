@@ -336,10 +336,117 @@ tcp_connect(Tcp_session sess, char *addrp, struct hostent *zhost, int d_port)
     return connect(sess->fd, (struct sockaddr *)&(sess->peer), salen);
 }
 
+#if defined(HAVE_POLL) || defined(HAVE_SELECT)
+/*
+ * Wait up to timeout milliseconds, or for ever if timeout is negative,
+ * until at least one of the n sessions in sessv has finished
+ * connecting, and set ready[i] for each that has.  Returns the number
+ * that have, which is zero if the time ran out, or -1 for an error.
+ */
+
+static int
+tcp_wait_connect(Tcp_session *sessv, int n, int timeout, int *ready)
+{
+    int i, ret;
+# ifdef HAVE_POLL
+    VARARR(struct pollfd, pfds, n);
+
+    for (i = 0; i < n; i++) {
+	pfds[i].fd = sessv[i]->fd;
+	pfds[i].events = POLLOUT;
+	pfds[i].revents = 0;
+    }
+    do {
+	ret = poll(pfds, n, timeout);
+    } while (ret < 0 && errno == EINTR && !errflag);
+    for (i = 0; i < n; i++)
+	ready[i] = (ret > 0 && pfds[i].revents);
+# else
+    fd_set wfds, efds;
+    struct timeval tv, *tvp = NULL;
+    int maxfd = 0;
+
+    do {
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+	for (i = 0; i < n; i++) {
+	    FD_SET(sessv[i]->fd, &wfds);
+	    FD_SET(sessv[i]->fd, &efds);
+	    if (sessv[i]->fd > maxfd)
+		maxfd = sessv[i]->fd;
+	}
+	if (timeout >= 0) {
+	    tv.tv_sec = timeout / 1000;
+	    tv.tv_usec = (timeout % 1000) * 1000;
+	    tvp = &tv;
+	}
+	ret = select(maxfd + 1, NULL, &wfds, &efds, tvp);
+    } while (ret < 0 && errno == EINTR && !errflag);
+    for (i = 0; i < n; i++)
+	ready[i] = (ret > 0 && (FD_ISSET(sessv[i]->fd, &wfds) ||
+				FD_ISSET(sessv[i]->fd, &efds)));
+    if (ret > 0)
+	for (ret = i = 0; i < n; i++)
+	    ret += ready[i];
+# endif
+    return ret;
+}
+#endif
+
+/*
+ * Finish a connection started without blocking, once it is ready.
+ * Returns 0 if it succeeded, else the error.
+ */
+
+static int
+tcp_connect_done(Tcp_session sess)
+{
+    int err = 0;
+    ZSOCKLEN_T len = sizeof(err);
+
+    if (getsockopt(sess->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &len) < 0)
+	err = errno;
+    sess->flags &= ~ZTCP_CONNECTING;
+    if (!err)
+	fcntl(sess->fd, F_SETFL, fcntl(sess->fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return err;
+}
+
+/* Get the value of the -T option in milliseconds, or -1 if not given. */
+
+static int
+tcp_timeout(char *nam, Options ops, int *timeout)
+{
+    mnumber mn;
+
+    *timeout = -1;
+    if (!OPT_ISSET(ops,'T'))
+	return 0;
+#if defined(HAVE_POLL) || defined(HAVE_SELECT)
+    mn = matheval(OPT_ARG(ops,'T'));
+    if (errflag)
+	return 1;
+    if (mn.type == MN_FLOAT)
+	mn.u.d *= 1000.0;
+    else
+	mn.u.d = (double) mn.u.l * 1000.0;
+    if (mn.u.d < 0 || mn.u.d > (double) INT_MAX) {
+	zwarnnam(nam, "invalid timeout: %s", OPT_ARG(ops,'T'));
+	return 1;
+    }
+    *timeout = (int) mn.u.d;
+    return 0;
+#else
+    zwarnnam(nam, "-T not currently supported");
+    return 1;
+#endif
+}
+
 static int
 bin_ztcp(char *nam, char **args, Options ops, UNUSED(int func))
 {
     int herrno, err=1, destport, force=0, verbose=0, test=0, targetfd=0;
+    int timeout, nonblock, ready, ret;
     ZSOCKLEN_T  len;
     char **addrp, *desthost, *localname, *remotename;
     struct hostent *zthost = NULL, *ztpeer = NULL;
@@ -363,6 +470,13 @@ bin_ztcp(char *nam, char **args, Options ops, UNUSED(int func))
 	}
     }
 
+    if (tcp_timeout(nam, ops, &timeout))
+	return 1;
+
+    if (!OPT_ISSET(ops,'W') && arrlen(args) > 3) {
+	zwarnnam(nam, "too many arguments");
+	return 1;
+    }
 
     if (OPT_ISSET(ops,'c')) {
 	if (!args[0]) {
@@ -466,6 +580,74 @@ bin_ztcp(char *nam, char **args, Options ops, UNUSED(int func))
 
 	return 0;
 
+    }
+    else if (OPT_ISSET(ops,'W'))
+    {
+#if defined(HAVE_POLL) || defined(HAVE_SELECT)
+	LinkNode node;
+	Tcp_session *sessv;
+	int *ready, n = 0, i, ret;
+	char **reply, **rp, buf[DIGBUFSIZE];
+
+	if (*args) {
+	    sessv = (Tcp_session *) zhalloc(arrlen(args) * sizeof(*sessv));
+	    for (; *args; args++) {
+		if (!(sess = zts_byfd(atoi(*args))) ||
+		    !(sess->flags & ZTCP_CONNECTING)) {
+		    zwarnnam(nam, "fd %s is not a connection in progress",
+			     *args);
+		    return 1;
+		}
+		sessv[n++] = sess;
+	    }
+	} else {
+	    for (node = firstnode(ztcp_sessions); node; incnode(node))
+		if (((Tcp_session)getdata(node))->flags & ZTCP_CONNECTING)
+		    n++;
+	    sessv = (Tcp_session *) zhalloc((n + 1) * sizeof(*sessv));
+	    n = 0;
+	    for (node = firstnode(ztcp_sessions); node; incnode(node))
+		if (((Tcp_session)getdata(node))->flags & ZTCP_CONNECTING)
+		    sessv[n++] = (Tcp_session)getdata(node);
+	}
+	if (!n) {
+	    zwarnnam(nam, "no connections in progress");
+	    return 1;
+	}
+	ready = (int *) zhalloc(n * sizeof(int));
+	if ((ret = tcp_wait_connect(sessv, n, timeout, ready)) < 0) {
+	    zwarnnam(nam, "error waiting for connections: %e", errno);
+	    return 1;
+	}
+
+	/* reply is set to pairs of file descriptor and error number */
+	rp = reply = (char **) zalloc((2 * ret + 1) * sizeof(char *));
+	for (i = 0; i < n; i++) {
+	    if (!ready[i])
+		continue;
+	    sess = sessv[i];
+	    convbase(buf, (zlong) sess->fd, 10);
+	    *rp++ = ztrdup(buf);
+	    err = tcp_connect_done(sess);
+	    convbase(buf, (zlong) err, 10);
+	    *rp++ = ztrdup(buf);
+	    if (verbose) {
+		if (err)
+		    printf("connection on fd %d failed: %s\n", sess->fd,
+			   strerror(err));
+		else
+		    printf("connection on fd %d is ready\n", sess->fd);
+	    }
+	    if (err)
+		tcp_close(sess);
+	}
+	*rp = NULL;
+	setaparam("reply", reply);
+	return !ret;
+#else
+	zwarnnam(nam, "-W not currently supported");
+	return 1;
+#endif
     }
     else if (OPT_ISSET(ops,'a'))
     {
@@ -583,6 +765,8 @@ bin_ztcp(char *nam, char **args, Options ops, UNUSED(int func))
 			int schar;
 			if (sess->flags & ZTCP_ZFTP)
 			    schar = 'Z';
+			else if (sess->flags & ZTCP_CONNECTING)
+			    schar = 'C';
 			else if (sess->flags & ZTCP_LISTEN)
 			    schar = 'L';
 			else if (sess->flags & ZTCP_INBOUND)
@@ -600,7 +784,9 @@ bin_ztcp(char *nam, char **args, Options ops, UNUSED(int func))
 				((sess->flags & ZTCP_INBOUND) ? "<-" : "->")),
 			       remotename, ntohs(sess->peer.in.sin_port),
 			       sess->fd,
-			       (sess->flags & ZTCP_ZFTP) ? " ZFTP" : "");
+			       (sess->flags & ZTCP_ZFTP) ? " ZFTP" :
+			       (sess->flags & ZTCP_CONNECTING) ?
+			       " (connecting)" : "");
 		    }
 		}
 	    }
@@ -645,12 +831,44 @@ bin_ztcp(char *nam, char **args, Options ops, UNUSED(int func))
 	    return 1;
 	}
 	
+	/*
+	 * With -n, or a timeout, connect without blocking.  With -n that
+	 * is all; the connection is finished by ztcp -W.
+	 */
+	nonblock = OPT_ISSET(ops,'n') || timeout >= 0;
+#if !defined(HAVE_POLL) && !defined(HAVE_SELECT)
+	if (nonblock) {
+	    zwarnnam(nam, "-n not currently supported");
+	    tcp_close(sess);
+	    zsfree(desthost);
+	    return 1;
+	}
+#endif
+	if (nonblock)
+	    fcntl(sess->fd, F_SETFL, fcntl(sess->fd, F_GETFL, 0) | O_NONBLOCK);
 	for (addrp = zthost->h_addr_list; err && *addrp; addrp++) {
 	    if (zthost->h_length != 4)
 		zwarnnam(nam, "address length mismatch");
 	    do {
 		err = tcp_connect(sess, *addrp, zthost, destport);
 	    } while (err && errno == EINTR && !errflag);
+	    if (nonblock && (!err || errno == EINPROGRESS)) {
+		if (OPT_ISSET(ops,'n')) {
+		    sess->flags |= ZTCP_CONNECTING;
+		    err = 0;
+		    break;
+		}
+#if defined(HAVE_POLL) || defined(HAVE_SELECT)
+		if (!err ||
+		    (ret = tcp_wait_connect(&sess, 1, timeout, &ready)) > 0)
+		    err = errno = tcp_connect_done(sess);
+		else {
+		    err = 1;
+		    if (!ret)
+			errno = ETIMEDOUT;
+		}
+#endif
+	    }
 	}
 	
 	if (err) {
@@ -672,8 +890,10 @@ bin_ztcp(char *nam, char **args, Options ops, UNUSED(int func))
 	    setiparam("REPLY", sess->fd);
 
 	    if (verbose)
-		printf("%s:%d is now on fd %d\n",
-			desthost, destport, sess->fd);
+		printf("%s:%d is %s on fd %d\n",
+		       desthost, ntohs(destport),
+		       (sess->flags & ZTCP_CONNECTING) ?
+		       "connecting" : "now", sess->fd);
 	}
 	
 	zsfree(desthost);
@@ -683,7 +903,7 @@ bin_ztcp(char *nam, char **args, Options ops, UNUSED(int func))
 }
 
 static struct builtin bintab[] = {
-    BUILTIN("ztcp", 0, bin_ztcp, 0, 3, 0, "acd:flLtv", NULL),
+    BUILTIN("ztcp", 0, bin_ztcp, 0, -1, 0, "acd:flLnT:tvW", NULL),
 };
 
 static struct features module_features = {
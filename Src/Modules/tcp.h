@@ -83,6 +83,7 @@ typedef struct tcp_session *Tcp_session;
 
 #define ZTCP_LISTEN  1
 #define ZTCP_INBOUND 2
+#define ZTCP_CONNECTING 4	/* outbound, connect not yet finished */
 #define ZTCP_ZFTP    16
 
 struct tcp_session {
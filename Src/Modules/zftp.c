@@ -57,6 +57,10 @@ typedef struct zftp_session *Zftp_session;
 /* it's a TELNET based protocol, but don't think I like doing this */
 #include <arpa/telnet.h>
 
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
 /*
  * We use poll() in preference to select because some subset of manuals says
  * that's the thing to do, plus it's a bit less fiddly.  I don't actually
@@ -108,7 +112,8 @@ int h_errno;
  * is pretty big, and should presumably send blocks
  * which are smaller to be on the safe side.
  * Currently we send 32768 and use that also as
- * the maximum to receive.  No-one's complained yet.  Of course,
+ * the maximum to receive, whatever ZFTP_BUFSIZE says.  No-one's
+ * complained yet.  Of course,
  * no-one's *used* it yet apart from me, but even so.
  */
 
@@ -228,6 +233,14 @@ static int zfclosing;
 static char *lastmsg, lastcodestr[4];
 static int lastcode;
 
+/*
+ * Set when, getting several files with the B preference, the PASV and
+ * transfer commands for the next file have been sent before the reply
+ * to the end of the last transfer was read.  Their replies are still
+ * to come.
+ */
+static int zfpending;
+
 /* remote system has size, mdtm commands */
 enum {
     ZFCP_UNKN = 0,		/* dunno if it works on this server */
@@ -280,7 +293,8 @@ static int zfstatfd = -1, *zfstatusp;
 enum {
     ZFPF_SNDP = 0x01,		/* Use send port mode */
     ZFPF_PASV = 0x02,		/* Try using passive mode */
-    ZFPF_DUMB = 0x04		/* Don't do clever things with variables */
+    ZFPF_DUMB = 0x04,		/* Don't do clever things with variables */
+    ZFPF_BTCH = 0x08		/* Pipeline commands for several files */
 };
 
 /* The flags as stored internally. */
@@ -824,6 +838,21 @@ zfgetmsg(void)
 /**/
 static int
 zfsendcmd(char *cmd)
+{
+    if (zfwritecmd(cmd))
+	return 6;
+
+    return zfgetmsg();
+}
+
+/*
+ * Send cmd, which may be several commands, without waiting for a
+ * reply.  Returns 0 for success, else 6 as for zfsendcmd().
+ */
+
+/**/
+static int
+zfwritecmd(char *cmd)
 {
     /*
      * We use the fd directly; there's no point even using
@@ -849,7 +878,20 @@ zfsendcmd(char *cmd)
 	return 6;
     }
 
-    return zfgetmsg();
+    return 0;
+}
+
+/* The command to ask for a passive data connection */
+
+/**/
+static char *
+zfpsvcmd(void)
+{
+#ifdef SUPPORT_IPV6
+    if (zfsess->control->peer.a.sa_family == AF_INET6)
+	return "EPSV\r\n";
+#endif /* SUPPORT_IPV6 */
+    return "PASV\r\n";
 }
 
 
@@ -870,16 +912,9 @@ zfopendata(char *name, union tcp_sockaddr *zdsockp, int *is_passivep)
     }
 
     if (!(zfstatusp[zfsessno] & ZFST_NOPS) && (zfprefs & ZFPF_PASV)) {
-	char *psv_cmd;
 	int err, salen;
 
-#ifdef SUPPORT_IPV6
-	if(zfsess->control->peer.a.sa_family == AF_INET6)
-	    psv_cmd = "EPSV\r\n";
-	else
-#endif /* SUPPORT_IPV6 */
-	    psv_cmd = "PASV\r\n";
-	if (zfsendcmd(psv_cmd) == 6)
+	if ((zfpending ? zfgetmsg() : zfsendcmd(zfpsvcmd())) == 6)
 	    return 1;
 	else if (lastcode >= 500 && lastcode <= 504) {
 	    /*
@@ -888,6 +923,11 @@ zfopendata(char *name, union tcp_sockaddr *zdsockp, int *is_passivep)
 	     */
 	    zfstatusp[zfsessno] |= ZFST_NOPS;
 	    zfclosedata();
+	    if (zfpending) {
+		/* the transfer command sent after it failed, too */
+		zfpending = 0;
+		zfgetmsg();
+	    }
 	    return zfopendata(name, zdsockp, is_passivep);
 	}
 	zdsockp->a.sa_family = zfsess->control->peer.a.sa_family;
@@ -1057,6 +1097,7 @@ zfclosedata(void)
  * then the start of the remote file.
  * getsize is non-zero if we want to try to find the number
  * of bytes in the reply to a RETR command.
+ * If zfpending is set, cmd has already been sent.
  *
  * Return 0 on success, 1 on failure.
  */
@@ -1069,8 +1110,14 @@ zfgetdata(char *name, char *rest, char *cmd, int getsize)
     int newfd, is_passive;
     union tcp_sockaddr zdsock;
 
-    if (zfopendata(name, &zdsock, &is_passive))
+    if (zfopendata(name, &zdsock, &is_passive)) {
+	if (zfpending) {
+	    /* the transfer command was sent anyway: mop up the reply */
+	    zfpending = 0;
+	    zfgetmsg();
+	}
 	return 1;
+    }
 
     /*
      * Set position in remote file for get/put.
@@ -1087,10 +1134,12 @@ zfgetdata(char *name, char *rest, char *cmd, int getsize)
 	return 1;
     }
 
-    if (zfsendcmd(cmd) > 2) {
+    if ((zfpending ? zfgetmsg() : zfsendcmd(cmd)) > 2) {
+	zfpending = 0;
 	zfclosedata();
 	return 1;
     }
+    zfpending = 0;
     if (getsize || (!(zfstatusp[zfsessno] & ZFST_TRSZ) &&
 		    !strncmp(cmd, "RETR", 4))) {
 	/*
@@ -1276,6 +1325,45 @@ zfstats(char *fnam, int remote, off_t *retsize, char **retmdtm, int fd)
     return 0;
 }
 
+/*
+ * Find the sizes of the remote files in args, sending all the SIZE
+ * commands at once and then reading the replies.  A size that isn't
+ * found is set to -1.
+ */
+
+/**/
+static void
+zfbatchsizes(char **args, off_t *sizes)
+{
+    char **aptr, *cmd, *ptr;
+    int i, n = arrlen(args), len = 0;
+
+    for (i = 0; i < n; i++)
+	sizes[i] = -1;
+    if (zfsess->has_size == ZFCP_NOPE)
+	return;
+
+    for (aptr = args; *aptr; aptr++)
+	len += strlen(*aptr) + 7;
+    ptr = cmd = zhalloc(len + 1);
+    for (aptr = args; *aptr; aptr++) {
+	sprintf(ptr, "SIZE %s\r\n", *aptr);
+	ptr += strlen(ptr);
+    }
+    if (zfwritecmd(cmd))
+	return;
+
+    for (i = 0; i < n; i++) {
+	if (zfgetmsg() == 6)
+	    return;
+	if (lastcode < 300) {
+	    sizes[i] = zstrtol(lastmsg, 0, 10);
+	    zfsess->has_size = ZFCP_YUPP;
+	} else if (lastcode >= 500 && lastcode <= 504)
+	    zfsess->has_size = ZFCP_NOPE;
+    }
+}
+
 /* Set parameters to say what's coming */
 
 /**/
@@ -1357,6 +1445,40 @@ zfwrite(int fd, char *bf, off_t sz, int tmout)
     return ret;
 }
 
+/*
+ * Send up to sz bytes from the regular file fdin to fd with sendfile(),
+ * with a timeout as for zfwrite().  Returns the number of bytes sent, 0
+ * at the end of the file, or -1 with errno set, which is ENOSYS if the
+ * system doesn't do that.
+ */
+
+/**/
+static int
+zfsendfile(int fd, int fdin, off_t sz, int tmout)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    int ret;
+
+    if (!tmout)
+	return sendfile(fd, fdin, NULL, sz);
+
+    if (setjmp(zfalrmbuf)) {
+	alarm(0);
+	zwarnnam("zftp", "timeout on network write");
+	return -1;
+    }
+    zfalarm(tmout);
+
+    ret = sendfile(fd, fdin, NULL, sz);
+
+    alarm(0);
+    return ret;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 static int zfread_eof;
 
 /* Version of zfread when we need to read in block mode. */
@@ -1453,22 +1575,26 @@ zfwrite_block(int fd, char *bf, off_t sz, int tmout)
  *
  * progress is 1 to use a progress meter.
  * startat says how far in we're starting with a REST command.
+ * next, if not NULL, is the command for the next transfer, to be sent
+ * with a PASV before waiting for the reply to the end of this one.
  *
  * Since we're doing some buffering here anyway, we don't bother
- * with a stdio layer.
+ * with a stdio layer.  The buffer size is given by $ZFTP_BUFSIZE,
+ * except in block mode.
  */
 
 /**/
 static int
-zfsenddata(char *name, int recv, int progress, off_t startat)
+zfsenddata(char *name, int recv, int progress, off_t startat, char *next)
 {
-#define ZF_BUFSIZE 32768
-#define ZF_ASCSIZE (ZF_BUFSIZE/2)
+#define ZF_BUFSIZE 65536
+#define ZF_BUFMAX (16*1024*1024)
+#define ZF_BLKSIZE 32768
     /* ret = 2 signals the local read/write failed, so send abort */
     int n, ret = 0, gotack = 0, fdin, fdout, fromasc = 0, toasc = 0;
-    int rtmout = 0, wtmout = 0;
-    char lsbuf[ZF_BUFSIZE], *ascbuf = NULL, *optr;
-    off_t sofar = 0, last_sofar = 0;
+    int rtmout = 0, wtmout = 0, usesendfile = 0;
+    char *lsbuf, *ascbuf = NULL, *optr;
+    off_t sofar = 0, last_sofar = 0, bufsize;
     readwrite_t read_ptr = zfread, write_ptr = zfwrite;
     Shfunc shfunc;
 
@@ -1504,13 +1630,54 @@ zfsenddata(char *name, int recv, int progress, off_t startat)
 	    write_ptr = zfwrite_block;
     }
 
+    if (ZFST_MODE(zfstatusp[zfsessno]) == ZFST_BLOC)
+	bufsize = ZF_BLKSIZE;
+    else if ((bufsize = getiparam("ZFTP_BUFSIZE")) <= 0)
+	bufsize = ZF_BUFSIZE;
+    else if (bufsize < 512)
+	bufsize = 512;
+    else if (bufsize > ZF_BUFMAX)
+	bufsize = ZF_BUFMAX;
+    lsbuf = zalloc(bufsize);
     if (toasc)
-	ascbuf = zalloc(ZF_ASCSIZE);
+	ascbuf = zalloc(bufsize/2);
+    else if (!recv && write_ptr == zfwrite) {
+	/*
+	 * An image transfer from a regular file can go straight
+	 * from the file to the socket without passing through here.
+	 */
+	struct stat st;
+
+	usesendfile = !fstat(fdin, &st) && S_ISREG(st.st_mode);
+    }
     zfpipe();
     zfread_eof = 0;
     while (!ret && !zfread_eof) {
-	n = (toasc) ? read_ptr(fdin, ascbuf, ZF_ASCSIZE, rtmout)
-	    : read_ptr(fdin, lsbuf, ZF_BUFSIZE, rtmout);
+	if (usesendfile) {
+	    n = zfsendfile(fdout, fdin, bufsize, wtmout);
+	    if (n < 0 && (errno == EINVAL || errno == ENOSYS) &&
+		!zfdrrrring) {
+		/* not for this file or socket, so do it by hand */
+		usesendfile = 0;
+		continue;
+	    }
+	    if (n > 0)
+		sofar += n;
+	    else if (n < 0) {
+		/* see below for what we're testing */
+		if (errno != EINTR || errflag || zfdrrrring) {
+		    if (!zfdrrrring &&
+			(!interact || (!errflag && errno != EPIPE)))
+			zwarnnam(name, "write failed: %e", errno);
+		    ret = 1;
+		    break;
+		}
+	    } else
+		break;
+	    goto report;
+	}
+	n = (toasc) ? read_ptr(fdin, ascbuf, bufsize/2, rtmout)
+	    : read_ptr(fdin, lsbuf, bufsize, rtmout);
 	if (n > 0) {
 	    char *iptr;
 	    if (toasc) {
@@ -1608,6 +1775,7 @@ zfsenddata(char *name, int recv, int progress, off_t startat)
 	    }
 	} else
 	    break;
+    report:
 	if (!ret && sofar != last_sofar && progress &&
 	    (shfunc = getshfunc("zftp_progress"))) {
 	    int osc = sfcontext;
@@ -1682,9 +1850,20 @@ zfsenddata(char *name, int recv, int progress, off_t startat)
 	noholdintr();
     }
 	
+    zfree(lsbuf, bufsize);
     if (toasc)
-	zfree(ascbuf, ZF_ASCSIZE);
+	zfree(ascbuf, bufsize/2);
     zfclosedata();
+    if (next && !ret && !errflag && !(zfstatusp[zfsessno] & ZFST_NOPS)) {
+	/*
+	 * Ask for the next file now; the server will get round to it
+	 * after the reply to this one, saving us the round trips.
+	 */
+	char *cmd = dyncat(zfpsvcmd(), next);
+
+	if (!zfwritecmd(cmd))
+	    zfpending = 1;
+    }
     if (!gotack && zfgetmsg() > 2)
 	ret = 1;
     return ret != 0;
@@ -2329,7 +2508,7 @@ zftp_dir(char *name, char **args, int flags)
 	return 1;
 
     fflush(stdout);		/* since we're now using fd 1 */
-    return zfsenddata(name, 1, 0, 0);
+    return zfsenddata(name, 1, 0, 0, NULL);
 }
 
 /* change the remote directory */
@@ -2550,7 +2729,10 @@ static int
 zftp_getput(char *name, char **args, int flags)
 {
     int ret = 0, recv = (flags & ZFTP_RECV), getsize = 0, progress = 1;
+    int pipeline = 0, i;
     char *cmd = recv ? "RETR " : (flags & ZFTP_APPE) ? "APPE " : "STOR ";
+    char *ln, *next = NULL;
+    off_t *sizes = NULL;
     Shfunc shfunc;
 
     /*
@@ -2566,8 +2748,28 @@ zftp_getput(char *name, char **args, int flags)
 
     if (recv)
 	fflush(stdout);		/* since we may be using fd 1 */
-    for (; *args; args++) {
-	char *ln, *rest = NULL;
+
+    /*
+     * With the B preference, getting several files in passive mode,
+     * the commands for each file are sent at the end of the transfer
+     * before, so the server doesn't wait for us between files.  The
+     * sizes for the progress report are asked for all at once first.
+     * This isn't done for puts: a STOR sent early would create the
+     * file on the server even if we then didn't send it.
+     */
+    if (recv && !(flags & ZFTP_REST) && *args && args[1] &&
+	(zfprefs & (ZFPF_BTCH|ZFPF_PASV)) == (ZFPF_BTCH|ZFPF_PASV) &&
+	!(zfstatusp[zfsessno] & ZFST_NOPS)) {
+	pipeline = 1;
+	if (progress && !(zfprefs & ZFPF_DUMB) &&
+	    getshfunc("zftp_progress")) {
+	    sizes = (off_t *)zhalloc(arrlen(args) * sizeof(off_t));
+	    zfbatchsizes(args, sizes);
+	}
+    }
+
+    for (i = 0; *args; args++, i++) {
+	char *rest = NULL;
 	off_t startat = 0;
 	if (progress && (shfunc = getshfunc("zftp_progress"))) {
 	    off_t sz = -1;
@@ -2579,7 +2781,10 @@ zftp_getput(char *name, char **args, int flags)
 	     * next time.  For that reason, the first call
 	     * of zftp_progress is delayed until zfsenddata().
 	     */
-	    if ((!(zfprefs & ZFPF_DUMB) &&
+	    if (sizes) {
+		if ((sz = sizes[i]) == -1)
+		    getsize = 1;
+	    } else if ((!(zfprefs & ZFPF_DUMB) &&
 		 (zfstatusp[zfsessno] & (ZFST_NOSZ|ZFST_TRSZ)) != ZFST_TRSZ)
 		|| !recv) {
 		/* the final 0 is a local fd to fstat if recv is zero */
@@ -2597,11 +2802,12 @@ zftp_getput(char *name, char **args, int flags)
 	    rest = tricat("REST ", args[1], "\r\n");
 	}
 
-	ln = tricat(cmd, *args, "\r\n");
+	ln = next ? next : tricat(cmd, *args, "\r\n");
+	next = (pipeline && args[1]) ? tricat(cmd, args[1], "\r\n") : NULL;
 	/* note zfsess->dfd doesn't exist till zfgetdata() creates it */
 	if (zfgetdata(name, rest, ln, getsize))
 	    ret = 2;
-	else if (zfsenddata(name, recv, progress, startat))
+	else if (zfsenddata(name, recv, progress, startat, next))
 	    ret = 1;
 	zsfree(ln);
 	/*
@@ -2627,6 +2833,19 @@ zftp_getput(char *name, char **args, int flags)
 	if (errflag)
 	    break;
     }
+    if (next) {
+	if (zfpending) {
+	    /*
+	     * We stopped with the next file already asked for.
+	     * Connect and hang up to get the server to give up on it.
+	     */
+	    if (!zfgetdata(name, NULL, next, 0)) {
+		zfclosedata();
+		zfgetmsg();
+	    }
+	}
+	zsfree(next);
+    }
     zfendtrans();
     return ret != 0;
 }
@@ -3102,6 +3321,11 @@ bin_zftp(char *name, char **args, UNUSED(Options ops), UNUSED(int func))
 		zfprefs |= ZFPF_DUMB;
 		break;
 
+	    case 'B':
+		/* batch */
+		zfprefs |= ZFPF_BTCH;
+		break;
+
 	    default:
 		zwarnnam(name, "preference %c not recognized", *ptr);
 		break;
@@ -3202,9 +3426,10 @@ boot_(UNUSED(Module m))
      * Set some default parameters.
      * These aren't special, so aren't associated with features.
      */
-    off_t tmout_def = 60;
+    off_t tmout_def = 60, bufsize_def = ZF_BUFSIZE;
     zfsetparam("ZFTP_VERBOSE", ztrdup("450"), ZFPM_IFUNSET);
     zfsetparam("ZFTP_TMOUT", &tmout_def, ZFPM_IFUNSET|ZFPM_INTEGER);
+    zfsetparam("ZFTP_BUFSIZE", &bufsize_def, ZFPM_IFUNSET|ZFPM_INTEGER);
     zfsetparam("ZFTP_PREFS", ztrdup("PS"), ZFPM_IFUNSET);
     /* default preferences if user deletes variable */
     zfprefs = ZFPF_SNDP|ZFPF_PASV;
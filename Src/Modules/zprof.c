@@ -50,6 +50,7 @@ struct sfunc {
     Pfunc p;
     Sfunc prev;
     double beg;
+    long gen;
 };
 
 typedef struct parc *Parc;
@@ -68,8 +69,64 @@ static int ncalls;
 static Parc arcs;
 static int narcs;
 static Sfunc stack;
+/*
+ * Incremented by zprof -c.  Calls still on the stack refer to data
+ * freed then, so they are not counted when they return.
+ */
+static long zprofgen;
 static Module zprof_module;
 
+/*
+ * In sampling mode the functions aren't timed when they are called.
+ * Instead a SIGPROF timer interrupts the shell at regular intervals
+ * of CPU time, and the handler adds the names of the functions on
+ * $funcstack to a fixed table of folded stacks.  That has to be done
+ * without allocating memory, so the table is made when sampling
+ * starts and samples that don't fit in it are only counted.
+ */
+
+#define ZPROF_NSAMPLES 1024
+#define ZPROF_STACKLEN 512
+#define ZPROF_DEPTH    128
+
+typedef struct psample *Psample;
+
+struct psample {
+    unsigned hash;
+    long count;
+    char stack[ZPROF_STACKLEN];
+};
+
+static Psample samples;
+static volatile long lostsamples;
+static int sampling, samplelines;
+static struct sigaction oldprofact;
+
+/*
+ * Line profiling.  Each time a command starts, the time since the
+ * previous one started is charged to the line that one was on, so the
+ * time for a line includes external commands it runs but not shell
+ * functions.
+ */
+
+typedef struct lfile *Lfile;
+
+struct lline {
+    long hits;
+    double time;
+};
+
+struct lfile {
+    Lfile next;
+    char *name;
+    zlong nlines;
+    struct lline *stats;
+};
+
+static Lfile lfiles, curlfile;
+static zlong curlno;
+static double linebeg;
+
 static void
 freepfuncs(Pfunc f)
 {
@@ -135,16 +192,424 @@ cmpparcs(Parc *a, Parc *b)
     return ((*a)->time > (*b)->time ? -1 : ((*a)->time != (*b)->time));
 }
 
+/* Add a number to a folded stack, for line numbers. */
+
+static char *
+addsampleline(char *bp, char *be, zlong line)
+{
+    char num[24], *np = num + sizeof(num);
+
+    if (line < 0)
+	line = 0;
+    do {
+	*--np = '0' + (int) (line % 10);
+	line /= 10;
+    } while (line && np > num);
+    if (bp < be)
+	*bp++ = ':';
+    while (bp < be && np < num + sizeof(num))
+	*bp++ = *np++;
+    return bp;
+}
+
+/* The SIGPROF handler. */
+
+static void
+zprof_sample(UNUSED(int sig))
+{
+    Funcstack fs, frames[ZPROF_DEPTH];
+    char buf[ZPROF_STACKLEN], *bp = buf, *be = buf + sizeof(buf) - 1, *np;
+    int n = 0, i, tries;
+    unsigned hash;
+    Psample p;
+
+    if (!samples)
+	return;
+    for (fs = funcstack; fs && n < ZPROF_DEPTH; fs = fs->prev)
+	frames[n++] = fs;
+    if (fs) {
+	/* Too deep: the outermost calls are left out. */
+	for (np = "..."; *np && bp < be; )
+	    *bp++ = *np++;
+    } else if (!n) {
+	for (np = "(toplevel)"; *np && bp < be; )
+	    *bp++ = *np++;
+    }
+    for (i = n - 1; i >= 0; i--) {
+	if (bp > buf && bp < be)
+	    *bp++ = ';';
+	for (np = frames[i]->name ? frames[i]->name : "?"; *np && bp < be; ) {
+	    /* These would make the output ambiguous. */
+	    if (*np == ';' || *np == ' ' || *np == '\n') {
+		*bp++ = '_';
+		np++;
+	    } else
+		*bp++ = *np++;
+	}
+	if (samplelines)
+	    bp = addsampleline(bp, be, i ? frames[i - 1]->lineno : lineno);
+    }
+    *bp = '\0';
+
+    for (hash = 0, np = buf; *np; np++)
+	hash = hash * 31 + (unsigned char) *np;
+    for (i = hash % ZPROF_NSAMPLES, tries = 0; tries < ZPROF_NSAMPLES;
+	 i = (i + 1) % ZPROF_NSAMPLES, tries++) {
+	p = samples + i;
+	if (!p->count) {
+	    p->hash = hash;
+	    strcpy(p->stack, buf);
+	    p->count = 1;
+	    return;
+	}
+	if (p->hash == hash && !strcmp(p->stack, buf)) {
+	    p->count++;
+	    return;
+	}
+    }
+    lostsamples++;
+}
+
+/* Start sampling rate times per second, or stop if rate is zero. */
+
+static int
+setsampling(char *nam, int rate)
+{
+    struct itimerval it;
+    struct sigaction act;
+
+    memset(&it, 0, sizeof(it));
+    if (sampling) {
+	setitimer(ITIMER_PROF, &it, NULL);
+	sigaction(SIGPROF, &oldprofact, NULL);
+	sampling = 0;
+    }
+    if (!rate)
+	return 0;
+
+    if (!samples)
+	samples = (Psample) zshcalloc(ZPROF_NSAMPLES * sizeof(*samples));
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = zprof_sample;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if (sigaction(SIGPROF, &act, &oldprofact)) {
+	zwarnnam(nam, "can't handle SIGPROF: %e", errno);
+	return 1;
+    }
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = (long) (1000000 / rate);
+    if (!it.it_interval.tv_usec)
+	it.it_interval.tv_usec = 1;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL)) {
+	zwarnnam(nam, "can't start timer: %e", errno);
+	sigaction(SIGPROF, &oldprofact, NULL);
+	return 1;
+    }
+    sampling = 1;
+    return 0;
+}
+
+static void
+freesamples(void)
+{
+    if (samples) {
+	zfree(samples, ZPROF_NSAMPLES * sizeof(*samples));
+	samples = NULL;
+    }
+    lostsamples = 0;
+}
+
+static int
+cmpsamples(Psample *a, Psample *b)
+{
+    return strcmp((*a)->stack, (*b)->stack);
+}
+
+/* Print the samples as folded stacks, one per line with its count. */
+
+static void
+printsamples(void)
+{
+    sigset_t mask = signal_block(signal_mask(SIGPROF));
+
+    if (samples) {
+	VARARR(Psample, ps, ZPROF_NSAMPLES);
+	Psample p, *pp;
+	int n = 0, i;
+
+	for (p = samples, i = 0; i < ZPROF_NSAMPLES; p++, i++)
+	    if (p->count)
+		ps[n++] = p;
+	qsort(ps, n, sizeof(p),
+	      (int (*) _((const void *, const void *))) cmpsamples);
+	for (pp = ps; n--; pp++)
+	    printf("%s %ld\n", (*pp)->stack, (*pp)->count);
+    }
+    if (lostsamples)
+	printf("(lost) %ld\n", lostsamples);
+    signal_setmask(mask);
+}
+
+static double
+zproftime(void)
+{
+    struct timeval tv;
+    struct timezone dummy;
+
+    tv.tv_sec = tv.tv_usec = 0;
+    gettimeofday(&tv, &dummy);
+    return ((((double) tv.tv_sec) * 1000.0) +
+	    (((double) tv.tv_usec) / 1000.0));
+}
+
+static void
+freelfiles(void)
+{
+    Lfile f, n;
+
+    for (f = lfiles; f; f = n) {
+	n = f->next;
+	zsfree(f->name);
+	if (f->stats)
+	    zfree(f->stats, f->nlines * sizeof(*f->stats));
+	zfree(f, sizeof(*f));
+    }
+    lfiles = curlfile = NULL;
+}
+
+/* Called by the shell as execlinehook. */
+
+static void
+zprof_line(int start)
+{
+    double now = zproftime();
+    Funcstack fs = funcstack;
+    char *name;
+    zlong line;
+    Lfile f;
+
+    if (curlfile) {
+	curlfile->stats[curlno].time += now - linebeg;
+	curlfile = NULL;
+    }
+    if (!start)
+	return;
+
+    /* Work out the line in the file as for $funcfiletrace. */
+    if (!fs) {
+	name = scriptfilename;
+	line = lineno;
+    } else if (fs->tp == FS_SOURCE) {
+	name = fs->filename;
+	line = lineno;
+    } else {
+	name = fs->filename;
+	line = fs->flineno + lineno;
+	if (fs->tp == FS_EVAL)
+	    line--;
+    }
+    if (!name)
+	name = "";
+    if (line < 0)
+	line = 0;
+
+    if (!lfiles || strcmp(name, lfiles->name)) {
+	Lfile *fp;
+
+	for (fp = &lfiles; *fp && strcmp(name, (*fp)->name);
+	     fp = &(*fp)->next);
+	if ((f = *fp))
+	    *fp = f->next;
+	else {
+	    f = (Lfile) zshcalloc(sizeof(*f));
+	    f->name = ztrdup(name);
+	}
+	/* Keep the file used last at the front. */
+	f->next = lfiles;
+	lfiles = f;
+    } else
+	f = lfiles;
+    if (line >= f->nlines) {
+	zlong n = f->nlines ? f->nlines : 64;
+
+	while (n <= line)
+	    n *= 2;
+	f->stats = (struct lline *)
+	    zrealloc(f->stats, n * sizeof(*f->stats));
+	memset(f->stats + f->nlines, 0,
+	       (n - f->nlines) * sizeof(*f->stats));
+	f->nlines = n;
+    }
+    f->stats[line].hits++;
+    curlfile = f;
+    curlno = line;
+    linebeg = now;
+}
+
+typedef struct lentry *Lentry;
+
+struct lentry {
+    Lfile f;
+    zlong line;
+};
+
 static int
-bin_zprof(UNUSED(char *nam), UNUSED(char **args), Options ops, UNUSED(int func))
+cmplentries(Lentry a, Lentry b)
 {
+    double ta = a->f->stats[a->line].time, tb = b->f->stats[b->line].time;
+
+    if (ta != tb)
+	return ta > tb ? -1 : 1;
+    if (a->f != b->f)
+	return strcmp(a->f->name, b->f->name);
+    return a->line < b->line ? -1 : (a->line != b->line);
+}
+
+/*
+ * Read the text of lines from a file for the listing.  Returns an
+ * array indexed by line number, or NULL if the file can't be read.
+ */
+
+static char **
+readlfile(Lfile f, zlong max)
+{
+    FILE *in;
+    char **text, buf[256], *p;
+    zlong line = 1;
+    int len, nl;
+
+    if (!*f->name || !(in = fopen(unmeta(f->name), "r")))
+	return NULL;
+    text = (char **) zhalloc((max + 1) * sizeof(char *));
+    memset(text, 0, (max + 1) * sizeof(char *));
+    while (line <= max && fgets(buf, sizeof(buf), in)) {
+	len = strlen(buf);
+	if ((nl = (len && buf[len - 1] == '\n')))
+	    buf[len - 1] = '\0';
+	/* Only the start of a long line is shown. */
+	if (!text[line]) {
+	    for (p = buf; inblank(*p); p++);
+	    text[line] = metafy(p, -1, META_HEAPDUP);
+	}
+	if (nl)
+	    line++;
+    }
+    fclose(in);
+    return text;
+}
+
+/* Print the time and number of commands run for each line. */
+
+static void
+printlines(void)
+{
+    Lfile f;
+    Lentry e, es;
+    zlong i, n = 0;
+    double total = 0.0;
+    char **text = NULL;
+
+    if (curlfile) {
+	/* Count the time so far for the line running zprof. */
+	zprof_line(0);
+	zprof_line(1);
+    }
+    for (f = lfiles; f; f = f->next)
+	for (i = 0; i < f->nlines; i++)
+	    if (f->stats[i].hits) {
+		n++;
+		total += f->stats[i].time;
+	    }
+    es = (Lentry) zhalloc((n + 1) * sizeof(*es));
+    for (e = es, f = lfiles; f; f = f->next)
+	for (i = 0; i < f->nlines; i++)
+	    if (f->stats[i].hits) {
+		e->f = f;
+		e->line = i;
+		e++;
+	    }
+    qsort(es, n, sizeof(*es),
+	  (int (*) _((const void *, const void *))) cmplentries);
+
+    printf("    hits         time        %%  file:line\n-----------------------------------------------------------------------------------\n");
+    for (e = es, f = NULL; n--; e++) {
+	struct lline *l = e->f->stats + e->line;
+
+	if (e->f != f) {
+	    f = e->f;
+	    text = readlfile(f, f->nlines);
+	}
+	printf("%8ld  %11.2f  %6.2f%%  ", l->hits, l->time,
+	       total > 0.0 ? (l->time / total) * 100.0 : 0.0);
+	nicezputs(f->name, stdout);
+	printf(":%ld", (long) e->line);
+	if (text && e->line <= f->nlines && text[e->line]) {
+	    fputs("  ", stdout);
+	    nicezputs(text[e->line], stdout);
+	}
+	putchar('\n');
+    }
+}
+
+static int
+bin_zprof(char *nam, char **args, Options ops, UNUSED(int func))
+{
+    if (OPT_ISSET(ops,'s')) {
+	zlong rate = 100;
+
+	if (*args) {
+	    char *eptr;
+
+	    rate = zstrtol(*args, &eptr, 10);
+	    if (*eptr) {
+		zwarnnam(nam, "number expected: %s", *args);
+		return 1;
+	    }
+	    if (rate < 0 || rate > 10000) {
+		zwarnnam(nam, "invalid sampling rate: %s", *args);
+		return 1;
+	    }
+	}
+	samplelines = OPT_ISSET(ops,'l');
+	return setsampling(nam, (int) rate);
+    } else if (OPT_ISSET(ops,'L') && *args) {
+	if (!strcmp(*args, "1"))
+	    execlinehook = zprof_line;
+	else if (!strcmp(*args, "0")) {
+	    if (curlfile)
+		zprof_line(0);
+	    execlinehook = NULL;
+	} else {
+	    zwarnnam(nam, "0 or 1 expected: %s", *args);
+	    return 1;
+	}
+	return 0;
+    } else if (*args) {
+	zwarnnam(nam, "too many arguments");
+	return 1;
+    }
     if (OPT_ISSET(ops,'c')) {
+	sigset_t mask;
+
 	freepfuncs(calls);
 	calls = NULL;
 	ncalls = 0;
 	freeparcs(arcs);
 	arcs = NULL;
 	narcs = 0;
+	zprofgen++;
+	mask = signal_block(signal_mask(SIGPROF));
+	if (samples)
+	    memset(samples, 0, ZPROF_NSAMPLES * sizeof(*samples));
+	lostsamples = 0;
+	signal_setmask(mask);
+	freelfiles();
+    } else if (OPT_ISSET(ops,'f')) {
+	printsamples();
+    } else if (OPT_ISSET(ops,'L')) {
+	printlines();
     } else {
 	VARARR(Pfunc, fs, (ncalls + 1));
 	Pfunc f, *fp;
@@ -210,6 +675,7 @@ bin_zprof(UNUSED(char *nam), UNUSED(char **args), Options ops, UNUSED(int func))
 		}
 	}
     }
+    fflush(stdout);
     return 0;
 }
 
@@ -225,7 +691,8 @@ zprof_wrapper(Eprog prog, FuncWrap w, char *name)
     struct timezone dummy;
     double prev = 0, now;
 
-    if (zprof_module && !(zprof_module->node.flags & MOD_UNLOAD)) {
+    if (zprof_module && !(zprof_module->node.flags & MOD_UNLOAD) &&
+	!sampling) {
         active = 1;
         if (!(f = findpfunc(name))) {
             f = (Pfunc) zalloc(sizeof(*f));
@@ -236,7 +703,7 @@ zprof_wrapper(Eprog prog, FuncWrap w, char *name)
             calls = f;
             ncalls++;
         }
-        if (stack) {
+        if (stack && stack->gen == zprofgen) {
             if (!(a = findparc(stack->p, f))) {
                 a = (Parc) zalloc(sizeof(*a));
                 a->from = stack->p;
@@ -250,6 +717,7 @@ zprof_wrapper(Eprog prog, FuncWrap w, char *name)
         }
         sf.prev = stack;
         sf.p = f;
+        sf.gen = zprofgen;
         stack = &sf;
 
         f->calls++;
@@ -260,14 +728,16 @@ zprof_wrapper(Eprog prog, FuncWrap w, char *name)
     }
     runshfunc(prog, w, name);
     if (active) {
-        if (zprof_module && !(zprof_module->node.flags & MOD_UNLOAD)) {
+        if (zprof_module && !(zprof_module->node.flags & MOD_UNLOAD) &&
+	    sf.gen == zprofgen) {
             tv.tv_sec = tv.tv_usec = 0;
             gettimeofday(&tv, &dummy);
 
             now = ((((double) tv.tv_sec) * 1000.0) +
                    (((double) tv.tv_usec) / 1000.0));
             f->self += now - sf.beg;
-            for (sp = sf.prev; sp && sp->p != f; sp = sp->prev);
+            for (sp = sf.prev; sp && (sp->gen != zprofgen || sp->p != f);
+		 sp = sp->prev);
             if (!sp)
                 f->time += now - prev;
             if (a) {
@@ -288,7 +758,7 @@ zprof_wrapper(Eprog prog, FuncWrap w, char *name)
 }
 
 static struct builtin bintab[] = {
-    BUILTIN("zprof", 0, bin_zprof, 0, 0, 0, "c", NULL),
+    BUILTIN("zprof", 0, bin_zprof, 0, 1, 0, "cfLls", NULL),
 };
 
 static struct funcwrap wrapper[] = {
@@ -335,6 +805,10 @@ boot_(Module m)
     arcs = NULL;
     narcs = 0;
     stack = NULL;
+    samples = NULL;
+    lostsamples = 0;
+    lfiles = curlfile = NULL;
+    sampling = 0;
     return addwrapper(m, wrapper);
 }
 
@@ -342,6 +816,11 @@ boot_(Module m)
 int
 cleanup_(Module m)
 {
+    setsampling(NULL, 0);
+    freesamples();
+    if (execlinehook == zprof_line)
+	execlinehook = NULL;
+    freelfiles();
     freepfuncs(calls);
     freeparcs(arcs);
     deletewrapper(m, wrapper);
@@ -35,6 +35,7 @@
  * pattern). */
 
 #define READ_MAX (1024 * 1024)
+#define PTY_CHUNK 4096
 
 typedef struct ptycmd *Ptycmd;
 
@@ -479,6 +480,8 @@ deleteptycmd(Ptycmd cmd)
 
     zsfree(p->name);
     freearray(p->args);
+    if (p->old)
+	zfree(p->old, p->olen);
 
     zclose(cmd->fd);
 
@@ -520,11 +523,52 @@ checkptycmd(Ptycmd cmd)
     cmd->read = (int) c;
 }
 
+/*
+ * Look for the first string in buf, ending after position from and
+ * at or before used, which is matched by prog.  buf is changed
+ * temporarily.  Only strings ending in lastch are tried if that is
+ * not -1.  Returns the length of the string, or -1.
+ */
+
+static int
+ptymatch(Patprog prog, char *buf, int from, int used, int lastch)
+{
+    int i;
+    char c;
+
+    for (i = from + 1; i <= used; i++) {
+	if (lastch >= 0 && (unsigned char) buf[i - 1] != lastch)
+	    continue;
+	c = buf[i];
+	buf[i] = '\0';
+	if (pattry(prog, buf)) {
+	    buf[i] = c;
+	    return i;
+	}
+	buf[i] = c;
+    }
+    return -1;
+}
+
+/*
+ * Keep the part of buf after the first len characters to be read
+ * again next time.
+ */
+
+static void
+ptykeep(Ptycmd cmd, char *buf, int len, int used)
+{
+    if (used > len) {
+	cmd->old = (char *) zalloc(cmd->olen = used - len);
+	memcpy(cmd->old, buf + len, cmd->olen);
+    }
+}
+
 static int
 ptyread(char *nam, Ptycmd cmd, char **args, int noblock, int mustmatch)
 {
-    int blen, used, seen = 0, ret = 0, matchok = 0;
-    char *buf;
+    int blen, used, seen = 0, ret = 0, matchok = 0, from, len, lastch = -1;
+    char *buf, *nl;
     Patprog prog = NULL;
 
     if (*args && args[1]) {
@@ -537,30 +581,77 @@ ptyread(char *nam, Ptycmd cmd, char **args, int noblock, int mustmatch)
 	p = dupstring(args[1]);
 	tokenize(p);
 	remnulargs(p);
+	/*
+	 * The first string read which matches `foo*' is the first
+	 * which matches `foo', so drop a final `*' after a plain
+	 * character.  Not with exclusions or negations, where that
+	 * isn't true.
+	 */
+	for (len = strlen(p); len && p[len - 1] == Star; len--);
+	if (len && len < (int) strlen(p) && !itok(p[len - 1]) &&
+	    !strchr(p, Tilde) && !strchr(p, Hat))
+	    p[len] = '\0';
 	if (!(prog = patcompile(p, PAT_STATIC, NULL))) {
 	    zwarnnam(nam, "bad pattern: %s", args[1]);
 	    return 1;
 	}
+	/*
+	 * The whole string read has to match, so if the pattern ends
+	 * in a plain character only strings ending in it need to be
+	 * tried.  Not if there are glob flags, which might make the
+	 * character match others.
+	 */
+	if ((len = strlen(p)) && !itok(p[len - 1]) && p[len - 1] != '\\' &&
+	    !(prog->globflags & (GF_IGNCASE|GF_LCMATCHUC))) {
+	    for (nl = p; *nl && !(*nl == Inpar && nl[1] == Pound); nl++);
+	    if (!*nl)
+		lastch = (len > 1 && p[len - 2] == Meta) ?
+		    (unsigned char) (p[len - 1] ^ 32) :
+		    (unsigned char) p[len - 1];
+	}
     } else
 	fflush(stdout);
 
+    /*
+     * Output is read in chunks, so more may be read than is wanted;
+     * the rest is kept in cmd->old for next time.
+     */
     if (cmd->old) {
 	used = cmd->olen;
-	buf = (char *) zhalloc((blen = 256 + used) + 1);
+	buf = (char *) zhalloc((blen = PTY_CHUNK + used) + 1);
 	memcpy(buf, cmd->old, cmd->olen);
 	zfree(cmd->old, cmd->olen);
 	cmd->old = NULL;
 	cmd->olen = 0;
+	seen = 1;
     } else {
 	used = 0;
-	buf = (char *) zhalloc((blen = 256) + 1);
+	buf = (char *) zhalloc((blen = PTY_CHUNK) + 1);
     }
     if (cmd->read != -1) {
-	buf[used] = (char) cmd->read;
-	buf[used + 1] = '\0';
-	seen = used = 1;
+	buf[used++] = (char) cmd->read;
+	seen = 1;
 	cmd->read = -1;
     }
+    buf[used] = '\0';
+    from = 0;
+
+    /* What was kept from last time may be enough. */
+    if (prog) {
+	if (used && (len = ptymatch(prog, buf, 0, used, lastch)) >= 0) {
+	    ptykeep(cmd, buf, len, used);
+	    used = len;
+	    matchok = 1;
+	    goto done;
+	}
+	from = used;
+    } else if (*args && used && (nl = memchr(buf, '\n', used))) {
+	len = nl - buf + 1;
+	ptykeep(cmd, buf, len, used);
+	used = len;
+	goto done;
+    }
+
     do {
 	if (noblock && cmd->read == -1) {
 	    int pollret;
@@ -606,19 +697,36 @@ ptyread(char *nam, Ptycmd cmd, char **args, int noblock, int mustmatch)
 	    if (cmd->fin)
 		break;
 	}
-	if (cmd->read != -1 || (ret = read(cmd->fd, buf + used, 1)) == 1) {
-	    if (cmd->read != -1) {
-		ret = 1;
-		buf[used] = (char) cmd->read;
-		cmd->read = -1;
-	    }
+	if (cmd->read != -1) {
+	    ret = 1;
+	    buf[used] = (char) cmd->read;
+	    cmd->read = -1;
+	} else
+	    ret = read(cmd->fd, buf + used,
+		       (blen - used < READ_MAX - used) ?
+		       blen - used : READ_MAX - used);
+	if (ret > 0) {
 	    seen = 1;
-	    if (++used == blen) {
+	    used += ret;
+	    buf[used] = '\0';
+	    if (prog) {
+		if ((len = ptymatch(prog, buf, from, used, lastch)) >= 0) {
+		    ptykeep(cmd, buf, len, used);
+		    used = len;
+		    matchok = 1;
+		}
+		from = used;
+	    } else if (*args && (nl = memchr(buf + used - ret, '\n', ret))) {
+		len = nl - buf + 1;
+		ptykeep(cmd, buf, len, used);
+		used = len;
+	    }
+	    if (used == blen) {
 		if (!*args) {
 		    write_loop(1, buf, used);
 		    used = 0;
 		} else {
-		    buf = hrealloc(buf, blen, blen << 1);
+		    buf = hrealloc(buf, blen + 1, (blen << 1) + 1);
 		    blen <<= 1;
 		}
 	    }
@@ -641,8 +749,7 @@ ptyread(char *nam, Ptycmd cmd, char **args, int noblock, int mustmatch)
 		break;
 	}
     } while (!(errflag || breaks || retflag || contflag) &&
-	     used < READ_MAX &&
-	     !(prog && ret && (matchok = pattry(prog, buf))));
+	     used < READ_MAX && !matchok);
 
     if (prog && ret < 0 &&
 #ifdef EWOULDBLOCK
@@ -658,6 +765,7 @@ ptyread(char *nam, Ptycmd cmd, char **args, int noblock, int mustmatch)
 
 	return 1;
     }
+ done:
     if (*args)
 	setsparam(*args, ztrdup(metafy(buf, used, META_HREALLOC)));
     else if (used)
@@ -30,14 +30,115 @@
 #include "zselect.mdh"
 #include "zselect.pro"
 
+#ifdef HAVE_POLL_H
+# include <poll.h>
+#endif
+#if defined(HAVE_POLL) && !defined(POLLIN)
+# undef HAVE_POLL
+#endif
+#if defined(HAVE_POLL) && defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+# include <sys/epoll.h>
+# define USE_EPOLL
+#endif
+
+/* Conditions to wait for; bit i is for fdchar[i] */
+#define ZSEL_READ	1
+#define ZSEL_WRITE	2
+#define ZSEL_ERROR	4
+
+static const char fdchar[3] = "rwe";
+
+/* A list of fd's and the conditions for each, in ascending fd order */
+struct selfd {
+    int fd;
+    int how;
+};
+
+struct sellist {
+    struct selfd *fds;
+    int n, size;
+    int heap;			/* allocated on the heap, not permanent */
+};
+
+/*
+ * The persistent set:  fd's added with -i are waited on by every
+ * call until they are removed with -d, so that a loop need not give
+ * them again each time.  Where epoll is available they are kept
+ * registered with keep_epfd, which is only made again when this
+ * process didn't make it (we're in a subshell), so that waiting
+ * costs nothing for those that are idle.  keep_noepoll is set if an
+ * fd couldn't be registered (a plain file, for example); we then
+ * use poll() until the set is next emptied.
+ */
+static struct sellist keepset;
+#ifdef USE_EPOLL
+static int keep_epfd = -1, keep_noepoll;
+static pid_t keep_epid;
+#endif
+
 /* Helper functions */
 
+/* Find the index of fd in l, or where it would go. */
+static int
+selfd_find(struct sellist *l, int fd)
+{
+    int lo = 0, hi = l->n;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (l->fds[mid].fd < fd)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Add conditions for fd to l.  Return the conditions it now has. */
+static int
+selfd_add(struct sellist *l, int fd, int how)
+{
+    int ind = selfd_find(l, fd);
+
+    if (ind < l->n && l->fds[ind].fd == fd)
+	return l->fds[ind].how |= how;
+    if (l->n == l->size) {
+	int nsize = l->size ? 2 * l->size : 16;
+	if (l->heap)
+	    l->fds = hrealloc((char *)l->fds, l->size * sizeof(struct selfd),
+			      nsize * sizeof(struct selfd));
+	else
+	    l->fds = zrealloc(l->fds, nsize * sizeof(struct selfd));
+	l->size = nsize;
+    }
+    memmove(l->fds + ind + 1, l->fds + ind,
+	    (l->n - ind) * sizeof(struct selfd));
+    l->fds[ind].fd = fd;
+    l->fds[ind].how = how;
+    l->n++;
+    return how;
+}
+
+/* Remove fd from l.  Return 1 if it was there. */
+static int
+selfd_del(struct sellist *l, int fd)
+{
+    int ind = selfd_find(l, fd);
+
+    if (ind == l->n || l->fds[ind].fd != fd)
+	return 0;
+    l->n--;
+    memmove(l->fds + ind, l->fds + ind + 1,
+	    (l->n - ind) * sizeof(struct selfd));
+    return 1;
+}
+
 /*
- * Handle an fd by adding it to the current fd_set.
+ * Handle an fd by adding it to the list with the given conditions.
  * Return 1 for error (after printing a message), 0 for OK.
  */
 static int
-handle_digits(char *nam, char *argptr, fd_set *fdset, int *fdmax)
+handle_digits(char *nam, char *argptr, struct sellist *l, int how)
 {
     int fd;
     char *endptr;
@@ -52,29 +153,387 @@ handle_digits(char *nam, char *argptr, fd_set *fdset, int *fdmax)
 	return 1;
     }
 
-    FD_SET(fd, fdset);
-    if (fd+1 > *fdmax)
-	*fdmax = fd+1;
+    selfd_add(l, fd, how);
     return 0;
 }
 
-/* The builtin itself */
+#ifdef USE_EPOLL
+/* Make the epoll events for a set of conditions. */
+static unsigned int
+keep_events(int how)
+{
+    return ((how & ZSEL_READ) ? EPOLLIN : 0) |
+	((how & ZSEL_WRITE) ? EPOLLOUT : 0) |
+	((how & ZSEL_ERROR) ? EPOLLPRI : 0);
+}
 
-/**/
+/* Forget keep_epfd. */
+static void
+keep_unepoll(void)
+{
+    if (keep_epfd >= 0)
+	zclose(keep_epfd);
+    keep_epfd = -1;
+}
+
+/*
+ * Tell keep_epfd, if we have one, that fd now has conditions how,
+ * or none if how is 0.
+ */
+static void
+keep_ctl(int fd, int how, int added)
+{
+    struct epoll_event ev;
+    int op = !how ? EPOLL_CTL_DEL : added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    if (keep_epfd < 0)
+	return;
+    if (keep_epid != getpid()) {
+	keep_unepoll();
+	return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = keep_events(how);
+    ev.data.fd = fd;
+    if (epoll_ctl(keep_epfd, op, fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+	keep_unepoll();
+	keep_noepoll = 1;
+    }
+}
+
+/*
+ * Return keep_epfd, making it first if need be, or -1 if poll()
+ * is to be used for the persistent set.
+ */
 static int
-bin_zselect(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+keep_epoll(void)
+{
+    int i;
+
+    if (keep_epfd >= 0 && keep_epid != getpid())
+	keep_unepoll();
+    if (keep_epfd >= 0 || keep_noepoll || !keepset.n)
+	return keep_epfd;
+    if ((keep_epfd = movefd(epoll_create(keepset.n))) < 0) {
+	keep_noepoll = 1;
+	return -1;
+    }
+    keep_epid = getpid();
+    for (i = 0; i < keepset.n; i++) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = keep_events(keepset.fds[i].how);
+	ev.data.fd = keepset.fds[i].fd;
+	if (epoll_ctl(keep_epfd, EPOLL_CTL_ADD, keepset.fds[i].fd, &ev) < 0) {
+	    keep_unepoll();
+	    keep_noepoll = 1;
+	    break;
+	}
+    }
+    return keep_epfd;
+}
+#endif
+
+/* Add to or remove from the persistent set. */
+
+static void
+keep_add(int fd, int how)
+{
+    int n = keepset.n;
+
+    how = selfd_add(&keepset, fd, how);
+#ifdef USE_EPOLL
+    keep_ctl(fd, how, keepset.n > n);
+#endif
+}
+
+static void
+keep_del(int fd)
+{
+    if (selfd_del(&keepset, fd)) {
+#ifdef USE_EPOLL
+	keep_ctl(fd, 0, 0);
+	if (!keepset.n) {
+	    keep_unepoll();
+	    keep_noepoll = 0;
+	}
+#endif
+    }
+}
+
+static void
+keep_clear(void)
+{
+#ifdef USE_EPOLL
+    keep_unepoll();
+    keep_noepoll = 0;
+#endif
+    if (keepset.fds)
+	zfree(keepset.fds, keepset.size * sizeof(struct selfd));
+    keepset.fds = NULL;
+    keepset.n = keepset.size = 0;
+}
+
+#ifdef HAVE_POLL
+/* Which of the conditions in how are met by poll() events revents. */
+static int
+poll_how(int how, int revents)
+{
+    int ret = 0;
+
+    if (revents & (POLLIN|POLLHUP|POLLERR))
+	ret |= ZSEL_READ;
+    if (revents & (POLLOUT|POLLERR))
+	ret |= ZSEL_WRITE;
+    if (revents & POLLPRI)
+	ret |= ZSEL_ERROR;
+    return ret & how;
+}
+
+static short
+poll_events(int how)
+{
+    return ((how & ZSEL_READ) ? POLLIN : 0) |
+	((how & ZSEL_WRITE) ? POLLOUT : 0) |
+	((how & ZSEL_ERROR) ? POLLPRI : 0);
+}
+#endif
+
+/*
+ * Wait for the fd's in l and the persistent set, with a timeout in
+ * milliseconds or -1 for none.  Those that are ready are added to
+ * ready.  Return -1 for error (after printing a message), else the
+ * number of fd's ready.
+ */
+static int
+zsel_wait(char *nam, struct sellist *l, int timeout, struct sellist *ready)
 {
-#ifdef HAVE_SELECT
-    int i, fd, fdsetind = 0, fdmax = 0, fdcount;
+#ifdef HAVE_POLL
+    struct pollfd *pfds;
+    int i, ret, npfds, epfd = -1;
+
+# ifdef USE_EPOLL
+    struct epoll_event *evs = NULL;
+
+    if ((epfd = keep_epoll()) >= 0)
+	evs = (struct epoll_event *)
+	    zhalloc(keepset.n * sizeof(struct epoll_event));
+    if (epfd >= 0 && !l->n) {
+	/* Nothing else to wait for:  no need to poll() as well. */
+	do {
+	    ret = epoll_wait(epfd, evs, keepset.n, timeout);
+	} while (ret < 0 && errno == EINTR && !errflag);
+    } else
+# endif
+    {
+	npfds = l->n + (epfd >= 0 ? 1 : keepset.n);
+	pfds = (struct pollfd *)zhalloc((npfds ? npfds : 1) *
+					sizeof(struct pollfd));
+	for (i = 0; i < l->n; i++) {
+	    pfds[i].fd = l->fds[i].fd;
+	    pfds[i].events = poll_events(l->fds[i].how);
+	    pfds[i].revents = 0;
+	}
+	if (epfd >= 0) {
+	    pfds[i].fd = epfd;
+	    pfds[i].events = POLLIN;
+	    pfds[i].revents = 0;
+	} else {
+	    for (; i < npfds; i++) {
+		pfds[i].fd = keepset.fds[i - l->n].fd;
+		pfds[i].events = poll_events(keepset.fds[i - l->n].how);
+		pfds[i].revents = 0;
+	    }
+	}
+
+	do {
+	    ret = poll(pfds, npfds, timeout);
+	} while (ret < 0 && errno == EINTR && !errflag);
+	if (ret < 0) {
+	    zwarnnam(nam, "error on poll: %e", errno);
+	    return -1;
+	}
+
+	for (i = 0; i < l->n; i++) {
+	    int how;
+
+	    if (pfds[i].revents & POLLNVAL) {
+		zwarnnam(nam, "bad file descriptor: %d", pfds[i].fd);
+		return -1;
+	    }
+	    if ((how = poll_how(l->fds[i].how, pfds[i].revents)))
+		selfd_add(ready, pfds[i].fd, how);
+	}
+	if (epfd < 0) {
+	    for (; i < npfds; i++) {
+		int how;
+
+		/* Closed without being removed:  forget it. */
+		if (pfds[i].revents & POLLNVAL)
+		    keep_del(pfds[i].fd);
+		else if ((how = poll_how(keepset.fds[selfd_find(&keepset,
+								pfds[i].fd)].how,
+					 pfds[i].revents)))
+		    selfd_add(ready, pfds[i].fd, how);
+	    }
+	    return ready->n;
+	}
+# ifdef USE_EPOLL
+	if (!pfds[l->n].revents)
+	    return ready->n;
+	ret = epoll_wait(epfd, evs, keepset.n, 0);
+# endif
+    }
+
+# ifdef USE_EPOLL
+    if (ret < 0) {
+	zwarnnam(nam, "error on epoll: %e", errno);
+	return -1;
+    }
+    for (i = 0; i < ret; i++) {
+	int ind = selfd_find(&keepset, evs[i].data.fd), revents = 0, how;
+
+	if (ind == keepset.n || keepset.fds[ind].fd != evs[i].data.fd)
+	    continue;
+	if (evs[i].events & EPOLLIN)
+	    revents |= POLLIN;
+	if (evs[i].events & EPOLLOUT)
+	    revents |= POLLOUT;
+	if (evs[i].events & EPOLLPRI)
+	    revents |= POLLPRI;
+	if (evs[i].events & EPOLLERR)
+	    revents |= POLLERR;
+	if (evs[i].events & EPOLLHUP)
+	    revents |= POLLHUP;
+	if ((how = poll_how(keepset.fds[ind].how, revents)))
+	    selfd_add(ready, evs[i].data.fd, how);
+    }
+# endif
+    return ready->n;
+#elif defined(HAVE_SELECT)
     fd_set fdset[3];
-    const char fdchar[3] = "rwe";
     struct timeval tv, *tvptr = NULL;
-    char *outarray = "reply", **outdata, **outptr;
-    char *outhash = NULL;
-    LinkList fdlist;
+    int i, j, ret, fdmax = 0;
 
     for (i = 0; i < 3; i++)
 	FD_ZERO(fdset+i);
+    for (j = 0; j < 2; j++) {
+	struct sellist *sl = j ? &keepset : l;
+
+	for (i = 0; i < sl->n; i++) {
+	    int fd = sl->fds[i].fd, k;
+
+	    if (fd >= FD_SETSIZE) {
+		zwarnnam(nam, "file descriptor too large: %d", fd);
+		return -1;
+	    }
+	    for (k = 0; k < 3; k++)
+		if (sl->fds[i].how & (1 << k))
+		    FD_SET(fd, fdset+k);
+	    if (fd+1 > fdmax)
+		fdmax = fd+1;
+	}
+    }
+    if (timeout >= 0) {
+	tvptr = &tv;
+	tv.tv_sec = (long)(timeout / 1000);
+	tv.tv_usec = (long)(timeout % 1000) * 1000L;
+    }
+
+    errno = 0;
+    do {
+	ret = select(fdmax, (SELECT_ARG_2_T)fdset, (SELECT_ARG_2_T)(fdset+1),
+		     (SELECT_ARG_2_T)(fdset+2), tvptr);
+    } while (ret < 0 && errno == EINTR && !errflag);
+    if (ret < 0) {
+	zwarnnam(nam, "error on select: %e", errno);
+	return -1;
+    }
+
+    for (j = 0; ret > 0 && j < 2; j++) {
+	struct sellist *sl = j ? &keepset : l;
+
+	for (i = 0; i < sl->n; i++) {
+	    int k, how = 0;
+
+	    for (k = 0; k < 3; k++)
+		if (FD_ISSET(sl->fds[i].fd, fdset+k))
+		    how |= 1 << k;
+	    if (how)
+		selfd_add(ready, sl->fds[i].fd, how);
+	}
+    }
+    return ready->n;
+#endif
+}
+
+/*
+ * Set the array or hash to show the conditions for the fd's in l.
+ * The array gets a string similar to the arguments for zselect, e.g.
+ * `-r 0 -w 1'; the hash has the fd's as keys and a (possibly improper)
+ * subset of "rwe" as each value.
+ */
+static void
+set_result(struct sellist *l, char *outarray, char *outhash)
+{
+    char **outdata, **outptr, buf[BDIGBUFSIZE];
+    int i, j;
+
+    outptr = outdata = (char **)zalloc((3 * l->n + 4) * sizeof(char *));
+    if (outhash) {
+	for (i = 0; i < l->n; i++) {
+	    char *ptr = buf;
+
+	    convbase(buf, l->fds[i].fd, 10);
+	    *outptr++ = ztrdup(buf);
+	    for (j = 0; j < 3; j++)
+		if (l->fds[i].how & (1 << j))
+		    *ptr++ = fdchar[j];
+	    *ptr = '\0';
+	    *outptr++ = ztrdup(buf);
+	}
+    } else {
+	for (j = 0; j < 3; j++) {
+	    int doneit = 0;
+
+	    for (i = 0; i < l->n; i++) {
+		if (!(l->fds[i].how & (1 << j)))
+		    continue;
+		if (!doneit) {
+		    buf[0] = '-';
+		    buf[1] = fdchar[j];
+		    buf[2] = '\0';
+		    *outptr++ = ztrdup(buf);
+		    doneit = 1;
+		}
+		convbase(buf, l->fds[i].fd, 10);
+		*outptr++ = ztrdup(buf);
+	    }
+	}
+    }
+    *outptr = NULL;
+    if (outhash)
+	sethparam(outhash, outdata);
+    else
+	setaparam(outarray, outdata);
+}
+
+/* The builtin itself */
+
+/**/
+static int
+bin_zselect(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+#if defined(HAVE_POLL) || defined(HAVE_SELECT)
+    int i, fdsetind = 0, timeout = -1, keep = 0;
+    char *outarray = "reply";
+    char *outhash = NULL;
+    struct sellist fdlist, ready;
+
+    memset(&fdlist, 0, sizeof(fdlist));
+    memset(&ready, 0, sizeof(ready));
+    fdlist.heap = ready.heap = 1;
 
     for (; *args; args++) {
 	char *argptr = *args, *endptr;
@@ -126,6 +585,19 @@ bin_zselect(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
 		    fdsetind = 2;
 		    break;
 
+		    /*
+		     * Add fd's to, or delete them from, the persistent
+		     * set instead of waiting.
+		     */
+		case 'i':
+		case 'd':
+		    if (keep && keep != *argptr) {
+			zwarnnam(nam, "illegal combination of options");
+			return 1;
+		    }
+		    keep = *argptr;
+		    break;
+
 		    /*
 		     * Get a timeout value in hundredths of a second
 		     * (same units as KEYTIMEOUT).  0 means just poll.
@@ -150,10 +622,9 @@ bin_zselect(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
 				 endptr);
 			return 1;
 		    }
-		    /* timevalue now active */
-		    tvptr = &tv;
-		    tv.tv_sec = (long)(tempnum / 100);
-		    tv.tv_usec = (long)(tempnum % 100) * 10000L;
+		    /* timevalue now active, in milliseconds */
+		    timeout = (tempnum > INT_MAX / 10) ? INT_MAX :
+			(int)tempnum * 10;
 
 		    /* remember argptr is incremented at end of loop */
 		    argptr = endptr - 1;
@@ -161,107 +632,37 @@ bin_zselect(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
 
 		    /* Digits following option without arguments are fd's. */
 		default:
-		    if (handle_digits(nam, argptr, fdset+fdsetind,
-				      &fdmax))
+		    if (handle_digits(nam, argptr, &fdlist, 1 << fdsetind))
 			return 1;
 		}
 	    }
-	} else if (handle_digits(nam, argptr, fdset+fdsetind, &fdmax))
+	} else if (handle_digits(nam, argptr, &fdlist, 1 << fdsetind))
 	    return 1;
     }
 
-    errno = 0;
-    do {
-	i = select(fdmax, (SELECT_ARG_2_T)fdset, (SELECT_ARG_2_T)(fdset+1),
-		   (SELECT_ARG_2_T)(fdset+2), tvptr);
-    } while (i < 0 && errno == EINTR && !errflag);
-
-    if (i <= 0) {
-	if (i < 0)
-	    zwarnnam(nam, "error on select: %e", errno);
-	/* else no fd's set.  Presumably a timeout. */
-	return 1;
+    if (keep == 'i') {
+	/* With no fd's, show what's in the set. */
+	if (!fdlist.n)
+	    set_result(&keepset, outarray, outhash);
+	for (i = 0; i < fdlist.n; i++)
+	    keep_add(fdlist.fds[i].fd, fdlist.fds[i].how);
+	return 0;
+    } else if (keep == 'd') {
+	if (!fdlist.n)
+	    keep_clear();
+	for (i = 0; i < fdlist.n; i++)
+	    keep_del(fdlist.fds[i].fd);
+	return 0;
     }
 
-    /*
-     * Make a linked list of all file descriptors which are ready.
-     * These go into an array preceded by -r, -w or -e for read, write,
-     * error as appropriate.  Typically there will only be one set
-     * so this looks rather like overkill.
-     */
-    fdlist = znewlinklist();
-    for (i = 0; i < 3; i++) {
-	int doneit = 0;
-	for (fd = 0; fd < fdmax; fd++) {
-	    if (FD_ISSET(fd, fdset+i)) {
-		char buf[BDIGBUFSIZE];
-		if (outhash) {
-		    /*
-		     * Key/value pairs; keys are fd's (as strings),
-		     * value is a (possibly improper) subset of "rwe".
-		     */
-		    LinkNode nptr;
-		    int found = 0;
-
-		    convbase(buf, fd, 10);
-		    for (nptr = firstnode(fdlist); nptr; 
-			 nptr = nextnode(nextnode(nptr))) {
-			if (!strcmp((char *)getdata(nptr), buf)) {
-			    /* Already there, add new character. */
-			    void **dataptr = getaddrdata(nextnode(nptr));
-			    char *data = (char *)*dataptr, *ptr;
-			    found = 1;
-			    if (!strchr(data, fdchar[i])) {
-				strcpy(buf, data);
-				for (ptr = buf; *ptr; ptr++)
-				    ;
-				*ptr++ = fdchar[i];
-				*ptr = '\0';
-				zsfree(data);
-				*dataptr = ztrdup(buf);
-			    }
-			    break;
-			}
-		    }
-		    if (!found) {
-			/* Add new key/value pair. */
-			zaddlinknode(fdlist, ztrdup(buf));
-			buf[0] = fdchar[i];
-			buf[1] = '\0';
-			zaddlinknode(fdlist, ztrdup(buf));
-		    }
-		} else {
-		    /* List of fd's preceded by -r, -w, -e. */
-		    if (!doneit) {
-			buf[0] = '-';
-			buf[1] = fdchar[i];
-			buf[2] = 0;
-			zaddlinknode(fdlist, ztrdup(buf));
-			doneit = 1;
-		    }
-		    convbase(buf, fd, 10);
-		    zaddlinknode(fdlist, ztrdup(buf));
-		}
-	    }
-	}
-    }
+    if ((i = zsel_wait(nam, &fdlist, timeout, &ready)) <= 0)
+	/* An error, or no fd's set.  Presumably a timeout. */
+	return 1;
 
-    /* convert list to array */
-    fdcount = countlinknodes(fdlist);
-    outptr = outdata = (char **)zalloc((fdcount+1)*sizeof(char *));
-    while (nonempty(fdlist))
-	*outptr++ = getlinknode(fdlist);
-    *outptr = '\0';
-    /* and store in array parameter */
-    if (outhash)
-	sethparam(outhash, outdata);
-    else
-	setaparam(outarray, outdata);
-    freelinklist(fdlist, NULL);
+    set_result(&ready, outarray, outhash);
 
     return 0;
 #else
-    /* TODO: use poll */
     zerrnam(nam, "your system does not implement the select system call.");
     return 2;
 #endif
@@ -324,5 +725,6 @@ cleanup_(Module m)
 int
 finish_(UNUSED(Module m))
 {
+    keep_clear();
     return 0;
 }
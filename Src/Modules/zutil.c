@@ -104,6 +104,40 @@ struct stypat {
 
 static HashTable zstyletab;
 
+/*
+ * Cache of the results of looking up styles.  Completion asks for the
+ * same styles in the same contexts many times over, and each lookup
+ * would otherwise try the patterns for the style one after another.
+ * An entry records the pattern that matched the context first, or
+ * none, for a style.  As entries point to styles and patterns, the
+ * whole cache is flushed whenever a style is set or deleted.  The
+ * values of eval styles are still worked out on each lookup.
+ */
+
+#define STYCACHE_SIZE 512
+
+struct stycache {
+    Style s;			/* style, NULL if entry is unused */
+    char *ctxt;			/* context looked up */
+    unsigned hashval;		/* hash of style name and context */
+    Stypat found;		/* first pattern matching, or NULL */
+};
+
+static struct stycache stycache[STYCACHE_SIZE];
+
+static void
+flushstycache(void)
+{
+    struct stycache *sc;
+
+    for (sc = stycache; sc < stycache + STYCACHE_SIZE; sc++)
+	if (sc->s) {
+	    zsfree(sc->ctxt);
+	    sc->ctxt = NULL;
+	    sc->s = NULL;
+	}
+}
+
 /* Memory stuff. */
 
 static void
@@ -419,21 +453,35 @@ lookupstyle(char *ctxt, char *style)
 {
     Style s;
     Stypat p;
-    char **found = NULL;
+    struct stycache *sc;
+    unsigned hashval;
 
-    s = (Style)zstyletab->getnode2(zstyletab, style);
-    if (s) {
+    if (!(s = (Style)zstyletab->getnode2(zstyletab, style)))
+	return NULL;
+
+    hashval = wordhasher(ctxt) * 31 + wordhasher(style);
+    sc = stycache + hashval % STYCACHE_SIZE;
+    if (sc->s == s && sc->hashval == hashval && !strcmp(sc->ctxt, ctxt))
+	p = sc->found;
+    else {
 	MatchData match;
 	savematch(&match);
 	for (p = s->pats; p; p = p->next)
-	    if (pattry(p->prog, ctxt)) {
-		found = (p->eval ? evalstyle(p) : p->vals);
+	    if (pattry(p->prog, ctxt))
 		break;
-	    }
 	restorematch(&match);
+
+	if (sc->s)
+	    zsfree(sc->ctxt);
+	sc->s = s;
+	sc->ctxt = ztrdup(ctxt);
+	sc->hashval = hashval;
+	sc->found = p;
     }
+    if (!p)
+	return NULL;
 
-    return found;
+    return (p->eval ? evalstyle(p) : p->vals);
 }
 
 static int
@@ -481,6 +529,7 @@ bin_zstyle(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
 	    zwarnnam(nam, "invalid pattern: %s", args[0]);
 	    return 1;
 	}
+	flushstycache();
 	if (!(s = (Style)zstyletab->getnode2(zstyletab, args[1])))
 	    s = addstyle(args[1]);
 	return setstypat(s, args[0], prog, args + 2, eval);
@@ -555,6 +604,7 @@ bin_zstyle(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
 	{
 	    Style s;
 
+	    flushstycache();
 	    if (args[1]) {
 		if (args[2]) {
 		    char *pat = args[1];
@@ -1900,11 +1950,11 @@ bin_zparseopts(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
     if (del) {
 	if (extract) {
 	    *cp = NULL;
-	    freearray(pparams);
+	    freepparams();
 	    pparams = zarrdup(np);
 	} else {
 	    pp = zarrdup(pp);
-	    freearray(pparams);
+	    freepparams();
 	    pparams = pp;
 	}
     }
@@ -1931,6 +1981,8 @@ int
 setup_(UNUSED(Module m))
 {
     zstyletab = newzstyletable(17, "zstyletab");
+    zstyletab->hash = wordhasher;
+    indexhashtable(zstyletab);
 
     return 0;
 }
@@ -1968,6 +2020,7 @@ cleanup_(Module m)
 int
 finish_(UNUSED(Module m))
 {
+    flushstycache();
     deletehashtable(zstyletab);
 
     return 0;
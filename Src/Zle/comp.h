@@ -30,6 +30,7 @@
 typedef struct cmatcher  *Cmatcher;
 typedef struct cmlist    *Cmlist;
 typedef struct cpattern  *Cpattern;
+typedef struct cpatmap   *Cpatmap;
 typedef struct menuinfo  *Menuinfo;
 typedef struct cexpl *Cexpl;
 typedef struct cmgroup *Cmgroup;
@@ -195,6 +196,25 @@ struct cpattern {
 				 */
 	convchar_t chr;		/* if a single character, it */
     } u;
+    Cpatmap map;		/* for a class, results worked out in
+				 * advance, or NULL */
+};
+
+/*
+ * What matching a class against each ASCII character gives, so that
+ * the class string doesn't have to be scanned for every character
+ * of every match.  For an equivalence class there is also what each
+ * of the first indexes into it stands for.
+ */
+
+#define CPAT_MAPSIZE 128
+
+struct cpatmap {
+    convchar_t ind[CPAT_MAPSIZE];	/* return value of pattern_match1() */
+    unsigned char mt[CPAT_MAPSIZE];	/* and the match type it gives */
+    convchar_t chr[CPAT_MAPSIZE];	/* character at index, if exact */
+    unsigned char chrmt[CPAT_MAPSIZE];	/* else the match type there */
+    unsigned char haschr[CPAT_MAPSIZE];	/* set if the index is valid */
 };
 
 /*
@@ -423,9 +443,11 @@ typedef void (*CLPrintFunc)(Cmgroup, Cmatch *, int, int, int, int);
 #define CP_QUOTES      (1 << CPN_QUOTES)
 #define CPN_IGNORED    25
 #define CP_IGNORED     (1 << CPN_IGNORED)
+#define CPN_REFINE     26
+#define CP_REFINE      (1 << CPN_REFINE)
 
-#define CP_KEYPARAMS   26
-#define CP_ALLKEYS     ((unsigned int) 0x3ffffff)
+#define CP_KEYPARAMS   27
+#define CP_ALLKEYS     ((unsigned int) 0x7ffffff)
 
 /* Hooks. */
 
@@ -454,6 +476,15 @@ struct chdata {
     Cmatch cur;			/* current match or NULL */
 };
 
+/* Phases of a completion told apart when profiling with compprof. */
+
+#define CPROF_OTHER  0		/* none of the others */
+#define CPROF_FUNCS  1		/* running completion functions */
+#define CPROF_ADD    2		/* adding and matching in compadd */
+#define CPROF_SORT   3		/* sorting and copying the matches */
+#define CPROF_LIST   4		/* listing the matches */
+#define CPROF_NUM    5
+
 /* The number of columns to leave empty between rows of matches. */
 
 #define CM_SPACE  2
@@ -281,6 +281,270 @@ mod_export int lastend;
 
 #define inststr(X) inststrlen((X),1,-1)
 
+/*
+ * Completion profiling.  After `compprof num', the time taken by each
+ * of the phases of the last num completions is kept, together with the
+ * time spent in each completion function and the numbers of matches
+ * added and kept.  The time is charged to one phase at a time; entering
+ * a phase with compprofenter() charges the time since the last change
+ * to the phase left.
+ */
+
+typedef struct compproffn *Compproffn;
+
+struct compproffn {
+    Compproffn next;
+    char *name;
+    long calls;
+    double time;		/* including functions called */
+    double self;		/* not including functions called */
+};
+
+typedef struct compprof *Compprof;
+
+struct compprof {
+    char *word;			/* word completed */
+    double phases[CPROF_NUM];	/* time for each phase */
+    int added;			/* matches added */
+    int kept;			/* matches left after removing duplicates */
+    Compproffn fns;		/* completion functions called */
+};
+
+/* Completion functions running, innermost first */
+
+typedef struct compprofstk *Compprofstk;
+
+struct compprofstk {
+    Compprofstk prev;
+    Compproffn fn;
+    double beg;
+    double inner;		/* time in functions called */
+};
+
+static struct compprof *compprofs;
+static int compprofmax;
+static zlong compprofnum;
+static Compprof curprof, lastprof;
+static Compprofstk profstack;
+static int profphase;
+static double profmark;
+
+static double
+compproftime(void)
+{
+    struct timeval tv;
+    struct timezone dummy;
+
+    gettimeofday(&tv, &dummy);
+    return (((double) tv.tv_sec) * 1000.0) + (((double) tv.tv_usec) / 1000.0);
+}
+
+/* Charge the time so far to the current phase and switch to another. */
+
+/**/
+int
+compprofenter(int phase)
+{
+    int old = profphase;
+
+    if (curprof) {
+	double now = compproftime();
+
+	curprof->phases[profphase] += now - profmark;
+	profmark = now;
+    }
+    profphase = phase;
+
+    return old;
+}
+
+static void
+freecompprof(Compprof p)
+{
+    Compproffn f, n;
+
+    zsfree(p->word);
+    for (f = p->fns; f; f = n) {
+	n = f->next;
+	zsfree(f->name);
+	zfree(f, sizeof(*f));
+    }
+    memset(p, 0, sizeof(*p));
+}
+
+static void
+startcompprof(char *word)
+{
+    if (!compprofmax)
+	return;
+    curprof = compprofs + (compprofnum++ % compprofmax);
+    freecompprof(curprof);
+    curprof->word = ztrdup(word ? word : "");
+    lastprof = curprof;
+    profstack = NULL;
+    profphase = CPROF_OTHER;
+    profmark = compproftime();
+}
+
+static void
+endcompprof(void)
+{
+    compprofenter(CPROF_OTHER);
+    curprof = NULL;
+}
+
+/* Run a shell function called during completion, timing it. */
+
+/**/
+void
+compprofcall(Eprog prog, FuncWrap w, char *name)
+{
+    struct compprofstk st;
+    Compprofstk sp;
+    Compproffn f;
+    double t;
+
+    if (!curprof) {
+	runshfunc(prog, w, name);
+	return;
+    }
+    for (f = curprof->fns; f; f = f->next)
+	if (!strcmp(f->name, name))
+	    break;
+    if (!f) {
+	f = (Compproffn) zshcalloc(sizeof(*f));
+	f->name = ztrdup(name);
+	f->next = curprof->fns;
+	curprof->fns = f;
+    }
+    f->calls++;
+    st.prev = profstack;
+    st.fn = f;
+    st.inner = 0.0;
+    profstack = &st;
+    st.beg = compproftime();
+
+    runshfunc(prog, w, name);
+
+    t = compproftime() - st.beg;
+    profstack = st.prev;
+    f->self += t - st.inner;
+    for (sp = profstack; sp && sp->fn != f; sp = sp->prev);
+    if (!sp)
+	f->time += t;
+    if (profstack)
+	profstack->inner += t;
+}
+
+/* Add the time for listing matches to the completion listed. */
+
+/**/
+void
+compproflist(double beg)
+{
+    if (lastprof && compprofmax)
+	lastprof->phases[CPROF_LIST] += compproftime() - beg;
+}
+
+/* Get the time listing starts, if it is to be added to a completion. */
+
+/**/
+double
+compprofstart(void)
+{
+    return (lastprof && compprofmax) ? compproftime() : 0.0;
+}
+
+static int
+cmpproffns(Compproffn *a, Compproffn *b)
+{
+    return ((*a)->self > (*b)->self ? -1 : ((*a)->self != (*b)->self));
+}
+
+static void
+printcompprof(int num, Compprof p)
+{
+    static char *names[CPROF_NUM] = {
+	"other", "functions", "compadd", "sort", "list"
+    };
+    Compproffn f, *fs, *fp;
+    double total = 0.0;
+    int i, n;
+
+    for (i = 0; i < CPROF_LIST; i++)
+	total += p->phases[i];
+    printf("%2d) ", num);
+    nicezputs(p->word, stdout);
+    printf("\n    %.2f ms, %d matches added, %d kept\n",
+	   total, p->added, p->kept);
+    for (i = 0; i < CPROF_NUM; i++)
+	printf("    %-10s %8.2f\n", names[i], p->phases[i]);
+
+    for (n = 0, f = p->fns; f; f = f->next)
+	n++;
+    if (!n)
+	return;
+    fs = (Compproffn *) zhalloc(n * sizeof(Compproffn));
+    for (fp = fs, f = p->fns; f; f = f->next)
+	*fp++ = f;
+    qsort(fs, n, sizeof(Compproffn),
+	  (int (*) _((const void *, const void *))) cmpproffns);
+    printf("    calls     time     self  name\n");
+    for (fp = fs; n--; fp++)
+	printf("    %5ld %8.2f %8.2f  %s\n",
+	       (*fp)->calls, (*fp)->time, (*fp)->self, (*fp)->name);
+}
+
+/**/
+int
+bin_compprof(char *name, char **argv, Options ops, UNUSED(int func))
+{
+    int i, n;
+
+    if (OPT_ISSET(ops, 'c') || *argv) {
+	if (curprof) {
+	    zwarnnam(name, "can't be changed while completing");
+	    return 1;
+	}
+	if (*argv) {
+	    char *end;
+
+	    n = (int) zstrtol(*argv, &end, 10);
+	    if (*end || n < 0) {
+		zwarnnam(name, "invalid number: %s", *argv);
+		return 1;
+	    }
+	} else
+	    n = 0;
+	freecompprofs();
+	if (n)
+	    compprofs = (Compprof) zshcalloc(n * sizeof(struct compprof));
+	compprofmax = n;
+	compprofnum = 0;
+	return 0;
+    }
+    n = (compprofnum < compprofmax ? (int) compprofnum : compprofmax);
+    for (i = 0; i < n; i++)
+	printcompprof(i + 1,
+		      compprofs + ((compprofnum - n + i) % compprofmax));
+    return 0;
+}
+
+/**/
+void
+freecompprofs(void)
+{
+    int i;
+
+    for (i = 0; i < compprofmax; i++)
+	freecompprof(compprofs + i);
+    if (compprofs)
+	zfree(compprofs, compprofmax * sizeof(struct compprof));
+    compprofs = NULL;
+    compprofmax = 0;
+    curprof = lastprof = NULL;
+}
+
 /*
  * Main completion entry point, called from zle. 
  * At this point the line is already metafied.
@@ -297,6 +561,7 @@ do_completion(UNUSED(Hookdef dummy), Compldat dat)
 
     METACHECK();
 
+    startcompprof(s);
     pushheap();
 
     ainfo = fainfo = NULL;
@@ -453,6 +718,7 @@ do_completion(UNUSED(Hookdef dummy), Compldat dat)
     if (zlemetacs > zlemetall)
 	zlemetacs = zlemetall;
     popheap();
+    endcompprof();
 
     return ret;
 }
@@ -542,6 +808,353 @@ after_complete(UNUSED(Hookdef dummy), int *dat)
     return 0;
 }
 
+/*
+ * A list can be refined rather than made again when all that has
+ * happened since it was made is that the prefix of the word was
+ * extended: the completion function then sets compstate[old_list] to
+ * `refine'.  For that we remember how the last list a completion
+ * function made came about, i.e. the compadd calls that added to it and
+ * the state each of them saw.  Refining the list means making those
+ * calls again with the extra characters added to the prefix, leaving
+ * out the function itself.
+ */
+
+typedef struct refadd *Refadd;
+typedef struct refrec *Refrec;
+
+/* One compadd call */
+
+struct refadd {
+    Refadd next;
+    struct cadata dat;		/* the options, permanently allocated */
+    char **argv;		/* the words, with -a and -k expanded */
+    char **disp;		/* the -d strings */
+    char **ign;			/* the -F suffixes and patterns */
+    char *prefix, *suffix;	/* the special parameters at the time */
+    char *iprefix, *isuffix;
+    char *qiprefix, *qisuffix;
+    char *exact, *patmatch;	/* and the keys of compstate we use */
+};
+
+/* What a list depended on and how it was made */
+
+struct refrec {
+    int ok;			/* nothing seen that stops refining */
+    Widget widget;		/* the widget and its function */
+    char *func;
+    char *linepre, *linesuf;	/* the line before and after the word */
+    char *context, *quote, *qstack;
+    int current;
+    char *prefix, *suffix;	/* the special parameters on entry */
+    char *iprefix, *isuffix;
+    char *qiprefix, *qisuffix;
+    Refadd adds, *lastadd;
+};
+
+/* The list we could refine; the one being made; the call being made again */
+
+static Refrec refrec, refnew;
+static Refadd refreplay;
+
+/* The characters added since refrec, if it can be refined */
+
+static char *refadded;
+
+static char *
+refdup(char *s)
+{
+    return ztrdup(s ? s : "");
+}
+
+static void
+freerefrec(Refrec r)
+{
+    Refadd a, n;
+
+    if (!r)
+	return;
+    for (a = r->adds; a; a = n) {
+	n = a->next;
+	zsfree(a->dat.ipre);
+	zsfree(a->dat.isuf);
+	zsfree(a->dat.ppre);
+	zsfree(a->dat.psuf);
+	zsfree(a->dat.prpre);
+	zsfree(a->dat.pre);
+	zsfree(a->dat.suf);
+	zsfree(a->dat.group);
+	zsfree(a->dat.rems);
+	zsfree(a->dat.remf);
+	zsfree(a->dat.ign);
+	zsfree(a->dat.exp);
+	zsfree(a->dat.disp);
+	zsfree(a->dat.mesg);
+	freecmatcher(a->dat.match);
+	freearray(a->argv);
+	if (a->disp)
+	    freearray(a->disp);
+	if (a->ign)
+	    freearray(a->ign);
+	zsfree(a->prefix);
+	zsfree(a->suffix);
+	zsfree(a->iprefix);
+	zsfree(a->isuffix);
+	zsfree(a->qiprefix);
+	zsfree(a->qisuffix);
+	zsfree(a->exact);
+	zsfree(a->patmatch);
+	zfree(a, sizeof(struct refadd));
+    }
+    zsfree(r->func);
+    zsfree(r->linepre);
+    zsfree(r->linesuf);
+    zsfree(r->context);
+    zsfree(r->quote);
+    zsfree(r->qstack);
+    zsfree(r->prefix);
+    zsfree(r->suffix);
+    zsfree(r->iprefix);
+    zsfree(r->isuffix);
+    zsfree(r->qiprefix);
+    zsfree(r->qisuffix);
+    zfree(r, sizeof(struct refrec));
+}
+
+/*
+ * Start recording the list about to be made by fn, with the state
+ * the completion function sees on entry.
+ */
+
+static Refrec
+refine_start(char *fn)
+{
+    Refrec r = (Refrec) zshcalloc(sizeof(struct refrec));
+
+    /* Braces in the word are too complicated to deal with. */
+    r->ok = !brbeg && !brend;
+    r->widget = compwidget;
+    r->func = ztrdup(fn);
+    r->linepre = ztrduppfx(zlemetaline, wb);
+    r->linesuf = ztrdup(zlemetaline + we);
+    r->context = refdup(compcontext);
+    r->quote = refdup(compquote);
+    r->qstack = refdup(compqstack);
+    r->current = compcurrent;
+    r->prefix = refdup(compprefix);
+    r->suffix = refdup(compsuffix);
+    r->iprefix = refdup(compiprefix);
+    r->isuffix = refdup(compisuffix);
+    r->qiprefix = refdup(compqiprefix);
+    r->qisuffix = refdup(compqisuffix);
+    r->lastadd = &r->adds;
+
+    return r;
+}
+
+/*
+ * Return the characters added to the prefix in r since refrec was
+ * made, if that's all that has changed, else NULL.
+ */
+
+static char *
+refine_check(Refrec r)
+{
+    Refrec o = refrec;
+
+    if (!o || !o->ok || !r->ok ||
+	o->widget != r->widget || o->current != r->current ||
+	strcmp(o->func, r->func) ||
+	strcmp(o->linepre, r->linepre) || strcmp(o->linesuf, r->linesuf) ||
+	strcmp(o->context, r->context) || strcmp(o->quote, r->quote) ||
+	strcmp(o->qstack, r->qstack) ||
+	strcmp(o->suffix, r->suffix) ||
+	strcmp(o->iprefix, r->iprefix) || strcmp(o->isuffix, r->isuffix) ||
+	strcmp(o->qiprefix, r->qiprefix) ||
+	strcmp(o->qisuffix, r->qisuffix) ||
+	!strpfx(o->prefix, r->prefix) || !r->prefix[strlen(o->prefix)])
+	return NULL;
+
+    return r->prefix + strlen(o->prefix);
+}
+
+/*
+ * Record a call to compadd for the list being made.  Only calls that
+ * add matches the normal way are any use; anything else means we
+ * can't refine the list.
+ */
+
+static void
+refine_record(Cadata dat, char **argv)
+{
+    Refrec r = refnew;
+    Refadd a;
+    char **words;
+    VARARR(char, entry, strlen(r->iprefix) + strlen(r->prefix) + 1);
+    VARARR(char, here, strlen(compiprefix) + strlen(compprefix) + 1);
+
+    if (!r->ok || dat->apar || dat->opar || dat->dpar)
+	return;
+    /*
+     * Matching must be done by us, and the function may only have
+     * moved the ends of the word between the prefixes and suffixes,
+     * so that adding to the prefix on entry adds to the prefix here.
+     */
+    strcpy(entry, r->iprefix);
+    strcat(entry, r->prefix);
+    strcpy(here, compiprefix);
+    strcat(here, compprefix);
+    if (!(dat->aflags & CAF_MATCH) || strcmp(entry, here) ||
+	!strsfx(compprefix, r->prefix) || !strpfx(compsuffix, r->suffix) ||
+	strcmp(dyncat(r->suffix, r->isuffix), dyncat(compsuffix, compisuffix)) ||
+	strcmp(r->qiprefix, compqiprefix) ||
+	strcmp(r->qisuffix, compqisuffix) ||
+	(comppatmatch && *comppatmatch)) {
+	r->ok = 0;
+	return;
+    }
+    if (dat->aflags & CAF_ARRAYS) {
+	LinkList l = newlinklist();
+	char **ap, **wp;
+
+	for (ap = argv; *ap; ap++)
+	    if ((wp = get_data_arr(*ap, (dat->aflags & CAF_KEYS))))
+		while (*wp)
+		    addlinknode(l, *wp++);
+	words = zlinklist2array(l);
+    } else
+	words = zarrdup(argv);
+
+    a = (Refadd) zshcalloc(sizeof(struct refadd));
+    a->dat.ipre = ztrdup(dat->ipre);
+    a->dat.isuf = ztrdup(dat->isuf);
+    a->dat.ppre = ztrdup(dat->ppre);
+    a->dat.psuf = ztrdup(dat->psuf);
+    a->dat.prpre = ztrdup(dat->prpre);
+    a->dat.pre = ztrdup(dat->pre);
+    a->dat.suf = ztrdup(dat->suf);
+    a->dat.group = ztrdup(dat->group);
+    a->dat.rems = ztrdup(dat->rems);
+    a->dat.remf = ztrdup(dat->remf);
+    a->dat.ign = ztrdup(dat->ign);
+    a->dat.flags = dat->flags;
+    a->dat.aflags = dat->aflags & ~(CAF_ARRAYS|CAF_KEYS);
+    if ((a->dat.match = dat->match))
+	dat->match->refc++;
+    a->dat.exp = ztrdup(dat->exp);
+    a->dat.disp = ztrdup(dat->disp);
+    a->dat.mesg = ztrdup(dat->mesg);
+    a->dat.dummies = dat->dummies;
+    a->argv = words;
+    if (dat->disp && (words = get_user_var(dat->disp)))
+	a->disp = zarrdup(words);
+    if (dat->ign && (words = get_user_var(dat->ign)))
+	a->ign = zarrdup(words);
+    a->prefix = ztrdup(compprefix);
+    a->suffix = ztrdup(compsuffix);
+    a->iprefix = ztrdup(compiprefix);
+    a->isuffix = ztrdup(compisuffix);
+    a->qiprefix = ztrdup(compqiprefix);
+    a->qisuffix = ztrdup(compqisuffix);
+    a->exact = refdup(compexact);
+    a->patmatch = refdup(comppatmatch);
+
+    *r->lastadd = a;
+    r->lastadd = &a->next;
+}
+
+/* Make the calls recorded in refrec again with added on the prefix. */
+
+static void
+refine_replay(char *added)
+{
+    Refadd a;
+    char *sprefix = compprefix, *ssuffix = compsuffix;
+    char *siprefix = compiprefix, *sisuffix = compisuffix;
+    char *sqiprefix = compqiprefix, *sqisuffix = compqisuffix;
+    char *sexact = compexact, *spatmatch = comppatmatch;
+
+    for (a = refrec->adds; a; a = a->next) {
+	struct cadata dat = a->dat;
+
+	dat.ipre = dupstring(dat.ipre);
+	dat.isuf = dupstring(dat.isuf);
+	dat.ppre = dupstring(dat.ppre);
+	dat.psuf = dupstring(dat.psuf);
+	dat.prpre = dupstring(dat.prpre);
+	dat.pre = dupstring(dat.pre);
+	dat.suf = dupstring(dat.suf);
+	dat.group = dupstring(dat.group);
+	dat.rems = dupstring(dat.rems);
+	dat.remf = dupstring(dat.remf);
+	dat.exp = dupstring(dat.exp);
+	dat.mesg = dupstring(dat.mesg);
+
+	compprefix = dyncat(a->prefix, added);
+	compsuffix = a->suffix;
+	compiprefix = a->iprefix;
+	compisuffix = a->isuffix;
+	compqiprefix = a->qiprefix;
+	compqisuffix = a->qisuffix;
+	compexact = a->exact;
+	comppatmatch = a->patmatch;
+
+	refreplay = a;
+	addmatches(&dat, arrdup(a->argv));
+	refreplay = NULL;
+    }
+    compprefix = sprefix;
+    compsuffix = ssuffix;
+    compiprefix = siprefix;
+    compisuffix = sisuffix;
+    compqiprefix = sqiprefix;
+    compqisuffix = sqisuffix;
+    compexact = sexact;
+    comppatmatch = spatmatch;
+}
+
+/*
+ * Refine the last list for compstate[old_list]=refine.  The calls
+ * that made it then become part of the list being made, so that it
+ * can be refined again in its turn.
+ */
+
+/**/
+void
+refine_list(void)
+{
+    char *added = refadded;
+    int onm = mnum;
+    Refadd a;
+
+    if (!added || !refrec || !refnew)
+	return;
+    refadded = NULL;
+    refine_replay(added);
+    if (mnum == onm || !refrec->adds)
+	return;
+    for (a = refrec->adds; a; a = a->next) {
+	char *p = tricat(a->prefix, added, "");
+
+	zsfree(a->prefix);
+	a->prefix = p;
+    }
+    *refnew->lastadd = refrec->adds;
+    refnew->lastadd = refrec->lastadd;
+    refrec->adds = NULL;
+    refrec->lastadd = &refrec->adds;
+}
+
+/* Forget any list we could refine; used when the module is unloaded. */
+
+/**/
+void
+free_refine(void)
+{
+    freerefrec(refrec);
+    freerefrec(refnew);
+    refrec = refnew = NULL;
+}
+
 /* This calls the given completion widget function. */
 
 static int parwb, parwe, paroffs;
@@ -568,7 +1181,7 @@ callcompfunc(char *s, char *fn)
 	rset = CP_ALLREALS;
 	kset = CP_ALLKEYS &
 	    ~(CP_PARAMETER | CP_REDIRECT | CP_QUOTE | CP_QUOTING |
-	      CP_EXACTSTR | CP_OLDLIST | CP_OLDINS |
+	      CP_EXACTSTR | CP_OLDLIST | CP_OLDINS | CP_REFINE |
 	      (useglob ? 0 : CP_PATMATCH));
 	zsfree(compvared);
 	if (varedarg) {
@@ -816,6 +1429,16 @@ callcompfunc(char *s, char *fn)
 	    compoldlist = compoldins = "";
 	compoldlist = ztrdup(compoldlist);
 	compoldins = ztrdup(compoldins);
+	freerefrec(refnew);
+	refnew = refine_start(fn);
+	zsfree(comprefine);
+	if ((tmp = refine_check(refnew))) {
+	    comprefine = ztrdup(refadded = dupstring(tmp));
+	    kset |= CP_REFINE;
+	} else {
+	    comprefine = ztrdup("");
+	    refadded = NULL;
+	}
 
 	incompfunc = 1;
 	startparamscope();
@@ -957,8 +1580,7 @@ makecomplist(char *s, int incmd, int lst)
 
     if (compfunc) {
 	char *os = s;
-	int onm = nmatches, odm = diffmatches, osi = movefd(0);
-
+	int onm = nmatches, odm = diffmatches, osi = movefd(0), ph;
 	bmatchers = NULL;
 	mstack = NULL;
 
@@ -984,12 +1606,31 @@ makecomplist(char *s, int incmd, int lst)
 	menucmp = menuacc = newmatches = onlyexpl = 0;
 
 	s = dupstring(os);
+	ph = compprofenter(CPROF_FUNCS);
 	callcompfunc(s, compfunc);
+	compprofenter(ph);
 	endcmgroup(NULL);
 
 	/* Needed for compcall. */
 	runhookdef(COMPCTLCLEANUPHOOK, NULL);
 
+	if (refnew) {
+	    /*
+	     * A list made afresh is the one to refine next time; one
+	     * kept from before leaves things as they were.
+	     */
+	    if (!oldlist) {
+		freerefrec(refrec);
+		refrec = NULL;
+		if (refnew->ok && mnum) {
+		    refrec = refnew;
+		    refnew = NULL;
+		}
+	    }
+	    freerefrec(refnew);
+	    refnew = NULL;
+	}
+
 	if (oldlist) {
 	    nmatches = onm;
 	    diffmatches = odm;
@@ -1016,6 +1657,10 @@ makecomplist(char *s, int incmd, int lst)
 	}
 	permmatches(1);
 	amatches = pmatches;
+	if (curprof) {
+	    curprof->added = mnum;
+	    curprof->kept = nmatches;
+	}
 	lastpermmnum = permmnum;
 	lastpermgnum = permgnum;
 
@@ -1970,6 +2615,7 @@ get_user_var(char *nam)
     }
 }
 
+/**/
 static char **
 get_data_arr(char *name, int keys)
 {
@@ -2030,6 +2676,20 @@ addmatch(char *str, int flags, char ***dispp, int line)
 /**/
 int
 addmatches(Cadata dat, char **argv)
+{
+    int ph = compprofenter(CPROF_ADD), ret;
+
+    ret = doaddmatches(dat, argv);
+    compprofenter(ph);
+
+    return ret;
+}
+
+/* Do the work for addmatches(). */
+
+/**/
+static int
+doaddmatches(Cadata dat, char **argv)
 {
     char *s, *ms, *lipre = NULL, *lisuf = NULL, *lpre = NULL, *lsuf = NULL;
     char **aign = NULL, **dparr = NULL, *oaq = autoq, *oppre = dat->ppre;
@@ -2048,6 +2708,9 @@ addmatches(Cadata dat, char **argv)
     Brinfo bp, bpl = brbeg, obpl, bsl = brend, obsl;
     Heap oldheap;
 
+    if (refnew && !refreplay)
+	refine_record(dat, argv);
+
     SWITCHHEAPS(oldheap, compheap) {
         if (dat->dummies)
             dat->aflags = ((dat->aflags | CAF_NOSORT | CAF_UNIQCON) &
@@ -2156,7 +2819,9 @@ addmatches(Cadata dat, char **argv)
 	    update_bmatchers();
 
 	/* Get the suffixes to ignore. */
-	if (dat->ign && (aign = get_user_var(dat->ign))) {
+	if (dat->ign &&
+	    (aign = (!refreplay ? get_user_var(dat->ign) :
+		     refreplay->ign ? arrdup(refreplay->ign) : NULL))) {
 	    char **ap, **sp, *tmp;
 	    Patprog *pp, prog;
 
@@ -2181,7 +2846,8 @@ addmatches(Cadata dat, char **argv)
 	}
 	/* Get the display strings. */
 	if (dat->disp)
-	    if ((disp = get_user_var(dat->disp)))
+	    if ((disp = (!refreplay ? get_user_var(dat->disp) :
+			 refreplay->disp ? arrdup(refreplay->disp) : NULL)))
 		disp--;
 	/* Get the contents of the completion variables if we have
 	 * to perform matching. */
@@ -3130,6 +3796,162 @@ matcheq(Cmatch a, Cmatch b)
 	  matchstreq(a->str, b->str)));
 }
 
+/*
+ * Sort keys for matches.  The rank puts matches ordered by display
+ * lines first and other matches ordered by display strings next, as
+ * in matchcmp(); the key is the display string, or else the match
+ * without its quoting backslashes as made comparable by zcollkey().
+ */
+
+struct matchkey {
+    Cmatch m;
+    int rank;
+    char *key;
+};
+
+static int
+matchkeycmp(const void *a, const void *b)
+{
+    const struct matchkey *ka = a, *kb = b;
+
+    if (ka->rank != kb->rank)
+	return ka->rank - kb->rank;
+    return strcmp(ka->key, kb->key);
+}
+
+/*
+ * Sort the n matches in rp, working out the key for each match only
+ * once.  Returns zero if that can't be done, in which case the
+ * caller has to sort with matchcmp().
+ */
+
+/**/
+static int
+sortmatches(Cmatch *rp, int n)
+{
+    struct matchkey *keys, *kp;
+    Cmatch *ap;
+
+    /* Numeric sorting needs the strings themselves. */
+    if (isset(NUMERICGLOBSORT) || !zcollkey(""))
+	return 0;
+
+    keys = (struct matchkey *) zhalloc(n * sizeof(struct matchkey));
+    for (ap = rp, kp = keys; *ap; ap++, kp++) {
+	Cmatch m = *ap;
+
+	kp->m = m;
+	if (m->disp && !(m->flags & CMF_MORDER)) {
+	    kp->rank = (m->flags & CMF_DISPLINE) ? 0 : 1;
+	    kp->key = m->disp;
+	} else {
+	    char *s = m->str;
+
+	    if (strchr(s, '\\')) {
+		char *p, *t;
+
+		/* Like zstrbcmp(), take the character after a backslash. */
+		for (p = t = s = dupstring(s); *p; p++) {
+		    if (*p == '\\' && !*++p)
+			break;
+		    *t++ = *p;
+		}
+		*t = '\0';
+	    }
+	    kp->rank = 2;
+	    kp->key = zcollkey(s);
+	}
+    }
+    qsort((void *) keys, n, sizeof(struct matchkey), matchkeycmp);
+
+    for (ap = rp, kp = keys; *ap; ap++, kp++)
+	*ap = kp->m;
+
+    return 1;
+}
+
+/*
+ * Hash the strings that matcheq() compares.  Matches that are equal
+ * have the same hash.
+ */
+
+/**/
+static unsigned
+matchhash(Cmatch m)
+{
+    unsigned h = 0;
+
+    if (m->ipre)
+	h = hasher(m->ipre);
+    if (m->pre)
+	h = h * 31 + hasher(m->pre);
+    if (m->ppre)
+	h = h * 31 + hasher(m->ppre);
+    if (m->psuf)
+	h = h * 31 + hasher(m->psuf);
+    if (m->suf)
+	h = h * 31 + hasher(m->suf);
+    if (m->disp)
+	h = h * 31 + hasher(m->disp) + 1;
+    if (m->str)
+	h = h * 31 + hasher(m->str);
+
+    return h;
+}
+
+/*
+ * Remove the matches in the unsorted array rp that are equal to
+ * an earlier one and mark those that show the same string as an
+ * earlier one, using a hash table instead of comparing every pair.
+ * Returns the number of matches removed.
+ */
+
+/**/
+static int
+uniqmatches(Cmatch *rp, int n)
+{
+    Cmatch *htab, *ap, *cp, *tp;
+    unsigned size, mask;
+    int removed = 0;
+
+    for (size = 16; size < 2 * (unsigned) n; size <<= 1);
+    mask = size - 1;
+    htab = (Cmatch *) hcalloc(size * sizeof(Cmatch));
+
+    for (ap = cp = rp; *ap; ap++) {
+	for (tp = htab + (matchhash(*ap) & mask); *tp;
+	     tp = htab + ((tp - htab + 1) & mask))
+	    if (matcheq(*tp, *ap))
+		break;
+	if (*tp)
+	    removed++;
+	else
+	    *tp = *cp++ = *ap;
+    }
+    *cp = NULL;
+
+    /*
+     * The first match showing a string gets CMF_FMULT, the others
+     * showing the same string CMF_MULT.
+     */
+    memset(htab, 0, size * sizeof(Cmatch));
+    for (ap = rp; *ap; ap++) {
+	if ((*ap)->disp)
+	    continue;
+	for (tp = htab + (hasher((*ap)->str) & mask); *tp;
+	     tp = htab + ((tp - htab + 1) & mask))
+	    if (!strcmp((*tp)->str, (*ap)->str))
+		break;
+	if (!*tp)
+	    *tp = *ap;
+	else if (!((*ap)->flags & CMF_MULT)) {
+	    (*ap)->flags |= CMF_MULT;
+	    (*tp)->flags |= CMF_FMULT;
+	}
+    }
+    return removed;
+}
+
 /* Make an array from a linked list. The second argument says whether *
  * the array should be sorted. The third argument is used to return   *
  * the number of elements in the resulting array. The fourth argument *
@@ -3172,8 +3994,9 @@ makearray(LinkList l, int type, int flags, int *np, int *nlp, int *llp)
     } else {
 	if (!(flags & CGF_NOSORT)) {
 	    /* Now sort the array (it contains matches). */
-	    qsort((void *) rp, n, sizeof(Cmatch),
-		  (int (*) _((const void *, const void *)))matchcmp);
+	    if (!sortmatches(rp, n))
+		qsort((void *) rp, n, sizeof(Cmatch),
+		      (int (*) _((const void *, const void *)))matchcmp);
 
 	    if (!(flags & CGF_UNIQCON)) {
 		int dup;
@@ -3201,30 +4024,9 @@ makearray(LinkList l, int type, int flags, int *np, int *nlp, int *llp)
 		    nl++;
 	    }
 	} else {
-	    if (!(flags & CGF_UNIQALL) && !(flags & CGF_UNIQCON)) {
-                int dup;
-
-		for (ap = rp; *ap; ap++) {
-		    for (bp = cp = ap + 1; *bp; bp++) {
-			if (!matcheq(*ap, *bp))
-			    *cp++ = *bp;
-			else
-			    n--;
-		    }
-		    *cp = NULL;
-                    if (!(*ap)->disp) {
-                        for (dup = 0, bp = ap + 1; *bp; bp++)
-                            if (!(*bp)->disp &&
-                                !((*bp)->flags & CMF_MULT) &&
-                                !strcmp((*ap)->str, (*bp)->str)) {
-                                (*bp)->flags |= CMF_MULT;
-                                dup = 1;
-                            }
-                        if (dup)
-                            (*ap)->flags |= CMF_FMULT;
-                    }
-		}
-	    } else if (!(flags & CGF_UNIQCON)) {
+	    if (!(flags & CGF_UNIQALL) && !(flags & CGF_UNIQCON))
+		n -= uniqmatches(rp, n);
+	    else if (!(flags & CGF_UNIQCON)) {
 		int dup;
 
 		for (ap = cp = rp; *ap; ap++) {
@@ -3316,6 +4118,20 @@ dupmatch(Cmatch m, int nbeg, int nend)
 /**/
 mod_export int
 permmatches(int last)
+{
+    int ph = compprofenter(CPROF_SORT), ret;
+
+    ret = dopermmatches(last);
+    compprofenter(ph);
+
+    return ret;
+}
+
+/* Do the work for permmatches(). */
+
+/**/
+static int
+dopermmatches(int last)
 {
     Cmgroup g = amatches, n;
     Cmatch *p, *q;
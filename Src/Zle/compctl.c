@@ -2133,7 +2133,7 @@ getreal(char *str)
 static void
 gen_matches_files(int dirs, int execs, int all)
 {
-    DIR *d;
+    struct dirlist dl;
     struct stat buf;
     char *n, p[PATH_MAX], *q = NULL, *e, *pathpref;
     LinkList l = NULL;
@@ -2162,7 +2162,7 @@ gen_matches_files(int dirs, int execs, int all)
 	pathpref = NULL;
 	pathpreflen = 0;
     }
-    if ((d = opendir(pathpref ? pathpref : "."))) {
+    if (!opendirlist(pathpref ? pathpref : ".", &dl)) {
 	/* If we search only special files, prepare a path buffer for stat. */
 	if (!all && pathpreflen) {
 	    /* include null byte we carefully added */
@@ -2170,7 +2170,7 @@ gen_matches_files(int dirs, int execs, int all)
 	}
 	q = p + pathpreflen;
 	/* Fine, now read the directory. */
-	while ((n = zreaddir(d, 1)) && !errflag) {
+	while ((n = readdirlist(&dl, NULL)) && !errflag) {
 	    /* Ignore files beginning with `.' unless the thing we found on *
 	     * the command line also starts with a dot or GLOBDOTS is set.  */
 	    if (*n != '.' || *fpre == '.' || isset(GLOBDOTS)) {
@@ -2249,7 +2249,7 @@ gen_matches_files(int dirs, int execs, int all)
 		}
 	    }
 	}
-	closedir(d);
+	closedirlist(&dl);
     }
     opts[NULLGLOB] = ng;
     addwhat = aw;
@@ -3761,6 +3761,7 @@ makecomplistflags(Compctl cc, char *s, int incmd, int compadd)
 	/* Now search the history. */
 	while (n-- && he) {
 	    int iwords;
+	    histentwords(he);
 	    for (iwords = he->nwords - 1; iwords >= 0; iwords--) {
 		h = he->node.nam + he->words[iwords*2];
 		e = he->node.nam + he->words[iwords*2+1];
@@ -70,6 +70,7 @@ char *compiprefix,
      *comptoend,
      *compoldlist,
      *compoldins,
+     *comprefine,
      *compvared;
 
 /**/
@@ -124,6 +125,8 @@ freecpattern(Cpattern p)
 	n = p->next;
 	if (p->tp <= CPAT_EQUIV)
 	    free(p->u.str);
+	if (p->map)
+	    zfree(p->map, sizeof(struct cpatmap));
 	zfree(p, sizeof(struct cpattern));
 
 	p = n;
@@ -171,6 +174,7 @@ cp_cpattern_element(Cpattern o)
     Cpattern n = zalloc(sizeof(struct cpattern));
 
     n->next = NULL;
+    n->map = NULL;
 
     n->tp = o->tp;
     switch (o->tp)
@@ -179,6 +183,10 @@ cp_cpattern_element(Cpattern o)
     case CPAT_NCLASS:
     case CPAT_EQUIV:
 	n->u.str = ztrdup(o->u.str);
+	if (o->map) {
+	    n->map = (Cpatmap) zalloc(sizeof(struct cpatmap));
+	    memcpy(n->map, o->map, sizeof(struct cpatmap));
+	}
 	break;
 
     case CPAT_CHAR:
@@ -515,6 +523,7 @@ parse_class(Cpattern p, char *iptr)
     }
 
     *optr = '\0';
+    p->map = make_cpatmap(p);
     return iptr;
 }
 
@@ -1075,7 +1084,8 @@ bin_compset(char *name, char **argv, UNUSED(Options ops), UNUSED(int func))
 }
 
 /* Definitions for the special parameters. Note that these have to match the
- * order of the CP_* bits in comp.h */
+ * order of the CP_* bits in comp.h.  A scalar with a variable may also
+ * have its own functions for when it is used. */
 
 #define VAL(X) ((void *) (&(X)))
 #define GSU(X) ((GsuScalar)(void *) (&(X)))
@@ -1090,6 +1100,8 @@ static const struct gsu_scalar compvarscalar_gsu =
 { strvargetfn, strvarsetfn, compunsetfn };
 static const struct gsu_scalar complist_gsu =
 { get_complist, set_complist, compunsetfn };
+static const struct gsu_scalar compoldlist_gsu =
+{ strvargetfn, set_compoldlist, compunsetfn };
 static const struct gsu_scalar unambig_gsu =
 { get_unambig, nullstrsetfn, compunsetfn };
 static const struct gsu_scalar unambig_pos_gsu =
@@ -1149,12 +1161,13 @@ static struct compparam compkparams[] = {
     { "list_max", PM_INTEGER, VAL(complistmax), NULL },
     { "last_prompt", PM_SCALAR, VAL(complastprompt), NULL },
     { "to_end", PM_SCALAR, VAL(comptoend), NULL },
-    { "old_list", PM_SCALAR, VAL(compoldlist), NULL },
+    { "old_list", PM_SCALAR, VAL(compoldlist), GSU(compoldlist_gsu) },
     { "old_insert", PM_SCALAR, VAL(compoldins), NULL },
     { "vared", PM_SCALAR, VAL(compvared), NULL },
     { "list_lines", PM_INTEGER | PM_READONLY, NULL, GSU(listlines_gsu) },
     { "all_quotes", PM_SCALAR | PM_READONLY, NULL, GSU(compqstack_gsu) },
     { "ignored", PM_INTEGER | PM_READONLY, VAL(compignored), NULL },
+    { "refine", PM_SCALAR | PM_READONLY, VAL(comprefine), NULL },
     { NULL, 0, NULL, NULL }
 };
 
@@ -1171,11 +1184,11 @@ addcompparams(struct compparam *cp, Param *pp)
 	DPUTS(!pm, "param not set in addcompparams");
 
 	*pp = pm;
-	pm->level = locallevel + 1;
+	setparamlevel(pm, locallevel + 1);
 	if ((pm->u.data = cp->var)) {
 	    switch(PM_TYPE(cp->type)) {
 	    case PM_SCALAR:
-		pm->gsu.s = &compvarscalar_gsu;
+		pm->gsu.s = cp->gsu ? cp->gsu : &compvarscalar_gsu;
 		break;
 	    case PM_INTEGER:
 		pm->gsu.i = &compvarinteger_gsu;
@@ -1210,7 +1223,7 @@ makecompparams(void)
 
     comprpms[CPN_COMPSTATE] = cpm;
     tht = paramtab;
-    cpm->level = locallevel + 1;
+    setparamlevel(cpm, locallevel + 1);
     cpm->gsu.h = &compstate_gsu;
     cpm->u.hash = paramtab = newparamtable(31, COMPSTATENAME);
     addcompparams(compkparams, compkpms);
@@ -1288,6 +1301,16 @@ get_complist(UNUSED(Param pm))
     return complist;
 }
 
+/**/
+static void
+set_compoldlist(Param pm, char *v)
+{
+    strvarsetfn(pm, v);
+    /* The refined list is made straight away so nmatches is right. */
+    if (compoldlist && !strcmp(compoldlist, "refine"))
+	refine_list();
+}
+
 /**/
 static char *
 get_unambig(UNUSED(Param pm))
@@ -1452,7 +1475,7 @@ comp_wrapper(Eprog prog, FuncWrap w, char *name)
 	owords = zarrdup(compwords);
 	oredirs = zarrdup(compredirs);
 
-	runshfunc(prog, w, name);
+	compprofcall(prog, w, name);
 
 	if (comprestore && !strcmp(comprestore, "auto")) {
 	    compcurrent = ocur;
@@ -1545,6 +1568,7 @@ cond_range(char **a, int id)
 
 static struct builtin bintab[] = {
     BUILTIN("compadd", BINF_HANDLES_OPTS, bin_compadd, 0, -1, 0, NULL, NULL),
+    BUILTIN("compprof", 0, bin_compprof, 0, 1, 0, "c", NULL),
     BUILTIN("compset", 0, bin_compset, 1, 3, 0, NULL, NULL),
 };
 
@@ -1593,7 +1617,7 @@ setup_(UNUSED(Module m))
 	compquoting = comprestore = complist = compinsert =
 	compexact = compexactstr = comppatmatch = comppatinsert =
 	complastprompt = comptoend = compoldlist = compoldins =
-	compvared = compqstack = NULL;
+	comprefine = compvared = compqstack = NULL;
     complastprefix = ztrdup("");
     complastsuffix = ztrdup("");
     complistmax = 0;
@@ -1653,6 +1677,7 @@ cleanup_(Module m)
 int
 finish_(UNUSED(Module m))
 {
+    freecompprofs();
     if (compwords)
 	freearray(compwords);
     if (compredirs)
@@ -1682,7 +1707,9 @@ finish_(UNUSED(Module m))
     zsfree(comptoend);
     zsfree(compoldlist);
     zsfree(compoldins);
+    zsfree(comprefine);
     zsfree(compvared);
+    free_refine();
 
     hascompmod = 0;
 
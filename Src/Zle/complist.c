@@ -1503,8 +1503,8 @@ compprintlist(int showall)
 	    }
 	} else if (!listdat.onlyexpl &&
 		   (g->lcount || (showall && g->mcount))) {
-	    int n = g->dcount, nl, nc, i, j, wid;
-	    Cmatch *q;
+	    int n = g->dcount, nl, nc, i, j, wid, nvl;
+	    Cmatch *q, **vl;
 
 	    nl = nc = g->lins;
 
@@ -1581,6 +1581,10 @@ compprintlist(int showall)
 		lastused = 1;
 	    } else
 		p = skipnolist(g->matches, showall);
+	    if (!(g->flags & CGF_ROWS) && nc > 1)
+		vl = listedmatches(g, showall, &nvl);
+	    else
+		vl = NULL;
 
 	    while (n && nl--) {
 		if (!lasttype && ml >= mlbeg) {
@@ -1617,10 +1621,14 @@ compprintlist(int showall)
 		    if (mfirstl < 0)
 			mfirstl = ml;
 
-		    if (--n)
-			for (j = ((g->flags & CGF_ROWS) ? 1 : nc);
-			     j && *q; j--)
-			    q = skipnolist(q + 1, showall);
+		    if (--n) {
+			if (vl)
+			    q = skiplisted(vl, nvl, q, nc);
+			else
+			    for (j = ((g->flags & CGF_ROWS) ? 1 : nc);
+				 j && *q; j--)
+				q = skipnolist(q + 1, showall);
+		    }
 		    mc++;
 		}
 		while (i-- > 0) {
@@ -1157,6 +1157,10 @@ pattern_match1(Cpattern p, convchar_t c, int *mtp)
 {
     convchar_t ind;
 
+    if (p->tp != CPAT_CHAR && p->map && (unsigned)c < CPAT_MAPSIZE) {
+	*mtp = p->map->mt[c];
+	return p->map->ind[c];
+    }
     *mtp = 0;
     switch (p->tp) {
     case CPAT_CCLASS:
@@ -1184,6 +1188,42 @@ pattern_match1(Cpattern p, convchar_t c, int *mtp)
 }
 
 
+/*
+ * Work out the map for a class in the heap, or return NULL if its
+ * results can't be known in advance because it refers to $IFS or
+ * $WORDCHARS.
+ */
+
+/**/
+mod_export Cpatmap
+make_cpatmap(Cpattern p)
+{
+    Cpatmap map;
+    convchar_t c, r;
+    int i, mt;
+
+    if (strchr(p->u.str, STOUC(Meta) + PP_IFS) ||
+	strchr(p->u.str, STOUC(Meta) + PP_IFSSPACE) ||
+	strchr(p->u.str, STOUC(Meta) + PP_WORD))
+	return NULL;
+
+    map = (Cpatmap) zhalloc(sizeof(struct cpatmap));
+    p->map = NULL;
+    for (c = 0; c < CPAT_MAPSIZE; c++) {
+	map->ind[c] = pattern_match1(p, c, &mt);
+	map->mt[c] = mt;
+    }
+    for (i = 0; i < CPAT_MAPSIZE; i++) {
+	if (p->tp == CPAT_EQUIV && PATMATCHINDEX(p->u.str, i, &r, &mt)) {
+	    map->haschr[i] = 1;
+	    map->chr[i] = r;
+	    map->chrmt[i] = mt;
+	} else
+	    map->haschr[i] = 0;
+    }
+    return map;
+}
+
 /*
  * Use an equivalence to deduce the line character from the word, or
  * vice versa.  (If vice versa, then "line" and "word" are reversed
@@ -1206,7 +1246,12 @@ pattern_match_equivalence(Cpattern lp, convchar_t wind, int wmtp,
     convchar_t lchr;
     int lmtp;
 
-    if (!PATMATCHINDEX(lp->u.str, wind-1, &lchr, &lmtp)) {
+    if (lp->map && (unsigned)(wind-1) < CPAT_MAPSIZE) {
+	if (!lp->map->haschr[wind-1])
+	    return CHR_INVALID;
+	lchr = lp->map->chr[wind-1];
+	lmtp = lp->map->chrmt[wind-1];
+    } else if (!PATMATCHINDEX(lp->u.str, wind-1, &lchr, &lmtp)) {
 	/*
 	 * No equivalent.  No possible match; give up.
 	 */
@@ -1749,12 +1794,14 @@ bld_line(Cmatcher mp, ZLE_STRING_T line, char *mword, char *word,
 	     */
 	    curgenpat->tp = CPAT_CHAR;
 	    curgenpat->u.chr = lchr;
+	    curgenpat->map = NULL;
 	} else {
 	    /*
 	     * Not an equivalence class, so we just keep the
 	     * test in the lpat as it is.
 	     */
 	    curgenpat->tp = lpat->tp;
+	    curgenpat->map = lpat->map;
 	    if (lpat->tp == CPAT_CHAR)
 		curgenpat->u.chr = lpat->u.chr;
 	    else if (lpat->tp != CPAT_ANY) {
@@ -876,7 +876,8 @@ struct cadef {
     Caarg rest;			/* the rest-argument */
     char **defs;		/* the original strings */
     int ndefs;			/* number of ... */
-    int lastt;			/* last time this was used */
+    unsigned hash;		/* defs_hash() of defs */
+    unsigned lastt;		/* when this was last used */
     Caopt *single;		/* array of single-letter options */
     char *match;		/* -M spec to use */
     int argsactive;		/* if arguments are still allowed */
@@ -933,11 +934,34 @@ struct caarg {
 #define CAA_RARGS  4
 #define CAA_RREST  5
 
-/* The cache of parsed descriptons. */
+/*
+ * The cache of parsed descriptons.  Commands with big sets of
+ * descriptions are often completed in turn, so this needs to be big
+ * enough that they don't keep pushing each other out.
+ */
 
-#define MAX_CACACHE 8
+#define MAX_CACACHE 64
 static Cadef cadef_cache[MAX_CACACHE];
 
+/* Counts lookups in the caches, to find the least recently used entry. */
+
+static unsigned defs_clock;
+
+/* Hash an array of definitions, so that most entries in a cache can be
+ * passed over without comparing the strings. */
+
+static unsigned
+defs_hash(char **a)
+{
+    unsigned h = 0;
+
+    if (a)
+	while (*a)
+	    h = h * 31 + hasher(*a++);
+
+    return h;
+}
+
 /* Compare two arrays of strings for equality. */
 
 static int
@@ -1112,7 +1136,8 @@ alloc_cadef(char **args, int single, char *match, char *nonarg, int flags)
 	ret->defs = NULL;
 	ret->ndefs = 0;
     }
-    ret->lastt = time(0);
+    ret->hash = defs_hash(args);
+    ret->lastt = ++defs_clock;
     ret->set = ret->sname = NULL;
     if (single) {
 	ret->single = (Caopt *) zalloc(256 * sizeof(Caopt));
@@ -1611,13 +1636,14 @@ get_cadef(char *nam, char **args)
 {
     Cadef *p, *min, new;
     int i, na = arrlen(args);
+    unsigned h = defs_hash(args);
 
     for (i = MAX_CACACHE, p = cadef_cache, min = NULL; i && *p; p++, i--)
-	if (*p && na == (*p)->ndefs && arrcmp(args, (*p)->defs)) {
-	    (*p)->lastt = time(0);
+	if ((*p)->hash == h && na == (*p)->ndefs && arrcmp(args, (*p)->defs)) {
+	    (*p)->lastt = ++defs_clock;
 
 	    return *p;
-	} else if (!min || !*p || (*p)->lastt < (*min)->lastt)
+	} else if (!min || (*p)->lastt < (*min)->lastt)
 	    min = p;
     if (i > 0)
 	min = p;
@@ -2776,7 +2802,8 @@ struct cvdef {
     Cvval vals;			/* value definitions */
     char **defs;		/* original strings */
     int ndefs;			/* number of ... */
-    int lastt;			/* last time used */
+    unsigned hash;		/* defs_hash() of defs */
+    unsigned lastt;		/* when this was last used */
     int words;                  /* if to look at other words */
 };
 
@@ -2798,7 +2825,7 @@ struct cvval {
 
 /* Cache. */
 
-#define MAX_CVCACHE 8
+#define MAX_CVCACHE 32
 static Cvdef cvdef_cache[MAX_CVCACHE];
 
 /* Memory stuff. */
@@ -2869,7 +2896,8 @@ parse_cvdef(char *nam, char **args)
     ret->vals = NULL;
     ret->defs = zarrdup(oargs);
     ret->ndefs = arrlen(oargs);
-    ret->lastt = time(0);
+    ret->hash = defs_hash(oargs);
+    ret->lastt = ++defs_clock;
     ret->words = words;
 
     for (valp = &(ret->vals); *args; args++) {
@@ -2997,13 +3025,14 @@ get_cvdef(char *nam, char **args)
 {
     Cvdef *p, *min, new;
     int i, na = arrlen(args);
+    unsigned h = defs_hash(args);
 
-    for (i = MAX_CVCACHE, p = cvdef_cache, min = NULL; *p && i--; p++)
-	if (*p && na == (*p)->ndefs && arrcmp(args, (*p)->defs)) {
-	    (*p)->lastt = time(0);
+    for (i = MAX_CVCACHE, p = cvdef_cache, min = NULL; i && *p; p++, i--)
+	if ((*p)->hash == h && na == (*p)->ndefs && arrcmp(args, (*p)->defs)) {
+	    (*p)->lastt = ++defs_clock;
 
 	    return *p;
-	} else if (!min || !*p || (*p)->lastt < (*min)->lastt)
+	} else if (!min || (*p)->lastt < (*min)->lastt)
 	    min = p;
     if (i > 0)
 	min = p;
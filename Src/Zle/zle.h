@@ -426,6 +426,16 @@ struct region_highlight {
  */
 #define N_SPECIAL_HIGHLIGHTS	(3)
 
+/*
+ * Default terminal sequences to turn bracketed paste on and off,
+ * the initial value of $zle_bracketed_paste, and the sequences the
+ * terminal sends around pasted text when it's on.
+ */
+#define BRACKETED_PASTE_ON	"\033[?2004h"
+#define BRACKETED_PASTE_OFF	"\033[?2004l"
+#define BRACKETED_PASTE_START	"\033[200~"
+#define BRACKETED_PASTE_END	"\033[201~"
+
 
 #ifdef MULTIBYTE_SUPPORT
 /*
@@ -684,7 +684,9 @@ insertlastword(char **args)
 	nwords = countlinknodes(l);
     } else {
 	/* Some stored line. */
-	if (!(he = quietgethist(evhist)) || !he->nwords) {
+	if ((he = quietgethist(evhist)))
+	    histentwords(he);
+	if (!he || !he->nwords) {
 	    unmetafy_line();
 	    return 1;
 	}
@@ -1073,6 +1075,8 @@ doisearch(char **args, int dir, int pattern)
     char *last_line = NULL;
     /* Text of the history line being examined */
     char *zt;
+    /* Character pairs in the search string: see histsig() */
+    zulong ssig;
     /*
      * sbptr: index into sbuf.
      * top_spot: stack index into the "isrch_spot" stack.
@@ -1259,6 +1263,12 @@ doisearch(char **args, int dir, int pattern)
 		    statusline = ibuf;
 		}
 	    }
+	    /*
+	     * For a plain string search, lines which can't contain
+	     * the string are rejected with a quick check of the
+	     * character pairs before searching along them.
+	     */
+	    ssig = pattern ? 0 : histsig(sbuf + (sbuf[0] == '^'), 1);
 	    /*
 	     * skip search if pattern compilation failed, or
 	     * if we back somewhere we already searched.
@@ -1412,7 +1422,9 @@ doisearch(char **args, int dir, int pattern)
 		hl = he->histnum;
 		zt = GETZLETEXT(he);
 		pos = (dir == 1) ? 0 : strlen(zt);
-		if (dup_ok)
+		if (ssig && !he->zle_text && (ssig & ~histentsig(he)))
+		    skip_line = 1;
+		else if (dup_ok)
 		    skip_line = 0;
 		else
 		    skip_line = isset(HISTFINDNODUPS)
@@ -50,6 +50,7 @@
 
 typedef struct keymapname *KeymapName;
 typedef struct key *Key;
+typedef struct keytrie *KeyTrie;
 
 struct keymapname {
     HashNode next;	/* next in the hash chain */
@@ -78,6 +79,7 @@ struct keymap {
     KeymapName primary;
     int flags;		/* various flags (see below) */
     int rc;		/* reference count */
+    KeyTrie trie;	/* multi arranged by byte, built when needed */
 };
 
 #define KM_IMMUTABLE (1<<1)
@@ -90,6 +92,23 @@ struct key {
     int prefixct;	/* number of sequences for which this is a prefix */
 };
 
+/*
+ * For reading keys, the entries in a keymap's multi table are also
+ * arranged as a tree on the bytes of their (metafied) sequences, so
+ * that following a sequence as it's typed is a step down the tree per
+ * byte rather than a hash lookup of the whole sequence so far.  The
+ * tree points at the entries in the hash table, so it's thrown away
+ * whenever a binding in the keymap changes and built again when next
+ * needed.
+ */
+
+struct keytrie {
+    Key key;		/* entry for the sequence ending here, if any */
+    int nchild;		/* number of bytes that can follow */
+    unsigned char *bytes;	/* those bytes, in order */
+    KeyTrie *child;	/* and the corresponding subtrees */
+};
+
 /* This structure is used when listing keymaps. */
 
 struct bindstate {
@@ -137,6 +156,10 @@ char *keybuf;
 
 static int keybuflen, keybufsz = 20;
 
+/* incremented whenever a tree of keymap bindings is freed */
+
+static int keytriegen;
+
 /* last command executed with execute-named-command */
 
 static Thingy lastnamed;
@@ -342,6 +365,7 @@ deletekeymap(Keymap km)
 {
     int i;
 
+    freekeytrie(km);
     deletehashtable(km->multi);
     for(i = 256; i--; )
 	unrefthingy(km->first[i]);
@@ -539,6 +563,7 @@ bindkey(Keymap km, char *seq, Thingy bind, char *str)
 	return 1;
     if(!*seq)
 	return 2;
+    freekeytrie(km);
     if(!bind || ztrlen(seq) > 1) {
 	/* key needs to become a prefix if isn't one already */
 	if(km->first[f]) {
@@ -616,6 +641,138 @@ bindkey(Keymap km, char *seq, Thingy bind, char *str)
     return 0;
 }
 
+/* Free a subtree of the bindings of a keymap. */
+
+/**/
+static void
+freekeytrienode(KeyTrie kt)
+{
+    int i;
+
+    for (i = 0; i < kt->nchild; i++)
+	freekeytrienode(kt->child[i]);
+    if (kt->nchild) {
+	zfree(kt->bytes, kt->nchild);
+	zfree(kt->child, kt->nchild * sizeof(KeyTrie));
+    }
+    zfree(kt, sizeof(*kt));
+}
+
+/* Throw away the tree of a keymap's bindings when they change. */
+
+/**/
+static void
+freekeytrie(Keymap km)
+{
+    if (km->trie) {
+	freekeytrienode(km->trie);
+	km->trie = NULL;
+	keytriegen++;
+    }
+}
+
+/*
+ * Find the subtree for byte c following kt, or if add is set make
+ * it if it's not there.
+ */
+
+/**/
+static KeyTrie
+keytriechild(KeyTrie kt, int c, int add)
+{
+    int lo = 0, hi = kt->nchild, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (kt->bytes[mid] == c)
+	    return kt->child[mid];
+	if (kt->bytes[mid] < c)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (!add)
+	return NULL;
+    kt->bytes = zrealloc(kt->bytes, kt->nchild + 1);
+    kt->child = zrealloc(kt->child, (kt->nchild + 1) * sizeof(KeyTrie));
+    memmove(kt->bytes + lo + 1, kt->bytes + lo, kt->nchild - lo);
+    memmove(kt->child + lo + 1, kt->child + lo,
+	    (kt->nchild - lo) * sizeof(KeyTrie));
+    kt->nchild++;
+    kt->bytes[lo] = c;
+    return kt->child[lo] = (KeyTrie) zshcalloc(sizeof(struct keytrie));
+}
+
+static KeyTrie buildtrie;
+
+/**/
+static void
+scanbuildtrie(HashNode hn, UNUSED(int flags))
+{
+    Key k = (Key) hn;
+    KeyTrie kt = buildtrie;
+    char *p;
+
+    for (p = k->nam; *p; p++)
+	kt = keytriechild(kt, STOUC(*p), 1);
+    kt->key = k;
+}
+
+/* Return the tree of a keymap's bindings, building it if need be. */
+
+/**/
+static KeyTrie
+keymaptrie(Keymap km)
+{
+    if (!km->trie) {
+	buildtrie = km->trie = (KeyTrie) zshcalloc(sizeof(struct keytrie));
+	scanhashtable(km->multi, 0, 0, 0, scanbuildtrie, 0);
+    }
+    return km->trie;
+}
+
+/*
+ * Follow len bytes of a metafied key sequence down from kt, returning
+ * NULL if no binding starts that way.
+ */
+
+/**/
+static KeyTrie
+keytriestep(KeyTrie kt, char *seq, int len)
+{
+    while (kt && len--)
+	kt = keytriechild(kt, STOUC(*seq++), 0);
+    return kt;
+}
+
+/*
+ * Look up the binding of the sequence in keybuf, which the caller has
+ * followed down the tree of km's bindings as far as kt, in the same
+ * way as keybind().  Also set *ispfxp if the sequence is a prefix of
+ * a longer bound sequence.
+ */
+
+/**/
+static Thingy
+keytriebind(Keymap km, KeyTrie kt, char **strp, int *ispfxp)
+{
+    if (keybuflen == 1 || (keybuflen == 2 && keybuf[0] == Meta)) {
+	int f = keybuflen == 1 ? STOUC(keybuf[0]) : STOUC(keybuf[1])^32;
+
+	if (km->first[f]) {
+	    *ispfxp = 0;
+	    return km->first[f];
+	}
+    }
+    if (!kt || !kt->key) {
+	*ispfxp = 0;
+	return t_undefinedkey;
+    }
+    *ispfxp = !!kt->key->prefixct;
+    *strp = kt->key->str;
+    return kt->key->bind;
+}
+
 /* Look up a key binding.  The binding is returned.  In the case of a  *
  * send-string, NULL is returned and *strp is modified to point to the *
  * metafied string of characters to be pushed back.                    */
@@ -640,28 +797,6 @@ keybind(Keymap km, char *seq, char **strp)
     return k->bind;
 }
 
-/* Check whether a key sequence is a prefix of a longer bound sequence. *
- * One oddity: if *nothing* in the keymap is bound, this returns true   *
- * for the empty sequence, even though this is not strictly accurate.   */
-
-/**/
-static int
-keyisprefix(Keymap km, char *seq)
-{
-    Key k;
-
-    if(!*seq)
-	return 1;
-    if(ztrlen(seq) == 1) {
-	int f = seq[0] == Meta ? STOUC(seq[1])^32 : STOUC(seq[0]);
-
-	if(km->first[f])
-	    return 0;
-    }
-    k = (Key) km->multi->getnode(km->multi, seq);
-    return k && k->prefixct;
-}
-
 /*******************/
 /* bindkey builtin */
 /*******************/
@@ -1338,6 +1473,11 @@ default_bindings(void)
     add_cursor_key(emap, TCDOWNCURSOR, t_downlineorhistory, 'B');
     add_cursor_key(emap, TCLEFTCURSOR, t_backwardchar, 'D');
     add_cursor_key(emap, TCRIGHTCURSOR, t_forwardchar, 'C');
+
+    /* all modes: the start of pasted text */
+    bindkey(emap, BRACKETED_PASTE_START, refthingy(t_bracketedpaste), NULL);
+    bindkey(vmap, BRACKETED_PASTE_START, refthingy(t_bracketedpaste), NULL);
+    bindkey(amap, BRACKETED_PASTE_START, refthingy(t_bracketedpaste), NULL);
    
     /* emacs mode: ^X sequences */
     bindkey(emap, "\30*",   refthingy(t_expandword), NULL);
@@ -1408,6 +1548,9 @@ getkeymapcmd(Keymap km, Thingy *funcp, char **strp)
     Thingy func = t_undefinedkey;
     char *str = NULL;
     int lastlen = 0, lastc = lastchar;
+    int gen = -1, seen = 0;
+    KeyTrie kt = NULL, lkt = NULL;
+    Keymap lkm = NULL;
 
     keybuflen = 0;
     keybuf[0] = 0;
@@ -1429,15 +1572,34 @@ getkeymapcmd(Keymap km, Thingy *funcp, char **strp)
 	char *s;
 	Thingy f;
 	int loc = !!localkeymap;
-	int ispfx = 0;
+	int ispfx = 0, kmpfx;
+
+	/*
+	 * Reading the key may have run code that changed bindings,
+	 * in which case start again from the top of the trees.
+	 */
+	if (gen != keytriegen || lkm != localkeymap) {
+	    kt = keymaptrie(km);
+	    lkm = localkeymap;
+	    lkt = lkm ? keymaptrie(lkm) : NULL;
+	    gen = keytriegen;
+	    seen = 0;
+	}
+	kt = keytriestep(kt, keybuf + seen, keybuflen - seen);
+	lkt = keytriestep(lkt, keybuf + seen, keybuflen - seen);
+	seen = keybuflen;
 
 	if (loc) {
-	    loc = ((f = keybind(localkeymap, keybuf, &s)) != t_undefinedkey);
-	    ispfx = keyisprefix(localkeymap, keybuf);
+	    loc = ((f = keytriebind(localkeymap, lkt, &s, &ispfx)) !=
+		   t_undefinedkey);
 	}
 	if (!loc)
-	    f = keybind(km, keybuf, &s);
-	ispfx |= keyisprefix(km, keybuf);
+	    f = keytriebind(km, kt, &s, &kmpfx);
+	else {
+	    char *ls;
+	    (void)keytriebind(km, kt, &ls, &kmpfx);
+	}
+	ispfx |= kmpfx;
 
 	if (f != t_undefinedkey) {
 	    lastlen = keybuflen;
@@ -36,6 +36,10 @@
 #if defined(HAVE_POLL) && !defined(POLLIN) && !defined(POLLNORM)
 # undef HAVE_POLL
 #endif
+#if defined(HAVE_POLL) && defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+# include <sys/epoll.h>
+# define USE_EPOLL
+#endif
 
 /* The input line assembled so far */
 
@@ -203,6 +207,200 @@ int nwatch;		/* Number of fd's we are watching */
 /**/
 Watch_fd watch_fds;
 
+/*
+ * Incremented whenever zle -F adds or removes a watched fd, so the
+ * set of descriptors we wait on below only needs making again when
+ * it has actually changed.
+ */
+/**/
+int watch_fds_gen;
+
+#ifdef HAVE_POLL
+/*
+ * What raw_getbyte() waits on, kept between calls:  the first pollfd
+ * is SHTTY, following are the nwatch fds in the same order as
+ * watch_fds.  wait_ready lists, in ascending order, the indexes that
+ * had events on the last wait.
+ *
+ * Where epoll is available the same fds are also registered with
+ * wait_epfd, so that waiting costs nothing for watched fds that are
+ * idle; the data for each is its index in wait_fds.  We fall back to
+ * poll() if any fd can't be registered (a plain file, for example).
+ */
+static struct pollfd *wait_fds;
+static int *wait_ready;
+static int nwait_fds, nwait_ready;
+static int wait_fds_gen = -1, wait_fds_tty = -1, wait_fds_dirty;
+# ifdef USE_EPOLL
+static struct epoll_event *wait_events;
+static int wait_epfd = -1;
+# endif
+
+/**/
+static void
+free_wait_fds(void)
+{
+# ifdef USE_EPOLL
+    if (wait_epfd >= 0) {
+	zclose(wait_epfd);
+	wait_epfd = -1;
+    }
+    if (wait_events)
+	zfree(wait_events, nwait_fds * sizeof(struct epoll_event));
+    wait_events = NULL;
+# endif
+    if (wait_fds) {
+	zfree(wait_fds, nwait_fds * sizeof(struct pollfd));
+	zfree(wait_ready, nwait_fds * sizeof(int));
+    }
+    wait_fds = NULL;
+    wait_ready = NULL;
+    nwait_fds = nwait_ready = wait_fds_dirty = 0;
+    wait_fds_gen = wait_fds_tty = -1;
+}
+
+/*
+ * Make sure the wait set matches SHTTY and watch_fds.  If fresh is
+ * set, also put back any fd's we stopped waiting on last time.
+ */
+
+/**/
+static void
+setup_wait_fds(int fresh)
+{
+    int i;
+
+    if (wait_fds && wait_fds_gen == watch_fds_gen &&
+	wait_fds_tty == SHTTY && !(fresh && wait_fds_dirty))
+	return;
+    free_wait_fds();
+
+    nwait_fds = 1 + nwatch;
+    wait_fds = zalloc(nwait_fds * sizeof(struct pollfd));
+    wait_ready = zalloc(nwait_fds * sizeof(int));
+    /*
+     * POLLIN, POLLIN, POLLIN,
+     * Keep those fd's POLLIN...
+     */
+    wait_fds[0].fd = SHTTY;
+    wait_fds[0].events = POLLIN;
+    wait_fds[0].revents = 0;
+    for (i = 0; i < nwatch; i++) {
+	wait_fds[i+1].fd = watch_fds[i].fd;
+	wait_fds[i+1].events = POLLIN;
+	wait_fds[i+1].revents = 0;
+    }
+    wait_fds_gen = watch_fds_gen;
+    wait_fds_tty = SHTTY;
+
+# ifdef USE_EPOLL
+    /* With nothing else to watch a poll() of the terminal is as good. */
+    if (nwatch && (wait_epfd = movefd(epoll_create(nwait_fds))) >= 0) {
+	for (i = 0; i < nwait_fds; i++) {
+	    struct epoll_event ev;
+
+	    memset(&ev, 0, sizeof(ev));
+	    ev.events = EPOLLIN;
+	    ev.data.u32 = i;
+	    if (epoll_ctl(wait_epfd, EPOLL_CTL_ADD, wait_fds[i].fd, &ev) < 0)
+		break;
+	}
+	if (i < nwait_fds) {
+	    zclose(wait_epfd);
+	    wait_epfd = -1;
+	} else
+	    wait_events = zalloc(nwait_fds * sizeof(struct epoll_event));
+    }
+# endif
+}
+
+/**/
+static int
+wait_ready_cmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Wait for input on the terminal or, unless ttyonly is set, any of the
+ * watched fd's; timeout is in milliseconds, or -1 for none.  The
+ * return value is as for poll(), with revents and wait_ready set for
+ * the fd's that are ready.
+ */
+
+/**/
+static int
+wait_for_fds(int ttyonly, int timeout)
+{
+    int i, ret;
+
+    for (i = 0; i < nwait_ready; i++)
+	wait_fds[wait_ready[i]].revents = 0;
+    nwait_ready = 0;
+
+# ifdef USE_EPOLL
+    if (wait_epfd >= 0 && !ttyonly) {
+	winch_unblock();
+	ret = epoll_wait(wait_epfd, wait_events, nwait_fds, timeout);
+	winch_block();
+	for (i = 0; i < ret; i++) {
+	    int ind = (int)wait_events[i].data.u32, revents = 0;
+
+	    if (ind >= nwait_fds)
+		continue;
+	    if (wait_events[i].events & EPOLLIN)
+		revents |= POLLIN;
+#  ifdef POLLERR
+	    if (wait_events[i].events & EPOLLERR)
+		revents |= POLLERR;
+#  endif
+#  ifdef POLLHUP
+	    if (wait_events[i].events & EPOLLHUP)
+		revents |= POLLHUP;
+#  endif
+	    if (revents && !wait_fds[ind].revents)
+		wait_ready[nwait_ready++] = ind;
+	    wait_fds[ind].revents |= revents;
+	}
+	if (nwait_ready > 1)
+	    qsort(wait_ready, nwait_ready, sizeof(int), wait_ready_cmp);
+	return ret;
+    }
+# endif
+
+    winch_unblock();
+    ret = poll(wait_fds, ttyonly ? 1 : nwait_fds, timeout);
+    winch_block();
+    if (ret > 0) {
+	for (i = 0; i < (ttyonly ? 1 : nwait_fds); i++)
+	    if (wait_fds[i].revents)
+		wait_ready[nwait_ready++] = i;
+    }
+    return ret;
+}
+
+/*
+ * Stop waiting on a watched fd which reported an error:  we'd only
+ * be told about it again straight away.  It goes back in the set on
+ * the next call to raw_getbyte().
+ */
+
+/**/
+static void
+unwait_fd(int ind)
+{
+# ifdef USE_EPOLL
+    if (wait_epfd >= 0) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	(void)epoll_ctl(wait_epfd, EPOLL_CTL_DEL, wait_fds[ind].fd, &ev);
+    }
+# endif
+    wait_fds[ind].events = 0;
+    wait_fds_dirty = 1;
+}
+#endif
+
 /* set up terminal */
 
 /**/
@@ -481,13 +679,21 @@ calc_timeout(struct ztmout *tmoutp, long do_keytmout)
 	    LinkNode tfnode = firstnode(timedfns);
 	    Timedfn tfdat;
 	    time_t diff, exp100ths;
+	    long nsdiff;
+	    struct timespec now;
 
 	    if (!tfnode)
 		break;
 
 	    tfdat = (Timedfn)getdata(tfnode);
-	    diff = tfdat->when - time(NULL);
-	    if (diff < 0) {
+	    zgettime_monotonic(&now);
+	    diff = tfdat->when.tv_sec - now.tv_sec;
+	    nsdiff = tfdat->when.tv_nsec - now.tv_nsec;
+	    if (nsdiff < 0) {
+		diff--;
+		nsdiff += 1000000000L;
+	    }
+	    if (diff < 0 || (diff == 0 && nsdiff == 0)) {
 		/* Already due; call it and rescan. */
 		tfdat->func();
 		continue;
@@ -496,8 +702,9 @@ calc_timeout(struct ztmout *tmoutp, long do_keytmout)
 	    if (diff > ZMAXTIMEOUT) {
 		tmoutp->exp100ths = ZMAXTIMEOUT * 100;
 		tmoutp->tp = ZTM_MAX;
-	    } else if (diff > 0) {
-		exp100ths = diff * 100;
+	    } else {
+		/* round up, so the function is due when we wake */
+		exp100ths = diff * 100 + (nsdiff + 9999999L) / 10000000L;
 		if (tmoutp->tp != ZTM_KEY ||
 		    exp100ths < tmoutp->exp100ths) {
 		    tmoutp->exp100ths = exp100ths;
@@ -549,8 +756,9 @@ raw_getbyte(long do_keytmout, char *cptr)
 #if defined(HAVE_SELECT) || defined(HAVE_POLL)
 	int i, errtry = 0, selret;
 # ifdef HAVE_POLL
-	int nfds;
-	struct pollfd *fds;
+	int r;
+
+	setup_wait_fds(1);
 # endif
 # if defined(HAS_TIO) && defined(sun)
 	/*
@@ -576,21 +784,6 @@ raw_getbyte(long do_keytmout, char *cptr)
 	settyinfo(&ti);
 	if (ret > 0)
 	    return 1;
-# endif
-# ifdef HAVE_POLL
-	nfds = 1 + nwatch;
-	/* First pollfd is SHTTY, following are the nwatch fds */
-	fds = zalloc(sizeof(struct pollfd) * nfds);
-	fds[0].fd = SHTTY;
-	/*
-	 * POLLIN, POLLIN, POLLIN,
-	 * Keep those fd's POLLIN...
-	 */
-	fds[0].events = POLLIN;
-	for (i = 0; i < nwatch; i++) {
-	    fds[i+1].fd = watch_fds[i].fd;
-	    fds[i+1].events = POLLIN;
-	}
 # endif
 	for (;;) {
 # ifdef HAVE_POLL
@@ -601,9 +794,9 @@ raw_getbyte(long do_keytmout, char *cptr)
 	    else
 		poll_timeout = -1;
 
-	    winch_unblock();
-	    selret = poll(fds, errtry ? 1 : nfds, poll_timeout);
-	    winch_block();
+	    /* Handlers may have added or removed watched fd's */
+	    setup_wait_fds(0);
+	    selret = wait_for_fds(errtry, poll_timeout);
 # else
 	    int fdmax = SHTTY;
 	    struct timeval *tvptr;
@@ -676,8 +869,9 @@ raw_getbyte(long do_keytmout, char *cptr)
 			 * call zle recursively), so recalculate
 			 * the time on each iteration.
 			 */
-			time_t now = time(NULL);
-			if (tfdat->when > now)
+			struct timespec now;
+			zgettime_monotonic(&now);
+			if (ztimespeccmp(&tfdat->when, &now) > 0)
 			    break;
 			tfdat->func();
 		    }
@@ -715,7 +909,7 @@ raw_getbyte(long do_keytmout, char *cptr)
 	     */
 	    if (
 # ifdef HAVE_POLL
-		 (fds[0].revents & POLLIN)
+		 (wait_fds[0].revents & POLLIN)
 # else
 		 FD_ISSET(SHTTY, &foofd)
 # endif
@@ -732,16 +926,25 @@ raw_getbyte(long do_keytmout, char *cptr)
 		memcpy(lwatch_fds, watch_fds, lnwatch*sizeof(struct watch_fd));
 		for (i = 0; i < lnwatch; i++)
 		    lwatch_fds[i].func = ztrdup(lwatch_fds[i].func);
-		for (i = 0; i < lnwatch; i++) {
-		    Watch_fd lwatch_fd = lwatch_fds + i;
-		    if (
 # ifdef HAVE_POLL
-			(fds[i+1].revents & (POLLIN|POLLERR|POLLHUP|POLLNVAL))
+		/*
+		 * Only the fd's that were ready need looking at; the
+		 * wait set matches the copy of the list we just made.
+		 */
+		for (r = 0; r < nwait_ready; r++) {
+		    Watch_fd lwatch_fd;
+		    int revents;
+		    if (!(i = wait_ready[r]) || i > lnwatch)
+			continue;
+		    lwatch_fd = lwatch_fds + --i;
+		    revents = wait_fds[i+1].revents;
+		    if (revents & (POLLIN|POLLERR|POLLHUP|POLLNVAL)) {
 # else
-			FD_ISSET(lwatch_fd->fd, &foofd) ||
-			FD_ISSET(lwatch_fd->fd, &errfd)
+		for (i = 0; i < lnwatch; i++) {
+		    Watch_fd lwatch_fd = lwatch_fds + i;
+		    if (FD_ISSET(lwatch_fd->fd, &foofd) ||
+			FD_ISSET(lwatch_fd->fd, &errfd)) {
 # endif
-			) {
 			/* Handle the fd. */
 			char *fdbuf;
 			{
@@ -759,15 +962,15 @@ raw_getbyte(long do_keytmout, char *cptr)
 			    zaddlinknode(funcargs, fdbuf);
 # ifdef HAVE_POLL
 #  ifdef POLLERR
-			    if (fds[i+1].revents & POLLERR)
+			    if (revents & POLLERR)
 				zaddlinknode(funcargs, ztrdup("err"));
 #  endif
 #  ifdef POLLHUP
-			    if (fds[i+1].revents & POLLHUP)
+			    if (revents & POLLHUP)
 				zaddlinknode(funcargs, ztrdup("hup"));
 #  endif
 #  ifdef POLLNVAL
-			    if (fds[i+1].revents & POLLNVAL)
+			    if (revents & POLLNVAL)
 				zaddlinknode(funcargs, ztrdup("nval"));
 #  endif
 # else
@@ -796,34 +999,21 @@ raw_getbyte(long do_keytmout, char *cptr)
 		zfree(lwatch_fds, lnwatch*sizeof(struct watch_fd));
 
 # ifdef HAVE_POLL
-		/* Function may have added or removed handlers */
-		nfds = 1 + nwatch;
-		if (nfds > 1) {
-		    fds = zrealloc(fds, sizeof(struct pollfd) * nfds);
-		    for (i = 0; i < nwatch; i++) {
-			/*
-			 * This is imperfect because it assumes fds[] and
-			 * watch_fds[] remain in sync, which may be false
-			 * if handlers are shuffled.  However, it should
-			 * be harmless (e.g., produce one extra pass of
-			 * the loop) in the event they fall out of sync.
-			 */
-			if (fds[i+1].fd == watch_fds[i].fd &&
-			    (fds[i+1].revents & (POLLERR|POLLHUP|POLLNVAL))) {
-			    fds[i+1].events = 0;	/* Don't poll this */
-			} else {
-			    fds[i+1].fd = watch_fds[i].fd;
-			    fds[i+1].events = POLLIN;
-			}
-			fds[i+1].revents = 0;
+		/*
+		 * Don't wait again on fd's with errors; the wait set is
+		 * made afresh if a handler changed the list.
+		 */
+		if (wait_fds_gen == watch_fds_gen) {
+		    for (r = 0; r < nwait_ready; r++) {
+			i = wait_ready[r];
+			if (i && (wait_fds[i].revents &
+				  (POLLERR|POLLHUP|POLLNVAL)))
+			    unwait_fd(i);
 		    }
 		}
 # endif
 	    }
 	}
-# ifdef HAVE_POLL
-	zfree(fds, sizeof(struct pollfd) * nfds);
-# endif
 	if (selret < 0)
 	    return selret;
 #else
@@ -965,6 +1155,73 @@ getbyte(long do_keytmout, int *timeout)
 }
 
 
+/*
+ * Read as many bytes as are immediately available, up to len, into buf,
+ * without waiting.  Bytes pushed back with ungetbyte() come first.
+ * Otherwise this returns the same bytes that the corresponding calls
+ * to getbyte() would, but reading all the bytes the terminal has ready
+ * at once, so it's suitable for taking large amounts of input such as
+ * pasted text.  Returns the number of bytes read, which is zero if
+ * none are ready.  Unlike getbyte(), this doesn't record the bytes for
+ * repeating a vi change, since the caller may not use them all; it
+ * passes the ones it does use to addvichgbytes().
+ */
+
+/**/
+mod_export int
+getavailbytes(char *buf, int len)
+{
+    int n = 0, r;
+    char *ptr;
+
+#ifdef MULTIBYTE_SUPPORT
+    lastchar_wide_valid = 0;
+#endif
+
+    while (n < len && kungetct)
+	buf[n++] = kungetbuf[--kungetct];
+#ifdef FIONREAD
+    if (!n) {
+	int val = 0;
+
+	if (ioctl(SHTTY, FIONREAD, (char *)&val) == 0 && val > 0) {
+	    if (val > len)
+		val = len;
+	    do {
+		r = read(SHTTY, buf, val);
+	    } while (r < 0 && errno == EINTR && !errflag);
+	    if (r > 0) {
+		n = r;
+		/* the exchange of \n and \r as in getbyte() */
+		for (ptr = buf; ptr < buf + n; ptr++) {
+		    if (*ptr == '\r')
+			*ptr = '\n';
+		    else if (*ptr == '\n')
+			*ptr = '\r';
+		}
+	    }
+	}
+    }
+#endif
+    if (n)
+	lastchar = STOUC(buf[n-1]);
+    return n;
+}
+
+/* Record n bytes from getavailbytes() that have been used. */
+
+/**/
+mod_export void
+addvichgbytes(char *buf, int n)
+{
+    if (n > 0 && vichgflag) {
+	while (vichgbufptr + n > vichgbufsz)
+	    vichgbuf = realloc(vichgbuf, vichgbufsz *= 2);
+	memcpy(vichgbuf + vichgbufptr, buf, n);
+	vichgbufptr += n;
+    }
+}
+
 /*
  * Get a full character rather than just a single byte.
  */
@@ -1159,8 +1416,8 @@ zlecore(void)
 char *
 zleread(char **lp, char **rp, int flags, int context, char *init, char *finish)
 {
-    char *s;
-    int old_errno = errno;
+    char *s, **bracket;
+    int old_errno = errno, bpaste = 0;
     int tmout = getiparam("TMOUT");
 
 #if defined(HAVE_POLL) || defined(HAVE_SELECT)
@@ -1257,6 +1514,13 @@ zleread(char **lp, char **rp, int flags, int context, char *init, char *finish)
     selectlocalmap(NULL);
     if (isset(PROMPTCR))
 	putc('\r', shout);
+    if (!(zlereadflags & ZLRF_NOSETTY) &&
+	!(termflags & (TERM_BAD|TERM_UNKNOWN)) &&
+	(bracket = getaparam("zle_bracketed_paste")) &&
+	arrlen(bracket) == 2) {
+	fputs(bracket[0], shout);
+	bpaste = 1;
+    }
     if (tmout)
 	alarm(tmout);
 
@@ -1296,7 +1560,16 @@ zleread(char **lp, char **rp, int flags, int context, char *init, char *finish)
 
     statusline = NULL;
     invalidatelist();
+    free_buffer_caches();
     trashzle();
+    if (bpaste) {
+	if ((bracket = getaparam("zle_bracketed_paste")) &&
+	    arrlen(bracket) == 2)
+	    fputs(bracket[1], shout);
+	else
+	    fputs(BRACKETED_PASTE_OFF, shout);
+	fflush(shout);
+    }
     free(lpromptbuf);
     free(rpromptbuf);
     zleactive = zlereadflags = lastlistlen = zlecontext = 0;
@@ -2088,6 +2361,14 @@ boot_(Module m)
     addhookfunc("after_trap", (Hookfn) zleaftertrap);
     (void)addhookdefs(m, zlehooks, sizeof(zlehooks)/sizeof(*zlehooks));
     zle_refresh_boot();
+    if (!getaparam("zle_bracketed_paste")) {
+	char **bracket = (char **)zalloc(3 * sizeof(char *));
+
+	bracket[0] = ztrdup(BRACKETED_PASTE_ON);
+	bracket[1] = ztrdup(BRACKETED_PASTE_OFF);
+	bracket[2] = NULL;
+	setaparam("zle_bracketed_paste", bracket);
+    }
     return 0;
 }
 
@@ -2120,6 +2401,9 @@ finish_(UNUSED(Module m))
     zfree(vichgbuf, vichgbufsz);
     zfree(kungetbuf, kungetsz);
     free_isrch_spots();
+#ifdef HAVE_POLL
+    free_wait_fds();
+#endif
     if (rdstrs)
         freelinklist(rdstrs, freestr);
     free(cutbuf.buf);
@@ -506,6 +506,103 @@ yank(UNUSED(char **args))
     return 0;
 }
 
+/*
+ * Read text pasted into the terminal, after the sequence that starts
+ * it, up to the sequence the terminal sends at the end.  The text is
+ * taken in chunks of whatever input is ready rather than a key at a
+ * time.  Returns the text metafied on the heap; newlines, which the
+ * terminal may send as carriage returns, are all newlines.
+ */
+
+/**/
+static char *
+bracketedstring(void)
+{
+    static const char endesc[] = BRACKETED_PASTE_END;
+    char chunk[BUFSIZ], *cptr = chunk;
+    int endpos = 0, navail = 0, next, timeout, avail = 0;
+    size_t psize = 256, current = 0;
+    char *pbuf = zhalloc(psize);
+
+    while (endesc[endpos]) {
+	if (!navail) {
+	    if (avail)
+		addvichgbytes(chunk, cptr - chunk);
+	    cptr = chunk;
+	    if ((navail = getavailbytes(chunk, sizeof(chunk))))
+		avail = 1;
+	    else {
+		/* nothing ready:  wait as for the rest of a key sequence */
+		avail = 0;
+		if ((next = getbyte(1L, &timeout)) == EOF)
+		    break;
+		*chunk = next;
+		navail = 1;
+	    }
+	}
+	next = STOUC(*cptr++);
+	navail--;
+	if (current + 2 >= psize) {
+	    pbuf = hrealloc(pbuf, psize, 2 * psize);
+	    psize *= 2;
+	}
+	if (!endpos || next != STOUC(endesc[endpos++]))
+	    endpos = (next == STOUC(*endesc));
+	if (imeta(next)) {
+	    pbuf[current++] = Meta;
+	    pbuf[current++] = next ^ 32;
+	} else if (next == '\r')
+	    pbuf[current++] = '\n';
+	else
+	    pbuf[current++] = next;
+    }
+    /*
+     * Anything after the end of the paste is typed input, which is
+     * recorded when it's read again.
+     */
+    if (avail)
+	addvichgbytes(chunk, cptr - chunk);
+    if (navail)
+	ungetbytes(cptr, navail);
+    pbuf[current - endpos] = '\0';
+    return pbuf;
+}
+
+/*
+ * Insert pasted text into the line as a single change, without
+ * treating any of it as editing commands.  With a numeric argument
+ * the text is quoted; with an argument, the text is assigned to the
+ * parameter of that name instead.
+ */
+
+/**/
+int
+bracketedpaste(char **args)
+{
+    char *pbuf = bracketedstring();
+
+    if (*args) {
+	setsparam(*args, ztrdup(pbuf));
+    } else {
+	ZLE_STRING_T wpaste, ins;
+	int n;
+	size_t len;
+
+	ins = wpaste = stringaszleline(pbuf, 0, &n, NULL, NULL);
+	len = n;
+	if (zmult != 1)
+	    ins = makequote(wpaste, &len);
+	if (region_active)
+	    killregion(zlenoargs);
+	mark = zlecs;
+	spaceinline(len);
+	ZS_memcpy(zleline + zlecs, ins, len);
+	zlecs += len;
+	free(wpaste);
+    }
+    return 0;
+}
+
 /**/
 int
 yankpop(UNUSED(char **args))
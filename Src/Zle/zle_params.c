@@ -159,7 +159,7 @@ makezleparams(int ro)
 	    pm = (Param) paramtab->getnode(paramtab, zp->name);
 	DPUTS(!pm, "param not set in makezleparams");
 
-	pm->level = locallevel + 1;
+	setparamlevel(pm, locallevel + 1);
 	pm->u.data = zp->data;
 	switch(PM_TYPE(zp->type)) {
 	    case PM_SCALAR:
@@ -203,13 +203,71 @@ set_buffer(UNUSED(Param pm), char *x)
     menucmp = 0;
 }
 
+/*
+ * Widgets often read $BUFFER, $LBUFFER and $RBUFFER several times
+ * without the line changing in between, so the last conversion of each
+ * is kept together with a copy of the characters it was made from.
+ * Comparing the characters is much cheaper than converting them again.
+ */
+
+struct bufcache {
+    ZLE_STRING_T line;		/* characters last converted */
+    int len;			/* number of them */
+    int sz;			/* allocated size of line */
+    char *str;			/* the conversion, metafied */
+};
+
+static struct bufcache buffer_cache, lbuffer_cache, rbuffer_cache;
+
+static char *
+cachedlineasstring(struct bufcache *bc, ZLE_STRING_T line, int len)
+{
+    if (!bc->str || bc->len != len ||
+	(len && ZS_memcmp(bc->line, line, len))) {
+	if (bc->str)
+	    free(bc->str);
+	bc->str = zlelineasstring(line, len, 0, NULL, NULL, 0);
+	if (len > bc->sz) {
+	    if (bc->line)
+		zfree(bc->line, bc->sz * ZLE_CHAR_SIZE);
+	    bc->line = (ZLE_STRING_T)zalloc(len * ZLE_CHAR_SIZE);
+	    bc->sz = len;
+	}
+	if (len)
+	    ZS_memcpy(bc->line, line, len);
+	bc->len = len;
+    }
+    return dupstring(bc->str);
+}
+
+static void
+freebufcache(struct bufcache *bc)
+{
+    if (bc->str)
+	free(bc->str);
+    if (bc->line)
+	zfree(bc->line, bc->sz * ZLE_CHAR_SIZE);
+    memset(bc, 0, sizeof(*bc));
+}
+
+/* Discard the copies of the line when the editor finishes. */
+
+/**/
+void
+free_buffer_caches(void)
+{
+    freebufcache(&buffer_cache);
+    freebufcache(&lbuffer_cache);
+    freebufcache(&rbuffer_cache);
+}
+
 /**/
 static char *
 get_buffer(UNUSED(Param pm))
 {
     if (zlemetaline != 0)
 	return dupstring(zlemetaline);
-    return zlelineasstring(zleline, zlell, 0, NULL, NULL, 1);
+    return cachedlineasstring(&buffer_cache, zleline, zlell);
 }
 
 /**/
@@ -306,7 +364,7 @@ get_lbuffer(UNUSED(Param pm))
 {
     if (zlemetaline != NULL)
 	return dupstrpfx(zlemetaline, zlemetacs);
-    return zlelineasstring(zleline, zlecs, 0, NULL, NULL, 1);
+    return cachedlineasstring(&lbuffer_cache, zleline, zlecs);
 }
 
 /**/
@@ -336,7 +394,7 @@ get_rbuffer(UNUSED(Param pm))
     if (zlemetaline != NULL)
 	return dupstrpfx((char *)zlemetaline + zlemetacs,
 			 zlemetall - zlemetacs);
-    return zlelineasstring(zleline + zlecs, zlell - zlecs, 0, NULL, NULL, 1);
+    return cachedlineasstring(&rbuffer_cache, zleline + zlecs, zlell - zlecs);
 }
 
 /**/
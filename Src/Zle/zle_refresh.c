@@ -388,11 +388,68 @@ zle_free_highlight(void)
  * region in element zero.
  */
 
+/*
+ * Text of the user entries of region_highlight as last read or
+ * assigned, together with the values it stands for.  An entry whose
+ * values haven't changed since is returned without being formatted
+ * again, and an assignment of the same text isn't parsed again, so
+ * that adding entries one at a time to a long array only costs the
+ * new entries.  The values are compared with the current ones because
+ * the start and end are moved as the line is edited.
+ */
+
+struct region_highlight_text {
+    char *str;
+    int atr, start, end, flags;
+};
+
+static struct region_highlight_text *region_highlight_texts;
+static int n_region_highlight_texts;
+
+/* Make room for n cached entries, dropping any beyond that. */
+
+static void
+size_region_highlight_texts(int n)
+{
+    int i;
+
+    for (i = n; i < n_region_highlight_texts; i++)
+	zsfree(region_highlight_texts[i].str);
+    if (n == n_region_highlight_texts)
+	return;
+    if (n) {
+	region_highlight_texts = (struct region_highlight_text *)
+	    zrealloc(region_highlight_texts, n * sizeof(*region_highlight_texts));
+	for (i = n_region_highlight_texts; i < n; i++)
+	    region_highlight_texts[i].str = NULL;
+    } else {
+	zfree(region_highlight_texts,
+	      n_region_highlight_texts * sizeof(*region_highlight_texts));
+	region_highlight_texts = NULL;
+    }
+    n_region_highlight_texts = n;
+}
+
+/* Record str as the text of user entry i, whose values are in rhp. */
+
+static void
+set_region_highlight_text(int i, char *str, struct region_highlight *rhp)
+{
+    struct region_highlight_text *rht = region_highlight_texts + i;
+
+    zsfree(rht->str);
+    rht->str = ztrdup(str);
+    rht->atr = rhp->atr;
+    rht->start = rhp->start;
+    rht->end = rhp->end;
+    rht->flags = rhp->flags;
+}
+
 /**/
 char **
 get_region_highlight(UNUSED(Param pm))
 {
-    int arrsize = n_region_highlights;
+    int arrsize = n_region_highlights, i;
     char **retarr, **arrp;
     struct region_highlight *rhp;
 
@@ -400,14 +457,23 @@ get_region_highlight(UNUSED(Param pm))
     if (arrsize)
 	arrsize -= N_SPECIAL_HIGHLIGHTS;
     arrp = retarr = (char **)zhalloc((arrsize+1)*sizeof(char *));
+    if (arrsize > n_region_highlight_texts)
+	size_region_highlight_texts(arrsize);
 
     /* ignore special highlighting */
-    for (rhp = region_highlights + N_SPECIAL_HIGHLIGHTS;
-	 arrsize--;
-	 rhp++, arrp++) {
+    for (i = 0, rhp = region_highlights + N_SPECIAL_HIGHLIGHTS;
+	 i < arrsize;
+	 i++, rhp++, arrp++) {
+	struct region_highlight_text *rht = region_highlight_texts + i;
 	char digbuf1[DIGBUFSIZE], digbuf2[DIGBUFSIZE];
 	int atrlen = 0, alloclen;
 
+	if (rht->str && rht->atr == rhp->atr && rht->start == rhp->start &&
+	    rht->end == rhp->end && rht->flags == rhp->flags) {
+	    *arrp = dupstring(rht->str);
+	    continue;
+	}
+
 	sprintf(digbuf1, "%d", rhp->start);
 	sprintf(digbuf2, "%d", rhp->end);
 
@@ -428,6 +494,7 @@ get_region_highlight(UNUSED(Param pm))
 		(rhp->flags & ZRH_PREDISPLAY) ? "P" : "",
 		digbuf1, digbuf2);
 	(void)output_highlight(rhp->atr, *arrp + strlen(*arrp));
+	set_region_highlight_text(i, *arrp, rhp);
     }
     *arrp = '\0';
     return retarr;
@@ -443,11 +510,13 @@ get_region_highlight(UNUSED(Param pm))
 void
 set_region_highlight(UNUSED(Param pm), char **aval)
 {
-    int len;
+    int len, i;
     char **av = aval;
     struct region_highlight *rhp;
 
     len = aval ? arrlen(aval) : 0;
+    if (len < n_region_highlight_texts)
+	size_region_highlight_texts(len);
     if (n_region_highlights != len + N_SPECIAL_HIGHLIGHTS) {
 	/* no null termination, but include special highlighting at start */
 	n_region_highlights = len + N_SPECIAL_HIGHLIGHTS;
@@ -459,11 +528,25 @@ set_region_highlight(UNUSED(Param pm), char **aval)
     if (!aval)
 	return;
 
-    for (rhp = region_highlights + N_SPECIAL_HIGHLIGHTS;
+    for (i = 0, rhp = region_highlights + N_SPECIAL_HIGHLIGHTS;
 	 *aval;
-	 rhp++, aval++) {
+	 i++, rhp++, aval++) {
 	char *strp, *oldstrp;
 
+	if (i < n_region_highlight_texts) {
+	    struct region_highlight_text *rht = region_highlight_texts + i;
+
+	    if (rht->str && !strcmp(rht->str, *aval)) {
+		rhp->atr = rht->atr;
+		rhp->start = rht->start;
+		rhp->end = rht->end;
+		rhp->flags = rht->flags;
+		continue;
+	    }
+	    zsfree(rht->str);
+	    rht->str = NULL;
+	}
+
 	oldstrp = *aval;
 	if (*oldstrp == 'P') {
 	    rhp->flags = ZRH_PREDISPLAY;
@@ -507,6 +590,103 @@ unset_region_highlight(Param pm, int exp)
 }
 
 
+/*
+ * Finding the region highlights that apply to each position of the
+ * line in turn.  Rather than testing every region at every position,
+ * the regions are sorted by where they start, and a list of those
+ * covering the current position is kept up to date as the position
+ * advances, so the cost per position depends only on the number of
+ * regions that overlap there.
+ */
+
+struct region_sweep {
+    /* Indices into region_highlights of non-empty regions, by start */
+    int *bystart;
+    int nbystart;
+    /* Next element of bystart to be reached */
+    int next;
+    /* Indices of regions covering the current position, in order */
+    int *active;
+    int nactive;
+};
+
+/* Offset of a region's start and end in the displayed line */
+
+#define REGION_OFFSET(rhp) \
+    (((rhp)->flags & ZRH_PREDISPLAY) ? 0 : predisplaylen)
+
+static int
+region_start_cmp(const void *a, const void *b)
+{
+    struct region_highlight *rha = region_highlights + *(const int *)a;
+    struct region_highlight *rhb = region_highlights + *(const int *)b;
+    int sa = rha->start + REGION_OFFSET(rha);
+    int sb = rhb->start + REGION_OFFSET(rhb);
+
+    return (sa == sb) ? *(const int *)a - *(const int *)b : sa - sb;
+}
+
+static void
+region_sweep_start(struct region_sweep *rs)
+{
+    struct region_highlight *rhp;
+    int ireg;
+
+    memset(rs, 0, sizeof(*rs));
+    if (!n_region_highlights)
+	return;
+    rs->bystart = (int *)zalloc(n_region_highlights * sizeof(int));
+    rs->active = (int *)zalloc(n_region_highlights * sizeof(int));
+    for (ireg = 0, rhp = region_highlights;
+	 ireg < n_region_highlights;
+	 ireg++, rhp++)
+	if (rhp->start < rhp->end)
+	    rs->bystart[rs->nbystart++] = ireg;
+    qsort(rs->bystart, rs->nbystart, sizeof(int), region_start_cmp);
+}
+
+/*
+ * Bring the list of active regions up to date for position pos,
+ * which must not be less than on the previous call.
+ */
+
+static void
+region_sweep_to(struct region_sweep *rs, int pos)
+{
+    struct region_highlight *rhp;
+    int i, j, ireg;
+
+    for (i = j = 0; i < rs->nactive; i++) {
+	rhp = region_highlights + rs->active[i];
+	if (pos < rhp->end + REGION_OFFSET(rhp))
+	    rs->active[j++] = rs->active[i];
+    }
+    rs->nactive = j;
+
+    while (rs->next < rs->nbystart) {
+	ireg = rs->bystart[rs->next];
+	rhp = region_highlights + ireg;
+	if (rhp->start + REGION_OFFSET(rhp) > pos)
+	    break;
+	rs->next++;
+	if (pos >= rhp->end + REGION_OFFSET(rhp))
+	    continue;
+	/* Later entries take precedence, so keep the original order */
+	for (i = rs->nactive++; i > 0 && rs->active[i - 1] > ireg; i--)
+	    rs->active[i] = rs->active[i - 1];
+	rs->active[i] = ireg;
+    }
+}
+
+static void
+region_sweep_finish(struct region_sweep *rs)
+{
+    if (rs->bystart) {
+	zfree(rs->bystart, n_region_highlights * sizeof(int));
+	zfree(rs->active, n_region_highlights * sizeof(int));
+    }
+}
+
 /* The last attributes that were on. */
 static int lastatr;
 
@@ -982,6 +1162,7 @@ zrefresh(void)
     int txtchange;		/* attributes set after prompts              */
     int rprompt_off = 1;	/* Offset of rprompt from right of screen    */
     struct rparams rpms;
+    struct region_sweep rsweep;	/* region highlights at current position     */
 #ifdef MULTIBYTE_SUPPORT
     int width;			/* width of wide character		     */
 #endif
@@ -993,6 +1174,7 @@ zrefresh(void)
      * improves speed a little in a common case.                             */
     if (inlist)
 	return;
+    runstats.refreshes++;
 
     /*
      * zrefresh() is called from all over the place, so we can't
@@ -1146,7 +1328,10 @@ zrefresh(void)
 	    vcs = 0;
 	    moveto(0, lpromptw);
 	}
-	fflush(shout);
+	/*
+	 * Don't flush here: the prompt goes out together with the
+	 * rest of the line at the end of the refresh.
+	 */
 	clearf = clearflag;
     } else if (winw != zterm_columns || rwinh != zterm_lines)
 	resetvideo();
@@ -1181,35 +1366,28 @@ zrefresh(void)
 
     rpms.s = nbuf[rpms.ln = 0] + lpromptw;
     rpms.sen = *nbuf + winw;
+    region_sweep_start(&rsweep);
     for (t = tmpline, tmppos = 0; tmppos < tmpll; t++, tmppos++) {
-	int base_atr_on = default_atr_on, base_atr_off = 0, ireg;
+	int base_atr_on = default_atr_on, base_atr_off = 0, iact;
 	int all_atr_on, all_atr_off;
 	struct region_highlight *rhp;
 	/*
 	 * Calculate attribute based on region.
 	 */
-	for (ireg = 0, rhp = region_highlights;
-	     ireg < n_region_highlights;
-	     ireg++, rhp++) {
-	    int offset;
-	    if (rhp->flags & ZRH_PREDISPLAY)
-		offset = 0;	/* include predisplay in start end */
-	    else
-		offset = predisplaylen; /* increment over it */
-	    if (rhp->start + offset <= tmppos &&
-		tmppos < rhp->end + offset) {
-		if (rhp->atr & (TXTFGCOLOUR|TXTBGCOLOUR)) {
-		    /* override colour with later entry */
-		    base_atr_on = (base_atr_on & ~TXT_ATTR_ON_VALUES_MASK) |
-			rhp->atr;
-		} else {
-		    /* no colour set yet */
-		    base_atr_on |= rhp->atr;
-		}
-		if (tmppos == rhp->end + offset - 1 ||
-		    tmppos == tmpll - 1)
-		    base_atr_off |= TXT_ATTR_OFF_FROM_ON(rhp->atr);
+	region_sweep_to(&rsweep, tmppos);
+	for (iact = 0; iact < rsweep.nactive; iact++) {
+	    rhp = region_highlights + rsweep.active[iact];
+	    if (rhp->atr & (TXTFGCOLOUR|TXTBGCOLOUR)) {
+		/* override colour with later entry */
+		base_atr_on = (base_atr_on & ~TXT_ATTR_ON_VALUES_MASK) |
+		    rhp->atr;
+	    } else {
+		/* no colour set yet */
+		base_atr_on |= rhp->atr;
 	    }
+	    if (tmppos == rhp->end + REGION_OFFSET(rhp) - 1 ||
+		tmppos == tmpll - 1)
+		base_atr_off |= TXT_ATTR_OFF_FROM_ON(rhp->atr);
 	}
 	if (special_atr_on & (TXTFGCOLOUR|TXTBGCOLOUR)) {
 	    /* keep colours from special attributes */
@@ -1248,7 +1426,7 @@ zrefresh(void)
 #ifdef __STDC_ISO_10646__
 		 !ZSH_INVALID_WCHAR_TEST(*t) &&
 #endif
-		 iswprint(*t) && (width = WCWIDTH(*t)) > 0) {
+		 WC_ISPRINT(*t) && (width = WCWIDTH(*t)) > 0) {
 	    int ichars;
 	    if (width > rpms.sen - rpms.s) {
 		int started = 0;
@@ -1401,6 +1579,7 @@ zrefresh(void)
 		break;
 	}
     }
+    region_sweep_finish(&rsweep);
 
 /* if we're really on the next line, don't fake it; do everything properly */
     if (t == scs &&
@@ -1430,7 +1609,7 @@ zrefresh(void)
 	u = outputline;
 	for (; u < outputline + outll; u++) {
 #ifdef MULTIBYTE_SUPPORT
-	    if (iswprint(*u)) {
+	    if (WC_ISPRINT(*u)) {
 		int width = WCWIDTH(*u);
 		/* Handle wide characters as above */
 		if (width > rpms.sen - rpms.s) {
@@ -2426,6 +2605,7 @@ singlerefresh(ZLE_STRING_T tmpline, int tmpll, int tmpcs)
 	nvcs = 0,		/* new video cursor column     */
 	owinpos = winpos,	/* previous window position    */
 	owinprompt = winprompt;	/* previous winprompt          */
+    struct region_sweep rsweep;	/* region highlights at t0     */
 #ifdef MULTIBYTE_SUPPORT
     int width;			/* width of multibyte character */
 #endif
@@ -2436,7 +2616,7 @@ singlerefresh(ZLE_STRING_T tmpline, int tmpll, int tmpcs)
 	if (tmpline[t0] == ZWC('\t'))
 	    vsiz = (vsiz | 7) + 2;
 #ifdef MULTIBYTE_SUPPORT
-	else if (iswprint(tmpline[t0]) && ((width = WCWIDTH(tmpline[t0])) > 0)) {
+	else if (WC_ISPRINT(tmpline[t0]) && ((width = WCWIDTH(tmpline[t0])) > 0)) {
 	    vsiz += width;
 	    if (isset(COMBININGCHARS) && IS_BASECHAR(tmpline[t0])) {
 		while (t0 < tmpll-1 && IS_COMBINING(tmpline[t0+1]))
@@ -2473,34 +2653,27 @@ singlerefresh(ZLE_STRING_T tmpline, int tmpll, int tmpcs)
     vp = vbuf + lpromptw;
     *vp = zr_zr;
 
+    region_sweep_start(&rsweep);
     for (t0 = 0; t0 < tmpll; t0++) {
-	int base_atr_on = 0, base_atr_off = 0, ireg;
+	int base_atr_on = 0, base_atr_off = 0, iact;
 	int all_atr_on, all_atr_off;
 	struct region_highlight *rhp;
 	/*
 	 * Calculate attribute based on region.
 	 */
-	for (ireg = 0, rhp = region_highlights;
-	     ireg < n_region_highlights;
-	     ireg++, rhp++) {
-	    int offset;
-	    if (rhp->flags & ZRH_PREDISPLAY)
-		offset = 0;	/* include predisplay in start end */
-	    else
-		offset = predisplaylen; /* increment over it */
-	    if (rhp->start + offset <= t0 &&
-		t0 < rhp->end + offset) {
-		if (base_atr_on & (TXTFGCOLOUR|TXTBGCOLOUR)) {
-		    /* keep colour already set */
-		    base_atr_on |= rhp->atr & ~TXT_ATTR_COLOUR_ON_MASK;
-		} else {
-		    /* no colour set yet */
-		    base_atr_on |= rhp->atr;
-		}
-		if (t0 == rhp->end + offset - 1 ||
-		    t0 == tmpll - 1)
-		    base_atr_off |= TXT_ATTR_OFF_FROM_ON(rhp->atr);
+	region_sweep_to(&rsweep, t0);
+	for (iact = 0; iact < rsweep.nactive; iact++) {
+	    rhp = region_highlights + rsweep.active[iact];
+	    if (base_atr_on & (TXTFGCOLOUR|TXTBGCOLOUR)) {
+		/* keep colour already set */
+		base_atr_on |= rhp->atr & ~TXT_ATTR_COLOUR_ON_MASK;
+	    } else {
+		/* no colour set yet */
+		base_atr_on |= rhp->atr;
 	    }
+	    if (t0 == rhp->end + REGION_OFFSET(rhp) - 1 ||
+		t0 == tmpll - 1)
+		base_atr_off |= TXT_ATTR_OFF_FROM_ON(rhp->atr);
 	}
 	if (special_atr_on & (TXTFGCOLOUR|TXTBGCOLOUR)) {
 	    /* keep colours from special attributes */
@@ -2524,7 +2697,7 @@ singlerefresh(ZLE_STRING_T tmpline, int tmpll, int tmpcs)
 	    vp->atr = all_atr_on | all_atr_off;
 	    vp++;
 #ifdef MULTIBYTE_SUPPORT
-	} else if (iswprint(tmpline[t0]) &&
+	} else if (WC_ISPRINT(tmpline[t0]) &&
 		   (width = WCWIDTH(tmpline[t0])) > 0) {
 	    int ichars;
 	    if (isset(COMBININGCHARS) && IS_BASECHAR(tmpline[t0])) {
@@ -2600,6 +2773,7 @@ singlerefresh(ZLE_STRING_T tmpline, int tmpll, int tmpcs)
 	if (t0 == tmpcs)
 	    nvcs = vp - vbuf - 1;
     }
+    region_sweep_finish(&rsweep);
     if (t0 == tmpcs)
 	nvcs = vp - vbuf;
     *vp = zr_zr;
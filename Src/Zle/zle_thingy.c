@@ -815,6 +815,7 @@ bin_zle_fd(char *name, char **args, Options ops, UNUSED(char func))
 	    new_fd->func = funcnam;
 	    new_fd->widget = OPT_ISSET(ops,'w') ? 1 : 0;
 	    nwatch = newnwatch;
+	    watch_fds_gen++;
 	}
     } else {
 	/* Deleting a handler */
@@ -840,6 +841,7 @@ bin_zle_fd(char *name, char **args, Options ops, UNUSED(char func))
 		zfree(watch_fds, nwatch*sizeof(struct watch_fd));
 		watch_fds = new_fds;
 		nwatch = newnwatch;
+		watch_fds_gen++;
 		found = 1;
 		break;
 	    }
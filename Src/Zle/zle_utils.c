@@ -197,34 +197,28 @@ zlelineasstring(ZLE_STRING_T instr, int inll, int incs, int *outllp,
 
 #ifdef MULTIBYTE_SUPPORT
     char *s;
-    int i, j;
+    int i, j, *offs = NULL;
     size_t mb_len = 0;
     mbstate_t mbs;
 
     s = zalloc(inll * MB_CUR_MAX + 1);
 
+    /*
+     * To find the positions of the highlighted regions in the
+     * output, record where each character starts.
+     */
+    if (region_highlights && outcsp == &zlemetacs &&
+	n_region_highlights > N_SPECIAL_HIGHLIGHTS)
+	offs = (int *)zalloc((inll + 1) * sizeof(int));
+
     outcs = 0;
     memset(&mbs, 0, sizeof(mbs));
     for (i=0; i < inll; i++) {
 	if (incs == 0)
 	    outcs = mb_len;
 	incs--;
-	if (region_highlights && outcsp == &zlemetacs) {
-	    for (rhp = region_highlights + N_SPECIAL_HIGHLIGHTS;
-		 rhp < region_highlights + n_region_highlights;
-		 rhp++) {
-		if (rhp->flags & ZRH_PREDISPLAY)
-		    sub = predisplaylen;
-		else
-		    sub = 0;
-		if (rhp->start - sub == 0)
-		    rhp->start_meta = sub + mb_len;
-		rhp->start--;
-		if (rhp->end - sub == 0)
-		    rhp->end_meta = sub + mb_len;
-		rhp->end--;
-	    }
-	}
+	if (offs)
+	    offs[i] = mb_len;
 #ifdef __STDC_ISO_10646__
 	if (ZSH_INVALID_WCHAR_TEST(instr[i])) {
 	    s[mb_len++] = ZSH_INVALID_WCHAR_TO_CHAR(instr[i]);
@@ -243,7 +237,8 @@ zlelineasstring(ZLE_STRING_T instr, int inll, int incs, int *outllp,
     }
     if (incs == 0)
 	outcs = mb_len;
-    if (region_highlights && outcsp == &zlemetacs) {
+    if (offs) {
+	offs[inll] = mb_len;
 	for (rhp = region_highlights + N_SPECIAL_HIGHLIGHTS;
 	     rhp < region_highlights + n_region_highlights;
 	     rhp++) {
@@ -251,11 +246,14 @@ zlelineasstring(ZLE_STRING_T instr, int inll, int incs, int *outllp,
 		sub = predisplaylen;
 	    else
 		sub = 0;
-	    if (rhp->start - sub == 0)
-		rhp->start_meta = sub + mb_len;
-	    if (rhp->end - sub == 0)
-		rhp->end_meta = sub + mb_len;
+	    if (rhp->start - sub >= 0 && rhp->start - sub <= inll)
+		rhp->start_meta = sub + offs[rhp->start - sub];
+	    rhp->start -= inll;
+	    if (rhp->end - sub >= 0 && rhp->end - sub <= inll)
+		rhp->end_meta = sub + offs[rhp->end - sub];
+	    rhp->end -= inll;
 	}
+	zfree(offs, (inll + 1) * sizeof(int));
     }
     s[mb_len] = '\0';
 
@@ -747,13 +745,13 @@ zle_free_positions(void)
 mod_export void
 spaceinline(int ct)
 {
-    int i, sub;
+    int sub;
     struct region_highlight *rhp;
 
     if (zlemetaline) {
 	sizeline(ct + zlemetall);
-	for (i = zlemetall; --i >= zlemetacs;)
-	    zlemetaline[i + ct] = zlemetaline[i];
+	memmove(zlemetaline + zlemetacs + ct, zlemetaline + zlemetacs,
+		zlemetall - zlemetacs);
 	zlemetall += ct;
 	zlemetaline[zlemetall] = '\0';
 
@@ -778,8 +776,7 @@ spaceinline(int ct)
 	}
     } else {
 	sizeline(ct + zlell);
-	for (i = zlell; --i >= zlecs;)
-	    zleline[i + ct] = zleline[i];
+	ZS_memmove(zleline + zlecs + ct, zleline + zlecs, zlell - zlecs);
 	zlell += ct;
 	zleline[zlell] = ZWC('\0');
 
@@ -847,9 +844,10 @@ shiftchars(int to, int cnt)
 	    }
 	}
 
-	while (to + cnt < zlemetall) {
-	    zlemetaline[to] = zlemetaline[to + cnt];
-	    to++;
+	if (to + cnt < zlemetall) {
+	    memmove(zlemetaline + to, zlemetaline + to + cnt,
+		    zlemetall - (to + cnt));
+	    to = zlemetall - cnt;
 	}
 	zlemetaline[zlemetall = to] = '\0';
     } else {
@@ -877,9 +875,9 @@ shiftchars(int to, int cnt)
 	    }
 	}
 
-	while (to + cnt < zlell) {
-	    zleline[to] = zleline[to + cnt];
-	    to++;
+	if (to + cnt < zlell) {
+	    ZS_memmove(zleline + to, zleline + to + cnt, zlell - (to + cnt));
+	    to = zlell - cnt;
 	}
 	zleline[zlell = to] = ZWC('\0');
     }
@@ -105,7 +105,7 @@ static struct builtin builtins[] =
     BUILTIN("pushln", 0, bin_print, 0, -1, BIN_PRINT, NULL, "-nz"),
     BUILTIN("pwd", 0, bin_pwd, 0, 0, 0, "rLP", NULL),
     BUILTIN("r", 0, bin_fc, 0, -1, BIN_R, "nrl", NULL),
-    BUILTIN("read", 0, bin_read, 0, -1, 0, "cd:ek:%lnpqrst:%zu:AE", NULL),
+    BUILTIN("read", 0, bin_read, 0, -1, 0, "bcd:ek:%lnpqrst:%zu:AE", NULL),
     BUILTIN("readonly", BINF_PLUSOPTS | BINF_MAGICEQUALS | BINF_PSPECIAL, bin_typeset, 0, -1, 0, "AE:%F:%HL:%R:%TUZ:%afghi:%lptux", "r"),
     BUILTIN("rehash", 0, bin_hash, 0, 0, 0, "df", "r"),
     BUILTIN("return", BINF_PSPECIAL, bin_break, 0, 1, BIN_RETURN, NULL, NULL),
@@ -154,18 +154,55 @@ createbuiltintable(void)
     builtintab->emptytable  = NULL;
     builtintab->filltable   = NULL;
     builtintab->cmpnodes    = strcmp;
-    builtintab->addnode     = addhashnode;
+    builtintab->addnode     = addbuiltinnode;
     builtintab->getnode     = gethashnode;
     builtintab->getnode2    = gethashnode2;
-    builtintab->removenode  = removehashnode;
-    builtintab->disablenode = disablehashnode;
-    builtintab->enablenode  = enablehashnode;
+    builtintab->removenode  = removebuiltinnode;
+    builtintab->disablenode = disablebuiltinnode;
+    builtintab->enablenode  = enablebuiltinnode;
     builtintab->freenode    = freebuiltinnode;
     builtintab->printnode   = printbuiltinnode;
 
     (void)addbuiltins("zsh", builtins, sizeof(builtins)/sizeof(*builtins));
 }
 
+/*
+ * Changes to the builtin table invalidate cached command lookups,
+ * see cmdgen in exec.c.
+ */
+
+/**/
+static void
+addbuiltinnode(HashTable ht, char *nam, void *nodeptr)
+{
+    cmdgen++;
+    addhashnode(ht, nam, nodeptr);
+}
+
+/**/
+static HashNode
+removebuiltinnode(HashTable ht, const char *nam)
+{
+    cmdgen++;
+    return removehashnode(ht, nam);
+}
+
+/**/
+static void
+disablebuiltinnode(HashNode hn, int flags)
+{
+    cmdgen++;
+    disablehashnode(hn, flags);
+}
+
+/**/
+static void
+enablebuiltinnode(HashNode hn, int flags)
+{
+    cmdgen++;
+    enablehashnode(hn, flags);
+}
+
 /* Print a builtin */
 
 /**/
@@ -654,7 +691,7 @@ bin_set(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
 	setaparam(arrayname, x);
     } else {
 	/* set shell arguments */
-	freearray(pparams);
+	freepparams();
 	pparams = zarrdup(args);
     }
     unqueue_signals();
@@ -2270,9 +2307,9 @@ typeset_single(char *cname, char *pname, Param pm, UNUSED(int func),
     }
 
     if (keeplocal)
-	pm->level = keeplocal;
+	setparamlevel(pm, keeplocal);
     else if (on & PM_LOCAL)
-	pm->level = locallevel;
+	setparamlevel(pm, locallevel);
     if (value && !(pm->node.flags & (PM_ARRAY|PM_HASHED))) {
 	Param ipm = pm;
 	if (!(pm = setsparam(pname, ztrdup(value))))
@@ -2996,6 +3033,7 @@ mkautofn(Shfunc shf)
     p->prog = (Wordcode) zalloc(p->len);
     p->strs = NULL;
     p->shf = shf;
+    p->text = NULL;
     p->npats = 0;
     p->nref = 1; /* allocated from permanent storage */
     p->pats = (Patprog *) p->prog;
@@ -4558,11 +4596,13 @@ bin_shift(char *name, char **argv, Options ops, UNUSED(int func))
 		memcpy(s, pparams, (l - num) * sizeof(char *));
 		s[l-num] = NULL;
 		while (num--)
-		    zsfree(pparams[l-1-num]);
+		    if (!pparamsheap)
+			zsfree(pparams[l-1-num]);
 	    } else {
 		memcpy(s, pparams + num, (l - num + 1) * sizeof(char *));
 		while (num--)
-		    zsfree(pparams[num]);
+		    if (!pparamsheap)
+			zsfree(pparams[num]);
 	    }
 	    zfree(pparams, (l + 1) * sizeof(char *));
 	    pparams = s;
@@ -4837,6 +4877,8 @@ zexit(int val, int from_where)
      * errors.
      */
     errflag = 0;
+    /* If we're still starting up, say how far we got. */
+    inittrace_finish();
 
     if (isset(MONITOR)) {
 	/* send SIGHUP to any jobs left running  */
@@ -4879,7 +4921,7 @@ int
 bin_dot(char *name, char **argv, UNUSED(Options ops), UNUSED(int func))
 {
     char **old, *old0 = NULL;
-    int diddot = 0, dotdot = 0;
+    int diddot = 0, dotdot = 0, oldheap = pparamsheap;
     char *s, **t, *enam, *arg0, *buf;
     struct stat st;
     enum source_return ret;
@@ -4888,8 +4930,10 @@ bin_dot(char *name, char **argv, UNUSED(Options ops), UNUSED(int func))
 	return 0;
     old = pparams;
     /* get arguments for the script */
-    if (argv[1])
+    if (argv[1]) {
 	pparams = zarrdup(argv + 1);
+	pparamsheap = 0;
+    }
 
     enam = arg0 = ztrdup(*argv);
     if (isset(FUNCTIONARGZERO)) {
@@ -4943,8 +4987,9 @@ bin_dot(char *name, char **argv, UNUSED(Options ops), UNUSED(int func))
     }
     /* clean up and return */
     if (argv[1]) {
-	freearray(pparams);
+	freepparams();
 	pparams = old;
+	pparamsheap = oldheap;
     }
     if (ret == SOURCE_NOT_FOUND) {
 	if (isset(POSIXBUILTINS)) {
@@ -5019,13 +5064,15 @@ eval(char **argv)
     } else
 	fpushed = 0;
 
-    prog = parse_string(zjoin(argv, ' ', 1), 1);
+    prog = parse_string_cached(zjoin(argv, ' ', 1), 1);
     if (prog) {
 	if (wc_code(*prog->prog) != WC_LIST) {
 	    /* No code to execute */
 	    lastval = 0;
 	} else {
+	    useeprog(prog);
 	    execode(prog, 1, 0, "eval");
+	    freeeprog(prog);
 
 	    if (errflag && !lastval)
 		lastval = errflag;
@@ -5196,6 +5243,28 @@ bin_eval(UNUSED(char *nam), char **argv, UNUSED(Options ops), UNUSED(int func))
 static char *zbuf;
 static int readfd;
 
+/*
+ * Input read ahead by zread() from readfd, so it doesn't need a system
+ * call for every character.  From a regular file, zreadfinish() moves
+ * the file offset back past what read didn't use.  With read -b from a
+ * pipe or socket, which can't do that, what's left over is kept for the
+ * next read -b from the same one.
+ */
+
+#define READAHEAD_SIZE 8192
+
+static struct readahead {
+    int fd;			/* for keptra, fd the input came from */
+    dev_t dev;			/* ... and its device and inode */
+    ino_t ino;
+    int pos, len;		/* next character and end of input */
+    char buf[READAHEAD_SIZE];
+} seekra, keptra = { -1 };
+
+/* The one of those in use by the current read, or NULL */
+
+static struct readahead *curra;
+
 /* Read a character from readfd, or from the buffer zbuf.  Return EOF on end of
 file/buffer. */
 
@@ -5313,6 +5382,10 @@ bin_read(char *name, char **args, Options ops, UNUSED(int func))
     } else
 	readfd = izle = 0;
 
+    /* zread() handles all other cases a character at a time */
+    if (!OPT_ISSET(ops,'k') && !OPT_ISSET(ops,'q') && !OPT_ISSET(ops,'z'))
+	zreadstart(OPT_ISSET(ops,'b'));
+
     if (OPT_ISSET(ops,'s') && SHTTY != -1) {
 	struct ttyinfo ti;
 	gettyinfo(&ti);
@@ -5401,10 +5474,11 @@ bin_read(char *name, char **args, Options ops, UNUSED(int func))
 	    if ((zlong)izle_timeout != timeout)
 		izle_timeout = LONG_MAX;
 #endif
-	} else {
+	} else if (!curra || curra->pos == curra->len) {
 	    if (readfd == -1 ||
 		!read_poll(readfd, &readchar, keys && !zleactive,
 			   timeout)) {
+		zreadfinish();
 		if (keys && !zleactive && !isem)
 		    settyinfo(&shttyinfo);
 		else if (resettty && SHTTY != -1)
@@ -5759,6 +5833,7 @@ bin_read(char *name, char **args, Options ops, UNUSED(int func))
 	    *pp++ = NULL;
 	    setaparam(reply, p);
 	}
+	zreadfinish();
 	if (resettty && SHTTY != -1)
 	    settyinfo(&saveti);
 	return c == EOF;
@@ -5888,6 +5963,7 @@ bin_read(char *name, char **args, Options ops, UNUSED(int func))
 	    break;
     }
     *bptr = '\0';
+    zreadfinish();
     if (resettty && SHTTY != -1)
 	settyinfo(&saveti);
     /* final assignment of reply, etc. */
@@ -5921,6 +5997,41 @@ bin_read(char *name, char **args, Options ops, UNUSED(int func))
     return errflag;
 }
 
+/**/
+static void
+zreadstart(int keep)
+{
+    struct stat st;
+
+    curra = NULL;
+    if (readfd < 0 || fstat(readfd, &st))
+	return;
+    if (S_ISREG(st.st_mode)) {
+	if (lseek(readfd, 0, SEEK_CUR) != (off_t)-1) {
+	    seekra.pos = seekra.len = 0;
+	    curra = &seekra;
+	}
+    } else if (keep && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+	if (keptra.fd != readfd || keptra.dev != st.st_dev ||
+	    keptra.ino != st.st_ino) {
+	    keptra.fd = readfd;
+	    keptra.dev = st.st_dev;
+	    keptra.ino = st.st_ino;
+	    keptra.pos = keptra.len = 0;
+	}
+	curra = &keptra;
+    }
+}
+
+/**/
+static void
+zreadfinish(void)
+{
+    if (curra == &seekra && seekra.pos < seekra.len)
+	lseek(readfd, (off_t)(seekra.pos - seekra.len), SEEK_CUR);
+    curra = NULL;
+}
+
 /**/
 static int
 zread(int izle, int *readchar, long izle_timeout)
@@ -5949,9 +6060,21 @@ zread(int izle, int *readchar, long izle_timeout)
 	*readchar = -1;
 	return STOUC(cc);
     }
+    if (curra && curra->pos < curra->len)
+	return STOUC(curra->buf[curra->pos++]);
     for (;;) {
 	/* read a character from readfd */
-	ret = read(readfd, &cc, 1);
+	if (curra) {
+	    ret = read(readfd, curra->buf, READAHEAD_SIZE);
+	    if (ret > 0) {
+		curra->len = ret;
+		curra->pos = 1;
+		cc = *curra->buf;
+		ret = 1;
+	    } else
+		curra->pos = curra->len = 0;
+	} else
+	    ret = read(readfd, &cc, 1);
 	switch (ret) {
 	case 1:
 	    /* return the character read */
@@ -79,6 +79,64 @@ gettimeofday(struct timeval *tv, struct timezone *tz)
 #endif
 
 
+/* Get the current time of day, to the nanosecond if we can */
+
+/**/
+mod_export void
+zgettime(struct timespec *ts)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    if (clock_gettime(CLOCK_REALTIME, ts) == 0)
+	return;
+#endif
+    {
+	struct timeval tv;
+	struct timezone dummy_tz;
+
+	gettimeofday(&tv, &dummy_tz);
+	ts->tv_sec = tv.tv_sec;
+	ts->tv_nsec = tv.tv_usec * 1000;
+    }
+}
+
+/*
+ * Get the time from a clock that isn't affected by changes to the
+ * system time, for measuring intervals.  Where there is a choice we
+ * use one that keeps counting while the system is suspended.  If
+ * there isn't one at all, this is the time of day.
+ */
+
+/**/
+mod_export void
+zgettime_monotonic(struct timespec *ts)
+{
+#ifdef HAVE_CLOCK_GETTIME
+# ifdef CLOCK_BOOTTIME
+    if (clock_gettime(CLOCK_BOOTTIME, ts) == 0)
+	return;
+# endif
+# ifdef CLOCK_MONOTONIC
+    if (clock_gettime(CLOCK_MONOTONIC, ts) == 0)
+	return;
+# endif
+#endif
+    zgettime(ts);
+}
+
+/* Compare two times, returning <0, 0 or >0 in the manner of strcmp */
+
+/**/
+mod_export int
+ztimespeccmp(struct timespec *t1, struct timespec *t2)
+{
+    if (t1->tv_sec != t2->tv_sec)
+	return (t1->tv_sec < t2->tv_sec) ? -1 : 1;
+    if (t1->tv_nsec != t2->tv_nsec)
+	return (t1->tv_nsec < t2->tv_nsec) ? -1 : 1;
+    return 0;
+}
+
+
 /* compute the difference between two calendar times */
 
 #ifndef HAVE_DIFFTIME
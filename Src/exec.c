@@ -30,6 +30,13 @@
 #include "zsh.mdh"
 #include "exec.pro"
 
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#ifdef MFD_ALLOW_SEALING
+#define USE_MEMFD 1
+#endif
+#endif
+
 /* Flags for last argument of addvars */
 
 enum {
@@ -181,6 +188,15 @@ struct execstack *exstack;
 /**/
 mod_export Funcstack funcstack;
 
+/*
+ * If set, called with 1 each time a command starts to be executed,
+ * after lineno is updated, and with 0 when the shell is about to wait
+ * for input at the prompt.  Used for profiling lines.
+ */
+
+/**/
+mod_export void (*execlinehook) _((int));
+
 #define execerr()				\
     do {					\
 	if (!forked) {				\
@@ -232,6 +248,91 @@ parse_string(char *s, int reset_lineno)
     return p;
 }
 
+/*
+ * Cache of programs parsed from strings, so that code run repeatedly
+ * by eval, execstring() or command substitution need not be parsed
+ * each time.  Besides the string, the result of parsing depends on the
+ * line number we start at, the options and the aliases, so those are
+ * recorded too.  The least recently used entry is replaced.
+ */
+
+#define PARSECACHE_SIZE 32
+
+/* Longer strings aren't worth keeping */
+
+#define PARSECACHE_MAXLEN 4096
+
+struct parsecache {
+    char *str;
+    unsigned hashval;
+    zlong lineno;
+    int aliasgen, noaliases;
+    char opts[OPT_SIZE];
+    Eprog prog;
+    zlong used;
+};
+
+static struct parsecache parsecache[PARSECACHE_SIZE];
+static zlong parsecacheclock;
+
+/* Numbers of lookups in the cache that found or didn't find an entry */
+
+/**/
+mod_export zlong parsecachehits, parsecachemisses;
+
+/*
+ * Parse a string, as parse_string(), using the cache.  The result may
+ * be permanently allocated, so the caller should useeprog() it while
+ * it's running and freeeprog() it afterwards.
+ */
+
+/**/
+mod_export Eprog
+parse_string_cached(char *s, int reset_lineno)
+{
+    struct parsecache *pc, *victim;
+    zlong startline = reset_lineno ? 1 : lineno;
+    unsigned hashval;
+    Eprog p;
+
+    if (strlen(s) > PARSECACHE_MAXLEN)
+	return parse_string(s, reset_lineno);
+    hashval = wordhasher(s);
+    victim = parsecache;
+    for (pc = parsecache; pc < parsecache + PARSECACHE_SIZE; pc++) {
+	if (!pc->prog) {
+	    victim = pc;
+	    continue;
+	}
+	if (pc->hashval == hashval && pc->lineno == startline &&
+	    pc->aliasgen == aliasgen && pc->noaliases == noaliases &&
+	    !strcmp(pc->str, s) && !memcmp(pc->opts, opts, OPT_SIZE)) {
+	    parsecachehits++;
+	    pc->used = ++parsecacheclock;
+	    return pc->prog;
+	}
+	if (victim->prog && pc->used < victim->used)
+	    victim = pc;
+    }
+    parsecachemisses++;
+    if (!(p = parse_string(s, reset_lineno)) || p == &dummy_eprog)
+	return p;
+
+    if (victim->prog) {
+	freeeprog(victim->prog);
+	zsfree(victim->str);
+    }
+    victim->str = ztrdup(s);
+    victim->hashval = hashval;
+    victim->lineno = startline;
+    victim->aliasgen = aliasgen;
+    victim->noaliases = noaliases;
+    memcpy(victim->opts, opts, OPT_SIZE);
+    victim->prog = dupeprog(p, 0);
+    victim->used = ++parsecacheclock;
+    return victim->prog;
+}
+
 /**/
 #ifdef HAVE_GETRLIMIT
 
@@ -297,12 +398,16 @@ zfork(struct timeval *tv)
      * zippy anyway.
      */
     queue_signals();
+    /* so children about to exec don't each rebuild the environment */
+    getexecenv(NULL);
     pid = fork();
     unqueue_signals();
     if (pid == -1) {
 	zerr("fork failed: %e", errno);
 	return -1;
     }
+    if (pid)
+	runstats.forks++;
 #ifdef HAVE_GETRLIMIT
     if (!pid)
 	/* set resource limits for the child process */
@@ -311,6 +416,139 @@ zfork(struct timeval *tv)
     return pid;
 }
 
+/**/
+#if defined(HAVE_POSIX_SPAWN) && defined(HAVE_SPAWN_H)
+
+/*
+ * Start a simple external command with posix_spawn() instead of
+ * forking and exec'ing.  This only works if the child would have
+ * nothing to do in between: no job control, no redirections or
+ * assignments, no globbing left, no tracing and no limits to set.
+ * The caller checks what it knows about the command; we check the
+ * rest and give the new process the signal state that entersubsh()
+ * and execute() would have left.
+ *
+ * Returns the pid of the new process, or 0 if the caller should
+ * fork in the usual way.  That includes the case where the spawn
+ * failed, so that the usual code reports the error or finds some
+ * other way to run the command.
+ */
+
+/**/
+static pid_t
+spawncmd(LinkList args, Cmdnam cn, int globbing, struct timeval *tv)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t defset, maskset;
+    struct timezone dummy_tz;
+    LinkNode node;
+    char *arg0 = (char *) peekfirst(args), *pth, *under;
+    char **argv, **envp, **pp;
+    pid_t pid;
+    int i, ret;
+
+    if (isset(MONITOR) || isset(XTRACE) || isset(RESTRICTED) ||
+	STTYval || zgetenv("ARGV0"))
+	return 0;
+    if (thisjob != -1 && thisjob >= jobtabsize - 1 && !expandjobtab())
+	return 0;
+#ifdef HAVE_GETRLIMIT
+    for (i = 0; i < RLIM_NLIMITS; i++)
+	if (limits[i].rlim_max != current_limits[i].rlim_max ||
+	    limits[i].rlim_cur != current_limits[i].rlim_cur)
+	    return 0;
+#endif
+    if (globbing)
+	for (node = firstnode(args); node; incnode(node))
+	    if (has_token((char *) getdata(node)))
+		return 0;
+
+    /* Only a path we can find without trying anything */
+    if (strchr(arg0, '/'))
+	pth = arg0;
+    else if (!cn)
+	return 0;
+    else if (cn->node.flags & HASHED)
+	pth = cn->u.cmd;
+    else {
+	if (!cn->u.name || !*cn->u.name)
+	    return 0;
+	/* execute() would try relative directories ahead of this one */
+	for (pp = path; pp < cn->u.name; pp++)
+	    if (**pp != '/')
+		return 0;
+	pth = zhtricat(*cn->u.name, "/", cn->node.nam);
+    }
+    if ((int) strlen(pth) >= PATH_MAX)
+	return 0;
+
+    argv = (char **) zhalloc((countlinknodes(args) + 1) * sizeof(char *));
+    for (node = firstnode(args), pp = argv; node; incnode(node))
+	*pp++ = unmetafy(dupstring((char *) getdata(node)), NULL);
+    *pp = NULL;
+    pth = unmetafy(dupstring(pth), NULL);
+
+    /* The environment, with $_ set as zexecve() does */
+    if (*pth == '/')
+	under = dyncat("_=", pth);
+    else
+	under = dyncat(zhtricat("_=", unmeta(pwd), "/"), pth);
+    envp = getexecenv(under);
+
+    /* Signals entersubsh() puts back to the default ... */
+    sigemptyset(&defset);
+    sigaddset(&defset, SIGTTOU);
+    sigaddset(&defset, SIGTTIN);
+    sigaddset(&defset, SIGTSTP);
+    if (!(sigtrapped[SIGQUIT] & ZSIG_IGNORED))
+	sigaddset(&defset, SIGQUIT);
+    /* ... and the mask execute() leaves, including holdintr() */
+    sigprocmask(SIG_SETMASK, NULL, &maskset);
+    sigdelset(&maskset, SIGCHLD);
+#ifdef SIGWINCH
+    sigdelset(&maskset, SIGWINCH);
+#endif
+    if (interact) {
+	sigaddset(&defset, SIGTERM);
+	if (sigtrapped[SIGINT] & ZSIG_IGNORED)
+	    sigaddset(&maskset, SIGINT);
+	else
+	    sigaddset(&defset, SIGINT);
+    }
+
+    /* File descriptors closed before the command is run */
+    posix_spawn_file_actions_init(&fa);
+    for (i = 10; i <= max_zsh_fd; i++)
+	if (fdtable[i] == FDT_INTERNAL || fdtable[i] == FDT_XTRACE)
+	    posix_spawn_file_actions_addclose(&fa, i);
+    if (coprocin != -1 && (coprocin < 10 || coprocin > max_zsh_fd ||
+			   fdtable[coprocin] != FDT_INTERNAL))
+	posix_spawn_file_actions_addclose(&fa, coprocin);
+    if (coprocout != -1 && (coprocout < 10 || coprocout > max_zsh_fd ||
+			    fdtable[coprocout] != FDT_INTERNAL))
+	posix_spawn_file_actions_addclose(&fa, coprocout);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &defset);
+    posix_spawnattr_setsigmask(&attr, &maskset);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+			     POSIX_SPAWN_SETSIGMASK);
+
+    if (tv)
+	gettimeofday(tv, &dummy_tz);
+    queue_signals();
+    ret = posix_spawn(&pid, pth, &fa, &attr, argv, envp);
+    unqueue_signals();
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    return ret ? 0 : pid;
+}
+
+/**/
+#endif /* HAVE_POSIX_SPAWN && HAVE_SPAWN_H */
+
 /*
  *   Allen Edeln gebiet ich Andacht,
  *   Hohen und Niedern von Heimdalls Geschlecht;
@@ -447,13 +685,12 @@ zexecve(char *pth, char **argv, char **newenvp)
 	strcpy(buf + 2, pth);
     else
 	sprintf(buf + 2, "%s/%s", pwd, pth);
-    zputenv(buf);
 #ifndef FD_CLOEXEC
     closedumps();
 #endif
 
     if (newenvp == NULL)
-	    newenvp = environ;
+	newenvp = getexecenv(buf);
     winch_unblock();
     execve(pth, argv, newenvp);
 
@@ -613,11 +850,7 @@ execute(LinkList args, int flags, int defpath)
 	 * for ARGV0: that's OK since we're about to exec or exit
 	 * on failure.
 	 */
-#ifdef USE_SET_UNSET_ENV
-	unsetenv("ARGV0");
-#else
-	delenvvalue(z - 6);
-#endif
+	zunsetenv("ARGV0");
     } else if (flags & BINF_DASH) {
     /* Else if the pre-command `-' was given, we add `-' *
      * to the front of argv[0] for this command.         */
@@ -889,6 +1122,7 @@ hashcmd(char *arg0, char **pp)
 	for (pq = pathchecked; pq <= pp; pq++)
 	    hashdir(pq);
 	pathchecked = pp + 1;
+	savehashdircaches();
     }
 
     return cn;
@@ -1032,8 +1266,11 @@ execstring(char *s, int dont_change_job, int exiting, char *context)
 	fputc('\n', stderr);
 	fflush(stderr);
     }
-    if ((prog = parse_string(s, 0)))
+    if ((prog = parse_string_cached(s, 0))) {
+	useeprog(prog);
 	execode(prog, dont_change_job, exiting, context);
+	freeeprog(prog);
+    }
     popheap();
 }
 
@@ -1098,6 +1335,8 @@ execsimple(Estate state)
     /* In evaluated traps, don't modify the line number. */
     if (!IN_EVAL_TRAP() && !ineval && code)
 	lineno = code - 1;
+    if (execlinehook)
+	execlinehook(1);
 
     code = wc_code(*state->pc++);
 
@@ -1677,6 +1916,8 @@ execpline2(Estate state, wordcode pcode,
     /* In evaluated traps, don't modify the line number. */
     if (!IN_EVAL_TRAP() && !ineval && WC_PIPE_LINENO(pcode))
 	lineno = WC_PIPE_LINENO(pcode) - 1;
+    if (execlinehook)
+	execlinehook(1);
 
     if (pline_level == 1) {
 	if ((how & Z_ASYNC) || (!sfcontext && !sourcelevel))
@@ -2354,6 +2595,29 @@ execsubst(LinkList strs)
     }
 }
 
+/*
+ * As execsubst(), but if substitution leaves a single word, a glob
+ * there may pass its matches to fn as it finds them instead of
+ * adding them to the list.
+ */
+
+/**/
+void
+execsubststream(LinkList strs, int (*fn) _((char *, void *)), void *data)
+{
+    if (strs) {
+	prefork(strs, esprefork);
+	if (esglob && !errflag) {
+	    if (nonempty(strs) && !nextnode(firstnode(strs))) {
+		globstreamfn = fn;
+		globstreamdata = data;
+	    }
+	    globlist(strs, 0);
+	    globstreamfn = NULL;
+	}
+    }
+}
+
 /*
  * Check if a builtin requires an autoload and if so
  * deal with it.  This may return NULL.
@@ -2384,6 +2648,75 @@ resolvebuiltin(const char *cmdarg, HashNode hn)
     return hn;
 }
 
+/*
+ * Generation count for the command lookup tables.  This is incremented
+ * whenever a node is added to, removed from, disabled or enabled in
+ * shfunctab or builtintab, so that the results cached below for a
+ * particular command word can be checked cheaply for staleness.
+ */
+
+/**/
+mod_export int cmdgen;
+
+/*
+ * Cache of the lookup of the first word of simple commands in the
+ * function and builtin tables.  It is indexed by the position of the
+ * command in the wordcode, so a loop running the same command many
+ * times only does the hash table lookups once.  Entries are only valid
+ * for the generation and the name they were made with.
+ */
+
+#define CMDCACHE_SIZE 256
+
+enum {
+    CMDC_NONE,			/* neither function nor builtin */
+    CMDC_SHFUNC,		/* shell function */
+    CMDC_BUILTIN		/* (resolved) non-prefix builtin */
+};
+
+struct cmdcache {
+    Wordcode pc;		/* start of the command in the wordcode */
+    char *nam;			/* command word looked up */
+    int gen;			/* value of cmdgen when made */
+    int type;			/* CMDC_* */
+    HashNode hn;		/* function or builtin found */
+    int cflags;			/* flags of builtin found */
+};
+
+static struct cmdcache cmdcache[CMDCACHE_SIZE];
+
+/* Find the cache slot for a command; NULL if it must be looked up. */
+
+static struct cmdcache *
+getcmdcache(Wordcode pc, char *nam)
+{
+    struct cmdcache *cc =
+	cmdcache + ((size_t)pc / sizeof(wordcode)) % CMDCACHE_SIZE;
+
+    if (cc->pc == pc && cc->gen == cmdgen && cc->nam && !strcmp(cc->nam, nam))
+	return cc;
+    return NULL;
+}
+
+/* Remember the result of looking up a command. */
+
+static void
+setcmdcache(Wordcode pc, char *nam, int type, HashNode hn, int cflags)
+{
+    struct cmdcache *cc =
+	cmdcache + ((size_t)pc / sizeof(wordcode)) % CMDCACHE_SIZE;
+
+    if (!cc->nam || strcmp(cc->nam, nam)) {
+	zsfree(cc->nam);
+	cc->nam = ztrdup(nam);
+    }
+    cc->pc = pc;
+    cc->gen = cmdgen;
+    cc->type = type;
+    cc->hn = hn;
+    cc->cflags = cflags;
+}
+
 /**/
 static void
 execcmd(Estate state, int input, int output, int how, int last1)
@@ -2479,30 +2812,55 @@ execcmd(Estate state, int input, int output, int how, int last1)
     if (type == WC_SIMPLE) {
 	while (args && nonempty(args)) {
 	    char *cmdarg = (char *) peekfirst(args);
+	    struct cmdcache *cc;
+	    int plain = !cflags;
 	    checked = !has_token(cmdarg);
 	    if (!checked)
 		break;
+	    /*
+	     * Only the plain command word is cached: after a precommand
+	     * modifier the lookup depends on the flags it set.
+	     */
+	    if (plain && (cc = getcmdcache(beg, cmdarg))) {
+		if (cc->type == CMDC_SHFUNC) {
+		    hn = cc->hn;
+		    is_shfunc = 1;
+		} else if (cc->type == CMDC_BUILTIN) {
+		    hn = cc->hn;
+		    cflags |= cc->cflags;
+		    is_builtin = 1;
+		    assign = (hn->flags & BINF_MAGICEQUALS);
+		}
+		break;
+	    }
 	    if (!(cflags & (BINF_BUILTIN | BINF_COMMAND)) &&
 		(hn = shfunctab->getnode(shfunctab, cmdarg))) {
+		if (plain)
+		    setcmdcache(beg, cmdarg, CMDC_SHFUNC, hn, 0);
 		is_shfunc = 1;
 		break;
 	    }
 	    if (!(hn = builtintab->getnode(builtintab, cmdarg))) {
+		if (plain)
+		    setcmdcache(beg, cmdarg, CMDC_NONE, NULL, 0);
 		checked = !(cflags & BINF_BUILTIN);
 		break;
 	    }
 	    orig_cflags |= cflags;
 	    cflags &= ~BINF_BUILTIN & ~BINF_COMMAND;
-	    cflags |= hn->flags;
 	    if (!(hn->flags & BINF_PREFIX)) {
+		cflags |= hn->flags;
 		is_builtin = 1;
 
 		/* autoload the builtin if necessary */
 		if (!(hn = resolvebuiltin(cmdarg, hn)))
 		    return;
+		if (plain)
+		    setcmdcache(beg, cmdarg, CMDC_BUILTIN, hn, cflags);
 		assign = (hn->flags & BINF_MAGICEQUALS);
 		break;
 	    }
+	    cflags |= hn->flags;
 	    checked = 0;
 	    if ((cflags & BINF_COMMAND) && nextnode(firstnode(args))) {
 		/* check for options to command builtin */
@@ -2867,6 +3225,20 @@ execcmd(Estate state, int input, int output, int how, int last1)
 
 	child_block();
 
+#if defined(HAVE_POSIX_SPAWN) && defined(HAVE_SPAWN_H)
+	/* A simple external command may not need a copy of the shell */
+	if (type == WC_SIMPLE && !is_cursh && !(how & Z_ASYNC) &&
+	    !input && !output && !varspc && (!redir || empty(redir)) &&
+	    !use_defpath && !(cflags & (BINF_DASH | BINF_CLEARENV)) &&
+	    (pid = spawncmd(args, (Cmdnam) hn,
+			    htok && !(cflags & BINF_NOGLOB), &bgtime))) {
+	    addproc(pid, text, 0, &bgtime);
+	    if (oautocont >= 0)
+		opts[AUTOCONTINUE] = oautocont;
+	    return;
+	}
+#endif
+
 	if (pipe(synch) < 0) {
 	    zerr("pipe failed: %e", errno);
 	    goto fatal;
@@ -3619,6 +3991,33 @@ gethere(char **strp, int typ)
 	    if (lexstop || c == '\n')
 		break;
 	    *bptr++ = c;
+	    if (hgetc == ingetc) {
+		/* Copy the rest of an ordinary line in one go */
+		char *run, *end;
+		int n;
+
+		for (run = end = inrun(&n); n && *end != '\n' && *end &&
+			 !itok(*end); end++, n--)
+		    ;
+		if ((n = end - run)) {
+		    while (bptr + n >= buf + bsiz) {
+			int toff = t - buf, boff = bptr - buf;
+			char *newbuf = realloc(buf, 2 * bsiz);
+			if (!newbuf) {
+			    /* out of memory */
+			    zfree(buf, bsiz);
+			    return NULL;
+			}
+			t = newbuf + toff;
+			bptr = newbuf + boff;
+			buf = newbuf;
+			bsiz *= 2;
+		    }
+		    memcpy(bptr, run, n);
+		    bptr += n;
+		    inskip(n);
+		}
+	    }
 	    c = hgetc();
 	}
 	*bptr = '\0';
@@ -3644,6 +4043,52 @@ gethere(char **strp, int typ)
     return s;
 }
 
+/*
+ * Get a file descriptor from which the contents of a here string
+ * can be read without going via a file in the file system.  Where
+ * available this is an anonymous memory file, sealed against writing
+ * so it behaves like the read-only temporary file; otherwise if the
+ * text is short enough to be buffered by the kernel it is a pipe.
+ * Returns -1 if the caller should fall back to a temporary file.
+ */
+
+/**/
+static int
+getherefd(char *t, int len)
+{
+#ifdef USE_MEMFD
+    int fd;
+
+    if ((fd = memfd_create("zsh-here", MFD_ALLOW_SEALING)) >= 0) {
+	if (write_loop(fd, t, len) == len &&
+	    lseek(fd, 0, SEEK_SET) == 0) {
+#ifdef F_ADD_SEALS
+	    (void)fcntl(fd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+#endif
+	    return fd;
+	}
+	close(fd);
+    }
+#endif
+#ifdef PIPE_BUF
+    if (len <= PIPE_BUF) {
+	int pipes[2];
+
+	if (pipe(pipes) < 0)
+	    return -1;
+	if (write_loop(pipes[1], t, len) != len) {
+	    close(pipes[0]);
+	    close(pipes[1]);
+	    return -1;
+	}
+	close(pipes[1]);
+	return pipes[0];
+    }
+#endif
+    return -1;
+}
+
 /* open here string fd */
 
 /**/
@@ -3666,6 +4111,8 @@ getherestr(struct redir *fn)
      */
     if (!(fn->flags & REDIRF_FROM_HEREDOC))
 	t[len++] = '\n';
+    if ((fd = getherefd(t, len)) >= 0)
+	return fd;
     if ((fd = gettempfile(NULL, 1, &s)) < 0)
 	return -1;
     write_loop(fd, t, len);
@@ -3702,6 +4149,221 @@ simple_redir_name(Eprog prog, int redir_type)
     return NULL;
 }
 
+/*
+ * Builtins that may be run by a command substitution in the current
+ * shell with the CURRENT_SHELL_SUBST option, since they do nothing
+ * but produce output and a status.  Options which make them do
+ * something else are checked by substarg_ok().
+ */
+
+static char *substbuiltins[] = {
+    ":", "[", "echo", "false", "print", "printf", "pwd", "return",
+    "test", "true", NULL
+};
+
+/* How deep we look into shell functions called by the substitution */
+
+#define SUBST_FUNC_DEPTH 8
+
+/*
+ * Test if an argument to one of substbuiltins is harmless.  Nothing
+ * may be substituted other than parameters; assignments and
+ * subscripts are not allowed in parameter substitutions, and the
+ * builtins that evaluate arithmetic must not see increments or
+ * assignments.  print and printf may not have options that write
+ * anywhere else.  pos is 0 for an option, 1 for the first argument
+ * after the options and 2 for the rest.  This errs on the side of
+ * caution.
+ */
+
+static int
+substarg_ok(char *cmd, char *arg, int tok, int pos)
+{
+    char *s;
+    int braces = 0;
+
+    for (s = arg; tok && *s; s++) {
+	switch (*s) {
+	case Inpar:
+	case Inbrack:
+	case Tick:
+	case Qtick:
+	case Inang:
+	case OutangProc:
+	    return 0;
+
+	case Inbrace:
+	    braces++;
+	    break;
+
+	case Outbrace:
+	    if (braces)
+		braces--;
+	    break;
+
+	case '=':
+	case Equals:
+	    /* ${name=value} or =cmd */
+	    if (braces || (*s == Equals && s == arg))
+		return 0;
+	    break;
+	}
+    }
+    if (!pos) {
+	if (!strcmp(cmd, "print") || !strcmp(cmd, "printf"))
+	    for (s = arg + 1; *s; s++)
+		if (strchr("fszSv", *s))
+		    return 0;
+    } else if ((pos > 1 && !strcmp(cmd, "printf")) ||
+	       !strcmp(cmd, "test") || !strcmp(cmd, "[") ||
+	       !strcmp(cmd, "return")) {
+	/* Things that may be evaluated as arithmetic */
+	s = dupstring(arg);
+	untokenize(s);
+	if (strstr(s, "++") || (strstr(s, "--") && strcmp(s, "--")) ||
+	    (strchr(s, '=') && strcmp(s, "=") && strcmp(s, "==") &&
+	     strcmp(s, "!=")))
+	    return 0;
+    }
+    return 1;
+}
+
+/*
+ * Test if prog is safe to run in the current shell in place of
+ * a subshell for a command substitution: it must consist of simple
+ * commands without redirections or assignments, each using one of
+ * substbuiltins or a shell function with the same property.
+ * depth is the level of shell function we are looking at.
+ */
+
+static int
+substprog_ok(Eprog prog, int depth)
+{
+    Wordcode pc = prog->prog;
+    wordcode code, lcode;
+
+    if (prog == &dummy_eprog || depth > SUBST_FUNC_DEPTH)
+	return 0;
+    while (wc_code(lcode = *pc++) == WC_LIST) {
+	if (WC_LIST_TYPE(lcode) & (Z_SIMPLE|Z_ASYNC))
+	    return 0;
+	while (wc_code(code = *pc++) == WC_SUBLIST) {
+	    Wordcode next = pc + WC_SUBLIST_SKIP(code);
+	    Shfunc shf;
+	    char *cmd, **bp;
+	    int argc, tok, pos = 0;
+
+	    if ((WC_SUBLIST_FLAGS(code) &
+		 (WC_SUBLIST_SIMPLE|WC_SUBLIST_COPROC)) ||
+		wc_code(*pc) != WC_PIPE || WC_PIPE_TYPE(*pc) != WC_PIPE_END ||
+		wc_code(pc[1]) != WC_SIMPLE)
+		return 0;
+	    pc++;
+	    argc = WC_SIMPLE_ARGC(*pc++);
+	    if (!argc)
+		return 0;
+	    cmd = ecrawstr(prog, pc++, &tok);
+	    if (tok)
+		return 0;
+	    if ((shf = (Shfunc) shfunctab->getnode(shfunctab, cmd))) {
+		if ((shf->node.flags & PM_UNDEFINED) ||
+		    !substprog_ok(shf->funcdef, depth + 1))
+		    return 0;
+	    } else {
+		for (bp = substbuiltins; *bp; bp++)
+		    if (!strcmp(*bp, cmd))
+			break;
+		if (!*bp || !builtintab->getnode(builtintab, cmd) ||
+		    (!depth && !strcmp(cmd, "return")))
+		    return 0;
+	    }
+	    while (--argc) {
+		char *arg = ecrawstr(prog, pc++, &tok);
+
+		if (!pos) {
+		    /* Something substituted could turn out to be an option */
+		    if (tok && (!strcmp(cmd, "print") ||
+				!strcmp(cmd, "printf")))
+			return 0;
+		    if (tok || *arg != '-' || !strcmp(arg, "-") ||
+			!strcmp(arg, "--")) {
+			pos = 1;
+			if (!strcmp(arg, "--"))
+			    continue;
+		    }
+		}
+		if (!substarg_ok(cmd, arg, tok, pos))
+		    return 0;
+		if (pos)
+		    pos = 2;
+	    }
+	    pc = next;
+	    if (WC_SUBLIST_TYPE(code) == WC_SUBLIST_END)
+		break;
+	}
+	if (WC_LIST_TYPE(lcode) & Z_END)
+	    break;
+    }
+    return 1;
+}
+
+/*
+ * Run prog in the current shell, catching the output in a temporary
+ * file, for a command substitution.  This happens with the option
+ * CURRENT_SHELL_SUBST when substprog_ok() says there is nothing a
+ * subshell would need to hide from us.  Returns NULL if we couldn't
+ * set this up, in which case the caller forks as usual.
+ */
+
+static LinkList
+getoutputcursh(Eprog prog, int qt)
+{
+    LinkList retval;
+    char *nam, *ou;
+    int fd, ofd;
+
+    fflush(stdout);
+    if ((fd = gettempfile(NULL, 1, &nam)) < 0)
+	return NULL;
+    unlink(nam);
+    if ((fd = movefd(fd)) < 0)
+	return NULL;
+    if ((ofd = movefd(dup(1))) < 0) {
+	zclose(fd);
+	return NULL;
+    }
+    if (dup2(fd, 1) < 0) {
+	zclose(ofd);
+	zclose(fd);
+	return NULL;
+    }
+    ou = dupstring(zunderscore);
+    zsh_subshell++;
+    cmdoutval = 0;
+    cmdpush(CS_CMDSUBST);
+    useeprog(prog);
+    execode(prog, 1, 0, "cmdsubst");
+    freeeprog(prog);
+    cmdpop();
+    zsh_subshell--;
+    fflush(stdout);
+    clearerr(stdout);
+    dup2(ofd, 1);
+    zclose(ofd);
+    setunderscore(ou);
+    /* An error only ends the substitution, as it would in a subshell */
+    if (errflag) {
+	errflag = 0;
+	lastval = 1;
+    }
+    cmdoutval = lastval;
+    lseek(fd, 0, SEEK_SET);
+    retval = readoutput(fd, qt);
+    fdtable[fd] = FDT_UNUSED;
+    lastval = cmdoutval;
+    return retval;
+}
+
 /* $(...) */
 
 /**/
@@ -3713,7 +4375,7 @@ getoutput(char *cmd, int qt)
     pid_t pid;
     char *s;
 
-    if (!(prog = parse_string(cmd, 0)))
+    if (!(prog = parse_string_cached(cmd, 0)))
 	return NULL;
 
     if ((s = simple_redir_name(prog, REDIR_READ))) {
@@ -3730,6 +4392,14 @@ getoutput(char *cmd, int qt)
 	}
 	return readoutput(stream, qt);
     }
+    if (isset(CURRENTSHELLSUBST) && unset(ERREXIT) && unset(ERRRETURN) &&
+	!sigtrapped[SIGDEBUG] && !sigtrapped[SIGZERR] &&
+	substprog_ok(prog, 0)) {
+	LinkList retval;
+
+	if ((retval = getoutputcursh(prog, qt)))
+	    return retval;
+    }
     if (mpipe(pipes) < 0) {
 	errflag = 1;
 	cmdoutpid = 0;
@@ -3770,6 +4440,10 @@ getoutput(char *cmd, int qt)
     return NULL;
 }
 
+/* Size of the reads done to get the output of a command substitution */
+
+#define READOUTPUT_CHUNK 65536
+
 /* read output of command substitution */
 
 /**/
@@ -3777,44 +4451,49 @@ mod_export LinkList
 readoutput(int in, int qt)
 {
     LinkList ret;
-    char *buf, *ptr;
-    int bsiz, c, cnt = 0;
-    FILE *fin;
-
-    fin = fdopen(in, "r");
-    ret = newlinklist();
-    ptr = buf = (char *) hcalloc(bsiz = 64);
-    while ((c = fgetc(fin)) != EOF || errno == EINTR) {
-	if (c == EOF) {
-	    errno = 0;
-	    clearerr(fin);
-	    continue;
-	}
-	if (imeta(c)) {
-	    *ptr++ = Meta;
-	    c ^= 32;
-	    cnt++;
-	}
-	if (++cnt >= bsiz) {
-	    char *pp = (char *) hcalloc(bsiz *= 2);
+    char *buf, *rbuf;
+    size_t rsiz = READOUTPUT_CHUNK, rlen = 0;
+    ssize_t n;
+    struct stat st;
 
-	    memcpy(pp, buf, cnt - 1);
-	    ptr = (buf = pp) + cnt - 1;
-	}
-	*ptr++ = c;
-    }
-    fclose(fin);
-    while (cnt && ptr[-1] == '\n')
-	ptr--, cnt--;
-    *ptr = '\0';
-    if (qt) {
-	if (!cnt) {
-	    *ptr++ = Nularg;
-	    *ptr = '\0';
+    /*
+     * Read the raw output in large chunks and metafy it in one go at
+     * the end.  Reading a file directly, as for $(<file), we can
+     * usually get it all in the first read.
+     */
+    if (fstat(in, &st) == 0 && S_ISREG(st.st_mode) &&
+	st.st_size >= (off_t)rsiz && st.st_size < INT_MAX / 2)
+	rsiz = (size_t)st.st_size + 1;
+    rbuf = (char *) zalloc(rsiz);
+    for (;;) {
+	if (rlen == rsiz) {
+	    rsiz *= 2;
+	    rbuf = (char *) zrealloc(rbuf, rsiz);
 	}
+	if ((n = read(in, rbuf + rlen, rsiz - rlen)) > 0)
+	    rlen += n;
+	else if (n < 0 && errno == EINTR)
+	    errno = 0;
+	else
+	    break;
+    }
+    close(in);
+    runstats.output_bytes += rlen;
+    while (rlen && rbuf[rlen - 1] == '\n')
+	rlen--;
+    ret = newlinklist();
+    if (rlen)
+	buf = metafy(rbuf, (int)rlen, META_HEAPDUP);
+    else {
+	buf = (char *) hcalloc(2);
+	if (qt)
+	    *buf = Nularg;
+    }
+    zfree(rbuf, rsiz);
+    if (qt)
 	addlinknode(ret, buf);
-    } else {
-	char **words = spacesplit(buf, 0, 1, 0);
+    else {
+	char **words = spacesplit(buf, 0, 2, 0);
 
 	while (*words) {
 	    if (isset(GLOBSUBST))
@@ -4284,9 +4963,11 @@ execfuncdef(Estate state, UNUSED(int do_exec))
 	for (i = npats; i--; pp++)
 	    *pp = dummy_patprog1;
 	prog->shf = NULL;
+	prog->text = NULL;
 
 	shf = (Shfunc) zalloc(sizeof(*shf));
 	shf->funcdef = prog;
+	prog->shf = shf;
 	shf->node.flags = 0;
 	shf->filename = ztrdup(scriptfilename);
 	shf->lineno = lineno;
@@ -4387,6 +5068,13 @@ shfunc_set_sticky(Shfunc shf)
 }
 
 
+/*
+ * Set when doshfunc() is called with the words of a command line, which
+ * stay on the heap until it returns so needn't be copied to $argv.
+ */
+
+static int shfuncheapargs;
+
 /* Main entry point to execute a shell function. */
 
 /**/
@@ -4429,6 +5117,7 @@ execshfunc(Shfunc shf, LinkList args)
     if ((osfc = sfcontext) == SFC_NONE)
 	sfcontext = SFC_DIRECT;
     xtrerr = stderr;
+    shfuncheapargs = 1;
     doshfunc(shf, args, 0);
     sfcontext = osfc;
     free(cmdstack);
@@ -4452,6 +5141,8 @@ execautofn(Estate state, UNUSED(int do_exec))
     Shfunc shf;
     char *oldscriptname, *oldscriptfilename;
 
+    if (wc_data(state->pc[-1]))
+	return execlazyfn(state);
     if (!(shf = loadautofn(state->prog->shf, 1, 0)))
 	return 1;
 
@@ -4472,6 +5163,44 @@ execautofn(Estate state, UNUSED(int do_exec))
     return lastval;
 }
 
+/*
+ * Run the body of a function defined with LAZY_FUNCTIONS, which has
+ * been kept as text: parse it and, if the function hasn't changed,
+ * keep the parsed version as its definition for next time.
+ */
+
+/**/
+static int
+execlazyfn(Estate state)
+{
+    wordcode code = state->pc[-1];
+    Shfunc shf = state->prog->shf;
+    char *text = ecgetstr(state, EC_NODUP, NULL);
+    zlong oldlineno = lineno;
+    struct estate s;
+    Eprog prog;
+
+    lineno = WC_LAZYFN_LINENO(code);
+    prog = parse_string(text, 0);
+    lineno = oldlineno;
+    if (!prog || errflag)
+	return 1;
+    if (shf && shf->funcdef == state->prog) {
+	shf->funcdef = dupeprog(prog, 0);
+	freeeprog(state->prog);
+	prog = shf->funcdef;
+    }
+
+    s.prog = prog;
+    s.pc = prog->prog;
+    s.strs = prog->strs;
+    useeprog(prog);
+    execlist(&s, 1, 0);
+    freeeprog(prog);
+
+    return lastval;
+}
+
 /**/
 Shfunc
 loadautofn(Shfunc shf, int fksh, int autol)
@@ -4479,12 +5208,15 @@ loadautofn(Shfunc shf, int fksh, int autol)
     int noalias = noaliases, ksh = 1;
     Eprog prog;
     char *fname;
+    struct inittrace itr;
 
     pushheap();
 
+    inittrace_begin(&itr);
     noaliases = (shf->node.flags & PM_UNALIASED);
     prog = getfpfunc(shf->node.nam, &ksh, &fname);
     noaliases = noalias;
+    inittrace_end(&itr, "autoload", shf->node.nam);
 
     if (ksh == 1) {
 	ksh = fksh;
@@ -4609,6 +5341,7 @@ doshfunc(Shfunc shfunc, LinkList doshargs, int noreturnval)
 {
     char **pptab, **x, *oargv0;
     int oldzoptind, oldlastval, oldoptcind, oldnumpipestats, ret;
+    int opparamsheap = pparamsheap, heapargs = shfuncheapargs;
     int *oldpipestats = NULL;
     char saveopts[OPT_SIZE], *oldscriptname = scriptname;
     char *name = shfunc->node.nam;
@@ -4623,6 +5356,7 @@ doshfunc(Shfunc shfunc, LinkList doshargs, int noreturnval)
     static int funcdepth;
 #endif
 
+    shfuncheapargs = 0;
     pushheap();
 
     oargv0 = NULL;
@@ -4719,9 +5453,14 @@ doshfunc(Shfunc shfunc, LinkList doshargs, int noreturnval)
 	}
 	/* first node contains name regardless of option */
 	node = node->next;
-	for (; node; node = node->next, x++)
-	    *x = ztrdup(getdata(node));
+	if ((pparamsheap = heapargs))
+	    for (; node; node = node->next, x++)
+		*x = (char *) getdata(node);
+	else
+	    for (; node; node = node->next, x++)
+		*x = ztrdup(getdata(node));
     } else {
+	pparamsheap = 0;
 	pparams = (char **) zshcalloc(sizeof *pparams);
 	if (isset(FUNCTIONARGZERO)) {
 	    oargv0 = argzero;
@@ -4781,12 +5520,13 @@ doshfunc(Shfunc shfunc, LinkList doshargs, int noreturnval)
 	retflag = 0;
 	breaks = obreaks;
     }
-    freearray(pparams);
+    freepparams();
     if (oargv0) {
 	zsfree(argzero);
 	argzero = oargv0;
     }
     pparams = pptab;
+    pparamsheap = opparamsheap;
     optcind = oldoptcind;
     zoptind = oldzoptind;
     scriptname = oldscriptname;
@@ -4915,6 +5655,11 @@ getfpfunc(char *s, int *ksh, char **fname)
 	    return r;
 	}
 	unmetafy(buf, NULL);
+	if (!access(buf, R_OK) && (r = try_cache_file(buf, NULL, ksh))) {
+	    if (fname)
+		*fname = ztrdup(buf);
+	    return r;
+	}
 	if (!access(buf, R_OK) && (fd = open(buf, O_RDONLY | O_NOCTTY)) != -1) {
 	    if ((len = lseek(fd, 0, 2)) != -1) {
 		d = (char *) zalloc(len + 1);
@@ -5006,6 +5751,7 @@ stripkshdef(Eprog prog, char *name)
 	for (i = npats; i--; pp++)
 	    *pp = dummy_patprog1;
 	ret->shf = NULL;
+	ret->text = NULL;
 
 	return ret;
     }
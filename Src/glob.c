@@ -42,9 +42,15 @@ typedef struct gmatch *Gmatch;
 
 struct gmatch {
     char *name;
+    /*
+     * If set, a string which sorts with strcmp() as name does with
+     * zstrcmp(); see zcollkey().
+     */
+    char *namekey;
     /*
      * Array of sort strings:  one for each GS_EXEC sort type in
-     * the glob qualifiers.
+     * the glob qualifiers.  These are collation keys, too, if
+     * namekey is set.
      */
     char **sortstrs;
     off_t size ALIGN64;
@@ -105,6 +111,19 @@ int pathpos;		/* position in pathbuf (needed by pattern code) */
 /**/
 char *pathbuf;		/* pathname buffer (needed by pattern code) */
 
+/*
+ * Set by a for loop while it expands its argument.  A glob there
+ * with the (i) qualifier hands each match to this function as soon
+ * as it is found, instead of adding it to the list; a non-zero
+ * return stops the glob.
+ */
+
+/**/
+int (*globstreamfn) _((char *, void *));
+
+/**/
+void *globstreamdata;
+
 typedef struct stat *Statptr;	 /* This makes the Ultrix compiler happy.  Go figure. */
 
 /* modifier for unit conversions */
@@ -176,10 +195,19 @@ struct globdata {
     int gd_range, gd_amc, gd_units;
     int gd_gf_nullglob, gd_gf_markdirs, gd_gf_noglobdots, gd_gf_listtypes;
     int gd_gf_numsort;
-    int gd_gf_follow, gd_gf_sorts, gd_gf_nsorts;
+    int gd_gf_follow, gd_gf_sorts, gd_gf_nsorts, gd_gf_typeonly;
     struct globsort gd_gf_sortlist[MAX_SORTS];
     LinkList gd_gf_pre_words;
 
+    /* Passing matches to a for loop as they are found */
+    int gd_gf_stream;		/* (i) qualifier given			*/
+    int (*gd_gf_streamfn) _((char *, void *));
+    void *gd_gf_streamdata;
+    int gd_gf_streamct;		/* number of matches passed on		*/
+    int gd_gf_streamstop;	/* the loop has finished		*/
+    int gd_gf_streambase;	/* fd for the directory we started in	*/
+    int gd_gf_streamdir;	/* fd for the loop's directory, or -1	*/
+
     char *gd_glob_pre, *gd_glob_suf;
 };
 
@@ -208,8 +236,19 @@ static struct globdata curglobdata;
 #define gf_follow     (curglobdata.gd_gf_follow)
 #define gf_sorts      (curglobdata.gd_gf_sorts)
 #define gf_nsorts     (curglobdata.gd_gf_nsorts)
+#define gf_typeonly   (curglobdata.gd_gf_typeonly)
 #define gf_sortlist   (curglobdata.gd_gf_sortlist)
 #define gf_pre_words  (curglobdata.gd_gf_pre_words)
+#define gf_stream     (curglobdata.gd_gf_stream)
+#define gf_streamfn   (curglobdata.gd_gf_streamfn)
+#define gf_streamdata (curglobdata.gd_gf_streamdata)
+#define gf_streamct   (curglobdata.gd_gf_streamct)
+#define gf_streamstop (curglobdata.gd_gf_streamstop)
+#define gf_streambase (curglobdata.gd_gf_streambase)
+#define gf_streamdir  (curglobdata.gd_gf_streamdir)
+
+/* Test if scanner() has found all the matches it is going to need */
+#define scandone(sc)  (((sc) && (sc) == matchct) || gf_streamstop)
 
 /* and macros for save/restore */
 
@@ -259,6 +298,149 @@ addpath(char *s, int l)
     pathbuf[pathpos] = '\0';
 }
 
+/*
+ * Recursive globbing spends most of its time waiting for directories
+ * to be read and files to be examined.  When a recursive scan finds
+ * enough subdirectories, we fork processes to walk the trees below
+ * them ahead of the shell.  They only read the directories and stat
+ * the files, so that the information is in the system's caches by
+ * the time the shell gets there:  all the matching is still done
+ * here, in the same order as before.
+ */
+
+#if defined(HAVE_OPENAT) && defined(HAVE_FDOPENDIR) && \
+    defined(HAVE_FSTATAT) && defined(HAVE_DIRFD)
+# define GLOB_PREFETCH
+#endif
+
+#ifdef GLOB_PREFETCH
+
+#define GLOB_PREFETCH_MIN   8	/* subdirectories needed to bother */
+#define GLOB_PREFETCH_MAX   8	/* most processes to start */
+#define GLOB_PREFETCH_DEPTH 64	/* how far down the processes go */
+
+#ifndef O_DIRECTORY
+# define O_DIRECTORY 0
+#endif
+
+static pid_t *prefetchpids;
+static int nprefetchpids;
+
+/* Read the directory open on dfd and everything below it, then close it. */
+
+/**/
+static void
+prefetchtree(int dfd, int follow, int depth)
+{
+    DIR *dir = fdopendir(dfd);
+    struct dirent *de;
+
+    if (!dir) {
+	close(dfd);
+	return;
+    }
+    while ((de = readdir(dir))) {
+	char *nam = de->d_name;
+	struct stat st;
+	int sub;
+
+	if (nam[0] == '.' &&
+	    (gf_noglobdots || !nam[1] || (nam[1] == '.' && !nam[2])))
+	    continue;
+	if (fstatat(dirfd(dir), nam, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) ||
+	    !S_ISDIR(st.st_mode) || depth >= GLOB_PREFETCH_DEPTH)
+	    continue;
+	if ((sub = openat(dirfd(dir), nam, O_RDONLY | O_DIRECTORY | O_NOCTTY
+#ifdef O_NOFOLLOW
+			  | (follow ? 0 : O_NOFOLLOW)
+#endif
+		 )) >= 0)
+	    prefetchtree(sub, follow, depth + 1);
+    }
+    closedir(dir);
+}
+
+/*
+ * Start processes to read the trees below the subdirectories of the
+ * current path, subdirlen bytes of names as stored by scanner().
+ * The first is left out as the shell is about to look at it anyway.
+ */
+
+/**/
+static void
+prefetchstart(char *subdirs, int subdirlen, int follow)
+{
+    char *fn, *dnam;
+    long ncpu = 1;
+    int n = 0, i, w, nw;
+
+    for (fn = subdirs; fn < subdirs + subdirlen;
+	 fn += strlen(fn) + 1 + sizeof(int))
+	n++;
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    /* Leave a processor for the shell itself. */
+    nw = (int)ncpu - 1;
+    if (nw > GLOB_PREFETCH_MAX)
+	nw = GLOB_PREFETCH_MAX;
+    if (nw > n / GLOB_PREFETCH_MIN)
+	nw = n / GLOB_PREFETCH_MIN;
+    if (nw < 1)
+	return;
+
+    dnam = pathbuf[pathbufcwd] ? unmeta(pathbuf + pathbufcwd) : ".";
+    prefetchpids = (pid_t *)zalloc(nw * sizeof(pid_t));
+    nprefetchpids = 0;
+    for (w = 0; w < nw; w++) {
+	pid_t pid = fork();
+
+	if (pid == -1)
+	    break;
+	if (!pid) {
+	    int base = open(dnam, O_RDONLY | O_DIRECTORY | O_NOCTTY);
+
+	    signal_default(SIGINT);
+	    signal_default(SIGQUIT);
+	    if (base >= 0) {
+		for (fn = subdirs, i = 0; fn < subdirs + subdirlen;
+		     fn += strlen(fn) + 1 + sizeof(int), i++) {
+		    int sub;
+
+		    if (!i || (i - 1) % nw != w)
+			continue;
+		    if ((sub = openat(base, unmeta(fn),
+				      O_RDONLY | O_DIRECTORY | O_NOCTTY)) >= 0)
+			prefetchtree(sub, follow, 1);
+		}
+	    }
+	    _exit(0);
+	}
+	prefetchpids[nprefetchpids++] = pid;
+    }
+}
+
+/* Get rid of any processes started by prefetchstart(). */
+
+/**/
+static void
+prefetchend(void)
+{
+    int i;
+
+    if (!prefetchpids)
+	return;
+    for (i = 0; i < nprefetchpids; i++)
+	kill(prefetchpids[i], SIGKILL);
+    for (i = 0; i < nprefetchpids; i++)
+	waitpid(prefetchpids[i], NULL, 0);
+    zfree(prefetchpids, nprefetchpids * sizeof(pid_t));
+    prefetchpids = NULL;
+    nprefetchpids = 0;
+}
+
+#endif /* GLOB_PREFETCH */
+
 /* stat the filename s appended to pathbuf.  l should be true for lstat,    *
  * false for stat.  If st is NULL, the file is only checked for existance.  *
  * s == "" is treated as s == ".".  This is necessary since on most systems *
@@ -297,11 +479,14 @@ statfullpath(const char *s, struct stat *st, int l)
 
 char **inserts;
 
-/* add a match to the list */
+/*
+ * add a match to the list.  dmode is the file's type as given by
+ * readdir(), or 0 if that's not known.
+ */
 
 /**/
 static void
-insert(char *s, int checked)
+insert(char *s, int checked, int dmode)
 {
     struct stat buf, buf2, *bp;
     char *news = s;
@@ -310,7 +495,25 @@ insert(char *s, int checked)
     queue_signals();
     inserts = NULL;
 
-    if (gf_listtypes || gf_markdirs) {
+    if (dmode && gf_typeonly) {
+	/*
+	 * The file exists, and we don't need anything but its type
+	 * from the stat information, so there's no need to get it.
+	 */
+	memset(&buf, 0, sizeof(buf));
+	buf.st_mode = dmode;
+	checked = statted = 1;
+    }
+    if (statted) {
+	if (gf_markdirs && S_ISDIR(buf.st_mode)) {
+	    int ll = strlen(s);
+
+	    news = (char *) hcalloc(ll + 2);
+	    strcpy(news, s);
+	    news[ll] = file_type(buf.st_mode);
+	    news[ll + 1] = '\0';
+	}
+    } else if (gf_listtypes || gf_markdirs) {
 	/* Add the type marker to the end of the filename */
 	mode_t mode;
 	checked = statted = 1;
@@ -401,6 +604,7 @@ insert(char *s, int checked)
 	    statted |= 2;
 	}
 	matchptr->name = news;
+	matchptr->namekey = NULL;
 	if (statted & 1) {
 	    matchptr->size = buf.st_size;
 	    matchptr->atime = buf.st_atime;
@@ -448,6 +652,83 @@ insert(char *s, int checked)
     return;
 }
 
+#ifdef HAVE_FCHDIR
+/*
+ * Pass one match to the loop streaming the glob.  The loop body runs
+ * in the directory the shell thinks it is in, not whichever directory
+ * scanner() has moved to for a long path.  If the body changes
+ * directory, remember where it went for the next match and for when
+ * the glob finishes.
+ */
+
+/**/
+static int
+streammatch(char *name)
+{
+    int scanfd = -1, ret, err = 0;
+    char *opwd;
+
+    if (pathbufcwd) {
+	if ((scanfd = open(".", O_RDONLY | O_NOCTTY)) < 0)
+	    err = 1;
+	else
+	    err = fchdir(gf_streamdir >= 0 ? gf_streamdir : gf_streambase);
+    } else if (gf_streamdir >= 0)
+	err = fchdir(gf_streamdir);
+    if (err) {
+	if (scanfd >= 0)
+	    close(scanfd);
+	zerr("current directory lost during glob");
+	return 1;
+    }
+    opwd = ztrdup(pwd);
+    ret = gf_streamfn(name, gf_streamdata);
+    if (strcmp(opwd, pwd)) {
+	if (gf_streamdir >= 0)
+	    close(gf_streamdir);
+	if ((gf_streamdir = open(".", O_RDONLY | O_NOCTTY)) < 0)
+	    err = 1;
+    }
+    zsfree(opwd);
+    if (!err && (scanfd >= 0 || gf_streamdir >= 0))
+	err = fchdir(scanfd >= 0 ? scanfd : gf_streambase);
+    if (scanfd >= 0)
+	close(scanfd);
+    if (err) {
+	zerr("current directory lost during glob");
+	return 1;
+    }
+    return ret;
+}
+#endif
+
+/* Hand the matches found so far to the loop streaming the glob. */
+
+/**/
+static void
+streammatches(void)
+{
+#ifdef HAVE_FCHDIR
+    Gmatch gm;
+
+    for (gm = matchbuf; gm < matchptr && !gf_streamstop; gm++) {
+	if (gf_pre_words) {
+	    LinkNode n;
+
+	    for (n = firstnode(gf_pre_words); n && !gf_streamstop;
+		 incnode(n))
+		gf_streamstop = streammatch(dupstring((char *)getdata(n)));
+	    if (gf_streamstop)
+		break;
+	}
+	gf_streamstop = streammatch(gm->name);
+	gf_streamct++;
+    }
+#endif
+    matchptr = matchbuf;
+    matchct = 0;
+}
+
 /* Do the globbing:  scanner is called recursively *
  * with successive bits of the path until we've    *
  * tried all of it.                                */
@@ -472,7 +753,7 @@ scanner(Complist q, int shortcircuit)
 	    q->closure = 1;
 	else {
 	    scanner(q->next, shortcircuit);
-	    if (shortcircuit && shortcircuit == matchct)
+	    if (scandone(shortcircuit))
 		return;
 	}
     }
@@ -521,7 +802,7 @@ scanner(Complist q, int shortcircuit)
 		    addpath(str, l);
 		    if (!closure || !statfullpath("", NULL, 1)) {
 			scanner((q->closure) ? q : q->next, shortcircuit);
-			if (shortcircuit && shortcircuit == matchct)
+			if (scandone(shortcircuit))
 			    return;
 		    }
 		    pathbuf[pathpos = oppos] = '\0';
@@ -530,21 +811,24 @@ scanner(Complist q, int shortcircuit)
 	} else {
 	    if (str[l])
 		str = dupstrpfx(str, l);
-	    insert(str, 0);
-	    if (shortcircuit && shortcircuit == matchct)
+	    insert(str, 0, 0);
+	    if (gf_streamfn)
+		streammatches();
+	    if (scandone(shortcircuit))
 		return;
 	}
     } else {
 	/* Do pattern matching on current path section. */
 	char *fn = pathbuf[pathbufcwd] ? unmeta(pathbuf + pathbufcwd) : ".";
 	int dirs = !!q->next;
-	DIR *lock = opendir(fn);
+	struct dirlist dl;
 	char *subdirs = NULL;
-	int subdirlen = 0;
+	int subdirlen = 0, dmode;
 
-	if (lock == NULL)
+	if (opendirlist(fn, &dl))
 	    return;
-	while ((fn = zreaddir(lock, 1)) && !errflag) {
+	while ((fn = readdirlist(&dl, &dmode)) && !errflag &&
+	       !gf_streamstop) {
 	    /* prefix and suffix are zle trickery */
 	    if (!dirs && !colonmod &&
 		((glob_pre && !strpfx(glob_pre, fn))
@@ -597,7 +881,12 @@ scanner(Complist q, int shortcircuit)
 			errsfound = forceerrs + 1;
 			forceerrs = -1;
 		    }
-		    if (closure) {
+		    if (closure && dmode &&
+			(!S_ISLNK(dmode) || !q->follow)) {
+			/* readdir() told us if it's a directory */
+			if (!S_ISDIR(dmode))
+			    continue;
+		    } else if (closure) {
 			/* if matching multiple directories */
 			struct stat buf;
 
@@ -622,16 +911,23 @@ scanner(Complist q, int shortcircuit)
 		    subdirlen += sizeof(int);
 		} else {
 		    /* if the last filename component, just add it */
-		    insert(fn, 1);
-		    if (shortcircuit && shortcircuit == matchct)
-			return;
+		    insert(fn, 1, dmode);
+		    if (gf_streamfn)
+			streammatches();
+		    if (scandone(shortcircuit))
+			break;
 		}
 	    }
 	}
-	closedir(lock);
+	closedirlist(&dl);
 	if (subdirs) {
 	    int oppos = pathpos;
 
+#ifdef GLOB_PREFETCH
+	    if (closure && (p->flags & PAT_ANY) && !prefetchpids)
+		prefetchstart(subdirs, subdirlen, q->follow);
+#endif
+
 	    for (fn = subdirs; fn < subdirs+subdirlen; ) {
 		int l = strlen(fn);
 		addpath(fn, l);
@@ -640,8 +936,8 @@ scanner(Complist q, int shortcircuit)
 		fn += sizeof(int);
 		/* scan next level */
 		scanner((q->closure) ? q : q->next, shortcircuit); 
-		if (shortcircuit && shortcircuit == matchct)
-		    return;
+		if (scandone(shortcircuit))
+		    break;
 		pathbuf[pathpos = oppos] = '\0';
 	    }
 	    hrealloc(subdirs, subdirlen, 0);
@@ -890,7 +1186,11 @@ gmatchcmp(Gmatch a, Gmatch b)
     for (i = gf_nsorts, s = gf_sortlist; i; i--, s++) {
 	switch (s->tp & ~GS_DESC) {
 	case GS_NAME:
-	    r = zstrcmp(b->name, a->name, gf_numsort ? SORTIT_NUMERICALLY : 0);
+	    if (a->namekey)
+		r = strcmp(b->namekey, a->namekey);
+	    else
+		r = zstrcmp(b->name, a->name,
+			    gf_numsort ? SORTIT_NUMERICALLY : 0);
 	    break;
 	case GS_DEPTH:
 	    {
@@ -922,8 +1222,11 @@ gmatchcmp(Gmatch a, Gmatch b)
 		asortstrp++;
 		bsortstrp++;
 	    }
-	    r = zstrcmp(*bsortstrp, *asortstrp,
-			gf_numsort ? SORTIT_NUMERICALLY : 0);
+	    if (a->namekey)
+		r = strcmp(*bsortstrp, *asortstrp);
+	    else
+		r = zstrcmp(*bsortstrp, *asortstrp,
+			    gf_numsort ? SORTIT_NUMERICALLY : 0);
 	    break;
 	case GS_SIZE:
 	    r = b->size - a->size;
@@ -988,6 +1291,13 @@ gmatchcmp(Gmatch a, Gmatch b)
     return 0;
 }
 
+/**/
+static int
+gmatchpcmp(const void *a, const void *b)
+{
+    return gmatchcmp(*(Gmatch *)a, *(Gmatch *)b);
+}
+
 /*
  * Duplicate a list of qualifiers using the `next' linkage (not the
  * `or' linkage).  Return the head element and set *last (if last non-NULL)
@@ -1159,7 +1469,10 @@ zglob(LinkList list, LinkNode np, int nountok)
     int nobareglob = !isset(BAREGLOBQUAL);
     int shortcircuit = 0;		/* How many files to match;      */
 					/* 0 means no limit              */
+    int (*streamfn) _((char *, void *)) = globstreamfn;
 
+    /* Code run by this glob mustn't stream into the same loop. */
+    globstreamfn = NULL;
     if (unset(GLOBOPT) || !haswilds(ostr) || unset(EXECOPT)) {
 	if (!nountok)
 	    untokenize(ostr);
@@ -1191,6 +1504,8 @@ zglob(LinkList list, LinkNode np, int nountok)
     gf_numsort = isset(NUMERICGLOBSORT);
     gf_sorts = gf_nsorts = 0;
     gf_pre_words = NULL;
+    gf_stream = gf_streamct = gf_streamstop = 0;
+    gf_streamfn = NULL;
 
     /* Check for qualifiers */
     while (!nobareglob ||
@@ -1509,6 +1824,10 @@ zglob(LinkList list, LinkNode np, int nountok)
 		    /* Numeric glob sort */
 		    gf_numsort = !(sense & 1);
 		    break;
+		case 'i':
+		    /* Unsorted; a for loop may use matches as found */
+		    gf_stream = !(sense & 1);
+		    break;
 		case 'Y':
 		{
 		    /* Short circuit: limit number of matches */
@@ -1783,9 +2102,39 @@ zglob(LinkList list, LinkNode np, int nountok)
 	return;
     }
     if (!gf_nsorts) {
-	gf_sortlist[0].tp = gf_sorts = (shortcircuit ? GS_NONE : GS_NAME);
+	gf_sortlist[0].tp = gf_sorts =
+	    ((shortcircuit || gf_stream) ? GS_NONE : GS_NAME);
 	gf_nsorts = 1;
     }
+#ifdef HAVE_FCHDIR
+    /*
+     * Matches can go straight to the loop if they don't need
+     * sorting, and we know where they start and end.
+     */
+    if (gf_stream && streamfn && !shortcircuit && !first && end == -1 &&
+	(gf_sortlist[0].tp & GS_NONE) &&
+	(gf_streambase = open(".", O_RDONLY | O_NOCTTY)) >= 0) {
+	gf_streamfn = streamfn;
+	gf_streamdata = globstreamdata;
+	gf_streamdir = -1;
+    }
+#endif
+    /*
+     * See if we only need the type of each file, which readdir()
+     * may give us without a stat().
+     */
+    gf_typeonly = !gf_listtypes && !gf_follow &&
+	!(gf_sorts & (GS_NORMAL|GS_LINKED));
+    for (qo = quals; gf_typeonly && qo; qo = qo->or)
+	for (qn = qo; qn && qn->func; qn = qn->next)
+	    if ((qn->sense & 2) ||
+		(qn->func != qualisreg && qn->func != qualisdir &&
+		 qn->func != qualislnk && qn->func != qualissock &&
+		 qn->func != qualisfifo && qn->func != qualisblk &&
+		 qn->func != qualischr && qn->func != qualisdev)) {
+		gf_typeonly = 0;
+		break;
+	    }
     /* Initialise receptacle for matched files, *
      * expanded by insert() where necessary.    */
     matchptr = matchbuf = (Gmatch)zalloc((matchsz = 16) *
@@ -1796,9 +2145,23 @@ zglob(LinkList list, LinkNode np, int nountok)
     /* The actual processing takes place here: matches go into  *
      * matchbuf.  This is the only top-level call to scanner(). */
     scanner(q, shortcircuit);
+#ifdef GLOB_PREFETCH
+    prefetchend();
+#endif
+#ifdef HAVE_FCHDIR
+    if (gf_streamfn) {
+	/* Leave the shell wherever the loop body put it. */
+	if (gf_streamdir >= 0) {
+	    if (fchdir(gf_streamdir))
+		zerr("current directory lost during glob");
+	    close(gf_streamdir);
+	}
+	close(gf_streambase);
+    }
+#endif
 
     /* Deal with failures to match depending on options */
-    if (matchct)
+    if (matchct || gf_streamct)
 	badcshglob |= 2;	/* at least one cmd. line expansion O.K. */
     else if (!gf_nullglob) {
 	if (isset(CSHNULLGLOB)) {
@@ -1811,6 +2174,7 @@ zglob(LinkList list, LinkNode np, int nountok)
 	} else {
 	    /* treat as an ordinary string */
 	    untokenize(matchptr->name = dupstring(ostr));
+	    matchptr->namekey = NULL;
 	    matchptr++;
 	    matchct = 1;
 	}
@@ -1874,10 +2238,45 @@ zglob(LinkList list, LinkNode np, int nountok)
 	    }
 	}
 
+	if (!gf_numsort) {
+	    /*
+	     * Collate each string once now, rather than in every
+	     * comparison.  The keys are only needed if there are
+	     * strings to compare.
+	     */
+	    Gmatch tmpptr;
+	    int iexec;
+
+	    if ((gf_sorts & GS_NAME) || nexecs) {
+		for (tmpptr = matchbuf; tmpptr < matchptr; tmpptr++) {
+		    /* If there are no keys, it's the same for all */
+		    if (!(tmpptr->namekey = zcollkey(tmpptr->name)))
+			break;
+		    for (iexec = 0; iexec < nexecs; iexec++)
+			tmpptr->sortstrs[iexec] =
+			    zcollkey(tmpptr->sortstrs[iexec]);
+		}
+	    }
+	}
+
 	/* Sort arguments in to lexical (and possibly numeric) order. *
-	 * This is reversed to facilitate insertion into the list.    */
-	qsort((void *) & matchbuf[0], matchct, sizeof(struct gmatch),
-	      (int (*) _((const void *, const void *)))gmatchcmp);
+	 * This is reversed to facilitate insertion into the list.    *
+	 * The structures are big, so sort pointers to them.          */
+	{
+	    Gmatch *sortptrs = (Gmatch *)zalloc(matchct * sizeof(Gmatch));
+	    char **names = (char **)zalloc(matchct * sizeof(char *));
+	    int i;
+
+	    for (i = 0; i < matchct; i++)
+		sortptrs[i] = matchbuf + i;
+	    qsort((void *) sortptrs, matchct, sizeof(Gmatch), gmatchpcmp);
+	    for (i = 0; i < matchct; i++)
+		names[i] = sortptrs[i]->name;
+	    for (i = 0; i < matchct; i++)
+		matchbuf[i].name = names[i];
+	    zfree(sortptrs, matchct * sizeof(Gmatch));
+	    zfree(names, matchct * sizeof(char *));
+	}
     }
 
     if (first < 0) {
@@ -1890,7 +2289,21 @@ zglob(LinkList list, LinkNode np, int nountok)
     else if (end > matchct)
 	end = matchct;
     if ((end -= first) > 0) {
-	if (gf_sortlist[0].tp & GS_NONE) {
+	if (!gf_pre_words) {
+	    /* One node each for the matches, allocated together */
+	    LinkNode nn = insertlinknodes(list, node, end);
+
+	    if (gf_sortlist[0].tp & GS_NONE) {
+		/* Match list was never reversed. */
+		matchptr = matchbuf + matchct - first - end;
+		for (; end-- > 0; incnode(nn))
+		    setdata(nn, (matchptr++)->name);
+	    } else {
+		matchptr = matchbuf + matchct - first - 1;
+		for (; end-- > 0; incnode(nn))
+		    setdata(nn, (matchptr--)->name);
+	    }
+	} else if (gf_sortlist[0].tp & GS_NONE) {
 	    /* Match list was never reversed, so insert back to front. */
 	    matchptr = matchbuf + matchct - first - 1;
 	    while (end-- > 0) {
@@ -1936,6 +2349,38 @@ file_type(mode_t filemode)
 	return '?';
 }
 
+/*
+ * Check if str is nothing but a numeric brace range such as {1..100}
+ * or {10..-10..2}.  The words that such a range expands to are just
+ * numbers, so they need no further expansion.
+ */
+
+/**/
+int
+isbracerange(char *str)
+{
+    int n, nz;
+
+    if (*str++ != Inbrace || isset(BRACECCL))
+	return 0;
+    for (n = 0; n < 3; n++) {
+	if (n && (*str++ != '.' || *str++ != '.'))
+	    return 0;
+	if (*str == '-')
+	    str++;
+	if (!idigit(*str))
+	    return 0;
+	for (nz = 0; idigit(*str); str++)
+	    nz |= (*str != '0');
+	/* A zero increment isn't a range */
+	if (n == 2 && !nz)
+	    return 0;
+	if (*str == Outbrace)
+	    return n && !str[1];
+    }
+    return 0;
+}
+
 /* check to see if str is eligible for brace expansion */
 
 /**/
@@ -2165,6 +2610,10 @@ bracechardots(char *str, convchar_t *c1p, convchar_t *c2p)
     return 1;
 }
 
+/* Most nodes allocated at once for the elements of a numeric brace range */
+
+#define BRACE_RANGE_CHUNK 4096
+
 /* brace expansion */
 
 /**/
@@ -2301,18 +2750,35 @@ xpandbraces(LinkList list, LinkNode *np)
 		rend -= (rend - rstart) % rincr;
 	    }
 	    uremnode(list, node);
-	    for (; rend >= rstart; rend -= rincr) {
-		/* Node added in at end, so do highest first */
-		p = dupstring(str3);
+	    while (rend >= rstart) {
+		/*
+		 * Get nodes for as many elements as we can in one go,
+		 * up to a limit so a huge range doesn't need a single
+		 * huge block.  Values are made highest first, so fill
+		 * them from the end unless they're decreasing.
+		 */
+		zulong left = ((zulong)rend - (zulong)rstart) / rincr + 1;
+		int n = left > BRACE_RANGE_CHUNK ? BRACE_RANGE_CHUNK : (int)left;
+		LinkNode nn = insertlinknodes(list, last, n);
+
+		if (rev)
+		    last = nn + n - 1;
+		else
+		    nn += n - 1;
+		for (; n--; rend -= rincr) {
+		    p = dupstring(str3);
 #if defined(ZLONG_IS_LONG_LONG) && defined(PRINTF_HAS_LLD)
-		sprintf(p + strp, "%0*lld", minw, rend);
+		    sprintf(p + strp, "%0*lld", minw, rend);
 #else
-		sprintf(p + strp, "%0*ld", minw, (long)rend);
+		    sprintf(p + strp, "%0*ld", minw, (long)rend);
 #endif
-		strcat(p + strp, str2 + 1);
-		insertlinknode(list, last, p);
-		if (rev)	/* decreasing:  add in reverse order. */
-		    last = nextnode(last);
+		    strcat(p + strp, str2 + 1);
+		    setdata(nn, p);
+		    if (rev)
+			incnode(nn);
+		    else
+			decnode(nn);
+		}
 	    }
 	    *np = nextnode(olast);
 	    return;
@@ -2731,6 +3197,8 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
      * is anchored.  It goes on the heap.
      */
     LinkList repllist = NULL;
+    struct patstralloc psa;
+    char startch;
 
     /* perform must-match test for complex closures */
     if (p->mustoff)
@@ -2750,6 +3218,10 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 
     /* in case we used the prog before... */
     p->flags &= ~(PAT_NOTSTART|PAT_NOTEND);
+    /* unmetafy the string once, not for every position tried */
+    patallocstr(p, s, &psa);
+    /* non-zero if a match can only start with this byte */
+    startch = (p->patstartch && !imeta(p->patstartch)) ? p->patstartch : 0;
 
     if (fl & SUB_ALL) {
 	int i = matched && pattry(p, s);
@@ -2792,7 +3264,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		    mb_metacharinit();
 		    for (t = s, umlen = 0; t < s + mlen; ) {
 			set_pat_end(p, *t);
-			if (pattrylen(p, s, t - s, umlen, 0)) {
+			if (pattrylenalloc(p, &psa, s, t - s, umlen, 0)) {
 			    mlen = patmatchlen();
 			    break;
 			}
@@ -2819,7 +3291,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	    tmatch = NULL;
 	    for (ioff = 0, t = s, umlen = umltot; t < s + l; ioff++) {
 		set_pat_start(p, t-s);
-		if (pattrylen(p, t, s + l - t, umlen, ioff))
+		if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff))
 		    tmatch = t;
 		if (fl & SUB_START)
 		    break;
@@ -2829,7 +3301,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		*sp = get_match_ret(*sp, tmatch - s, l, fl, replstr, NULL);
 		return 1;
 	    }
-	    if (!(fl & SUB_START) && pattrylen(p, s + l, 0, 0, ioff)) {
+	    if (!(fl & SUB_START) && pattrylenalloc(p, &psa, s + l, 0, 0, ioff)) {
 		*sp = get_match_ret(*sp, l, l, fl, replstr, NULL);
 		return 1;
 	    }
@@ -2842,7 +3314,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	    mb_metacharinit();
 	    for (ioff = 0, t = s, umlen = umltot; t < s + l; ioff++) {
 		set_pat_start(p, t-s);
-		if (pattrylen(p, t, s + l - t, umlen, ioff)) {
+		if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff)) {
 		    *sp = get_match_ret(*sp, t-s, l, fl, replstr, NULL);
 		    return 1;
 		}
@@ -2850,7 +3322,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		    break;
 		umlen -= iincchar(&t);
 	    }
-	    if (!(fl & SUB_START) && pattrylen(p, s + l, 0, 0, ioff)) {
+	    if (!(fl & SUB_START) && pattrylenalloc(p, &psa, s + l, 0, 0, ioff)) {
 		*sp = get_match_ret(*sp, l, l, fl, replstr, NULL);
 		return 1;
 	    }
@@ -2878,9 +3350,13 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		/* loop over all matches for global substitution */
 		matched = 0;
 		for (; t < s + l; ioff++) {
+		    if (startch && *t != startch) {
+			umlen -= iincchar(&t);
+			continue;
+		    }
 		    /* Find the longest match from this position. */
 		    set_pat_start(p, t-s);
-		    if (pattrylen(p, t, s + l - t, umlen, ioff)) {
+		    if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff)) {
 			char *mpos = t + patmatchlen();
 			if (!(fl & SUB_LONG) && !(p->flags & PAT_PURES)) {
 			    char *ptr;
@@ -2894,7 +3370,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 			     */
 			    for (ptr = t, umlen2 = 0; ptr < mpos;) {
 				set_pat_end(p, *ptr);
-				if (pattrylen(p, t, ptr - t, umlen2, ioff)) {
+				if (pattrylenalloc(p, &psa, t, ptr - t, umlen2, ioff)) {
 				    mpos = t + patmatchlen();
 				    break;
 				}
@@ -2953,7 +3429,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	    /* Longest/shortest at end, matching substrings.       */
 	    if (!(fl & SUB_LONG)) {
 		set_pat_start(p, l);
-		if (pattrylen(p, s + l, 0, 0, umltot) && !--n) {
+		if (pattrylenalloc(p, &psa, s + l, 0, 0, umltot) && !--n) {
 		    *sp = get_match_ret(*sp, l, l, fl, replstr, NULL);
 		    return 1;
 		}
@@ -2973,7 +3449,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	    mb_metacharinit();
 	    for (ioff = 0, t = s, umlen = umltot; t < s + l; ioff++) {
 		set_pat_start(p, t-s);
-		if (pattrylen(p, t, s + l - t, umlen, ioff)) {
+		if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff)) {
 		    nmatches++;
 		    tmatch = t;
 		}
@@ -2989,7 +3465,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		    mb_metacharinit();
 		    for (ioff = 0, t = s, umlen = umltot; t < s + l; ioff++) {
 			set_pat_start(p, t-s);
-			if (pattrylen(p, t, s + l - t, umlen, ioff) &&
+			if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff) &&
 			    !n--) {
 			    tmatch = t;
 			    break;
@@ -3002,7 +3478,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		if (!(fl & SUB_LONG) && !(p->flags & PAT_PURES)) {
 		    for (t = tmatch, umlen = 0; t < mpos; ) {
 			set_pat_end(p, *t);
-			if (pattrylen(p, tmatch, t - tmatch, umlen, ioff)) {
+			if (pattrylenalloc(p, &psa, tmatch, t - tmatch, umlen, ioff)) {
 			    mpos = tmatch + patmatchlen();
 			    break;
 			}
@@ -3014,7 +3490,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		return 1;
 	    }
 	    set_pat_start(p, l);
-	    if ((fl & SUB_LONG) && pattrylen(p, s + l, 0, 0, umltot) && !--n) {
+	    if ((fl & SUB_LONG) && pattrylenalloc(p, &psa, s + l, 0, 0, umltot) && !--n) {
 		*sp = get_match_ret(*sp, l, l, fl, replstr, NULL);
 		return 1;
 	    }
@@ -3094,6 +3570,8 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
      * is anchored.  It goes on the heap.
      */
     LinkList repllist = NULL;
+    struct patstralloc psa;
+    char startch;
 
     /* perform must-match test for complex closures */
     if (p->mustoff)
@@ -3113,6 +3591,10 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 
     /* in case we used the prog before... */
     p->flags &= ~(PAT_NOTSTART|PAT_NOTEND);
+    /* unmetafy the string once, not for every position tried */
+    patallocstr(p, s, &psa);
+    /* non-zero if a match can only start with this byte */
+    startch = (p->patstartch && !imeta(p->patstartch)) ? p->patstartch : 0;
 
     if (fl & SUB_ALL) {
 	int i = matched && pattry(p, s);
@@ -3139,7 +3621,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		     */
 		    for (t = s, umlen = 0; t < s + mlen; METAINC(t), umlen++) {
 			set_pat_end(p, *t);
-			if (pattrylen(p, s, t - s, umlen, 0)) {
+			if (pattrylenalloc(p, &psa, s, t - s, umlen, 0)) {
 			    mlen = patmatchlen();
 			    break;
 			}
@@ -3159,7 +3641,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		if (t > s && t[-1] == Meta)
 		    t--;
 		set_pat_start(p, t-s);
-		if (pattrylen(p, t, s + l - t, umlen, ioff)) {
+		if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff)) {
 		    *sp = get_match_ret(*sp, t - s, l, fl, replstr, NULL);
 		    return 1;
 		}
@@ -3175,7 +3657,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	    for (ioff = 0, t = s, umlen = uml; t < s + l;
 		 ioff++, METAINC(t), umlen--) {
 		set_pat_start(p, t-s);
-		if (pattrylen(p, t, s + l - t, umlen, ioff)) {
+		if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff)) {
 		    *sp = get_match_ret(*sp, t-s, l, fl, replstr, NULL);
 		    return 1;
 		}
@@ -3205,9 +3687,11 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		/* loop over all matches for global substitution */
 		matched = 0;
 		for (; t < s + l; METAINC(t), ioff++, umlen--) {
+		    if (startch && *t != startch)
+			continue;
 		    /* Find the longest match from this position. */
 		    set_pat_start(p, t-s);
-		    if (pattrylen(p, t, s + l - t, umlen, ioff)) {
+		    if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff)) {
 			char *mpos = t + patmatchlen();
 			if (!(fl & SUB_LONG) && !(p->flags & PAT_PURES)) {
 			    char *ptr;
@@ -3215,7 +3699,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 			    for (ptr = t, umlen2 = 0; ptr < mpos;
 				 METAINC(ptr), umlen2++) {
 				set_pat_end(p, *ptr);
-				if (pattrylen(p, t, ptr - t, umlen2, ioff)) {
+				if (pattrylenalloc(p, &psa, t, ptr - t, umlen2, ioff)) {
 				    mpos = t + patmatchlen();
 				    break;
 				}
@@ -3272,7 +3756,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	    /* Longest/shortest at end, matching substrings.       */
 	    if (!(fl & SUB_LONG)) {
 		set_pat_start(p, l);
-		if (pattrylen(p, s + l, 0, 0, uml) && !--n) {
+		if (pattrylenalloc(p, &psa, s + l, 0, 0, uml) && !--n) {
 		    *sp = get_match_ret(*sp, l, l, fl, replstr, NULL);
 		    return 1;
 		}
@@ -3282,7 +3766,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		if (t > s && t[-1] == Meta)
 		    t--;
 		set_pat_start(p, t-s);
-		if (pattrylen(p, t, s + l - t, umlen, ioff) && !--n) {
+		if (pattrylenalloc(p, &psa, t, s + l - t, umlen, ioff) && !--n) {
 		    /* Found the longest match */
 		    char *mpos = t + patmatchlen();
 		    if (!(fl & SUB_LONG) && !(p->flags & PAT_PURES)) {
@@ -3291,7 +3775,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 			for (ptr = t, umlen2 = 0; ptr < mpos;
 			     METAINC(ptr), umlen2++) {
 			    set_pat_end(p, *ptr);
-			    if (pattrylen(p, t, ptr - t, umlen2, ioff)) {
+			    if (pattrylenalloc(p, &psa, t, ptr - t, umlen2, ioff)) {
 				mpos = t + patmatchlen();
 				break;
 			    }
@@ -3303,7 +3787,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 		}
 	    }
 	    set_pat_start(p, l);
-	    if ((fl & SUB_LONG) && pattrylen(p, s + l, 0, 0, uml) && !--n) {
+	    if ((fl & SUB_LONG) && pattrylenalloc(p, &psa, s + l, 0, 0, uml) && !--n) {
 		*sp = get_match_ret(*sp, l, l, fl, replstr, NULL);
 		return 1;
 	    }
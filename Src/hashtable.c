@@ -41,9 +41,20 @@
 
 #define HASHTABLE_INTERNAL_MEMBERS \
     ScanStatus scan;		/* status of a scan over this hashtable     */ \
+    HashSlot slots;		/* open addressing index, or NULL           */ \
+    int slotmask;		/* number of slots - 1                      */ \
+    int slotct;			/* number of slots in use                   */ \
+    HashNode *order;		/* indexed nodes in order of addition       */ \
+    int orderct;		/* number of entries used in order[]        */ \
+    int ordersize;		/* number of entries allocated in order[]   */ \
+    int orderholes;		/* entries of removed nodes in order[]      */ \
+    int hbase;			/* number of buckets at start of this round */ \
+    int hsplit;			/* next bucket to split in this round       */ \
+    int hcap;			/* number of entries allocated in nodes[]   */ \
     HASHTABLE_DEBUG_MEMBERS
 
 typedef struct scanstatus *ScanStatus;
+typedef struct hashslot *HashSlot;
 
 #include "zsh.mdh"
 #include "hashtable.pro"
@@ -66,6 +77,47 @@ struct scanstatus {
     } u;
 };
 
+/*
+ * A slot in the open addressing index of a hash table.  If a table
+ * has an index, every node in it is also entered into the index, under
+ * the full value of the table's hash function; lookups then probe the
+ * slots linearly from the hash value, comparing the stored hash values,
+ * and only compare keys when those agree.  The chains hanging off nodes[]
+ * are still maintained as they are what is used to scan a table, both
+ * here and elsewhere in the shell.  Empty slots have a NULL node; the
+ * index is kept at most half full, and deletion shifts back following
+ * entries, so there are no tombstones.
+ *
+ * A table with an index also keeps its nodes in order[], densely and
+ * in the order they were added, which the slots refer to; scans of
+ * the table that don't sort it go through that, so they see nodes in
+ * that order and in consecutive memory.  A removed node leaves a NULL
+ * entry behind, and order[] is compacted when it has too many.
+ */
+
+struct hashslot {
+    unsigned hashval;
+    int ord;			/* index into order[] */
+    HashNode node;
+};
+
+/* Initial number of slots in an index: must be a power of two */
+
+#define HASHSLOT_MIN 8
+
+/*
+ * Hash tables grow by linear hashing.  A round starts with hbase
+ * buckets; buckets are split in order, each into itself and the bucket
+ * hbase above it, until the number of buckets has doubled and the next
+ * round starts.  Hence the nodes are always in nodes[0] to
+ * nodes[hsize-1] for anything scanning the table, but no single
+ * addition has to rehash the whole table.  This is the most buckets
+ * split at once: more than one lets a table catch up on splits it
+ * couldn't do while it was being scanned.
+ */
+
+#define HASHSPLIT_MAX 4
+
 /********************************/
 /* Generic Hash Table functions */
 /********************************/
@@ -88,6 +140,223 @@ hasher(const char *str)
     return hashval;
 }
 
+/*
+ * Alternative hash function which mixes the key four bytes at a time
+ * (the mixing steps are those of MurmurHash3).  This gives a better
+ * spread than hasher(), which matters for tables with an index where
+ * the full hash value is used.
+ */
+
+/**/
+mod_export unsigned
+wordhasher(const char *str)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    unsigned hashval = 0x9747b28cU, w, len = 0;
+    int i;
+
+    for (;;) {
+	for (w = 0, i = 0; i < 4 && s[i]; i++)
+	    w |= (unsigned) s[i] << (8 * i);
+	if (!i)
+	    break;
+	s += i;
+	len += i;
+	w *= 0xcc9e2d51U;
+	w = (w << 15) | (w >> 17);
+	w *= 0x1b873593U;
+	hashval ^= w;
+	if (i < 4)
+	    break;
+	hashval = (hashval << 13) | (hashval >> 19);
+	hashval = hashval * 5 + 0xe6546b64U;
+    }
+    hashval ^= len;
+    hashval ^= hashval >> 16;
+    hashval *= 0x85ebca6bU;
+    hashval ^= hashval >> 13;
+    hashval *= 0xc2b2ae35U;
+    hashval ^= hashval >> 16;
+
+    return hashval;
+}
+
+/* Get the bucket in nodes[] for the hash value hashval. */
+
+/**/
+static unsigned
+hashbucket(HashTable ht, unsigned hashval)
+{
+    unsigned b = hashval % ht->hbase;
+
+    if (b < (unsigned) ht->hsplit)
+	b = hashval % (2 * (unsigned) ht->hbase);
+    return b;
+}
+
+/*
+ * Find the slot in the index of ht for the key nam with hash value
+ * hashval.  This is either the slot holding the node for the key, or
+ * the empty slot where it would be put.
+ */
+
+/**/
+static HashSlot
+findhashslot(HashTable ht, unsigned hashval, const char *nam)
+{
+    HashSlot slots = ht->slots, sl;
+    unsigned i = hashval & ht->slotmask;
+
+    for (;;) {
+	sl = slots + i;
+	if (!sl->node ||
+	    (sl->hashval == hashval && ht->cmpnodes(sl->node->nam, nam) == 0))
+	    return sl;
+	i = (i + 1) & ht->slotmask;
+    }
+}
+
+/* Allocate the index of ht with nslots slots and enter all the nodes. */
+
+/**/
+static void
+fillhashslots(HashTable ht, int nslots)
+{
+    HashNode hn;
+    HashSlot sl;
+    int i;
+
+    ht->slots = (HashSlot) zshcalloc(nslots * sizeof(struct hashslot));
+    ht->slotmask = nslots - 1;
+    ht->slotct = 0;
+    ht->ordersize = nslots / 2;
+    ht->order = (HashNode *) zalloc(ht->ordersize * sizeof(HashNode));
+    ht->orderct = ht->orderholes = 0;
+    for (i = 0; i < ht->hsize; i++)
+	for (hn = ht->nodes[i]; hn; hn = hn->next) {
+	    unsigned hashval = ht->hash(hn->nam);
+
+	    sl = findhashslot(ht, hashval, hn->nam);
+	    sl->hashval = hashval;
+	    sl->ord = ht->orderct;
+	    sl->node = ht->order[ht->orderct++] = hn;
+	    ht->slotct++;
+	}
+}
+
+/*
+ * Squeeze the entries of removed nodes out of order[], and make the
+ * slots refer to the new positions.
+ */
+
+/**/
+static void
+compacthashorder(HashTable ht)
+{
+    int *newpos = (int *) zalloc(ht->orderct * sizeof(int));
+    int i, j, nslots = ht->slotmask + 1;
+
+    for (i = j = 0; i < ht->orderct; i++) {
+	newpos[i] = j;
+	if (ht->order[i])
+	    ht->order[j++] = ht->order[i];
+    }
+    for (i = 0; i < nslots; i++)
+	if (ht->slots[i].node)
+	    ht->slots[i].ord = newpos[ht->slots[i].ord];
+    zfree(newpos, ht->orderct * sizeof(int));
+    ht->orderct = j;
+    ht->orderholes = 0;
+}
+
+/* Enter a new node into the empty slot sl of the index of ht. */
+
+/**/
+static void
+addhashslot(HashTable ht, HashSlot sl, unsigned hashval, HashNode hn)
+{
+    sl->hashval = hashval;
+    sl->node = hn;
+    if (ht->orderct == ht->ordersize) {
+	if (ht->orderholes * 2 > ht->orderct && !ht->scan)
+	    compacthashorder(ht);
+	else {
+	    ht->ordersize *= 2;
+	    ht->order = (HashNode *) zrealloc(ht->order,
+					      ht->ordersize * sizeof(HashNode));
+	}
+    }
+    sl->ord = ht->orderct;
+    ht->order[ht->orderct++] = hn;
+    if (++ht->slotct * 2 > ht->slotmask + 1) {
+	/* Double the index; the stored hash values are reused. */
+	HashSlot oslots = ht->slots, osl, nsl;
+	int onslots = ht->slotmask + 1, i;
+	unsigned j;
+
+	ht->slots = (HashSlot) zshcalloc(2 * onslots * sizeof(struct hashslot));
+	ht->slotmask = 2 * onslots - 1;
+	for (i = 0, osl = oslots; i < onslots; i++, osl++) {
+	    if (!osl->node)
+		continue;
+	    for (j = osl->hashval & ht->slotmask; ht->slots[j].node;
+		 j = (j + 1) & ht->slotmask)
+		;
+	    nsl = ht->slots + j;
+	    *nsl = *osl;
+	}
+	zfree(oslots, onslots * sizeof(struct hashslot));
+    }
+}
+
+/* Remove the entry in slot sl of the index of ht. */
+
+/**/
+static void
+removehashslot(HashTable ht, HashSlot sl)
+{
+    unsigned i = sl - ht->slots, j = i, home;
+
+    ht->order[sl->ord] = NULL;
+    ht->orderholes++;
+    /*
+     * Move back any following entry which would no longer be
+     * found once this slot is empty, i.e. whose home slot does not
+     * lie cyclically within (i, j].
+     */
+    for (;;) {
+	j = (j + 1) & ht->slotmask;
+	if (!ht->slots[j].node)
+	    break;
+	home = ht->slots[j].hashval & ht->slotmask;
+	if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+	    continue;
+	ht->slots[i] = ht->slots[j];
+	i = j;
+    }
+    ht->slots[i].node = NULL;
+    ht->slotct--;
+}
+
+/*
+ * Give a hash table an open addressing index, making lookups faster
+ * for big tables at the cost of some memory.  This should be done
+ * once all the table's methods are set up.
+ */
+
+/**/
+mod_export void
+indexhashtable(HashTable ht)
+{
+    int nslots = HASHSLOT_MIN;
+
+    if (ht->slots)
+	return;
+    while (nslots < 2 * ht->ct + 2)
+	nslots *= 2;
+    fillhashslots(ht, nslots);
+}
+
 /* Get a new hash table */
 
 /**/
@@ -109,10 +378,12 @@ newhashtable(int size, UNUSED(char const *name), UNUSED(PrintTableStats printinf
     ht->tablename = ztrdup(name);
 #endif /* ZSH_HASH_DEBUG */
     ht->nodes = (HashNode *) zshcalloc(size * sizeof(HashNode));
-    ht->hsize = size;
+    ht->hsize = ht->hbase = ht->hcap = size;
+    ht->hsplit = 0;
     ht->ct = 0;
     ht->scan = NULL;
     ht->scantab = NULL;
+    ht->slots = NULL;
     return ht;
 }
 
@@ -135,7 +406,11 @@ deletehashtable(HashTable ht)
 	firstht = ht->next;
     zsfree(ht->tablename);
 #endif /* ZSH_HASH_DEBUG */
-    zfree(ht->nodes, ht->hsize * sizeof(HashNode));
+    zfree(ht->nodes, ht->hcap * sizeof(HashNode));
+    if (ht->slots) {
+	zfree(ht->slots, (ht->slotmask + 1) * sizeof(struct hashslot));
+	zfree(ht->order, ht->ordersize * sizeof(HashNode));
+    }
     zfree(ht, sizeof(*ht));
 }
 
@@ -168,7 +443,31 @@ addhashnode2(HashTable ht, char *nam, void *nodeptr)
     hn = (HashNode) nodeptr;
     hn->nam = nam;
 
-    hashval = ht->hash(hn->nam) % ht->hsize;
+    hashval = ht->hash(hn->nam);
+    if (ht->slots) {
+	HashSlot sl = findhashslot(ht, hashval, hn->nam);
+	HashNode *bucket = ht->nodes + hashbucket(ht, hashval);
+
+	if (!sl->node) {
+	    hn->next = *bucket;
+	    *bucket = hn;
+	    addhashslot(ht, sl, hashval, hn);
+	    if (++ht->ct >= ht->hsize * 2 && !ht->scan)
+		expandhashtable(ht);
+	    return NULL;
+	}
+	hp = sl->node;
+	sl->node = ht->order[sl->ord] = hn;
+	if (*bucket == hp)
+	    *bucket = hn;
+	else {
+	    for (hq = *bucket; hq->next != hp; hq = hq->next)
+		;
+	    hq->next = hn;
+	}
+	goto replacing;
+    }
+    hashval = hashbucket(ht, hashval);
     hp = ht->nodes[hashval];
 
     /* check if this is the first node for this hash value */
@@ -228,7 +527,13 @@ gethashnode(HashTable ht, const char *nam)
     unsigned hashval;
     HashNode hp;
 
-    hashval = ht->hash(nam) % ht->hsize;
+    runstats.hash_lookups++;
+    hashval = ht->hash(nam);
+    if (ht->slots) {
+	hp = findhashslot(ht, hashval, nam)->node;
+	return (hp && !(hp->flags & DISABLED)) ? hp : NULL;
+    }
+    hashval = hashbucket(ht, hashval);
     for (hp = ht->nodes[hashval]; hp; hp = hp->next) {
 	if (ht->cmpnodes(hp->nam, nam) == 0) {
 	    if (hp->flags & DISABLED)
@@ -252,7 +557,11 @@ gethashnode2(HashTable ht, const char *nam)
     unsigned hashval;
     HashNode hp;
 
-    hashval = ht->hash(nam) % ht->hsize;
+    runstats.hash_lookups++;
+    hashval = ht->hash(nam);
+    if (ht->slots)
+	return findhashslot(ht, hashval, nam)->node;
+    hashval = hashbucket(ht, hashval);
     for (hp = ht->nodes[hashval]; hp; hp = hp->next) {
 	if (ht->cmpnodes(hp->nam, nam) == 0)
 	    return hp;
@@ -272,7 +581,24 @@ removehashnode(HashTable ht, const char *nam)
     unsigned hashval;
     HashNode hp, hq;
 
-    hashval = ht->hash(nam) % ht->hsize;
+    hashval = ht->hash(nam);
+    if (ht->slots) {
+	HashSlot sl = findhashslot(ht, hashval, nam);
+	HashNode *bucket = ht->nodes + hashbucket(ht, hashval);
+
+	if (!(hp = sl->node))
+	    return NULL;
+	removehashslot(ht, sl);
+	if (*bucket == hp)
+	    *bucket = hp->next;
+	else {
+	    for (hq = *bucket; hq->next != hp; hq = hq->next)
+		;
+	    hq->next = hp->next;
+	}
+	goto gotit;
+    }
+    hashval = hashbucket(ht, hashval);
     hp = ht->nodes[hashval];
 
     /* if no nodes at this hash value, return NULL */
@@ -410,6 +736,29 @@ scanmatchtable(HashTable ht, Patprog pprog, int sorted,
 	    }
 	}
 
+	ht->scan = NULL;
+    } else if (ht->slots) {
+	/*
+	 * Go through the nodes in order of addition.  Nodes added
+	 * during the scan are not seen; removed ones leave NULLs,
+	 * and order[] isn't compacted while the scan is going on.
+	 */
+	int i, ct = ht->orderct;
+
+	st.sorted = 0;
+	st.u.u = NULL;
+	ht->scan = &st;
+
+	for (i = 0; i < ct; i++) {
+	    HashNode hn = ht->order[i];
+
+	    if (hn && (!flags1 || (hn->flags & flags1)) &&
+		!(hn->flags & flags2) && (!pprog || pattry(pprog, hn->nam))) {
+		match++;
+		scanfunc(hn, scanflags);
+	    }
+	}
+
 	ht->scan = NULL;
     } else {
 	int i, hsize = ht->hsize;
@@ -446,32 +795,52 @@ scanhashtable(HashTable ht, int sorted, int flags1, int flags2,
 }
 
 /* Expand hash tables when they get too many entries. *
- * The new size is 4 times the previous size.         */
+ * This splits a few buckets as described above.      */
 
 /**/
 static void
 expandhashtable(HashTable ht)
 {
-    struct hashnode **onodes, **ha, *hn, *hp;
-    int i, osize;
-
-    osize = ht->hsize;
-    onodes = ht->nodes;
-
-    ht->hsize = osize * 4;
-    ht->nodes = (HashNode *) zshcalloc(ht->hsize * sizeof(HashNode));
-    ht->ct = 0;
+    struct hashnode *hn, *hp, **lo, **hi;
+    unsigned size2;
+    int n;
+
+    for (n = 0; n < HASHSPLIT_MAX && ht->ct >= ht->hsize * 2; n++) {
+	size2 = 2 * (unsigned) ht->hbase;
+	if (ht->hsize == ht->hcap) {
+	    /* room for all the buckets of this round */
+	    ht->nodes = (HashNode *) zrealloc(ht->nodes,
+					      size2 * sizeof(HashNode));
+	    ht->hcap = size2;
+	}
 
-    /* scan through the old list of nodes, and *
-     * rehash them into the new list of nodes  */
-    for (i = 0, ha = onodes; i < osize; i++, ha++) {
-	for (hn = *ha; hn;) {
+	/*
+	 * Nodes in bucket hsplit either stay there or move up to the
+	 * new bucket at the end; keep them in the same order.
+	 */
+	hn = ht->nodes[ht->hsplit];
+	lo = ht->nodes + ht->hsplit;
+	hi = ht->nodes + ht->hsize;
+	for (; hn; hn = hp) {
 	    hp = hn->next;
-	    ht->addnode(ht, hn->nam, hn);
-	    hn = hp;
+	    if (ht->hash(hn->nam) % size2 == (unsigned) ht->hsplit) {
+		*lo = hn;
+		lo = &hn->next;
+	    } else {
+		*hi = hn;
+		hi = &hn->next;
+	    }
+	}
+	*lo = *hi = NULL;
+
+	ht->hsize++;
+	if (++ht->hsplit == ht->hbase) {
+	    ht->hbase = size2;
+	    ht->hsplit = 0;
 	}
     }
-    zfree(onodes, osize * sizeof(HashNode));
+    if (n)
+	runstats.hash_expansions++;
 }
 
 /* Empty the hash table and resize it if necessary */
@@ -495,14 +864,21 @@ resizehashtable(HashTable ht, int newsize)
 
     /* If new size desired is different from current size, *
      * we free it and allocate a new nodes array.          */
-    if (ht->hsize != newsize) {
-	zfree(ht->nodes, ht->hsize * sizeof(HashNode));
+    if (ht->hcap != newsize) {
+	zfree(ht->nodes, ht->hcap * sizeof(HashNode));
 	ht->nodes = (HashNode *) zshcalloc(newsize * sizeof(HashNode));
-	ht->hsize = newsize;
+	ht->hcap = newsize;
     } else {
 	/* else we just re-zero the current nodes array */
 	memset(ht->nodes, 0, newsize * sizeof(HashNode));
     }
+    ht->hsize = ht->hbase = newsize;
+    ht->hsplit = 0;
+    if (ht->slots) {
+	memset(ht->slots, 0, (ht->slotmask + 1) * sizeof(struct hashslot));
+	ht->slotct = 0;
+	ht->orderct = ht->orderholes = 0;
+    }
 
     ht->ct = 0;
 }
@@ -554,6 +930,35 @@ printhashtabinfo(HashTable ht)
 	printf("number of hash values with chain of length %d  : %4d\n", i, chainlen[i]);
     printf("number of hash values with chain of length %d+ : %4d\n", MAXDEPTH, chainlen[MAXDEPTH]);
     printf("total number of nodes                         : %4d\n", total);
+
+    if (ht->slots) {
+	/*
+	 * The probe length for a node is the number of slots looked
+	 * at to find it, starting from its home slot.
+	 */
+	int probelen[MAXDEPTH + 1], nslots = ht->slotmask + 1, maxprobe = 0;
+	long sumprobe = 0;
+
+	memset(probelen, 0, sizeof(probelen));
+	for (i = 0; i < nslots; i++) {
+	    if (!ht->slots[i].node)
+		continue;
+	    tmpcount = ((i - (int)(ht->slots[i].hashval & ht->slotmask)) &
+			ht->slotmask) + 1;
+	    sumprobe += tmpcount;
+	    if (tmpcount > maxprobe)
+		maxprobe = tmpcount;
+	    probelen[tmpcount > MAXDEPTH ? MAXDEPTH : tmpcount - 1]++;
+	}
+	printf("\nsize of index   : %d\n", nslots);
+	printf("nodes in index  : %d\n", ht->slotct);
+	for (i = 0; i < MAXDEPTH; i++)
+	    printf("number of nodes with probe length %d           : %4d\n", i + 1, probelen[i]);
+	printf("number of nodes with probe length %d+          : %4d\n", MAXDEPTH + 1, probelen[MAXDEPTH]);
+	printf("average probe length                          : %.2f\n",
+	       ht->slotct ? (double)sumprobe / ht->slotct : 0.0);
+	printf("maximum probe length                          : %4d\n", maxprobe);
+    }
 }
 
 /**/
@@ -597,7 +1002,7 @@ createcmdnamtable(void)
 {
     cmdnamtab = newhashtable(201, "cmdnamtab", NULL);
 
-    cmdnamtab->hash        = hasher;
+    cmdnamtab->hash        = wordhasher;
     cmdnamtab->emptytable  = emptycmdnamtable;
     cmdnamtab->filltable   = fillcmdnamtable;
     cmdnamtab->cmpnodes    = strcmp;
@@ -609,6 +1014,7 @@ createcmdnamtable(void)
     cmdnamtab->enablenode  = NULL;
     cmdnamtab->freenode    = freecmdnamnode;
     cmdnamtab->printnode   = printcmdnamnode;
+    indexhashtable(cmdnamtab);
 
     pathchecked = path;
 }
@@ -621,6 +1027,235 @@ emptycmdnamtable(HashTable ht)
     pathchecked = path;
 }
 
+/* Files in a directory being hashed can be looked at relative to it */
+#if defined(HAVE_DIRFD) && defined(HAVE_FSTATAT) && defined(HAVE_FACCESSAT)
+# define HASHDIR_AT
+#endif
+
+/*
+ * Cache of the commands found in directories, kept in the file named
+ * by $ZSH_HASH_CACHE.  For each directory this records its device,
+ * inode and modification time, whether HASH_EXECUTABLES_ONLY was set
+ * when it was read, and the names of the commands found, each
+ * terminated by a NUL.  When all of those still agree the names are
+ * used without reading the directory again.  The file starts with
+ * HASHDIRCACHE_MAGIC; each directory then has a line of text
+ *   <dev> <ino> <mtime> <flags> <length of names> <directory>
+ * followed by the names and a newline.
+ */
+
+#define HASHDIRCACHE_MAGIC "#zsh hash cache 1\n"
+
+/* Directory was listed with HASH_EXECUTABLES_ONLY set */
+#define HDC_EXECONLY 1
+
+typedef struct hashdircache *Hashdircache;
+
+struct hashdircache {
+    Hashdircache next;
+    char *dir;			/* metafied name of the directory */
+    unsigned long dev, ino;
+    long mtime;
+    int flags;
+    char *names;		/* NUL-terminated names of commands */
+    int nameslen;		/* total length of names */
+    long scanned;		/* time directory was read, 0 if from file */
+};
+
+/* The cached directories, and the file they belong to */
+
+static Hashdircache hashdircaches;
+static char *hashdircachefile;
+
+/* Set if some directory has been read again since the file was loaded */
+
+static int hashdircachedirty;
+
+/**/
+static void
+freehashdircaches(void)
+{
+    Hashdircache hc, next;
+
+    for (hc = hashdircaches; hc; hc = next) {
+	next = hc->next;
+	zsfree(hc->dir);
+	if (hc->names)
+	    zfree(hc->names, hc->nameslen);
+	zfree(hc, sizeof(*hc));
+    }
+    hashdircaches = NULL;
+    zsfree(hashdircachefile);
+    hashdircachefile = NULL;
+    hashdircachedirty = 0;
+}
+
+/*
+ * Make sure the cache in memory is the one for file, which is
+ * metafied, reading the file if necessary.  Anything in the file
+ * that doesn't look right ends the read; the directories it would
+ * have supplied will just be read again.
+ */
+
+/**/
+static void
+loadhashdircaches(char *file)
+{
+    FILE *in;
+    char *buf, *ptr, *end, *eol, *dir;
+    struct stat st;
+    Hashdircache hc;
+
+    if (hashdircachefile && !strcmp(hashdircachefile, file))
+	return;
+    freehashdircaches();
+    hashdircachefile = ztrdup(file);
+
+    if (!(in = fopen(unmeta(file), "r")))
+	return;
+    if (fstat(fileno(in), &st) < 0 || !S_ISREG(st.st_mode) ||
+	st.st_size < (off_t)strlen(HASHDIRCACHE_MAGIC)) {
+	fclose(in);
+	return;
+    }
+    buf = (char *)zalloc(st.st_size);
+    if (fread(buf, 1, st.st_size, in) != (size_t)st.st_size ||
+	strncmp(buf, HASHDIRCACHE_MAGIC, strlen(HASHDIRCACHE_MAGIC))) {
+	fclose(in);
+	zfree(buf, st.st_size);
+	return;
+    }
+    fclose(in);
+
+    ptr = buf + strlen(HASHDIRCACHE_MAGIC);
+    end = buf + st.st_size;
+    while (ptr < end && (eol = memchr(ptr, '\n', end - ptr))) {
+	unsigned long dev, ino;
+	long mtime, len;
+	int flags;
+
+	*eol = '\0';
+	dev = strtoul(ptr, &ptr, 10);
+	ino = strtoul(ptr, &ptr, 10);
+	mtime = strtol(ptr, &ptr, 10);
+	flags = (int)strtol(ptr, &ptr, 10);
+	len = strtol(ptr, &dir, 10);
+	if (dir == ptr || *dir++ != ' ' || *dir != '/' ||
+	    len < 0 || len + 1 > end - (eol + 1) ||
+	    (len && eol[len] != '\0') || eol[len + 1] != '\n')
+	    break;
+
+	hc = (Hashdircache) zshcalloc(sizeof(*hc));
+	hc->dir = ztrdup(dir);
+	hc->dev = dev;
+	hc->ino = ino;
+	hc->mtime = mtime;
+	hc->flags = flags;
+	if ((hc->nameslen = (int)len)) {
+	    hc->names = (char *)zalloc(len);
+	    memcpy(hc->names, eol + 1, len);
+	}
+	hc->next = hashdircaches;
+	hashdircaches = hc;
+	ptr = eol + len + 2;
+    }
+    zfree(buf, st.st_size);
+}
+
+/*
+ * Write the cache back to its file, if any directory was read
+ * again.  Directories modified in the second they were read are left
+ * out, as a later change in the same second wouldn't show up.
+ */
+
+/**/
+void
+savehashdircaches(void)
+{
+    FILE *out;
+    char *tmpfile;
+    Hashdircache hc;
+    char pidbuf[DIGBUFSIZE + 1];
+    int fd, ok;
+
+    if (!hashdircachedirty || !hashdircachefile)
+	return;
+    hashdircachedirty = 0;
+
+    /* a name of our own, as other shells may be doing the same */
+    sprintf(pidbuf, ".%ld", (long)getpid());
+    tmpfile = bicat(hashdircachefile, pidbuf);
+    unlink(unmeta(tmpfile));
+    if ((fd = open(unmeta(tmpfile), O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0 ||
+	!(out = fdopen(fd, "w"))) {
+	if (fd >= 0)
+	    close(fd);
+	zsfree(tmpfile);
+	return;
+    }
+    ok = fputs(HASHDIRCACHE_MAGIC, out) >= 0;
+    for (hc = hashdircaches; ok && hc; hc = hc->next) {
+	if (hc->scanned && hc->mtime >= hc->scanned)
+	    continue;
+	ok = fprintf(out, "%lu %lu %ld %d %d %s\n", hc->dev, hc->ino,
+		     hc->mtime, hc->flags, hc->nameslen, hc->dir) > 0 &&
+	    fwrite(hc->names, 1, hc->nameslen, out) == (size_t)hc->nameslen &&
+	    putc('\n', out) != EOF;
+    }
+    if (fclose(out) == 0 && ok) {
+	char *newfile = ztrdup(unmeta(tmpfile));
+
+	/* rename() makes sure other shells see a complete file */
+	ok = rename(newfile, unmeta(hashdircachefile)) == 0;
+	zsfree(newfile);
+    } else
+	ok = 0;
+    if (!ok)
+	unlink(unmeta(tmpfile));
+    zsfree(tmpfile);
+}
+
+/*
+ * Add a command found in the directory dirp to the command hashtable.
+ * This is used both for names read from the directory and for names
+ * from the cache, so they are treated the same way.
+ */
+
+/**/
+static void
+hashdirname(char *fn, char **dirp)
+{
+    Cmdnam cn;
+#if defined(_WIN32) || defined(__CYGWIN__)
+    char *exe;
+#endif /* _WIN32 || _CYGWIN__ */
+
+    if (!cmdnamtab->getnode(cmdnamtab, fn)) {
+	cn = (Cmdnam) zshcalloc(sizeof *cn);
+	cn->node.flags = 0;
+	cn->u.name = dirp;
+	cmdnamtab->addnode(cmdnamtab, ztrdup(fn), cn);
+    }
+#if defined(_WIN32) || defined(__CYGWIN__)
+    /* Hash foo.exe as foo, since when no real foo exists, foo.exe
+       will get executed by DOS automatically.  This quiets
+       spurious corrections when CORRECT or CORRECT_ALL is set. */
+    if ((exe = strrchr(fn, '.')) &&
+	(exe[1] == 'E' || exe[1] == 'e') &&
+	(exe[2] == 'X' || exe[2] == 'x') &&
+	(exe[3] == 'E' || exe[3] == 'e') && exe[4] == 0) {
+	char *base = dupstrpfx(fn, exe - fn);
+
+	if (!cmdnamtab->getnode(cmdnamtab, base)) {
+	    cn = (Cmdnam) zshcalloc(sizeof *cn);
+	    cn->node.flags = 0;
+	    cn->u.name = dirp;
+	    cmdnamtab->addnode(cmdnamtab, ztrdup(base), cn);
+	}
+    }
+#endif /* _WIN32 || __CYGWIN__ */
+}
+
 /* Add all commands in a given directory *
  * to the command hashtable.             */
 
@@ -628,19 +1263,44 @@ emptycmdnamtable(HashTable ht)
 void
 hashdir(char **dirp)
 {
-    Cmdnam cn;
     DIR *dir;
-    char *fn, *unmetadir, *pathbuf, *pathptr;
+    char *fn, *unmetadir, *pathbuf, *pathptr, *cachefile;
     int dirlen;
-#if defined(_WIN32) || defined(__CYGWIN__)
-    char *exe;
-#endif /* _WIN32 || _CYGWIN__ */
+    Hashdircache hc = NULL;
+    struct stat dirbuf;
+    int cacheflags = isset(HASHEXECUTABLESONLY) ? HDC_EXECONLY : 0;
+    /* names found when they're going into the cache */
+    char *names = NULL;
+    int nameslen = 0, namessize = 0;
 
     if (isrelative(*dirp))
 	return;
+    if ((cachefile = getsparam("ZSH_HASH_CACHE")) && *cachefile) {
+	loadhashdircaches(cachefile);
+	if (stat(unmeta(*dirp), &dirbuf) < 0)
+	    return;
+	for (hc = hashdircaches; hc; hc = hc->next)
+	    if (!strcmp(hc->dir, *dirp))
+		break;
+	if (hc && hc->dev == (unsigned long)dirbuf.st_dev &&
+	    hc->ino == (unsigned long)dirbuf.st_ino &&
+	    hc->mtime == (long)dirbuf.st_mtime && hc->flags == cacheflags) {
+	    char *nam = hc->names, *nend = hc->names + hc->nameslen;
+
+	    for (; nam < nend; nam += strlen(nam) + 1)
+		hashdirname(nam, dirp);
+	    return;
+	}
+	namessize = 256;
+	names = (char *)zalloc(namessize);
+    } else if (hashdircachefile)
+	freehashdircaches();
     unmetadir = unmeta(*dirp);
-    if (!(dir = opendir(unmetadir)))
+    if (!(dir = opendir(unmetadir))) {
+	if (names)
+	    zfree(names, namessize);
 	return;
+    }
 
     dirlen = strlen(unmetadir);
     pathbuf = (char *)zalloc(dirlen + PATH_MAX + 2);
@@ -648,55 +1308,86 @@ hashdir(char **dirp)
     pathptr = pathbuf + dirlen + 1;
 
     while ((fn = zreaddir(dir, 1))) {
-	if (!cmdnamtab->getnode(cmdnamtab, fn)) {
+	/*
+	 * When building the cache each entry has to be tested, as the
+	 * cache is of the directory, not what was added from it.
+	 */
+	if (names || !cmdnamtab->getnode(cmdnamtab, fn)) {
 	    char *fname = ztrdup(fn);
 	    struct stat statbuf;
 	    int add = 0, dummylen;
 
 	    unmetafy(fn, &dummylen);
-	    if (strlen(fn) > PATH_MAX) {
+	    if (unset(HASHEXECUTABLESONLY)) {
+		add = 1;
+#ifdef HASHDIR_AT
+	    } else if (dirfd(dir) >= 0) {
+		/*
+		 * Look up the file relative to the directory: this saves
+		 * resolving the whole path again for every file, which
+		 * is slow on some network file systems.
+		 */
+		if (fstatat(dirfd(dir), fn, &statbuf, 0) == 0 &&
+		    S_ISREG(statbuf.st_mode) && (statbuf.st_mode & S_IXUGO) &&
+		    faccessat(dirfd(dir), fn, X_OK, 0) == 0)
+		    add = 1;
+#endif
+	    } else if (strlen(fn) > PATH_MAX) {
 		/* Too heavy to do all the allocation */
 		add = 1;
 	    } else {
 		strcpy(pathptr, fn);
 		/*
 		 * This is the same test as for the glob qualifier for
-		 * executable plain files.
+		 * executable plain files.  The mode is looked at first
+		 * as that rules out most files without an access().
 		 */
-		if (unset(HASHEXECUTABLESONLY) ||
-		    (access(pathbuf, X_OK) == 0 &&
-		     stat(pathbuf, &statbuf) == 0 &&
-		     S_ISREG(statbuf.st_mode) && (statbuf.st_mode & S_IXUGO)))
+		if (stat(pathbuf, &statbuf) == 0 &&
+		    S_ISREG(statbuf.st_mode) && (statbuf.st_mode & S_IXUGO) &&
+		    access(pathbuf, X_OK) == 0)
 		    add = 1;
 	    }
-	    if (add) {
-		cn = (Cmdnam) zshcalloc(sizeof *cn);
-		cn->node.flags = 0;
-		cn->u.name = dirp;
-		cmdnamtab->addnode(cmdnamtab, fname, cn);
-	    } else
-		zsfree(fname);
-	}
-#if defined(_WIN32) || defined(__CYGWIN__)
-	/* Hash foo.exe as foo, since when no real foo exists, foo.exe
-	   will get executed by DOS automatically.  This quiets
-	   spurious corrections when CORRECT or CORRECT_ALL is set. */
-	if ((exe = strrchr(fn, '.')) &&
-	    (exe[1] == 'E' || exe[1] == 'e') &&
-	    (exe[2] == 'X' || exe[2] == 'x') &&
-	    (exe[3] == 'E' || exe[3] == 'e') && exe[4] == 0) {
-	    *exe = 0;
-	    if (!cmdnamtab->getnode(cmdnamtab, fn)) {
-		cn = (Cmdnam) zshcalloc(sizeof *cn);
-		cn->node.flags = 0;
-		cn->u.name = dirp;
-		cmdnamtab->addnode(cmdnamtab, ztrdup(fn), cn);
+	    if (add && names) {
+		int len = strlen(fname) + 1;
+
+		if (nameslen + len > namessize) {
+		    int newsize = 2 * (nameslen + len);
+
+		    names = (char *)zrealloc(names, newsize);
+		    namessize = newsize;
+		}
+		memcpy(names + nameslen, fname, len);
+		nameslen += len;
 	    }
+	    if (add)
+		hashdirname(fname, dirp);
+	    zsfree(fname);
 	}
-#endif /* _WIN32 || __CYGWIN__ */
     }
     closedir(dir);
     zfree(pathbuf, dirlen + PATH_MAX + 2);
+
+    if (names) {
+	if (!hc) {
+	    hc = (Hashdircache) zshcalloc(sizeof(*hc));
+	    hc->dir = ztrdup(*dirp);
+	    hc->next = hashdircaches;
+	    hashdircaches = hc;
+	} else if (hc->names)
+	    zfree(hc->names, hc->nameslen);
+	hc->dev = (unsigned long)dirbuf.st_dev;
+	hc->ino = (unsigned long)dirbuf.st_ino;
+	hc->mtime = (long)dirbuf.st_mtime;
+	hc->flags = cacheflags;
+	if ((hc->nameslen = nameslen)) {
+	    hc->names = (char *)zrealloc(names, nameslen);
+	} else {
+	    hc->names = NULL;
+	    zfree(names, namessize);
+	}
+	hc->scanned = (long)time(NULL);
+	hashdircachedirty = 1;
+    }
 }
 
 /* Go through user's PATH and add everything to *
@@ -712,6 +1403,7 @@ fillcmdnamtable(UNUSED(HashTable ht))
 	hashdir(pq);
 
     pathchecked = pq;
+    savehashdircaches();
 }
 
 /**/
@@ -808,11 +1500,11 @@ createshfunctable(void)
 {
     shfunctab = newhashtable(7, "shfunctab", NULL);
 
-    shfunctab->hash        = hasher;
+    shfunctab->hash        = wordhasher;
     shfunctab->emptytable  = NULL;
     shfunctab->filltable   = NULL;
     shfunctab->cmpnodes    = strcmp;
-    shfunctab->addnode     = addhashnode;
+    shfunctab->addnode     = addshfuncnode;
     shfunctab->getnode     = gethashnode;
     shfunctab->getnode2    = gethashnode2;
     shfunctab->removenode  = removeshfuncnode;
@@ -820,6 +1512,17 @@ createshfunctable(void)
     shfunctab->enablenode  = enableshfuncnode;
     shfunctab->freenode    = freeshfuncnode;
     shfunctab->printnode   = printshfuncnode;
+    indexhashtable(shfunctab);
+}
+
+/* Add an entry to the shell function hash table. */
+
+/**/
+static void
+addshfuncnode(HashTable ht, char *nam, void *nodeptr)
+{
+    cmdgen++;
+    addhashnode(ht, nam, nodeptr);
 }
 
 /* Remove an entry from the shell function hash table.   *
@@ -833,6 +1536,7 @@ removeshfuncnode(UNUSED(HashTable ht), const char *nam)
     HashNode hn;
     int signum;
 
+    cmdgen++;
     if (!strncmp(nam, "TRAP", 4) && (signum = getsignum(nam + 4)) != -1)
 	hn = removetrap(signum);
     else
@@ -849,6 +1553,7 @@ removeshfuncnode(UNUSED(HashTable ht), const char *nam)
 static void
 disableshfuncnode(HashNode hn, UNUSED(int flags))
 {
+    cmdgen++;
     hn->flags |= DISABLED;
     if (!strncmp(hn->nam, "TRAP", 4)) {
 	int signum = getsignum(hn->nam + 4);
@@ -869,6 +1574,7 @@ enableshfuncnode(HashNode hn, UNUSED(int flags))
 {
     Shfunc shf = (Shfunc) hn;
 
+    cmdgen++;
     shf->node.flags &= ~DISABLED;
     if (!strncmp(shf->node.nam, "TRAP", 4)) {
 	int signum = getsignum(shf->node.nam + 4);
@@ -1066,6 +1772,48 @@ mod_export HashTable aliastab;
 
 /**/
 mod_export HashTable sufaliastab;
+
+/*
+ * Incremented whenever an alias is added, removed, enabled or
+ * disabled, so that code parsed earlier can be seen to be out of date.
+ */
+
+/**/
+mod_export int aliasgen;
+
+/* Functions to alter alias tables, keeping track of the changes */
+
+/**/
+static void
+addaliasnode(HashTable ht, char *nam, void *nodeptr)
+{
+    aliasgen++;
+    addhashnode(ht, nam, nodeptr);
+}
+
+/**/
+static HashNode
+removealiasnode(HashTable ht, const char *nam)
+{
+    aliasgen++;
+    return removehashnode(ht, nam);
+}
+
+/**/
+static void
+disablealiasnode(HashNode hn, int flags)
+{
+    aliasgen++;
+    disablehashnode(hn, flags);
+}
+
+/**/
+static void
+enablealiasnode(HashNode hn, int flags)
+{
+    aliasgen++;
+    enablehashnode(hn, flags);
+}
  
 /* Create new hash tables for aliases */
 
@@ -1073,18 +1821,19 @@ mod_export HashTable sufaliastab;
 void
 createaliastable(HashTable ht)
 {
-    ht->hash        = hasher;
+    ht->hash        = wordhasher;
     ht->emptytable  = NULL;
     ht->filltable   = NULL;
     ht->cmpnodes    = strcmp;
-    ht->addnode     = addhashnode;
+    ht->addnode     = addaliasnode;
     ht->getnode     = gethashnode;
     ht->getnode2    = gethashnode2;
-    ht->removenode  = removehashnode;
-    ht->disablenode = disablehashnode;
-    ht->enablenode  = enablehashnode;
+    ht->removenode  = removealiasnode;
+    ht->disablenode = disablealiasnode;
+    ht->enablenode  = enablealiasnode;
     ht->freenode    = freealiasnode;
     ht->printnode   = printaliasnode;
+    indexhashtable(ht);
 }
 
 /**/
@@ -1297,10 +2046,12 @@ addhistnode(HashTable ht, char *nam, void *nodeptr)
 	 || (he->node.flags & HIST_FOREIGN && (Histent)oldnode == he->up)) {
 	    (void) addhashnode2(ht, oldnode->nam, oldnode); /* restore hash */
 	    he->node.flags |= HIST_DUP;
+	    histdupct++;
 	    he->node.flags &= ~HIST_MAKEUNIQUE;
 	}
 	else {
 	    oldnode->flags |= HIST_DUP;
+	    histdupct++;
 	    if (hist_ignore_all_dups)
 		freehistnode(oldnode); /* Remove the old dup */
 	}
@@ -1314,7 +2065,7 @@ void
 freehistnode(HashNode nodeptr)
 {
     freehistdata((Histent)nodeptr, 1);
-    zfree(nodeptr, sizeof (struct histent));
+    freehistent((Histent)nodeptr);
 }
 
 /**/
@@ -1326,8 +2077,12 @@ freehistdata(Histent he, int unlink)
 
     if (!(he->node.flags & (HIST_DUP | HIST_TMPSTORE)))
 	removehashnode(histtab, he->node.nam);
+    else if (he->node.flags & HIST_DUP) {
+	he->node.flags &= ~HIST_DUP;
+	histdupct--;
+    }
 
-    zsfree(he->node.nam);
+    freehistenttext(he);
     if (he->nwords)
 	zfree(he->words, he->nwords*2*sizeof(short));
 
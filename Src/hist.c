@@ -30,6 +30,10 @@
 #include "zsh.mdh"
 #include "hist.pro"
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#endif
+
 /* Functions to call for getting/ungetting a character and for history
  * word control. */
 
@@ -92,6 +96,11 @@ struct histent curline;
 /**/
 zlong histlinect;
 
+/* number of those entries marked HIST_DUP */
+
+/**/
+zlong histdupct;
+
 /* The history lines are kept in a hash, and also doubly-linked in a ring */
 
 /**/
@@ -198,11 +207,17 @@ int hlinesz;
  
 static zlong defev;
 
-/* Remember the last line in the history file so we can find it again. */
+/*
+ * Remember the last line in the history file so we can find it again.
+ * The device and inode tell us whether the file is still the one in
+ * which we recorded the offset fpos, or has been replaced by a rewrite.
+ */
 static struct histfile_stats {
     char *text;
     time_t stim, mtim;
     off_t fpos, fsiz;
+    dev_t dev;
+    ino_t ino;
     zlong next_write_ev;
 } lasthist;
 
@@ -213,6 +228,7 @@ static struct histsave {
     Histent hist_ring;
     zlong curhist;
     zlong histlinect;
+    zlong histdupct;
     zlong histsiz;
     zlong savehistsiz;
     int locallevel;
@@ -391,6 +407,7 @@ getsubsargs(char *subline, int *gbalp, int *cflagp)
 static int
 getargc(Histent ehist)
 {
+    histentwords(ehist);
     return ehist->nwords ? ehist->nwords-1 : 0;
 }
 
@@ -1117,7 +1134,8 @@ putoldhistentryontop(short keep_going)
 	if (!keep_going)
 	    max_unique_ct = savehistsiz;
 	do {
-	    if (max_unique_ct-- <= 0 || he == hist_ring) {
+	    /* With no duplicates at all there's no point looking */
+	    if (!histdupct || max_unique_ct-- <= 0 || he == hist_ring) {
 		max_unique_ct = 0;
 		he = hist_ring->down;
 		next = hist_ring;
@@ -1137,6 +1155,107 @@ putoldhistentryontop(short keep_going)
     hist_ring = he;
 }
 
+/*
+ * History entries are allocated in slots carved out of large chunks,
+ * rather than one by one, which saves the allocator's overhead on
+ * each of what may be a very large number of entries.  Each slot has
+ * room after the entry for a short line of text, which is where most
+ * lines end up instead of in a separate allocation.  Freed slots are
+ * kept on a list for reuse; the chunks themselves are freed when
+ * there are no entries left.
+ */
+
+#define HISTENT_TEXTSIZE	32
+#define HISTENT_SLOTSIZE \
+    ((sizeof(struct histent) + HISTENT_TEXTSIZE + 15) & ~(size_t)15)
+#define HISTENT_CHUNKSLOTS	512
+
+/* The text stored in the slot of an entry */
+#define HISTENT_TEXT(he) ((char *)(he) + sizeof(struct histent))
+
+struct histchunk {
+    struct histchunk *next;
+};
+
+#define HISTCHUNK_HDRSIZE \
+    ((sizeof(struct histchunk) + 15) & ~(size_t)15)
+
+static struct histchunk *histchunks;
+static Histent histent_free;
+static zlong histentct;
+
+/**/
+Histent
+allochistent(void)
+{
+    Histent he;
+
+    if (!histent_free) {
+	struct histchunk *chunk =
+	    zalloc(HISTCHUNK_HDRSIZE + HISTENT_CHUNKSLOTS * HISTENT_SLOTSIZE);
+	char *slot = (char *)chunk + HISTCHUNK_HDRSIZE;
+	int i;
+
+	chunk->next = histchunks;
+	histchunks = chunk;
+	for (i = 0; i < HISTENT_CHUNKSLOTS; i++, slot += HISTENT_SLOTSIZE) {
+	    ((Histent)slot)->up = histent_free;
+	    histent_free = (Histent)slot;
+	}
+    }
+    he = histent_free;
+    histent_free = he->up;
+    memset(he, 0, sizeof *he);
+    histentct++;
+    return he;
+}
+
+/**/
+void
+freehistent(Histent he)
+{
+    he->up = histent_free;
+    histent_free = he;
+    if (!--histentct) {
+	while (histchunks) {
+	    struct histchunk *next = histchunks->next;
+	    zfree(histchunks,
+		  HISTCHUNK_HDRSIZE + HISTENT_CHUNKSLOTS * HISTENT_SLOTSIZE);
+	    histchunks = next;
+	}
+	histent_free = NULL;
+    }
+}
+
+/*
+ * Set the text of a history entry to a copy of str, in the entry's
+ * own slot if it fits.
+ */
+
+/**/
+char *
+sethistenttext(Histent he, char *str)
+{
+    size_t len = strlen(str);
+
+    if (len < HISTENT_TEXTSIZE)
+	he->node.nam = memcpy(HISTENT_TEXT(he), str, len + 1);
+    else
+	he->node.nam = ztrdup(str);
+    return he->node.nam;
+}
+
+/* Free the text of a history entry */
+
+/**/
+void
+freehistenttext(Histent he)
+{
+    if (he->node.nam != HISTENT_TEXT(he))
+	zsfree(he->node.nam);
+    he->node.nam = NULL;
+}
+
 /**/
 Histent
 prepnexthistent(void)
@@ -1152,7 +1271,7 @@ prepnexthistent(void)
     }
 
     if (histlinect < histsiz) {
-	he = (Histent)zshcalloc(sizeof *he);
+	he = allochistent();
 	if (!hist_ring)
 	    hist_ring = he->up = he->down = he;
 	else {
@@ -1360,7 +1479,7 @@ hend(Eprog prog)
 	} else
 	    he = prepnexthistent();
 
-	he->node.nam = ztrdup(chline);
+	sethistenttext(he, chline);
 	he->stim = time(NULL);
 	he->ftim = 0L;
 	he->node.flags = newflags;
@@ -1587,6 +1706,7 @@ hconsearch(char *str, int *marg)
 	    continue;
 	if ((s = strstr(he->node.nam, str))) {
 	    int pos = s - he->node.nam;
+	    histentwords(he);
 	    while (t1 < he->nwords && he->words[2*t1] <= pos)
 		t1++;
 	    *marg = t1 - 1;
@@ -2124,9 +2244,12 @@ gethist(int ev)
 static char *
 getargs(Histent elist, int arg1, int arg2)
 {
-    short *words = elist->words;
-    int pos1, nwords = elist->nwords;
+    short *words;
+    int pos1, nwords;
 
+    histentwords(elist);
+    words = elist->words;
+    nwords = elist->nwords;
     if (arg2 < arg1 || arg1 >= nwords || arg2 >= nwords) {
 	/* remember, argN is indexed from 0, nwords is total no. of words */
 	herrflush();
@@ -2289,49 +2412,202 @@ resizehistents(void)
     }
 }
 
+/*
+ * Read the next line of a history file which is held in memory
+ * between *ptrp and end, copying it to *bufp and extending the
+ * buffer as necessary.  As for the file
+ * itself, a backslash at the end of a line continues the entry on
+ * the next line.  Returns one more than the length of the entry,
+ * 0 at the end of the file, or -1 if the line contains a null.
+ */
+
 static int
-readhistline(int start, char **bufp, int *bufsiz, FILE *in)
+readhistmem(char **bufp, int *bufsiz, char **ptrp, char *end)
 {
-    char *buf = *bufp;
-    if (fgets(buf + start, *bufsiz - start, in)) {
-	int len = start + strlen(buf + start);
-	if (len == start)
+    char *ptr = *ptrp, *nl;
+    int len = 0, n;
+
+    if (ptr == end)
+	return 0;
+    for (;;) {
+	if (!(nl = memchr(ptr, '\n', end - ptr)))
+	    nl = end;
+	n = nl - ptr;
+	if (memchr(ptr, '\0', n))
 	    return -1;
-	if (buf[len - 1] != '\n') {
-	    if (!feof(in)) {
-		if (len < (*bufsiz) - 1)
-		    return -1;
-		*bufp = zrealloc(buf, 2 * (*bufsiz));
-		*bufsiz = 2 * (*bufsiz);
-		return readhistline(len, bufp, bufsiz, in);
-	    }
-	}
-	else {
-	    buf[len - 1] = '\0';
-	    if (len > 1 && buf[len - 2] == '\\' &&
-		(len < 3 || buf[len - 3] != '\\')) {
-		buf[--len - 1] = '\n';
-		if (!feof(in))
-		    return readhistline(len, bufp, bufsiz, in);
-	    }
+	if (len + n + 1 > *bufsiz) {
+	    while (len + n + 1 > *bufsiz)
+		*bufsiz *= 2;
+	    *bufp = zrealloc(*bufp, *bufsiz);
+	}
+	memcpy(*bufp + len, ptr, n);
+	len += n;
+	ptr = (nl == end) ? end : nl + 1;
+	if (ptr == end || len == 0 || (*bufp)[len - 1] != '\\' ||
+	    (len > 1 && (*bufp)[len - 2] == '\\'))
+	    break;
+	(*bufp)[len - 1] = '\n';
+    }
+    (*bufp)[len] = '\0';
+    *ptrp = ptr;
+    return len + 1;
+}
+
+/*
+ * Read the len bytes at offset pos of the history file fd into buf.
+ * Returns the number of bytes actually read.
+ */
+
+static off_t
+readhistbytes(int fd, char *buf, off_t pos, off_t len)
+{
+    off_t got = 0;
+    ssize_t n;
+
+    if (lseek(fd, pos, SEEK_SET) != pos)
+	return 0;
+    while (got < len &&
+	   ((n = read(fd, buf + got, len - got)) > 0 ||
+	    (n < 0 && errno == EINTR)))
+	if (n > 0)
+	    got += n;
+    return got;
+}
+
+/*
+ * Test if the newline at nl in a history file held in memory from base
+ * ends an entry, i.e. the line isn't continued with a backslash.
+ */
+
+#define HISTENTEND(base, nl) \
+    ((nl) == (base) || (nl)[-1] != '\\' || \
+     ((nl) - 1 > (base) && (nl)[-2] == '\\'))
+
+/*
+ * Find where the last n entries of a history file held in memory
+ * between base and end start, by looking back from the end for the
+ * newlines that finish entries.  The number of entries before that
+ * point, which we won't read, is returned in *skippedp.  If that part
+ * of the file contains a null we return base, so that reading the
+ * file reports it as corrupt just as it would have done.
+ */
+
+static char *
+histfiletail(char *base, char *end, zlong n, zlong *skippedp)
+{
+    char *p = end, *nl;
+    zlong ct = 0;
+
+    *skippedp = 0;
+    if (p > base && p[-1] == '\n')
+	p--;
+    while (p > base) {
+	if (*--p == '\n' && HISTENTEND(base, p) && ++ct == n)
+	    break;
+    }
+    if (p == base)
+	return base;
+    if (memchr(base, '\0', p - base))
+	return base;
+    for (nl = base; (nl = memchr(nl, '\n', p + 1 - nl)); nl++)
+	if (HISTENTEND(base, nl))
+	    (*skippedp)++;
+    return p + 1;
+}
+
+/*
+ * Split the words of a history entry read from a file; this is
+ * put off until something wants them, since most entries are never
+ * looked at in that much detail.
+ */
+
+/**/
+mod_export void
+histentwords(Histent he)
+{
+    static short *words;
+    static int nwords;
+    int nwordpos;
+
+    if (!(he->node.flags & HIST_NOWORDS))
+	return;
+    he->node.flags &= ~HIST_NOWORDS;
+    histsplitwords(he->node.nam, &words, &nwords, &nwordpos, 0);
+    if ((he->nwords = nwordpos/2)) {
+	he->words = (short *)zalloc(nwordpos*sizeof(short));
+	memcpy(he->words, words, nwordpos*sizeof(short));
+    } else
+	he->words = (short *)NULL;
+}
+
+/*
+ * A quick test for history searches.  Each character in a line,
+ * folded to lower case, sets a bit in the low half of the signature
+ * and each pair of adjacent characters one in the high half; a line
+ * can only contain a string if it has all the bits the string has.  A line with non-ASCII characters might
+ * match in ways that don't show up here, so gets every bit set.
+ * In a string being searched for (search is set) such characters
+ * are just left out.
+ */
+
+#define HISTSIGHALF (4 * (int)sizeof(zulong))
+
+/**/
+mod_export zulong
+histsig(char *s, int search)
+{
+    zulong sig = 0;
+    int c, last = -1;
+
+    for (; *s; s++) {
+	c = STOUC(*s);
+	if (c >= 0x80) {
+	    if (!search)
+		return ~(zulong)0;
+	    last = -1;
+	    continue;
 	}
-	return len;
+	if (c >= 'A' && c <= 'Z')
+	    c += 'a' - 'A';
+	sig |= (zulong)1 << (c % HISTSIGHALF);
+	if (last >= 0)
+	    sig |= (zulong)1 << (HISTSIGHALF + (last * 7 + c) % HISTSIGHALF);
+	last = c;
     }
-    return 0;
+    return sig;
+}
+
+/*
+ * Return the signature of a history entry, working it out the first
+ * time it's asked for.  The line being edited changes under us, so
+ * it matches anything.
+ */
+
+/**/
+mod_export zulong
+histentsig(Histent he)
+{
+    if (he == &curline)
+	return ~(zulong)0;
+    if (!(he->node.flags & HIST_HASSIG)) {
+	he->sig = histsig(he->node.nam, 0);
+	he->node.flags |= HIST_HASSIG;
+    }
+    return he->sig;
 }
 
 /**/
 void
 readhistfile(char *fn, int err, int readflags)
 {
-    char *buf, *start = NULL;
-    FILE *in;
+    char *buf, *start = NULL, *base, *ptr, *end;
+    int fd;
     Histent he;
     time_t stim, ftim, tim = time(NULL);
-    off_t fpos;
+    off_t fpos, fsize, from;
     short *words;
     struct stat sb;
-    int nwordpos, nwords, bufsiz;
+    int nwordpos, nwords, bufsiz, mapped = 0;
     int searching, newflags, l, ret, uselex;
 
     if (!fn && !(fn = getsparam("HISTFILE")))
@@ -2340,7 +2616,8 @@ readhistfile(char *fn, int err, int readflags)
 	sb.st_size == 0)
 	return;
     if (readflags & HFILE_FAST) {
-	if ((lasthist.fsiz == sb.st_size && lasthist.mtim == sb.st_mtime)
+	if ((lasthist.fsiz == sb.st_size && lasthist.mtim == sb.st_mtime &&
+	     lasthist.ino == sb.st_ino && lasthist.dev == sb.st_dev)
 	    || lockhistfile(fn, 0))
 	    return;
 	lasthist.fsiz = sb.st_size;
@@ -2353,16 +2630,25 @@ readhistfile(char *fn, int err, int readflags)
 	    return;
 	}
     }
-    if ((in = fopen(unmeta(fn), "r"))) {
-	nwords = 64;
-	words = (short *)zalloc(nwords*sizeof(short));
-	bufsiz = 1024;
-	buf = zalloc(bufsiz);
-
-	pushheap();
+    if ((fd = open(unmeta(fn), O_RDONLY | O_NOCTTY)) >= 0 &&
+	fstat(fd, &sb) == 0) {
+	/*
+	 * Parse the file straight from memory; mapping it avoids
+	 * copying it through stdio a line at a time.
+	 *
+	 * When we are picking up lines another shell has added, start
+	 * at the last line we know about provided the file is still
+	 * the one we saw before, so only the new tail is looked at.
+	 * If that line isn't there any more, the file was rewritten
+	 * and we go back to the start, using the time stamps to find
+	 * where the new lines begin.
+	 */
+	fsize = sb.st_size;
+	from = 0;
 	if (readflags & HFILE_FAST && lasthist.text) {
-	    if (lasthist.fpos < lasthist.fsiz) {
-		fseek(in, lasthist.fpos, 0);
+	    if (lasthist.fpos < lasthist.fsiz && lasthist.fpos < fsize &&
+		lasthist.ino == sb.st_ino && lasthist.dev == sb.st_dev) {
+		from = lasthist.fpos;
 		searching = 1;
 	    }
 	    else {
@@ -2371,14 +2657,59 @@ readhistfile(char *fn, int err, int readflags)
 	    }
 	} else
 	    searching = 0;
+	if (readflags & HFILE_USE_OPTIONS) {
+	    lasthist.dev = sb.st_dev;
+	    lasthist.ino = sb.st_ino;
+	}
+	base = NULL;
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+	if (fsize > 0) {
+	    base = (char *)mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	    if (base == (char *)MAP_FAILED)
+		base = NULL;
+	    else
+		mapped = 1;
+	}
+#endif
+	if (!base) {
+	    /* Only the part from the offset is needed unless we restart */
+	    base = zalloc(fsize + 1);
+	    fsize = from + readhistbytes(fd, base + from, from, fsize - from);
+	}
+	ptr = base + from;
+	end = base + fsize;
 
+	nwords = 64;
+	words = (short *)zalloc(nwords*sizeof(short));
+	bufsiz = 1024;
+	buf = zalloc(bufsiz);
+
+	pushheap();
 	newflags = HIST_OLD | HIST_READ;
 	if (readflags & HFILE_FAST)
 	    newflags |= HIST_FOREIGN;
 	if (readflags & HFILE_SKIPOLD
 	 || (hist_ignore_all_dups && newflags & hist_skip_flags))
 	    newflags |= HIST_MAKEUNIQUE;
-	while (fpos = ftell(in), (l = readhistline(0, &buf, &bufsiz, in))) {
+	uselex = isset(HISTLEXWORDS) && !(readflags & HFILE_FAST);
+	/*
+	 * If nothing decides which lines to keep except their position,
+	 * only the last $HISTSIZE entries of the file can survive, so
+	 * don't bother with the rest.
+	 */
+	if (!searching && !(newflags & HIST_MAKEUNIQUE) &&
+	    !hist_ignore_all_dups && !isset(HISTEXPIREDUPSFIRST) &&
+	    histsiz > 0) {
+	    zlong skipped;
+
+	    ptr = histfiletail(base, end, histsiz, &skipped);
+	    /* Number the entries as if we had read the others */
+	    curhist += skipped;
+	    if (readflags & HFILE_USE_OPTIONS)
+		histfile_linect += skipped;
+	}
+	while (fpos = ptr - base,
+	       (l = readhistmem(&buf, &bufsiz, &ptr, end))) {
 	    char *pt = buf;
 
 	    if (l < 0) {
@@ -2409,7 +2740,11 @@ readhistfile(char *fn, int err, int readflags)
 		     && histstrcmp(pt, lasthist.text) == 0)
 			searching = 0;
 		    else {
-			fseek(in, 0, 0);
+			if (!mapped && from &&
+			    readhistbytes(fd, base, 0, from) < from)
+			    end = ptr;
+			from = 0;
+			ptr = base;
 			histfile_linect = 0;
 			searching = -1;
 		    }
@@ -2429,7 +2764,7 @@ readhistfile(char *fn, int err, int readflags)
 	    }
 
 	    he = prepnexthistent();
-	    he->node.nam = ztrdup(pt);
+	    sethistenttext(he, pt);
 	    he->node.flags = newflags;
 	    if ((he->stim = stim) == 0)
 		he->stim = he->ftim = tim;
@@ -2439,20 +2774,26 @@ readhistfile(char *fn, int err, int readflags)
 		he->ftim = ftim;
 
 	    /*
-	     * Divide up the words.
+	     * Divide up the words.  Splitting on white space can wait
+	     * until the words are needed; the lexer can't be called
+	     * safely later on, so if that's wanted do it now.
 	     */
 	    start = pt;
-	    uselex = isset(HISTLEXWORDS) && !(readflags & HFILE_FAST);
-	    histsplitwords(pt, &words, &nwords, &nwordpos, uselex);
-	    if (uselex)
+	    if (uselex) {
+		histsplitwords(pt, &words, &nwords, &nwordpos, 1);
 		freeheap();
 
-	    he->nwords = nwordpos/2;
-	    if (he->nwords) {
-		he->words = (short *)zalloc(nwordpos*sizeof(short));
-		memcpy(he->words, words, nwordpos*sizeof(short));
-	    } else
+		he->nwords = nwordpos/2;
+		if (he->nwords) {
+		    he->words = (short *)zalloc(nwordpos*sizeof(short));
+		    memcpy(he->words, words, nwordpos*sizeof(short));
+		} else
+		    he->words = (short *)NULL;
+	    } else {
+		he->node.flags |= HIST_NOWORDS;
+		he->nwords = 0;
 		he->words = (short *)NULL;
+	    }
 	    addhistnode(histtab, he->node.nam, he);
 	    if (he->node.flags & HIST_DUP) {
 		freehistnode(&he->node);
@@ -2467,9 +2808,19 @@ readhistfile(char *fn, int err, int readflags)
 	zfree(buf, bufsiz);
 
 	popheap();
-	fclose(in);
-    } else if (err)
-	zerr("can't read history file %s", fn);
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+	if (mapped)
+	    munmap(base, fsize);
+	else
+#endif
+	    zfree(base, sb.st_size + 1);
+	close(fd);
+    } else {
+	if (fd >= 0)
+	    close(fd);
+	if (err)
+	    zerr("can't read history file %s", fn);
+    }
 
     unlockhistfile(fn);
 
@@ -2477,6 +2828,28 @@ readhistfile(char *fn, int err, int readflags)
 	zleentry(ZLE_CMD_SET_HIST_LINE, curhist);
 }
 
+/*
+ * While another shell has the history file locked we retry after a
+ * short delay which grows each time, rather than a whole second, so
+ * that a brief write by another shell holds us up only briefly.  The
+ * delay depends a little on the process ID so shells waiting together
+ * don't all try again at the same moment.
+ */
+
+#define HISTLOCK_FIRST_SLEEP	10000L	/* 10 ms */
+#define HISTLOCK_MAX_SLEEP	500000L	/* 0.5 s */
+
+static void
+histlocksleep(long *sleep_usp)
+{
+    long us = *sleep_usp;
+
+    zsleep(us / 2 + (long)(((unsigned long)mypid * 2654435761UL) >> 8) %
+	   (us / 2 + 1));
+    if ((*sleep_usp = us * 2) > HISTLOCK_MAX_SLEEP)
+	*sleep_usp = HISTLOCK_MAX_SLEEP;
+}
+
 #ifdef HAVE_FCNTL_H
 static int flock_fd = -1;
 
@@ -2489,6 +2862,7 @@ static int
 flockhistfile(char *fn, int keep_trying)
 {
     struct flock lck;
+    long sleep_us = HISTLOCK_FIRST_SLEEP;
     int ctr = keep_trying ? 9 : 0;
 
     if ((flock_fd = open(unmeta(fn), O_RDWR | O_NOCTTY)) < 0)
@@ -2505,7 +2879,9 @@ flockhistfile(char *fn, int keep_trying)
 	    flock_fd = -1;
 	    return 1;
 	}
-	sleep(1);
+	/* A signal just means we wait again; anything else, back off */
+	if (errno != EINTR)
+	    histlocksleep(&sleep_us);
     }
 
     return 0;
@@ -2661,6 +3037,8 @@ savehistfile(char *fn, int err, int writeflags)
 		if (fstat(fileno(out), &sb) == 0) {
 		    lasthist.fsiz = sb.st_size;
 		    lasthist.mtim = sb.st_mtime;
+		    lasthist.dev = sb.st_dev;
+		    lasthist.ino = sb.st_ino;
 		}
 		zsfree(lasthist.text);
 		lasthist.text = ztrdup(start);
@@ -2725,7 +3103,7 @@ savehistfile(char *fn, int err, int writeflags)
 static int lockhistct;
 
 static int
-checklocktime(char *lockfile, time_t then)
+checklocktime(char *lockfile, long *sleep_usp, time_t then)
 {
     time_t now = time(NULL);
 
@@ -2736,7 +3114,7 @@ checklocktime(char *lockfile, time_t then)
     }
 
     if (now - then < 10)
-	sleep(1);
+	histlocksleep(sleep_usp);
     else
 	unlink(lockfile);
 
@@ -2754,6 +3132,7 @@ lockhistfile(char *fn, int keep_trying)
 {
     int ct = lockhistct;
     int ret = 0;
+    long sleep_us = HISTLOCK_FIRST_SLEEP;
 
     if (!fn && !(fn = getsparam("HISTFILE")))
 	return 1;
@@ -2797,7 +3176,7 @@ lockhistfile(char *fn, int keep_trying)
 		    continue;
 		break;
 	    }
-	    if (checklocktime(lockfile, sb.st_mtime) < 0) {
+	    if (checklocktime(lockfile, &sleep_us, sb.st_mtime) < 0) {
 		ret = 1;
 		break;
 	    }
@@ -2825,7 +3204,7 @@ lockhistfile(char *fn, int keep_trying)
 			continue;
 		    ret = 2;
 		} else {
-		    if (checklocktime(lockfile, sb.st_mtime) < 0) {
+		    if (checklocktime(lockfile, &sleep_us, sb.st_mtime) < 0) {
 			ret = 1;
 			break;
 		    }
@@ -2853,7 +3232,7 @@ lockhistfile(char *fn, int keep_trying)
 		ret = 2;
 		break;
 	    }
-	    if (checklocktime(lockfile, sb.st_mtime) < 0) {
+	    if (checklocktime(lockfile, &sleep_us, sb.st_mtime) < 0) {
 		ret = 1;
 		break;
 	    }
@@ -3421,6 +3800,7 @@ pushhiststack(char *hf, zlong hs, zlong shs, int level)
     h->hist_ring = hist_ring;
     h->curhist = curhist;
     h->histlinect = histlinect;
+    h->histdupct = histdupct;
     h->histsiz = histsiz;
     h->savehistsiz = savehistsiz;
     h->locallevel = level;
@@ -3433,7 +3813,7 @@ pushhiststack(char *hf, zlong hs, zlong shs, int level)
 	    unsetparam("HISTFILE");
     }
     hist_ring = NULL;
-    curhist = histlinect = 0;
+    curhist = histlinect = histdupct = 0;
     if (zleactive)
 	zleentry(ZLE_CMD_SET_HIST_LINE, curhist);
     histsiz = hs;
@@ -3478,6 +3858,7 @@ pophiststack(void)
     if (zleactive)
 	zleentry(ZLE_CMD_SET_HIST_LINE, curhist);
     histlinect = h->histlinect;
+    histdupct = h->histdupct;
     histsiz = h->histsiz;
     savehistsiz = h->savehistsiz;
 
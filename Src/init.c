@@ -117,6 +117,8 @@ loop(int toplevel, int justonce)
 	    setblock_stdin();
 	    if (interact && toplevel) {
 	        int hstop = stophist;
+		if (execlinehook)
+		    execlinehook(0);
 		stophist = 3;
 		preprompt();
 		if (stophist != 3)
@@ -182,6 +184,7 @@ loop(int toplevel, int justonce)
 	    }
 	    if (stopmsg)	/* unset 'you have stopped jobs' flag */
 		stopmsg--;
+	    freedircache();
 	    execode(prog, 0, 0, toplevel ? "toplevel" : "file");
 	    tok = toksav;
 	    if (toplevel)
@@ -591,11 +594,18 @@ init_io(void)
 #endif
 }
 
+/*
+ * Buffer for output to the terminal.  This is large enough that a
+ * complete redraw of the editing area normally leaves in a single write.
+ */
+
+#define SHOUTBUFSIZ (8 * BUFSIZ)
+
 /**/
 mod_export void
 init_shout(void)
 {
-    static char shoutbuf[BUFSIZ];
+    static char shoutbuf[SHOUTBUFSIZ];
 #if defined(JOB_CONTROL) && defined(TIOCSETD) && defined(NTTYDISC)
     int ldisc;
 #endif
@@ -615,7 +625,7 @@ init_shout(void)
     /* Associate terminal file descriptor with a FILE pointer */
     shout = fdopen(SHTTY, "w");
 #ifdef _IOFBF
-    setvbuf(shout, shoutbuf, _IOFBF, BUFSIZ);
+    setvbuf(shout, shoutbuf, _IOFBF, SHOUTBUFSIZ);
 #endif
   
     gettyinfo(&shttyinfo);	/* get tty state */
@@ -1224,6 +1234,7 @@ init_misc(void)
 	    fclose(bshin);
 	SHIN = movefd(open("/dev/null", O_RDONLY | O_NOCTTY));
 	bshin = fdopen(SHIN, "r");
+	inittrace_finish();
 	execstring(cmd, 0, 1, "cmdarg");
 	stopmsg = 1;
 	zexit(lastval, 0);
@@ -1231,6 +1242,7 @@ init_misc(void)
 
     if (interact && isset(RCS))
 	readhistfile(NULL, 0, HFILE_USE_OPTIONS);
+    inittrace_finish();
 }
 
 /*
@@ -1247,17 +1259,21 @@ source(char *s)
     zlong oldlineno;
     int oldshst, osubsh, oloops;
     FILE *obshin;
+    struct shinfile oshinfile;
     char *old_scriptname = scriptname, *us;
     char *old_scriptfilename = scriptfilename;
     unsigned char *ocs;
     int ocsp;
     int otrap_return = trap_return, otrap_state = trap_state;
     struct funcstack fstack;
+    struct inittrace itr;
     enum source_return ret = SOURCE_OK;
 
+    inittrace_begin(&itr);
     if (!s || 
 	(!(prog = try_source_file((us = unmeta(s)))) &&
 	 (tempfd = movefd(open(us, O_RDONLY | O_NOCTTY))) == -1)) {
+	inittrace_end(&itr, "notfound", s ? s : "");
 	return SOURCE_NOT_FOUND;
     }
 
@@ -1277,6 +1293,7 @@ source(char *s)
     if (!prog) {
 	SHIN = tempfd;
 	bshin = fdopen(SHIN, "r");
+	shinfileopen(SHIN, &oshinfile);
     }
     subsh  = 0;
     lineno = 1;
@@ -1344,6 +1361,7 @@ source(char *s)
     if (prog)
 	freeeprog(prog);
     else {
+	shinfileclose(&oshinfile);
 	fclose(bshin);
 	fdtable[SHIN] = FDT_UNUSED;
 	SHIN = fd;		     /* the shell input fd                   */
@@ -1362,10 +1380,168 @@ source(char *s)
     free(cmdstack);
     cmdstack = ocs;
     cmdsp = ocsp;
+    inittrace_end(&itr, "source", s);
 
     return ret;
 }
 
+/*
+ * Startup tracing.  If ZSH_STARTUP_TRACE names a file in the
+ * environment the shell is started with, the time taken by each
+ * phase of initialisation, each file sourced and each function
+ * autoloaded before the shell starts reading commands is appended
+ * to that file, one line for each.  The lines are written in one go
+ * when start up is over, or if the shell exits before then.
+ */
+
+/* the file to write to, or NULL if we aren't tracing */
+static char *inittracefile;
+
+/* the lines written so far */
+static LinkList inittracelist;
+
+/* when tracing started, and the process that started it */
+static struct timespec inittracestart;
+static pid_t inittracepid;
+
+/* the depth of nesting of traced steps */
+static int inittracedepth;
+
+/* the phase of initialisation we are in */
+static struct inittrace inittracephase;
+static char *inittracephasename;
+
+/**/
+static long
+inittrace_usec(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000L +
+	(to->tv_nsec - from->tv_nsec) / 1000L;
+}
+
+/* Start tracing if asked to.  Called first thing when the shell starts. */
+
+/**/
+static void
+inittrace_init(void)
+{
+    char *s = zgetenv("ZSH_STARTUP_TRACE");
+
+    if (!s || !*s || getuid() != geteuid() || getgid() != getegid())
+	return;
+    inittracefile = ztrdup(s);
+    inittracelist = znewlinklist();
+    inittracepid = getpid();
+    zgettime_monotonic(&inittracestart);
+}
+
+/* Note the start of a step to trace. */
+
+/**/
+void
+inittrace_begin(struct inittrace *it)
+{
+    if (!(it->active = (inittracefile != NULL)))
+	return;
+    zgettime_monotonic(&it->wall);
+    it->cpu = clock();
+    inittracedepth++;
+}
+
+/*
+ * Record a step that has finished.  Each line has the process ID,
+ * the kind of step, how deeply it is nested, its start relative
+ * to the start of the shell, and the wall clock and processor time
+ * it took, all in microseconds, followed by its name.  The fields
+ * are separated by tabs.
+ */
+
+/**/
+void
+inittrace_end(struct inittrace *it, char *kind, char *name)
+{
+    struct timespec now;
+    char *line;
+
+    if (!it->active || !inittracefile)
+	return;
+    it->active = 0;
+    zgettime_monotonic(&now);
+    inittracedepth--;
+    line = zhalloc(strlen(kind) + strlen(name) + 100);
+    sprintf(line, "%ld\t%s\t%d\t%ld\t%ld\t%ld\t%s\n", (long)inittracepid,
+	    kind, inittracedepth, inittrace_usec(&inittracestart, &it->wall),
+	    inittrace_usec(&it->wall, &now),
+	    (long)((double)(clock() - it->cpu) * 1000000.0 / CLOCKS_PER_SEC),
+	    unmeta(name));
+    zaddlinknode(inittracelist, ztrdup(line));
+}
+
+/* Move on to the next phase of initialisation, if name is not NULL. */
+
+/**/
+static void
+inittrace_phase(char *name)
+{
+    if (inittracephasename)
+	inittrace_end(&inittracephase, "phase", inittracephasename);
+    if ((inittracephasename = name))
+	inittrace_begin(&inittracephase);
+}
+
+/*
+ * Start up is over:  write the trace, with a final line for the
+ * whole of it, and stop tracing.
+ */
+
+/**/
+void
+inittrace_finish(void)
+{
+    struct inittrace whole;
+    LinkNode node;
+    int fd;
+
+    if (!inittracefile || getpid() != inittracepid)
+	return;
+    /* anything we were in the middle of when exiting is lost */
+    inittracedepth = inittracephasename ? 1 : 0;
+    inittrace_phase(NULL);
+    inittrace_begin(&whole);
+    /*
+     * The wall clock time is from the start of tracing, but clock()
+     * counts from the start of the process, so the CPU time includes
+     * what came before zsh_main().
+     */
+    whole.wall = inittracestart;
+    whole.cpu = 0;
+    inittrace_end(&whole, "total", zsh_name);
+
+    if ((fd = open(inittracefile, O_WRONLY | O_CREAT | O_APPEND | O_NOCTTY,
+		   0666)) >= 0) {
+	/* one write, so that shells starting together don't mix lines */
+	size_t len = 0;
+	char *buf, *ptr;
+
+	for (node = firstnode(inittracelist); node; incnode(node))
+	    len += strlen((char *)getdata(node));
+	ptr = buf = zalloc(len + 1);
+	for (node = firstnode(inittracelist); node; incnode(node)) {
+	    strcpy(ptr, (char *)getdata(node));
+	    ptr += strlen(ptr);
+	}
+	if (write_loop(fd, buf, len) < 0)
+	    zwarn("can't write startup trace to %s: %e", inittracefile, errno);
+	zfree(buf, len + 1);
+	close(fd);
+    } else
+	zwarn("can't open startup trace %s: %e", inittracefile, errno);
+    freelinklist(inittracelist, freestr);
+    inittracelist = NULL;
+    zsfree(inittracefile);
+    inittracefile = NULL;
+}
+
 /* Try to source a file in the home directory */
 
 /**/
@@ -1549,6 +1725,9 @@ zsh_main(UNUSED(int argc), char **argv)
 {
     char **t, *runscript = NULL;
     int t0;
+
+    inittrace_init();
+    inittrace_phase("init_jobs");
 #ifdef USE_LOCALE
     setlocale(LC_ALL, "");
 #endif
@@ -1597,17 +1776,26 @@ zsh_main(UNUSED(int argc), char **argv)
     opts[PRIVILEGED] = (getuid() != geteuid() || getgid() != getegid());
     opts[USEZLE] = 1;   /* may be unset in init_io() */
     /* sets INTERACTIVE, SHINSTDIN and SINGLECOMMAND */
+    inittrace_phase("parseargs");
     parseargs(argv, &runscript);
 
     SHTTY = -1;
+    inittrace_phase("init_io");
     init_io();
+    inittrace_phase("setupvals");
     setupvals();
 
+    inittrace_phase("init_signals");
     init_signals();
+    inittrace_phase("init_bltinmods");
     init_bltinmods();
+    inittrace_phase("init_builtins");
     init_builtins();
+    inittrace_phase("run_init_scripts");
     run_init_scripts();
+    inittrace_phase("setupshin");
     setupshin(runscript);
+    inittrace_phase("init_misc");
     init_misc();
 
     for (;;) {
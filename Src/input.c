@@ -74,6 +74,13 @@
 #include "zsh.mdh"
 #include "input.pro"
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#if defined(MAP_PRIVATE) && defined(PROT_READ)
+#define USE_MMAP 1
+#endif
+#endif
+
 /* the shell input fd */
 
 /**/
@@ -128,6 +135,10 @@ static struct instacks *instack, *instacktop;
 
 static int instacksz = INSTACK_INITIAL;
 
+/* Contents of the file being sourced, if read in one go */
+
+static struct shinfile shinfile;
+
 /* Read a line from bshin.  Convert tokens and   *
  * null characters to Meta c^32 character pairs. */
 
@@ -176,6 +187,114 @@ shingetline(void)
     }
 }
 
+/*
+ * Read the whole of the regular file on fd, which is about to become
+ * SHIN for a sourced script, so that inputline() can hand its lines to
+ * the lexer directly instead of reading them one at a time from bshin.
+ * The state for any enclosing script is saved in *save, to be restored
+ * by shinfileclose().  If the file can't be read this way, bshin is
+ * used as usual.
+ */
+
+/**/
+void
+shinfileopen(int fd, struct shinfile *save)
+{
+    struct stat st;
+    char *raw = NULL, *s, *e, *d;
+    size_t len, rawsz, n;
+    int mapped = 0;
+
+    *save = shinfile;
+    shinfile.buf = shinfile.ptr = shinfile.end = NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+	lseek(fd, 0, SEEK_CUR) != 0)
+	return;
+    rawsz = len = (size_t)st.st_size;
+#ifdef USE_MMAP
+    if ((raw = (char *)mmap(NULL, len, PROT_READ, MAP_PRIVATE,
+			    fd, 0)) == (char *)MAP_FAILED)
+	raw = NULL;
+    else
+	mapped = 1;
+#endif
+    if (!raw) {
+	size_t got = 0;
+	ssize_t r;
+
+	raw = (char *)zalloc(len);
+	while (got < len) {
+	    if ((r = read(fd, raw + got, len - got)) > 0)
+		got += r;
+	    else if (r == 0)
+		break;
+	    else if (errno != EINTR) {
+		zfree(raw, len);
+		lseek(fd, 0, SEEK_SET);
+		return;
+	    }
+	}
+	if (!got) {
+	    zfree(raw, len);
+	    return;
+	}
+	/* If the file shrank, use what's there. */
+	len = got;
+    }
+
+    /*
+     * Metafy as shingetline() does, and terminate each line so that
+     * it can be used in place as an input buffer.
+     */
+    e = raw + len;
+    for (n = len + 1, s = raw; s < e; s++)
+	if (imeta(*s) || *s == '\n')
+	    n++;
+    d = shinfile.buf = (char *)zalloc(n);
+    for (s = raw; s < e; s++) {
+	if (imeta(*s)) {
+	    *d++ = Meta;
+	    *d++ = *s ^ 32;
+	} else if ((*d++ = *s) == '\n')
+	    *d++ = '\0';
+    }
+    *d = '\0';
+    shinfile.ptr = shinfile.buf;
+    shinfile.end = d;
+
+#ifdef USE_MMAP
+    if (mapped)
+	munmap(raw, rawsz);
+    else
+#endif
+	zfree(raw, rawsz);
+}
+
+/* Finish with the file read by shinfileopen() and restore *save. */
+
+/**/
+void
+shinfileclose(struct shinfile *save)
+{
+    if (shinfile.buf)
+	zfree(shinfile.buf, shinfile.end - shinfile.buf + 1);
+    shinfile = *save;
+}
+
+/* Return the next line of the file read by shinfileopen(). */
+
+/**/
+static char *
+shinfilegetline(void)
+{
+    char *line = shinfile.ptr;
+
+    if (line >= shinfile.end)
+	return NULL;
+    shinfile.ptr = line + strlen(line) + 1;
+    return line;
+}
+
 /* Get the next character from the input.
  * Will call inputline() to get a new line where necessary.
  */
@@ -223,6 +342,33 @@ ingetc(void)
     }
 }
 
+/*
+ * Return a pointer to the characters left in the current input buffer,
+ * with their number in *lenp, so that the lexer can scan runs of
+ * ordinary characters without going through ingetc() for each.  Any
+ * characters used must be consumed with inskip().  The caller must
+ * stop at tokens and newlines, which ingetc() treats specially.
+ */
+
+/**/
+char *
+inrun(int *lenp)
+{
+    *lenp = lexstop ? 0 : inbufleft;
+    return inbufptr;
+}
+
+/* Consume n characters returned by inrun(). */
+
+/**/
+void
+inskip(int n)
+{
+    inbufptr += n;
+    inbufleft -= n;
+    inbufct -= n;
+}
+
 /* Read a line from the current command stream and store it as input */
 
 /**/
@@ -230,7 +376,7 @@ static int
 inputline(void)
 {
     char *ingetcline, **ingetcpmptl = NULL, **ingetcpmptr = NULL;
-    int context = ZLCON_LINE_START;
+    int context = ZLCON_LINE_START, inflags = INP_FREE;
 
     /* If reading code interactively, work out the prompts. */
     if (interact && isset(SHINSTDIN)) {
@@ -267,7 +413,11 @@ inputline(void)
 	    write_loop(2, pptbuf, pptlen);
 	    free(pptbuf);
 	}
-	ingetcline = shingetline();
+	if (shinfile.buf) {
+	    ingetcline = shinfilegetline();
+	    inflags = 0;
+	} else
+	    ingetcline = shingetline();
     } else {
 	/*
 	 * Since we may have to read multiple lines before getting
@@ -290,7 +440,8 @@ inputline(void)
 	return lexstop = 1;
     }
     if (errflag) {
-	free(ingetcline);
+	if (inflags & INP_FREE)
+	    free(ingetcline);
 	return lexstop = errflag = 1;
     }
     if (isset(VERBOSE)) {
@@ -298,7 +449,7 @@ inputline(void)
 	zputs(ingetcline, stderr);
 	fflush(stderr);
     }
-    if (keyboardhackchar && *ingetcline &&
+    if (keyboardhackchar && (inflags & INP_FREE) && *ingetcline &&
 	ingetcline[strlen(ingetcline) - 1] == '\n' &&
 	interact && isset(SHINSTDIN) &&
 	SHTTY != -1 && ingetcline[1])
@@ -328,7 +479,7 @@ inputline(void)
     }
     isfirstch = 1;
     /* Put this into the input channel. */
-    inputsetline(ingetcline, INP_FREE);
+    inputsetline(ingetcline, inflags);
 
     return 0;
 }
@@ -77,6 +77,106 @@ static struct job *oldjobtab;
 /* The size of that. */
 static int oldmaxjob;
 
+/*
+ * Index from process IDs to the number of the job in jobtab they
+ * were added to, so findproc() doesn't have to search the whole
+ * table for every child reaped.  This is only a hint: the job is
+ * checked when the entry is used, and findproc() falls back to a
+ * full search, so processes moved between jobs or jobs cleared
+ * behind our back do no harm.
+ */
+
+struct pidindex {
+    struct pidindex *next;
+    pid_t pid;
+    int job;
+    int aux;
+};
+
+static struct pidindex **pidindextab;
+static int pidindexsize, pidindexct;
+
+#define PIDINDEX_INITSIZE 64
+#define pidindexslot(P) ((unsigned)(P) & (pidindexsize - 1))
+
+/* Remember that pid is in job; aux as for addproc(). */
+
+static void
+pidindex_add(pid_t pid, int job, int aux)
+{
+    struct pidindex *pi;
+
+    if (pidindexct >= pidindexsize) {
+	int osize = pidindexsize, i;
+	struct pidindex **otab = pidindextab, *nx;
+
+	pidindexsize = osize ? osize * 2 : PIDINDEX_INITSIZE;
+	pidindextab = (struct pidindex **)
+	    zshcalloc(pidindexsize * sizeof(struct pidindex *));
+	for (i = 0; i < osize; i++) {
+	    for (pi = otab[i]; pi; pi = nx) {
+		nx = pi->next;
+		pi->next = pidindextab[pidindexslot(pi->pid)];
+		pidindextab[pidindexslot(pi->pid)] = pi;
+	    }
+	}
+	if (otab)
+	    zfree(otab, osize * sizeof(struct pidindex *));
+    }
+    for (pi = pidindextab[pidindexslot(pid)]; pi; pi = pi->next)
+	if (pi->pid == pid)
+	    break;
+    if (!pi) {
+	pi = (struct pidindex *) zalloc(sizeof(struct pidindex));
+	pi->pid = pid;
+	pi->next = pidindextab[pidindexslot(pid)];
+	pidindextab[pidindexslot(pid)] = pi;
+	pidindexct++;
+    }
+    pi->job = job;
+    pi->aux = aux;
+}
+
+/* Forget pid if it's still recorded as being in job. */
+
+static void
+pidindex_del(pid_t pid, int job)
+{
+    struct pidindex *pi, **pip;
+
+    if (!pidindexct)
+	return;
+    for (pip = pidindextab + pidindexslot(pid); (pi = *pip);
+	 pip = &pi->next) {
+	if (pi->pid == pid) {
+	    if (pi->job == job) {
+		*pip = pi->next;
+		zfree(pi, sizeof(struct pidindex));
+		pidindexct--;
+	    }
+	    return;
+	}
+    }
+}
+
+/* Forget everything, when the job table is cleared. */
+
+static void
+pidindex_clear(void)
+{
+    struct pidindex *pi, *nx;
+    int i;
+
+    for (i = 0; i < pidindexsize && pidindexct; i++) {
+	for (pi = pidindextab[i]; pi; pi = nx) {
+	    nx = pi->next;
+	    zfree(pi, sizeof(struct pidindex));
+	    pidindexct--;
+	}
+	pidindextab[i] = NULL;
+    }
+}
+
 /* shell timings */
  
 /**/
@@ -162,6 +262,28 @@ findproc(pid_t pid, Job *jptr, Process *pptr, int aux)
 
     *jptr = NULL;
     *pptr = NULL;
+    if (pidindexct) {
+	struct pidindex *pi;
+
+	for (pi = pidindextab[pidindexslot(pid)]; pi; pi = pi->next)
+	    if (pi->pid == pid)
+		break;
+	/*
+	 * The usual case is that it's a running process in the job
+	 * the index says it is; anything else gets the full search.
+	 */
+	if (pi && pi->aux == aux && pi->job <= maxjob &&
+	    !(jobtab[pi->job].stat & STAT_DONE)) {
+	    for (pn = aux ? jobtab[pi->job].auxprocs : jobtab[pi->job].procs;
+		 pn; pn = pn->next) {
+		if (pn->pid == pid && pn->status == SP_RUNNING) {
+		    *pptr = pn;
+		    *jptr = jobtab + pi->job;
+		    return 1;
+		}
+	    }
+	}
+    }
     for (i = 1; i <= maxjob; i++)
     {
 	/*
@@ -1227,11 +1349,13 @@ void
 freejob(Job jn, int deleting)
 {
     struct process *pn, *nx;
+    int job = (jn >= jobtab && jn < jobtab + jobtabsize) ? jn - jobtab : -1;
 
     pn = jn->procs;
     jn->procs = NULL;
     for (; pn; pn = nx) {
 	nx = pn->next;
+	pidindex_del(pn->pid, job);
 	zfree(pn, sizeof(struct process));
     }
 
@@ -1239,6 +1363,7 @@ freejob(Job jn, int deleting)
     jn->auxprocs = NULL;
     for (; pn; pn = nx) {
 	nx = pn->next;
+	pidindex_del(pn->pid, job);
 	zfree(pn, sizeof(struct process));
     }
 
@@ -1249,7 +1374,7 @@ freejob(Job jn, int deleting)
     jn->pwd = NULL;
     if (jn->stat & STAT_WASSUPER) {
 	/* careful in case we shrink and move the job table */
-	int job = jn - jobtab;
+	job = jn - jobtab;
 	if (deleting)
 	    deletejob(jobtab + jn->other, 0);
 	else
@@ -1321,6 +1446,7 @@ addproc(pid_t pid, char *text, int aux, struct timeval *bgtime)
 	*pn->text = '\0';
     pn->status = SP_RUNNING;
     pn->next = NULL;
+    pidindex_add(pid, thisjob, aux);
 
     if (!aux)
     {
@@ -1537,6 +1663,7 @@ clearjobtab(int monitor)
 
     memset(jobtab, 0, jobtabsize * sizeof(struct job)); /* zero out table */
     maxjob = 0;
+    pidindex_clear();
 
     /*
      * Although we don't have job control in subshells, we
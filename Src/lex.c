@@ -231,6 +231,8 @@ struct lexstack {
     Wordcode ecbuf;
     Eccstr ecstrs;
     int ecsoffs, ecssub, ecnfunc;
+    Eccstr *ecstrtab;
+    int ecstrtabsz, ecnstrs;
 
     unsigned char *cstack;
     int csp;
@@ -306,6 +308,9 @@ lexsave(void)
     ls->ecsoffs = ecsoffs;
     ls->ecssub = ecssub;
     ls->ecnfunc = ecnfunc;
+    ls->ecstrtab = ecstrtab;
+    ls->ecstrtabsz = ecstrtabsz;
+    ls->ecnstrs = ecnstrs;
     ls->toklineno = toklineno;
     cmdsp = 0;
     inredir = 0;
@@ -371,6 +376,9 @@ lexrestore(void)
     ecsoffs = lstack->ecsoffs;
     ecssub = lstack->ecssub;
     ecnfunc = lstack->ecnfunc;
+    ecstrtab = lstack->ecstrtab;
+    ecstrtabsz = lstack->ecstrtabsz;
+    ecnstrs = lstack->ecnstrs;
     hlinesz = lstack->hlinesz;
     toklineno = lstack->toklineno;
     errflag = 0;
@@ -583,6 +591,59 @@ add(int c)
     }
 }
 
+/*
+ * Add a run of characters that need no special treatment straight from
+ * the input buffer to the token buffer, instead of one at a time via
+ * hgetc() and add().  This is only possible when nothing else needs to
+ * see the characters, i.e. history isn't active and the lexer isn't
+ * being used for the line editor.  If endchar is 0 the characters are
+ * those that are plain in an unquoted word, else those that are plain
+ * inside double quotes ending with endchar.  Returns the number of
+ * characters added.
+ */
+
+/**/
+int
+addrun(int endchar)
+{
+    char *start, *ptr, *end;
+    int n;
+
+    if (hgetc != ingetc || lexflags)
+	return 0;
+    start = inrun(&n);
+    for (ptr = start, end = start + n; ptr < end; ptr++) {
+	int c = STOUC(*ptr);
+
+	if (!c || itok(c) || c == '\n')
+	    break;
+	if (!endchar) {
+	    if (lexact2[c] != LX2_OTHER || lextok2[c] != c || inblank(c))
+		break;
+	} else if (c == endchar || c == '\\' || c == '$' || c == '}' ||
+		   c == '`' || c == '\'' || c == '(' || c == ')' ||
+		   c == '[' || c == ']' || c == '"')
+	    break;
+    }
+    if (!(n = ptr - start))
+	return 0;
+    if (len + n >= bsiz) {
+	int newbsiz = bsiz;
+
+	while (len + n >= newbsiz)
+	    newbsiz *= 2;
+	tokstr = (char *)hrealloc(tokstr, bsiz, newbsiz);
+	memset(tokstr + bsiz, 0, newbsiz - bsiz);
+	bsiz = newbsiz;
+	bptr = tokstr + len;
+    }
+    memcpy(bptr, start, n);
+    bptr += n;
+    len += n;
+    inskip(n);
+    return n;
+}
+
 #define SETPARBEGIN {							\
 	if ((lexflags & LEXFLAGS_ZLE) && !(inbufflags & INP_ALIAS) &&	\
 	    zlemetacs >= zlemetall+1-inbufct)				\
@@ -1426,6 +1487,11 @@ gettokstr(int c, int sub)
 	    break;
 	}
 	add(c);
+	if ((e = addrun(0))) {
+	    /* as if each character had been round the loop */
+	    fdpar = 0;
+	    intpos = (intpos > e) ? intpos - e : 0;
+	}
 	c = hgetc();
 	if (intpos)
 	    intpos--;
@@ -1583,6 +1649,7 @@ dquote_parse(char endchar, int sub)
 	if (err || lexstop)
 	    break;
 	add(c);
+	(void)addrun(endchar);
     }
     if (intick == 2)
 	ALLOWHIST
@@ -1963,3 +2030,537 @@ skipcomm(void)
     cmdpop();
     return lexstop;
 }
+
+/*
+ * Reading function bodies without parsing them, for LAZY_FUNCTIONS.
+ *
+ * The body of a function defined with braces is read a character at a
+ * time, following just enough of the syntax (quotes, substitutions,
+ * comments, words and command position) to find the brace that closes
+ * it, using the same rules as gettokstr() and exalias().  Anything
+ * that would need the real lexer to be sure where the body ends, such
+ * as a here-document or a case statement, stops this.
+ */
+
+static int lzback;
+
+/*
+ * lzinner is set while skipping anything but plain words, such as a
+ * quoted string or a substitution.  A closing brace at the start of a
+ * line is then taken to be the end of the function after all, so that
+ * a construct skipped wrongly doesn't run on to the end of the file;
+ * the definition is parsed as usual instead.
+ */
+
+static int lzinner, lzbol, lzstopped;
+
+/* Get a character for the body, or -1 at the end of input or on error. */
+
+static int
+lzgetc(void)
+{
+    int c;
+
+    if (lzback >= 0) {
+	c = lzback;
+	lzback = -1;
+	return c;
+    }
+    if (lzstopped)
+	return -1;
+    c = hgetc();
+    if (lexstop || errflag)
+	return -1;
+    add(c);
+    if (c == '}' && lzbol && lzinner) {
+	lzstopped = 1;
+	return -1;
+    }
+    lzbol = (c == '\n');
+    return c;
+}
+
+/* Skip a single-quoted string; a $'...' string if dollar is set. */
+
+static int
+lzsquote(int dollar)
+{
+    int c;
+
+    while ((c = lzgetc()) != '\'') {
+	if (c < 0 || ((c == '\\' || c == Meta) && dollar && lzgetc() < 0))
+	    return 1;
+    }
+    return 0;
+}
+
+/* Skip a backquoted command substitution. */
+
+static int
+lzbquote(void)
+{
+    int c;
+
+    while ((c = lzgetc()) != '`') {
+	if (c < 0 || ((c == '\\' || c == Meta) && lzgetc() < 0))
+	    return 1;
+    }
+    return 0;
+}
+
+static int lzparen _((void));
+static int lzbrace _((int));
+
+/* Skip what follows a $; dq is set in a double-quoted string. */
+
+static int
+lzdollar(int dq)
+{
+    int c = lzgetc();
+
+    if (c == '(')
+	return lzparen();
+    if (c == '{')
+	return lzbrace(dq);
+    if (c == '\'' && !dq)
+	return lzsquote(1);
+    lzback = c;
+    return c < 0;
+}
+
+/* Skip a double-quoted string. */
+
+static int
+lzdquote(void)
+{
+    int c;
+
+    while ((c = lzgetc()) != '"') {
+	switch (c) {
+	case -1:
+	    return 1;
+	case '\\':
+	case Meta:
+	    if (lzgetc() < 0)
+		return 1;
+	    break;
+	case '$':
+	    if (lzdollar(1))
+		return 1;
+	    break;
+	case '`':
+	    if (lzbquote())
+		return 1;
+	    break;
+	}
+    }
+    return 0;
+}
+
+/* Skip a parameter substitution after ${. */
+
+static int
+lzbrace(int dq)
+{
+    int c, bct = 1;
+
+    while ((c = lzgetc()) >= 0) {
+	switch (c) {
+	case '\\':
+	case Meta:
+	    if (lzgetc() < 0)
+		return 1;
+	    break;
+	case '\'':
+	    if (!dq && lzsquote(0))
+		return 1;
+	    break;
+	case '"':
+	    if (lzdquote())
+		return 1;
+	    break;
+	case '`':
+	    if (lzbquote())
+		return 1;
+	    break;
+	case '$':
+	    if (lzdollar(dq))
+		return 1;
+	    break;
+	case '{':
+	    bct++;
+	    break;
+	case '}':
+	    if (!--bct)
+		return 0;
+	    break;
+	}
+    }
+    return 1;
+}
+
+/*
+ * Skip a command substitution after $( or a process substitution,
+ * in the manner of skipcomm().
+ */
+
+static int
+lzparen(void)
+{
+    int c, pct = 1, start = 0, iswhite;
+    char word[5];
+    int wlen = 0;
+
+    while ((c = lzgetc()) >= 0) {
+	iswhite = inblank(c) || c == ';' || c == '&' || c == '|' ||
+	    c == '(' || c == ')';
+	if (iswhite) {
+	    if (wlen == 4 && !strncmp(word, "case", 4))
+		return 1;
+	    wlen = 0;
+	} else if (wlen < 5)
+	    word[wlen++] = c;
+	switch (c) {
+	case '(':
+	    pct++;
+	    break;
+	case ')':
+	    if (!--pct)
+		return 0;
+	    break;
+	case '\\':
+	case Meta:
+	    if (lzgetc() < 0)
+		return 1;
+	    break;
+	case '\'':
+	    if (lzsquote(0))
+		return 1;
+	    break;
+	case '"':
+	    if (lzdquote())
+		return 1;
+	    break;
+	case '`':
+	    if (lzbquote())
+		return 1;
+	    break;
+	case '$':
+	    if (lzdollar(0))
+		return 1;
+	    break;
+	case '<':
+	    if ((c = lzgetc()) == '<') {
+		/* A here-document needs proper parsing. */
+		if ((c = lzgetc()) != '<')
+		    return 1;
+	    } else
+		lzback = c;
+	    break;
+	case '#':
+	    /* A comment only starts a word, as in $((#x)) it doesn't. */
+	    if (start) {
+		while ((c = lzgetc()) != '\n')
+		    if (c < 0)
+			return 1;
+		wlen = 0;
+	    }
+	    break;
+	}
+	start = inblank(c);
+    }
+    return 1;
+}
+
+/* Words after which we are still in command position. */
+
+static char *lzcmdwords[] = {
+    "!", "always", "coproc", "do", "elif", "else", "if", "nocorrect",
+    "then", "time", "until", "while", NULL
+};
+
+/*
+ * Read the body text of a function whose opening brace has just been
+ * read, up to the matching closing brace.  This returns the text on
+ * the heap, or NULL if the end of the body can't be found this way.
+ * In that case the input read has been put back so that the body can
+ * be parsed as usual.
+ */
+
+/* Does the start of a word look like an assignment? */
+
+static int
+lzassign(char *word, int wlen)
+{
+    int i;
+
+    if (!iident(*word) || idigit(*word))
+	return 0;
+    for (i = 1; i < wlen && i < 64 && iident(word[i]); i++)
+	;
+    return i < 63 && i < wlen &&
+	(word[i] == '=' || word[i] == '[' ||
+	 (word[i] == '+' && i + 1 < wlen && word[i + 1] == '='));
+}
+
+/**/
+char *
+lexlazybody(void)
+{
+    zlong olineno = lineno;
+    int depth = 1, cmdpos = 1, redir = 0, oldcmdpos = 0, fnames = 0;
+    int inarray = 0;
+    int c, d, n, end = -1;
+    /* State of the current word */
+    char word[64];
+    int wlen = 0, wbct = 0, wpar = 0, wquoted = 0, rawend = 0, rawpos = 0;
+    int comments = !nocomments && (isset(INTERACTIVECOMMENTS) ||
+				   (!expanding &&
+				    (!interact || unset(SHINSTDIN) || strin)));
+
+    bptr = tokstr = (char *) hcalloc(bsiz = 256);
+    len = 0;
+    lzback = -1;
+    lzbol = lzstopped = 0;
+
+    for (;;) {
+	lzinner = 0;
+	c = lzgetc();
+	lzinner = 1;
+	if (!wlen) {
+	    if (c >= 0 && iblank(c))
+		continue;
+	    if (c == hashchar && comments) {
+		while ((c = lzgetc()) != '\n')
+		    if (c < 0)
+			goto fail;
+	    } else if (c == '{' && cmdpos && !redir) {
+		depth++;
+		fnames = 0;
+		continue;
+	    }
+	}
+	switch (c) {
+	case '\\':
+	    if ((c = lzgetc()) < 0)
+		goto fail;
+	    if (c != '\n' || wlen) {
+		wquoted = 1;
+		goto wordchar;
+	    }
+	    continue;
+
+	case Meta:
+	    if (lzgetc() < 0)
+		goto fail;
+	    goto wordchar;
+
+	case '\'':
+	case '"':
+	case '`':
+	    if (c == '\'' ? lzsquote(0) : c == '"' ? lzdquote() : lzbquote())
+		goto fail;
+	    wquoted = 1;
+	    goto wordchar;
+
+	case '$':
+	    if (lzdollar(0))
+		goto fail;
+	    wquoted = 1;
+	    goto wordchar;
+
+	case '{':
+	    wbct++;
+	    goto wordchar;
+
+	case '}':
+	    if (wbct) {
+		wbct--;
+		goto wordchar;
+	    }
+	    if (rawend && rawpos == len - 2) {
+		/* x}} would be lexed differently once the brace is gone */
+		goto fail;
+	    }
+	    if (wlen < (int)sizeof(word))
+		word[wlen] = c;
+	    wlen++;
+	    rawend = 1;
+	    rawpos = len - 1;
+	    continue;
+
+	case '(':
+	    if ((d = lzgetc()) == ')') {
+		/* () after a function name */
+		c = -2;
+		break;
+	    }
+	    lzback = d;
+	    if (!wlen && cmdpos && !redir) {
+		/* subshell */
+		continue;
+	    }
+	    if (cmdpos && !redir && !wpar && !inarray &&
+		wlen < (int)sizeof(word) && word[wlen - 1] == '=' &&
+		lzassign(word, wlen)) {
+		/* x=( ... ): the elements aren't in command position */
+		inarray = 1;
+		cmdpos = 0;
+		wlen = wbct = wquoted = rawend = 0;
+		continue;
+	    }
+	    wpar++;
+	    goto wordchar;
+
+	case ')':
+	    if (wpar) {
+		wpar--;
+		goto wordchar;
+	    }
+	    break;
+
+	case '<':
+	case '>':
+	case '=':
+	    if ((d = lzgetc()) == '(' && (c != '=' || !wlen)) {
+		if (lzparen())
+		    goto fail;
+		wquoted = 1;
+		goto wordchar;
+	    }
+	    lzback = d;
+	    if (c == '=')
+		goto wordchar;
+	    break;
+
+	case -1:
+	case '\n':
+	case ';':
+	case '&':
+	case '|':
+	    break;
+
+	default:
+	    if (iblank(c))
+		break;
+	wordchar:
+	    if (wlen < (int)sizeof(word))
+		word[wlen] = c;
+	    wlen++;
+	    rawend = 0;
+	    continue;
+	}
+
+	/* c ends the current word, if any. */
+	if (wlen) {
+	    int assign = cmdpos && !redir && lzassign(word, wlen);
+
+	    if (rawend) {
+		/*
+		 * A brace at the end of an assignment isn't split off,
+		 * and we can't tell for certain with long words.
+		 */
+		if (assign || wlen >= (int)sizeof(word))
+		    goto fail;
+		if (!--depth) {
+		    /*
+		     * The character after the brace goes back to the
+		     * lexer; that's only simple if it was the last read.
+		     */
+		    if (c == -2 || lzback >= 0 || errflag)
+			goto fail;
+		    if (c >= 0)
+			hungetc(c);
+		    end = rawpos;
+		    break;
+		}
+	    } else if (wlen == 1 && *word == '{' && !wquoted) {
+		/* A brace that isn't in command position: let the
+		 * parser decide what it is. */
+		goto fail;
+	    }
+	    if (redir) {
+		redir = 0;
+		cmdpos = oldcmdpos;
+	    } else if (cmdpos && !wquoted && wlen < (int)sizeof(word)) {
+		char **wp;
+
+		if ((wlen == 4 && !strncmp(word, "case", 4)) ||
+		    (wlen == 6 && !strncmp(word, "select", 6)))
+		    goto fail;
+		if (wlen == 8 && !strncmp(word, "function", 8))
+		    fnames = 1;
+		else {
+		    for (wp = lzcmdwords; *wp; wp++)
+			if ((int)strlen(*wp) == wlen &&
+			    !strncmp(*wp, word, wlen))
+			    break;
+		    if (!*wp && !assign && !fnames)
+			cmdpos = 0;
+		}
+	    } else if (!assign && !fnames)
+		cmdpos = 0;
+	    wlen = wbct = wpar = wquoted = rawend = 0;
+	}
+	switch (c) {
+	case -1:
+	    goto fail;
+	case -2:
+	    /* () */
+	    cmdpos = 1;
+	    fnames = 0;
+	    break;
+	case '\n':
+	    if (inarray)
+		break;
+	    /* FALLTHROUGH */
+	case ';':
+	case '&':
+	case '|':
+	    cmdpos = 1;
+	    fnames = 0;
+	    if (redir) {
+		redir = 0;
+		oldcmdpos = 1;
+	    }
+	    break;
+	case ')':
+	    /* After an array assignment we may still see a command. */
+	    cmdpos = inarray;
+	    inarray = 0;
+	    break;
+	case '<':
+	case '>':
+	    /* A redirection: the next word is not a command. */
+	    d = c;
+	    for (n = 1; (c = lzgetc()) == '<' || c == '>' || c == '&' ||
+		     c == '|' || c == '!'; n++)
+		if (n == 1 && (c != '<' || d != '<'))
+		    d = 0;
+		else if (n == 2 && c == '<')
+		    d = 0;
+	    lzback = c;
+	    if (d == '<' && n >= 2)
+		goto fail;	/* here-document */
+	    if (!redir) {
+		redir = 1;
+		oldcmdpos = cmdpos;
+	    }
+	    cmdpos = 0;
+	    break;
+	}
+    }
+
+    tokstr[end] = '\0';
+    return tokstr;
+
+ fail:
+    if (errflag)
+	return NULL;
+    /* Put back what we read so the parser can have another go. */
+    *bptr = '\0';
+    lexstop = 0;
+    lineno = olineno;
+    inpush(tokstr, INP_CONT, NULL);
+    return NULL;
+}
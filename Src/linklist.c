@@ -144,6 +144,37 @@ insertlinknode(LinkList list, LinkNode node, void *dat)
     return new;
 }
 
+/*
+ * Insert n nodes in a linked list after a given node, in a single
+ * allocation from the heap, and return the first.  The nodes are
+ * consecutive in memory, so the last is the return value plus n - 1;
+ * their data are left for the caller to fill in.  This is for callers
+ * putting many elements into a list in one go.
+ */
+
+/**/
+mod_export LinkNode
+insertlinknodes(LinkList list, LinkNode node, int n)
+{
+    LinkNode tmp, new;
+    int i;
+
+    tmp = node->next;
+    new = (LinkNode) zhalloc(n * sizeof *new);
+    for (i = 0; i < n; i++) {
+	new[i].prev = i ? new + i - 1 : node;
+	new[i].next = new + i + 1;
+	new[i].dat = NULL;
+    }
+    node->next = new;
+    new[n - 1].next = tmp;
+    if (tmp)
+	tmp->prev = new + n - 1;
+    else
+	list->list.last = new + n - 1;
+    return new;
+}
+
 /**/
 mod_export LinkNode
 zinsertlinknode(LinkList list, LinkNode node, void *dat)
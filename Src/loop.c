@@ -45,6 +45,52 @@ mod_export int contflag;
 /**/
 mod_export int breaks;
 
+/* State for a for loop taking matches straight from a glob */
+
+struct forstream {
+    Estate state;
+    Wordcode loop;
+    char *name;
+};
+
+/*
+ * Run the body of a for loop for one file found by a glob with
+ * the (i) qualifier.  Return non-zero if the loop has finished.
+ */
+
+/**/
+static int
+forstreammatch(char *str, void *data)
+{
+    struct forstream *fs = (struct forstream *)data;
+
+    if (isset(XTRACE)) {
+	printprompt4();
+	fprintf(xtrerr, "%s=%s\n", fs->name, str);
+	fflush(xtrerr);
+    }
+    setsparam(fs->name, ztrdup(str));
+    pushheap();
+    fs->state->pc = fs->loop;
+    execlist(fs->state, 1, 0);
+    popheap();
+    if (breaks) {
+	breaks--;
+	if (breaks || !contflag)
+	    return 1;
+	contflag = 0;
+    }
+    if (retflag)
+	return 1;
+    if (errflag) {
+	if (breaks)
+	    breaks--;
+	lastval = 1;
+	return 1;
+    }
+    return 0;
+}
+
 /**/
 int
 execfor(Estate state, int do_exec)
@@ -88,7 +134,23 @@ execfor(Estate state, int do_exec)
 		return 0;
 	    }
 	    if (htok) {
-		execsubst(args);
+		if (!nextnode(firstnode(vars))) {
+		    /*
+		     * A glob may pass its matches to the loop body
+		     * as it finds them; see forstreammatch().
+		     */
+		    struct forstream fs;
+
+		    fs.state = state;
+		    fs.loop = state->pc;
+		    fs.name = (char *)getdata(firstnode(vars));
+		    loops++;
+		    cmdpush(CS_FOR);
+		    execsubststream(args, forstreammatch, &fs);
+		    cmdpop();
+		    loops--;
+		} else
+		    execsubst(args);
 		if (errflag) {
 		    state->pc = end;
 		    return 1;
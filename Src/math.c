@@ -28,6 +28,7 @@
  */
 
 struct mathvalue;
+struct mathcode;
 
 #include "zsh.mdh"
 #include "math.pro"
@@ -70,6 +71,20 @@ static int mlevel = 0;
 
 static int unary = 1;
 
+/*
+ * Set by zzlex() when the token it returns depends on the state of
+ * the shell rather than just the text, or when it changed the output
+ * format on the way; see mathlex().
+ */
+
+#define MLEX_PID        1
+#define MLEX_LASTVAL    2
+#define MLEX_POUND      4
+#define MLEX_RADIX      8
+#define MLEX_UNDERSCORE 16
+
+static int lexspecial;
+
 /* LR = left-to-right associativity *
  * RL = right-to-left associativity *
  * BOOL = short-circuiting boolean   */
@@ -316,11 +331,65 @@ struct mathvalue {
      * stores a reference to it.
      */
     Value pval;
+    /*
+     * Alternatively, a plain integer or floating point parameter
+     * whose value we read directly.
+     */
+    Param pm;
     mnumber val;
 };
 
 static struct mathvalue *stack;
 
+/* Compiled expressions: see getmathcode() */
+
+enum {
+    MI_NUM,			/* push a constant */
+    MI_PID,			/* push $$ */
+    MI_LASTVAL,			/* push $? */
+    MI_POUND,			/* push $# */
+    MI_ID,			/* variable reference */
+    MI_CID,			/* #variable */
+    MI_FUNC,			/* math function call */
+    MI_RADIX,			/* output format specification */
+    MI_OP,			/* apply operator */
+    MI_BOP,			/* left hand side of && etc. is done */
+    MI_BOPEND,			/* apply && etc. */
+    MI_QUEST,			/* condition of ?: is done */
+    MI_COLON,			/* middle of ?: is done */
+    MI_QEND			/* apply ?: */
+};
+
+struct mathinstr {
+    int code;
+    /*
+     * Operator for MI_OP etc.; for MI_NUM, the new value of lastbase
+     * or -2; for MI_RADIX, the MLEX_RADIX and MLEX_UNDERSCORE bits
+     */
+    int tok;
+    mnumber val;		/* MI_NUM; for MI_RADIX, radix in u.l */
+    int under;			/* MI_RADIX */
+    char *str;			/* MI_ID, MI_CID, MI_FUNC */
+};
+
+struct mathcode {
+    char *expr;			/* text of expression */
+    unsigned hval;		/* hash of expression */
+    int opts;			/* options that affect lexing as mathoptbits() */
+    int busy;			/* number of mathexec()s running this */
+    int end, mtok;		/* where and how the parse stopped */
+    int ninstr;
+    struct mathinstr *instr;
+};
+
+#define MATHCACHE_SIZE 64
+
+/* Nesting of ?: and && etc. we'll compile */
+
+#define MATHCTL_MAX 32
+
+static struct mathcode *mathcache[MATHCACHE_SIZE];
+
 enum prec_type {
     /* Evaluating a top-level expression */
     MPREC_TOP,
@@ -329,6 +398,30 @@ enum prec_type {
 };
 
 
+/*
+ * If s is the name of an integer or floating point parameter that keeps
+ * its value in the usual place, return it, so that we don't need to go
+ * through the Value machinery.
+ */
+
+static Param
+mathnumparam(char *s)
+{
+    Param pm;
+
+    if (strchr(s, '[') || !(pm = (Param) paramtab->getnode(paramtab, s)) ||
+	(pm->node.flags & PM_UNSET))
+	return NULL;
+    switch (PM_TYPE(pm->node.flags)) {
+    case PM_INTEGER:
+	return (pm->gsu.i == &stdinteger_gsu) ? pm : NULL;
+    case PM_EFLOAT:
+    case PM_FFLOAT:
+	return (pm->gsu.f == &stdfloat_gsu) ? pm : NULL;
+    }
+    return NULL;
+}
+
 /*
  * Get a number from a variable.
  * Try to be clever about reusing subscripts by caching the Value structure.
@@ -338,6 +431,21 @@ getmathparam(struct mathvalue *mptr)
 {
     if (!mptr->pval) {
 	char *s = mptr->lval;
+	Param pm;
+
+	if ((pm = mathnumparam(s))) {
+	    mnumber mn;
+
+	    mptr->pm = pm;
+	    if (PM_TYPE(pm->node.flags) == PM_INTEGER) {
+		mn.type = MN_INTEGER;
+		mn.u.l = pm->u.val;
+	    } else {
+		mn.type = MN_FLOAT;
+		mn.u.d = pm->u.dval;
+	    }
+	    return mn;
+	}
 	mptr->pval = (Value)zhalloc(sizeof(struct value));
 	if (!getvalue(mptr->pval, &s, 1))
 	{
@@ -357,6 +465,7 @@ mathevall(char *s, enum prec_type prec_tp, char **ep)
     char *xyylval;
     int xsp;
     struct mathvalue *xstack = 0, nstack[STACKSZ];
+    struct mathcode *mc;
     mnumber ret;
 
     if (mlevel >= MAX_MLEVEL) {
@@ -395,8 +504,14 @@ mathevall(char *s, enum prec_type prec_tp, char **ep)
     unary = 1;
     stack[0].val.type = MN_INTEGER;
     stack[0].val.u.l = 0;
-    mathparse(prec_tp == MPREC_TOP ? TOPPREC : ARGPREC);
-    *ep = ptr;
+    if (prec_tp == MPREC_TOP && (mc = getmathcode(s))) {
+	mathexec(mc);
+	*ep = s + mc->end;
+	mtok = mc->mtok;
+    } else {
+	mathparse(prec_tp == MPREC_TOP ? TOPPREC : ARGPREC);
+	*ep = ptr;
+    }
     DPUTS(!errflag && sp > 0,
 	  "BUG: math: wallabies roaming too freely in outback");
 
@@ -699,10 +814,12 @@ zzlex(void)
 	    }
 	    return EQ;
 	case '$':
+	    lexspecial |= MLEX_PID;
 	    yyval.u.l = mypid;
 	    return NUM;
 	case '?':
 	    if (unary) {
+		lexspecial |= MLEX_LASTVAL;
 		yyval.u.l = lastval;
 		return NUM;
 	    }
@@ -738,6 +855,7 @@ zzlex(void)
 		    if (idigit(*ptr)) {
 			outputradix = n * zstrtol(ptr, &ptr, 10);
 			checkradix = 1;
+			lexspecial |= MLEX_RADIX;
 		    }
 		    if (*ptr == '_') {
 			ptr++;
@@ -745,6 +863,7 @@ zzlex(void)
 			    outputunderscore = zstrtol(ptr, &ptr, 10);
 			else
 			    outputunderscore = 3;
+			lexspecial |= MLEX_UNDERSCORE;
 		    }
 		} else {
 		    bofs:
@@ -810,6 +929,7 @@ zzlex(void)
 		return (func ? FUNC : (cct ? CID : ID));
 	    }
 	    else if (cct) {
+		lexspecial |= MLEX_POUND;
 		yyval.u.l = poundgetfn(NULL);
 		return NUM;
 	    }
@@ -828,6 +948,7 @@ push(mnumber val, char *lval, int getme)
     stack[sp].val = val;
     stack[sp].lval = lval;
     stack[sp].pval = NULL;
+    stack[sp].pm = NULL;
     if (getme)
 	stack[sp].val.type = MN_UNSET;
 }
@@ -878,13 +999,14 @@ getcvar(char *s)
 static mnumber
 setmathvar(struct mathvalue *mvp, mnumber v)
 {
+    Param pm;
+
     if (mvp->pval) {
 	/*
 	 * This value may have been hanging around for a while.
 	 * Be ultra-paranoid in checking the variable is still valid.
 	 */
 	char *s = mvp->lval, *ptr;
-	Param pm;
 	DPUTS(!mvp->lval, "no variable name but variable value in math");
 	if ((ptr = strchr(s, '[')))
 	    s = dupstrpfx(s, ptr - s);
@@ -897,6 +1019,24 @@ setmathvar(struct mathvalue *mvp, mnumber v)
 	}
 	/* Different parameter, start again from scratch */
 	mvp->pval = NULL;
+    } else if (mvp->lval && (pm = mathnumparam(mvp->lval)) &&
+	       (!mvp->pm || pm == mvp->pm) && isset(EXECOPT) &&
+	       !(pm->node.flags & (PM_READONLY|PM_RESTRICTED|PM_EXPORTED)) &&
+	       !pm->env && (unset(ALLEXPORT) ||
+			    (pm->node.flags & PM_HASHELEM))) {
+	/*
+	 * Set it directly; this does what setnumvalue() would, as
+	 * there's nothing to export.
+	 */
+	if (noeval)
+	    return v;
+	if (PM_TYPE(pm->node.flags) == PM_INTEGER) {
+	    pm->u.val = (v.type & MN_INTEGER) ? v.u.l : (zlong) v.u.d;
+	    if (!pm->base && lastbase != -1)
+		pm->base = lastbase;
+	} else
+	    pm->u.dval = (v.type & MN_INTEGER) ? (double) v.u.l : v.u.d;
+	return v;
     }
     if (!mvp->lval) {
 	zerr("lvalue required");
@@ -1247,6 +1387,7 @@ op(int what)
 	    spval->u.l = !spval->u.l;
 	stack[sp].lval = NULL;
 	stack[sp].pval = NULL;
+	stack[sp].pm = NULL;
 	break;
     case COMP:
 	if (spval->type & MN_FLOAT) {
@@ -1256,6 +1397,7 @@ op(int what)
 	    spval->u.l = ~spval->u.l;
 	stack[sp].lval = NULL;
 	stack[sp].pval = NULL;
+	stack[sp].pm = NULL;
 	break;
     case POSTPLUS:
 	a = *spval;
@@ -1276,6 +1418,7 @@ op(int what)
     case UPLUS:
 	stack[sp].lval = NULL;
 	stack[sp].pval = NULL;
+	stack[sp].pm = NULL;
 	break;
     case UMINUS:
 	if (spval->type & MN_FLOAT)
@@ -1284,6 +1427,7 @@ op(int what)
 	    spval->u.l = -spval->u.l;
 	stack[sp].lval = NULL;
 	stack[sp].pval = NULL;
+	stack[sp].pm = NULL;
 	break;
     case QUEST:
 	DPUTS(sp < 2, "BUG: math: three shall be the number of the counting.");
@@ -1522,3 +1666,340 @@ mathparse(int pc)
 	checkunary(mtok, optr);
     }
 }
+
+/*
+ * Cache of compiled expressions.
+ *
+ * Expressions evaluated by matheval() are often the same text again
+ * and again, for example in the body of a loop.  Rather than lexing
+ * it every time, mathcompile() runs the same operator-precedence
+ * parse as mathparse() once, recording what mathparse() would do in
+ * a list of instructions, and mathexec() later replays them using
+ * the same push(), op() and bop() as the parser.  Anything the
+ * compiler doesn't like, including any error, means we don't cache
+ * the expression and let mathparse() deal with it as before, so
+ * messages and side effects are unchanged.
+ */
+
+/* State of the compiler */
+
+static struct mathinstr *mcinstr;
+static int mcsize, mcused, mcdepth, mcmaxdepth;
+
+/* Options that change what the lexer and parser do. */
+
+static int
+mathoptbits(void)
+{
+    return (isset(CPRECEDENCES) | (isset(FORCEFLOAT) << 1) |
+	    (isset(OCTALZEROES) << 2) | (isset(MULTIBYTE) << 3) |
+	    (isset(POSIXIDENTIFIERS) << 4));
+}
+
+/**/
+static void
+freemathcode(struct mathcode *mc)
+{
+    int i;
+
+    for (i = 0; i < mc->ninstr; i++)
+	zsfree(mc->instr[i].str);
+    zfree(mc->instr, mc->ninstr * sizeof(struct mathinstr));
+    zsfree(mc->expr);
+    zfree(mc, sizeof(*mc));
+}
+
+/**/
+static struct mathinstr *
+mathemit(int code, int tok)
+{
+    struct mathinstr *mi;
+
+    if (mcused == mcsize) {
+	mcsize = mcsize ? 2 * mcsize : 16;
+	mcinstr = (struct mathinstr *)
+	    zrealloc(mcinstr, mcsize * sizeof(struct mathinstr));
+    }
+    mi = mcinstr + mcused++;
+    memset(mi, 0, sizeof(*mi));
+    mi->code = code;
+    mi->tok = tok;
+
+    return mi;
+}
+
+/*
+ * Call zzlex() for the compiler, recording anything it did that
+ * mathexec() will need to repeat.
+ */
+
+/**/
+static int
+mathlex(void)
+{
+    int tok;
+
+    lexspecial = 0;
+    lastbase = -2;
+    tok = zzlex();
+    if (lexspecial & (MLEX_RADIX|MLEX_UNDERSCORE)) {
+	struct mathinstr *mi = mathemit(MI_RADIX,
+					lexspecial &
+					(MLEX_RADIX|MLEX_UNDERSCORE));
+
+	mi->val.u.l = outputradix;
+	mi->under = outputunderscore;
+    }
+    return tok;
+}
+
+/* This mirrors mathparse(). */
+
+/**/
+static void
+mathcompile(int pc)
+{
+    int otok;
+    char *optr = ptr;
+    struct mathinstr *mi;
+
+    if (errflag)
+	return;
+    mtok = mathlex();
+    if (pc == TOPPREC && mtok == EOI)
+	return;
+    checkunary(mtok, optr);
+    while (prec[mtok] <= pc) {
+	if (errflag)
+	    return;
+	switch (mtok) {
+	case NUM:
+	    if (lexspecial & MLEX_PID)
+		mathemit(MI_PID, 0);
+	    else if (lexspecial & MLEX_LASTVAL)
+		mathemit(MI_LASTVAL, 0);
+	    else if (lexspecial & MLEX_POUND)
+		mathemit(MI_POUND, 0);
+	    else {
+		mi = mathemit(MI_NUM, lastbase);
+		mi->val = yyval;
+	    }
+	    break;
+	case ID:
+	case CID:
+	case FUNC:
+	    mi = mathemit(mtok == ID ? MI_ID : mtok == CID ? MI_CID : MI_FUNC,
+			  0);
+	    mi->str = ztrdup(yylval);
+	    break;
+	case M_INPAR:
+	    mathcompile(TOPPREC);
+	    if (mtok != M_OUTPAR) {
+		if (!errflag)
+		    zerr("')' expected");
+		return;
+	    }
+	    break;
+	case QUEST:
+	    mathemit(MI_QUEST, 0);
+	    if (++mcdepth > mcmaxdepth)
+		mcmaxdepth = mcdepth;
+	    mathcompile(prec[COLON] - 1);
+	    if (mtok != COLON) {
+		if (!errflag)
+		    zerr("':' expected");
+		return;
+	    }
+	    mathemit(MI_COLON, 0);
+	    mathcompile(prec[QUEST]);
+	    mathemit(MI_QEND, QUEST);
+	    mcdepth--;
+	    continue;
+	default:
+	    otok = mtok;
+	    if (MTYPE(type[otok]) == BOOL) {
+		mathemit(MI_BOP, otok);
+		if (++mcdepth > mcmaxdepth)
+		    mcmaxdepth = mcdepth;
+		mathcompile(prec[otok] - (MTYPE(type[otok]) != RL));
+		mathemit(MI_BOPEND, otok);
+		mcdepth--;
+	    } else {
+		mathcompile(prec[otok] - (MTYPE(type[otok]) != RL));
+		mathemit(MI_OP, otok);
+	    }
+	    continue;
+	}
+	optr = ptr;
+	mtok = mathlex();
+	checkunary(mtok, optr);
+    }
+}
+
+/*
+ * Find the compiled form of the expression s, compiling it if it's
+ * not in the cache.  Returns NULL if it can't be compiled.
+ */
+
+/**/
+static struct mathcode *
+getmathcode(char *s)
+{
+    struct mathcode *mc, **mcp;
+    unsigned hval = 0;
+    int opts = mathoptbits(), ne, xoutputradix, xoutputunderscore;
+    char *p;
+
+    if (errflag)
+	return NULL;
+    /*
+     * Identifiers with non-ASCII characters depend on the locale,
+     * so don't bother with those.
+     */
+    for (p = s; *p; p++) {
+	if ((unsigned char) *p >= 0x80)
+	    return NULL;
+	hval = hval * 65599 + (unsigned char) *p;
+    }
+    mcp = mathcache + (hval % MATHCACHE_SIZE);
+    if ((mc = *mcp) && mc->hval == hval && mc->opts == opts &&
+	!strcmp(mc->expr, s))
+	return mc;
+    if (mc && mc->busy)
+	return NULL;
+
+    queue_signals();
+    ne = noerrs;
+    noerrs = 1;
+    xoutputradix = outputradix;
+    xoutputunderscore = outputunderscore;
+    mcused = mcdepth = mcmaxdepth = 0;
+    mcinstr = NULL;
+    mcsize = 0;
+
+    mathcompile(TOPPREC);
+
+    /*
+     * A floating point constant with underscores makes the lexer
+     * carry on in a copy of the string, so we can't record the end.
+     */
+    if (errflag || mcmaxdepth > MATHCTL_MAX || ptr < s || ptr > p) {
+	errflag = 0;
+	while (mcused--)
+	    zsfree(mcinstr[mcused].str);
+	zfree(mcinstr, mcsize * sizeof(struct mathinstr));
+	mc = NULL;
+    } else {
+	if (*mcp)
+	    freemathcode(*mcp);
+	*mcp = mc = (struct mathcode *) zalloc(sizeof(*mc));
+	mc->expr = ztrdup(s);
+	mc->hval = hval;
+	mc->opts = opts;
+	mc->busy = 0;
+	mc->end = ptr - s;
+	mc->mtok = mtok;
+	mc->ninstr = mcused;
+	mc->instr = (struct mathinstr *)
+	    zrealloc(mcinstr, mcused * sizeof(struct mathinstr));
+    }
+    mcinstr = NULL;
+    outputradix = xoutputradix;
+    outputunderscore = xoutputunderscore;
+    noerrs = ne;
+    unqueue_signals();
+
+    /* Set up as mathevall() did for the parser. */
+    ptr = s;
+    unary = 1;
+    lastbase = -1;
+
+    return mc;
+}
+
+/* Evaluate a compiled expression. */
+
+/**/
+static void
+mathexec(struct mathcode *mc)
+{
+    struct mathinstr *mi, *me = mc->instr + mc->ninstr;
+    int ctl[MATHCTL_MAX], nctl = 0, xnoeval = noeval, q;
+    mnumber n;
+
+    mc->busy++;
+    n.type = MN_INTEGER;
+    for (mi = mc->instr; mi < me && !errflag; mi++) {
+	switch (mi->code) {
+	case MI_NUM:
+	    if (mi->tok != -2)
+		lastbase = mi->tok;
+	    push(mi->val, NULL, 0);
+	    break;
+	case MI_PID:
+	    n.u.l = mypid;
+	    push(n, NULL, 0);
+	    break;
+	case MI_LASTVAL:
+	    n.u.l = lastval;
+	    push(n, NULL, 0);
+	    break;
+	case MI_POUND:
+	    n.u.l = poundgetfn(NULL);
+	    push(n, NULL, 0);
+	    break;
+	case MI_ID:
+	    push(zero_mnumber, dupstring(mi->str), !noeval);
+	    break;
+	case MI_CID:
+	    push((noeval ? zero_mnumber : getcvar(mi->str)),
+		 dupstring(mi->str), 0);
+	    break;
+	case MI_FUNC:
+	    push((noeval ? zero_mnumber : callmathfunc(mi->str)),
+		 dupstring(mi->str), 0);
+	    break;
+	case MI_RADIX:
+	    if (mi->tok & MLEX_RADIX)
+		outputradix = mi->val.u.l;
+	    if (mi->tok & MLEX_UNDERSCORE)
+		outputunderscore = mi->under;
+	    break;
+	case MI_OP:
+	    op(mi->tok);
+	    break;
+	case MI_BOP:
+	    ctl[nctl++] = noeval;
+	    bop(mi->tok);
+	    break;
+	case MI_BOPEND:
+	    noeval = ctl[--nctl];
+	    op(mi->tok);
+	    break;
+	case MI_QUEST:
+	    if (stack[sp].val.type == MN_UNSET)
+		stack[sp].val = getmathparam(stack + sp);
+	    q = (stack[sp].val.type == MN_FLOAT) ?
+		(stack[sp].val.u.d == 0 ? 0 : 1) :
+		stack[sp].val.u.l != 0;
+	    ctl[nctl++] = q;
+	    if (!q)
+		noeval++;
+	    break;
+	case MI_COLON:
+	    if (ctl[nctl - 1])
+		noeval++;
+	    else
+		noeval--;
+	    break;
+	case MI_QEND:
+	    if (ctl[--nctl])
+		noeval--;
+	    op(QUEST);
+	    break;
+	}
+    }
+    /* The parser restores this as it unwinds after an error, too. */
+    noeval = xnoeval;
+    mc->busy--;
+}
@@ -65,6 +65,14 @@
 	which means that we can give it back to the system when the pool is
 	freed.
 
+	New arenas grow geometrically with the number of arenas already
+	in use, so that a heap holding a lot of data is made up of a few
+	big arenas rather than many of the default size.  Arenas which
+	are no longer needed after freeheap(), popheap() or old_heaps()
+	are kept on a small list of retained arenas and handed out again
+	by zhalloc() before any new memory is requested from the system.
+	Statistics about this are kept in heapstats.
+
 	hrealloc(char *p, size_t old, size_t new) is an optimisation
 	with a similar interface to realloc().  Typically the new size
 	will be larger than the old one, since there is no gain in
@@ -107,17 +115,37 @@ union mem_align {
 
 #define H_ISIZE  sizeof(union mem_align)
 #define HEAPSIZE (16384 - H_ISIZE)
-/* Memory available for user data in default arena size */
-#define HEAP_ARENA_SIZE (HEAPSIZE - sizeof(struct heap))
 #define HEAPFREE (16384 - H_ISIZE)
 
 /* Memory available for user data in heap h */
 #define ARENA_SIZEOF(h) ((h)->size - sizeof(struct heap))
 
+/*
+ * The size of a new arena doubles for each arena already on the heap
+ * list, up to HEAPSIZE << HEAP_GROW_MAX.
+ */
+#define HEAP_GROW_MAX 6
+
+/*
+ * The maximum number of arenas, and of bytes in them, kept for reuse
+ * when no longer needed.
+ */
+#define HEAP_RETAIN_MAX   4
+#define HEAP_RETAIN_BYTES (8 * 1024 * 1024)
+
 /* list of zsh heaps */
 
 static Heap heaps;
 
+/* list of arenas retained for reuse */
+
+static Heap heaps_retained;
+
+/* statistics about the heaps */
+
+/**/
+mod_export struct heapstats heapstats;
+
 /* a heap with free space, not always correct (it will be the last heap
  * if that was newly allocated but it may also be another one) */
 
@@ -221,11 +249,7 @@ old_heaps(Heap old)
 		    "freed in old_heaps().\n", h->heap_id);
 	}
 #endif
-#ifdef USE_MMAP
-	munmap((void *) h, h->size);
-#else
-	zfree(h, HEAPSIZE);
-#endif
+	heap_release_arena(h);
     }
     heaps = old;
 #ifdef ZSH_HEAP_DEBUG
@@ -281,6 +305,7 @@ pushheap(void)
     Heapstack hs;
 
     queue_signals();
+    runstats.heap_pushes++;
 
 #if defined(ZSH_MEM) && defined(ZSH_MEM_DEBUG)
     h_push++;
@@ -370,11 +395,7 @@ freeheap(void)
 	    }
 #endif
 	} else {
-#ifdef USE_MMAP
-	    munmap((void *) h, h->size);
-#else
-	    zfree(h, HEAPSIZE);
-#endif
+	    heap_release_arena(h);
 	}
     }
     if (hl)
@@ -395,6 +416,7 @@ popheap(void)
     Heapstack hs;
 
     queue_signals();
+    runstats.heap_pops++;
 
 #if defined(ZSH_MEM) && defined(ZSH_MEM_DEBUG)
     h_pop++;
@@ -423,11 +445,7 @@ popheap(void)
 
 	    hl = h;
 	} else {
-#ifdef USE_MMAP
-	    munmap((void *) h, h->size);
-#else
-	    zfree(h, HEAPSIZE);
-#endif
+	    heap_release_arena(h);
 	}
     }
     if (hl)
@@ -475,6 +493,73 @@ mmap_heap_alloc(size_t *n)
 }
 #endif
 
+/*
+ * Get an arena of at least *n bytes, either one retained from earlier
+ * or new memory.  *n is set to the size actually available; for a
+ * new arena this is rounded up as described for mmap_heap_alloc().
+ */
+
+/**/
+static Heap
+heap_get_arena(size_t *n)
+{
+    Heap h, hp, best = NULL, bestp = NULL;
+
+    for (hp = NULL, h = heaps_retained; h; hp = h, h = h->next)
+	if (h->size >= *n && (!best || h->size < best->size))
+	    best = h, bestp = hp;
+
+    if (best) {
+	if (bestp)
+	    bestp->next = best->next;
+	else
+	    heaps_retained = best->next;
+	heapstats.retained--;
+	heapstats.retained_bytes -= best->size;
+	heapstats.reused++;
+	*n = best->size;
+	h = best;
+    } else {
+#ifdef USE_MMAP
+	h = mmap_heap_alloc(n);
+#else
+	h = (Heap) zalloc(*n);
+#endif
+	heapstats.created++;
+    }
+    heapstats.arenas++;
+    if ((heapstats.bytes += *n) > heapstats.peak_bytes)
+	heapstats.peak_bytes = heapstats.bytes;
+
+    return h;
+}
+
+/*
+ * An arena is no longer needed:  keep it for reuse if there is
+ * room, else give it back.
+ */
+
+/**/
+static void
+heap_release_arena(Heap h)
+{
+    heapstats.arenas--;
+    heapstats.bytes -= h->size;
+    if (heapstats.retained < HEAP_RETAIN_MAX &&
+	heapstats.retained_bytes + h->size <= HEAP_RETAIN_BYTES) {
+	h->next = heaps_retained;
+	heaps_retained = h;
+	heapstats.retained++;
+	heapstats.retained_bytes += h->size;
+	return;
+    }
+#ifdef USE_MMAP
+    munmap((void *) h, h->size);
+#else
+    zfree(h, HEAPSIZE);
+#endif
+}
+
 /* check whether a pointer is within a memory pool */
 
 /**/
@@ -531,6 +616,7 @@ zhalloc(size_t size)
     }
     {
 	Heap hp;
+	int narenas = 0;
         /* not found, allocate new heap */
 #if defined(ZSH_MEM) && !defined(USE_MMAP)
 	static int called = 0;
@@ -538,14 +624,15 @@ zhalloc(size_t size)
             /* tricky, see above */
 #endif
 
-	n = HEAP_ARENA_SIZE > size ? HEAPSIZE : size + sizeof(*h);
-	for (hp = NULL, h = heaps; h; hp = h, h = h->next);
+	for (hp = NULL, h = heaps; h; hp = h, h = h->next)
+	    narenas++;
+	if (narenas > HEAP_GROW_MAX)
+	    narenas = HEAP_GROW_MAX;
+	n = ((HEAPSIZE + H_ISIZE) << narenas) - H_ISIZE;
+	if (n < size + sizeof(*h))
+	    n = size + sizeof(*h);
 
-#ifdef USE_MMAP
-	h = mmap_heap_alloc(&n);
-#else
-	h = (Heap) zalloc(n);
-#endif
+	h = heap_get_arena(&n);
 
 #if defined(ZSH_MEM) && !defined(USE_MMAP)
 	if (called)
@@ -655,11 +742,7 @@ hrealloc(char *p, size_t old, size_t new)
 	    else
 		heaps = h->next;
 	    fheap = NULL;
-#ifdef USE_MMAP
-	    munmap((void *) h, h->size);
-#else
-	    zfree(h, HEAPSIZE);
-#endif
+	    heap_release_arena(h);
 	    unqueue_signals();
 	    return NULL;
 	}
@@ -669,13 +752,17 @@ hrealloc(char *p, size_t old, size_t new)
 	     * one of sufficient size.
 	     *
 	     * To avoid this happening too often, allocate
-	     * chunks in multiples of HEAPSIZE.
+	     * chunks in multiples of HEAPSIZE, and at least
+	     * double the size of the heap so that growing a
+	     * value piece by piece doesn't copy it every time.
 	     * (Historical note:  there didn't used to be any
 	     * point in this since we didn't consistently record
 	     * the allocated size of the heap, but now we do.)
 	     */
 	    size_t n = (new + sizeof(*h) + HEAPSIZE);
 	    n -= n % HEAPSIZE;
+	    if (n < 2 * h->size)
+		n = 2 * h->size;
 	    fheap = NULL;
 
 #ifdef USE_MMAP
@@ -687,13 +774,16 @@ hrealloc(char *p, size_t old, size_t new)
 		 */
 		Heap hnew;
 
-		hnew = mmap_heap_alloc(&n);
+		hnew = heap_get_arena(&n);
 		/* Copy the entire heap, header (with next pointer) included */
 		memcpy(hnew, h, h->size);
-		munmap((void *)h, h->size);
+		heap_release_arena(h);
 		h = hnew;
 	    }
 #else
+	    heapstats.bytes += n - h->size;
+	    if (heapstats.bytes > heapstats.peak_bytes)
+		heapstats.peak_bytes = heapstats.bytes;
 	    h = (Heap) realloc(h, n);
 #endif
 
@@ -886,7 +976,13 @@ zrealloc(void *ptr, size_t size)
    that can hold M_SNUM blocks. Each array is stored in one segment of the
    main allocator. In these segments the third field of the header structure
    (free) contains a pointer to the first free block in the array. The
-   last field (used) gives the number of already used blocks in the array.
+   field used gives the number of already used blocks in the array.
+   The arrays for each size class are kept on a doubly linked list (next
+   and prev) with the arrays that still have free blocks first.  All
+   arrays are also entered into an index sorted by address, so that
+   free() and realloc() can find the array holding a small block with
+   a binary search instead of walking the lists of every size class;
+   the size given to zfree() is then not needed to find the class.
 
    If the macro name ZSH_MEM_DEBUG is defined, some information about the memory
    usage is stored. This information can than be viewed by calling the
@@ -949,6 +1045,11 @@ struct m_hdr {
 				   if block of small blocks: next one with
 				                 small blocks of same size*/
     struct m_shdr *free;	/* if block of small blocks: free list */
+    struct m_hdr *prev;		/* if block of small blocks: previous one
+				   with small blocks of same size */
+#ifdef PAD_64_BIT
+    struct m_hdr *dummy3;
+#endif
     zlong used;			/* if block of small blocks: number of used
 				                                     blocks */
 #if defined(PAD_64_BIT) && !defined(ZSH_64_BIT_TYPE)
@@ -1017,31 +1118,138 @@ static char *m_high, *m_low;
 #define M_SIDX(S)  ((S) / M_ISIZE)
 #define M_SNUM     128
 #define M_SLEN(M)  ((M)->len / M_SNUM)
-#if defined(PAD_64_BIT) && !defined(ZSH_64_BIT_TYPE)
-/* Include the dummy in the alignment */
-#define M_SBLEN(S) ((S) * M_SNUM + sizeof(struct m_shdr *) +  \
-		    2*sizeof(zlong) + sizeof(struct m_hdr *))
-#define M_BSLEN(S) (((S) - sizeof(struct m_shdr *) -  \
-		     2*sizeof(zlong) - sizeof(struct m_hdr *)) / M_SNUM)
-#else
-#define M_SBLEN(S) ((S) * M_SNUM + sizeof(struct m_shdr *) +  \
-		    sizeof(zlong) + sizeof(struct m_hdr *))
-#define M_BSLEN(S) (((S) - sizeof(struct m_shdr *) -  \
-		     sizeof(zlong) - sizeof(struct m_hdr *)) / M_SNUM)
-#endif
-#define M_NSMALL    8
+/* The part of the header after the len field, including any padding */
+#define M_SHLEN    (M_HSIZE - M_ISIZE)
+#define M_SBLEN(S) ((S) * M_SNUM + M_SHLEN)
+#define M_BSLEN(S) (((S) - M_SHLEN) / M_SNUM)
+#define M_NSMALL    17
 
 static struct m_hdr *m_small[M_NSMALL];
 
+/* The index of all blocks holding small blocks, sorted by address.
+ * M_SIDXMIN is the minimum number of entries allocated for it; this must
+ * be big enough that the index itself is never a small block. */
+
+#define M_SIDXMIN  64
+
+static struct m_hdr **m_sidx;
+static long m_nsidx, m_sidxsz;
+
 #ifdef ZSH_MEM_DEBUG
 
 static int m_s = 0, m_b = 0;
 static int m_m[1025], m_f[1025];
 
+/* per size class: small blocks taken from an array that already existed
+ * (hits) and arrays that had to be created (misses) */
+static int m_shit[M_NSMALL], m_smiss[M_NSMALL];
+
 static struct m_hdr *m_l;
 
 #endif /* ZSH_MEM_DEBUG */
 
+/* Find the block of small blocks containing p, or NULL if there is none. */
+
+static struct m_hdr *
+m_sfind(void *p)
+{
+    long lo = 0, hi = m_nsidx - 1, mid;
+    struct m_hdr *mt;
+
+    while (lo <= hi) {
+	mid = (lo + hi) / 2;
+	mt = m_sidx[mid];
+	if (((char *)mt) > ((char *)p))
+	    hi = mid - 1;
+	else if ((((char *)mt) + mt->len) < ((char *)p))
+	    lo = mid + 1;
+	else
+	    return mt;
+    }
+    return NULL;
+}
+
+/* Enter a new block of small blocks into the index. */
+
+static void
+m_sindex_add(struct m_hdr *m)
+{
+    long lo = 0, hi = m_nsidx;
+
+    if (m_nsidx == m_sidxsz) {
+	/*
+	 * This allocates memory itself, so it must happen before
+	 * we start changing the index.
+	 */
+	long nsz = m_sidxsz ? 2 * m_sidxsz : M_SIDXMIN;
+	struct m_hdr **n = (struct m_hdr **) malloc(nsz * sizeof(*n));
+
+	if (m_nsidx)
+	    memcpy(n, m_sidx, m_nsidx * sizeof(*n));
+	if (m_sidx)
+	    zfree(m_sidx, m_sidxsz * sizeof(*m_sidx));
+	m_sidx = n;
+	m_sidxsz = nsz;
+    }
+    while (lo < hi) {
+	long mid = (lo + hi) / 2;
+
+	if (((char *)m_sidx[mid]) < ((char *)m))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    memmove(m_sidx + lo + 1, m_sidx + lo, (m_nsidx - lo) * sizeof(*m_sidx));
+    m_sidx[lo] = m;
+    m_nsidx++;
+}
+
+/* Remove a block of small blocks that is about to be freed. */
+
+static void
+m_sindex_del(struct m_hdr *m)
+{
+    long lo = 0, hi = m_nsidx;
+
+    while (lo < hi) {
+	long mid = (lo + hi) / 2;
+
+	if (((char *)m_sidx[mid]) < ((char *)m))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    DPUTS(lo == m_nsidx || m_sidx[lo] != m,
+	  "BUG: small block array not in index");
+    m_nsidx--;
+    memmove(m_sidx + lo, m_sidx + lo + 1, (m_nsidx - lo) * sizeof(*m_sidx));
+}
+
+/* Unlink a block of small blocks from the list for its size. */
+
+static void
+m_sunlink(struct m_hdr *m, int s)
+{
+    if (m->prev)
+	m->prev->next = m->next;
+    else
+	m_small[s] = m->next;
+    if (m->next)
+	m->next->prev = m->prev;
+    m->next = m->prev = NULL;
+}
+
+/* Put a block of small blocks at the head of the list for its size. */
+
+static void
+m_spush(struct m_hdr *m, int s)
+{
+    m->prev = NULL;
+    if ((m->next = m_small[s]))
+	m->next->prev = m;
+    m_small[s] = m;
+}
+
 MALLOC_RET_T
 malloc(MALLOC_ARG_T size)
 {
@@ -1096,12 +1304,12 @@ malloc(MALLOC_ARG_T size)
     /* Do we need a small block? */
 
     if ((s = M_SIDX(size)) && s < M_NSMALL) {
-	/* yep, find a memory block with free small blocks of the
-	   appropriate size (if we find it in this list, this means that
-	   it has room for at least one more small block) */
-	for (mp = NULL, m = m_small[s]; m && !m->free; mp = m, m = m->next);
+	/* yep, see if the first memory block holding small blocks of
+	   the appropriate size has room for at least one more; blocks
+	   which are full are always kept at the end of the list */
+	m = m_small[s];
 
-	if (m) {
+	if (m && m->free) {
 	    /* we found one */
 	    struct m_shdr *sh = m->free;
 
@@ -1114,17 +1322,15 @@ malloc(MALLOC_ARG_T size)
 	       beginning of the list, to make the search faster) */
 
 	    if (m->used == M_SNUM && m->next) {
-		for (mt = m; mt->next; mt = mt->next);
+		for (mt = m->next; mt->next; mt = mt->next);
 
+		m_sunlink(m, s);
 		mt->next = m;
-		if (mp)
-		    mp->next = m->next;
-		else
-		    m_small[s] = m->next;
-		m->next = NULL;
+		m->prev = mt;
 	    }
 #ifdef ZSH_MEM_DEBUG
 	    m_m[size / M_ISIZE]++;
+	    m_shit[s]++;
 #endif
 
 	    unqueue_signals();
@@ -1261,12 +1467,13 @@ malloc(MALLOC_ARG_T size)
 	m->used = 1;
 
 	/* put the block on the list of blocks holding small blocks if
-	   this size */
-	m->next = m_small[s];
-	m_small[s] = m;
+	   this size, and into the index used to find it again in free() */
+	m_spush(m, s);
+	m_sindex_add(m);
 
 #ifdef ZSH_MEM_DEBUG
 	m_m[os / M_ISIZE]++;
+	m_smiss[s]++;
 #endif
 
 	unqueue_signals();
@@ -1281,26 +1488,20 @@ malloc(MALLOC_ARG_T size)
 }
 
 /* this is an internal free(); the second argument may, but need not hold
-   the size of the block the first argument is pointing to; if it is the
-   right size of this block, freeing it will be faster, though; the value
-   0 for this parameter means: `don't know' */
+   the size of the block the first argument is pointing to; the value
+   0 for this parameter means: `don't know'.  The size is only used for
+   consistency checks, the block holding small blocks is found from the
+   address alone */
 
 /**/
 mod_export void
 zfree(void *p, int sz)
 {
-    struct m_hdr *m = (struct m_hdr *)(((char *)p) - M_ISIZE), *mp, *mt = NULL;
-    int i;
+    struct m_hdr *m = (struct m_hdr *)(((char *)p) - M_ISIZE), *mp, *mt;
 # ifdef DEBUG
     int osz = sz;
 # endif
 
-#ifdef ZSH_SECURE_FREE
-    sz = 0;
-#else
-    sz = (sz + M_ALIGN - 1) & ~(M_ALIGN - 1);
-#endif
-
     if (!p)
 	return;
 
@@ -1313,91 +1514,68 @@ zfree(void *p, int sz)
 
     queue_signals();
 
-  fr_rec:
-
-    if ((i = sz / M_ISIZE) < M_NSMALL || !sz)
-	/* if the given sizes says that it is a small block, find the
-	   memory block holding it; we search all blocks with blocks
-	   of at least the given size; if the size parameter is zero,
-	   this means, that all blocks are searched */
-	for (; i < M_NSMALL; i++) {
-	    for (mp = NULL, mt = m_small[i];
-		 mt && (((char *)mt) > ((char *)p) ||
-			(((char *)mt) + mt->len) < ((char *)p));
-		 mp = mt, mt = mt->next);
-
-	    if (mt) {
-		/* we found the block holding the small block */
-		struct m_shdr *sh = (struct m_shdr *)p;
+    if ((mt = m_sfind(p))) {
+	/* we found the block holding the small block */
+	struct m_shdr *sh = (struct m_shdr *)p;
+	int i = M_SIDX(M_BSLEN(mt->len));
 
 #ifdef ZSH_SECURE_FREE
-		struct m_shdr *sh2;
+	struct m_shdr *sh2;
 
-		/* check if the given address is equal to the address of
-		   the first small block plus an integer multiple of the
-		   block size */
-		if ((((char *)p) - (((char *)mt) + sizeof(struct m_hdr))) %
-		    M_BSLEN(mt->len)) {
+	/* check if the given address is equal to the address of
+	   the first small block plus an integer multiple of the
+	   block size */
+	if ((((char *)p) - (((char *)mt) + sizeof(struct m_hdr))) %
+	    M_BSLEN(mt->len)) {
 
-		    DPUTS(1, "BUG: attempt to free storage at invalid address");
-		    unqueue_signals();
-		    return;
-		}
-		/* check, if the address is on the (block-intern) free list */
-		for (sh2 = mt->free; sh2; sh2 = sh2->next)
-		    if (((char *)p) == ((char *)sh2)) {
-
-			DPUTS(1, "BUG: attempt to free already free storage");
-			unqueue_signals();
-			return;
-		    }
+	    DPUTS(1, "BUG: attempt to free storage at invalid address");
+	    unqueue_signals();
+	    return;
+	}
+	/* check, if the address is on the (block-intern) free list */
+	for (sh2 = mt->free; sh2; sh2 = sh2->next)
+	    if (((char *)p) == ((char *)sh2)) {
+
+		DPUTS(1, "BUG: attempt to free already free storage");
+		unqueue_signals();
+		return;
+	    }
 #endif
-		DPUTS(M_BSLEN(mt->len) < osz,
-		      "BUG: attempt to free more than allocated.");
+	DPUTS(M_BSLEN(mt->len) < osz,
+	      "BUG: attempt to free more than allocated.");
 
 #ifdef ZSH_MEM_DEBUG
-		m_f[M_BSLEN(mt->len) / M_ISIZE]++;
-		memset(sh, 0xff, M_BSLEN(mt->len));
+	m_f[M_BSLEN(mt->len) / M_ISIZE]++;
+	memset(sh, 0xff, M_BSLEN(mt->len));
 #endif
 
-		/* put the block onto the free list */
-		sh->next = mt->free;
-		mt->free = sh;
-
-		if (--mt->used) {
-		    /* if there are still used blocks in this block, we
-		       put it at the beginning of the list with blocks
-		       holding small blocks of the same size (since we
-		       know that there is at least one free block in it,
-		       this will make allocation of small blocks faster;
-		       it also guarantees that long living memory blocks
-		       are preferred over younger ones */
-		    if (mp) {
-			mp->next = mt->next;
-			mt->next = m_small[i];
-			m_small[i] = mt;
-		    }
-		    unqueue_signals();
-		    return;
-		}
-		/* if there are no more used small blocks in this
-		   block, we free the whole block */
-		if (mp)
-		    mp->next = mt->next;
-		else
-		    m_small[i] = mt->next;
-
-		m = mt;
-		p = (void *) & m->next;
-
-		break;
-	    } else if (sz) {
-		/* if we didn't find a block and a size was given, try it
-		   again as if no size were given */
-		sz = 0;
-		goto fr_rec;
+	/* put the block onto the free list */
+	sh->next = mt->free;
+	mt->free = sh;
+
+	if (--mt->used) {
+	    /* if there are still used blocks in this block, we
+	       put it at the beginning of the list with blocks
+	       holding small blocks of the same size (since we
+	       know that there is at least one free block in it,
+	       this will make allocation of small blocks faster;
+	       it also guarantees that long living memory blocks
+	       are preferred over younger ones */
+	    if (mt->prev) {
+		m_sunlink(mt, i);
+		m_spush(mt, i);
 	    }
+	    unqueue_signals();
+	    return;
 	}
+	/* if there are no more used small blocks in this
+	   block, we free the whole block */
+	m_sunlink(mt, i);
+	m_sindex_del(mt);
+
+	m = mt;
+	p = (void *) & m->next;
+    }
 #ifdef ZSH_MEM_DEBUG
     if (!mt)
 	m_f[m->len < (1024 * M_ISIZE) ? (m->len / M_ISIZE) : 1024]++;
@@ -1510,7 +1688,7 @@ realloc(MALLOC_RET_T p, MALLOC_ARG_T size)
 {
     struct m_hdr *m = (struct m_hdr *)(((char *)p) - M_ISIZE), *mt;
     char *r;
-    int i, l = 0;
+    int l;
 
     /* some system..., see above */
     if (!p && size)
@@ -1523,18 +1701,9 @@ realloc(MALLOC_RET_T p, MALLOC_ARG_T size)
 
     /* check if we are reallocating a small block, if we do, we have
        to compute the size of the block from the sort of block it is in */
-    for (i = 0; i < M_NSMALL; i++) {
-	for (mt = m_small[i];
-	     mt && (((char *)mt) > ((char *)p) ||
-		    (((char *)mt) + mt->len) < ((char *)p));
-	     mt = mt->next);
-
-	if (mt) {
-	    l = M_BSLEN(mt->len);
-	    break;
-	}
-    }
-    if (!l)
+    if ((mt = m_sfind(p)))
+	l = M_BSLEN(mt->len);
+    else
 	/* otherwise the size of the block is in the memory just before
 	   the given address */
 	l = m->len;
@@ -1571,7 +1740,7 @@ calloc(MALLOC_ARG_T n, MALLOC_ARG_T size)
 int
 bin_mem(char *name, char **argv, Options ops, int func)
 {
-    int i, ii, fi, ui, j;
+    int i, ii, fi, ui;
     struct m_hdr *m, *mf, *ms;
     char *b, *c, buf[40];
     long u = 0, f = 0, to, cu;
@@ -1635,10 +1804,7 @@ bin_mem(char *name, char **argv, Options ops, int func)
     printf("\nblock list:\nnum\ttnum\taddr\t\tlen\tstate\tcum\n");
     for (m = m_l, mf = m_free, ii = fi = ui = 1; ((char *)m) < m_high;
 	 m = (struct m_hdr *)(((char *)m) + M_ISIZE + m->len), ii++) {
-	for (j = 0, ms = NULL; j < M_NSMALL && !ms; j++)
-	    for (ms = m_small[j]; ms; ms = ms->next)
-		if (ms == m)
-		    break;
+	ms = m_sfind(m);
 
 	if (m == mf)
 	    buf[0] = '\0';
@@ -1684,6 +1850,32 @@ bin_mem(char *name, char **argv, Options ops, int func)
 	    }
 	    putchar('\n');
 	}
+
+    if (OPT_ISSET(ops,'v')) {
+	printf("\nStatistics for each size class of small blocks.  For\n");
+	printf("each size the number of arrays holding blocks of that\n");
+	printf("size, the numbers of used and free blocks in them and the\n");
+	printf("number of bytes taken by the arrays are shown.  Allocs is\n");
+	printf("the number of blocks allocated, hits the number of those\n");
+	printf("that could be taken from an existing array.\n");
+    }
+    printf("\nsize classes:\nsize\tarrays\tused\tfree\tbytes\tallocs\thits\thit%%\n");
+    for (i = 1; i < M_NSMALL; i++) {
+	long na = 0, nu = 0;
+	int nall = m_shit[i] + m_smiss[i];
+
+	for (m = m_small[i]; m; m = m->next) {
+	    na++;
+	    nu += m->used;
+	}
+	if (!na && !nall)
+	    continue;
+	printf("%ld\t%ld\t%ld\t%ld\t%ld\t%d\t%d\t%d\n",
+	       (long)i * M_ISIZE, na, nu, na * M_SNUM - nu,
+	       na * (long)(M_ISIZE + M_SBLEN(i * M_ISIZE)),
+	       nall, m_shit[i], nall ? (int)((100.0 * m_shit[i]) / nall) : 0);
+    }
+
     if (OPT_ISSET(ops,'v')) {
 	printf("\n\nBelow is some information about the allocation\n");
 	printf("behaviour of the zsh heaps. First the number of times\n");
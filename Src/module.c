@@ -1557,6 +1557,82 @@ hpux_dlsym(void *handle, char *name)
 # define RTLD_GLOBAL 0
 #endif
 
+/*
+ * Where along $module_path each module was last found:  the flags of
+ * the node hold the index into the path.  Loading a module again
+ * then doesn't need to try the directories before it.  The table is
+ * emptied when $module_path is changed, for which we keep a copy of
+ * the path as it was when the table was filled.
+ */
+
+static HashTable modpathtab;
+static char **modpathcopy;
+
+/**/
+static void
+freemodpathnode(HashNode hn)
+{
+    zsfree(hn->nam);
+    zfree(hn, sizeof(*hn));
+}
+
+/*
+ * Return the table of module locations, emptied if $module_path
+ * has changed since it was last used.
+ */
+
+/**/
+static HashTable
+getmodpathtab(void)
+{
+    char **pp, **cp;
+
+    if (!modpathtab) {
+	modpathtab = newhashtable(17, "modpathtab", NULL);
+
+	modpathtab->hash        = hasher;
+	modpathtab->emptytable  = emptyhashtable;
+	modpathtab->filltable   = NULL;
+	modpathtab->cmpnodes    = strcmp;
+	modpathtab->addnode     = addhashnode;
+	modpathtab->getnode     = gethashnode2;
+	modpathtab->getnode2    = gethashnode2;
+	modpathtab->removenode  = removehashnode;
+	modpathtab->disablenode = NULL;
+	modpathtab->enablenode  = NULL;
+	modpathtab->freenode    = freemodpathnode;
+	modpathtab->printnode   = NULL;
+    }
+    if (modpathcopy) {
+	for (pp = module_path, cp = modpathcopy; *pp && *cp; pp++, cp++)
+	    if (strcmp(*pp, *cp))
+		break;
+	if (!*pp && !*cp)
+	    return modpathtab;
+	freearray(modpathcopy);
+    }
+    modpathcopy = zarrdup(module_path);
+    emptyhashtable(modpathtab);
+    return modpathtab;
+}
+
+/*
+ * Try to load a module from a single directory in $module_path.
+ */
+
+/**/
+static void *
+try_load_module_dir(char const *dir, char const *name)
+{
+    char buf[PATH_MAX + 1];
+
+    if (1 + strlen(name) + 1 + strlen(DL_EXT) + (*dir ? strlen(dir) : 1)
+	> PATH_MAX)
+	return NULL;
+    sprintf(buf, "%s/%s.%s", *dir ? dir : ".", name, DL_EXT);
+    return dlopen(unmeta(buf), RTLD_LAZY | RTLD_GLOBAL);
+}
+
 /*
  * Attempt to load a module.  This is the lowest level of
  * zsh function for dynamical modules.  Returns the handle
@@ -1567,17 +1643,24 @@ hpux_dlsym(void *handle, char *name)
 static void *
 try_load_module(char const *name)
 {
-    char buf[PATH_MAX + 1];
+    HashTable ht = getmodpathtab();
+    HashNode hn;
     char **pp;
     void *ret = NULL;
-    int l;
 
-    l = 1 + strlen(name) + 1 + strlen(DL_EXT);
-    for (pp = module_path; !ret && *pp; pp++) {
-	if (l + (**pp ? strlen(*pp) : 1) > PATH_MAX)
-	    continue;
-	sprintf(buf, "%s/%s.%s", **pp ? *pp : ".", name, DL_EXT);
-	ret = dlopen(unmeta(buf), RTLD_LAZY | RTLD_GLOBAL);
+    if ((hn = ht->getnode(ht, name))) {
+	if ((ret = try_load_module_dir(module_path[hn->flags], name)))
+	    return ret;
+	/* it's gone, so look for it again */
+	ht->freenode(ht->removenode(ht, name));
+    }
+    for (pp = module_path; *pp; pp++) {
+	if ((ret = try_load_module_dir(*pp, name))) {
+	    hn = (HashNode) zshcalloc(sizeof(*hn));
+	    hn->flags = pp - module_path;
+	    ht->addnode(ht, ztrdup(name), hn);
+	    break;
+	}
     }
 
     return ret;
@@ -59,6 +59,17 @@ char **pparams,		/* $argv        */
      **psvar,		/* $psvar       */
      **watch,		/* $watch       */
      **zsh_eval_context; /* $zsh_eval_context */
+
+/*
+ * Set if the elements of pparams are the words of the command that
+ * called the current function, which stay on its heap until the
+ * function returns, rather than being allocated separately.  Use
+ * freepparams() to free pparams.
+ */
+
+/**/
+mod_export int pparamsheap;
+
 /**/
 mod_export
 char **path,		/* $path        */
@@ -100,10 +111,10 @@ zlong lastval,		/* $?           */
      zterm_lines,	/* $LINES       */
      rprompt_indent,	/* $ZLE_RPROMPT_INDENT */
      ppid,		/* $PPID        */
-     zsh_subshell;	/* $ZSH_SUBSHELL */
+     zsh_subshell,	/* $ZSH_SUBSHELL */
+     lineno;		/* $LINENO      */
 /**/
-zlong lineno,		/* $LINENO      */
-     zoptind,		/* $OPTIND      */
+zlong zoptind,		/* $OPTIND      */
      shlvl;		/* $SHLVL       */
 
 /* $histchars */
@@ -186,6 +197,8 @@ static const struct gsu_integer savehist_gsu =
 { savehistsizegetfn, savehistsizesetfn, stdunsetfn };
 static const struct gsu_integer intseconds_gsu =
 { intsecondsgetfn, intsecondssetfn, stdunsetfn };
+static const struct gsu_scalar lazyenv_gsu =
+{ lazyenvgetfn, lazyenvsetfn, stdunsetfn };
 static const struct gsu_float floatseconds_gsu =
 { floatsecondsgetfn, floatsecondssetfn, stdunsetfn };
 static const struct gsu_integer uid_gsu =
@@ -437,7 +450,7 @@ newparamtable(int size, char const *name)
 	size = 17;
     ht = newhashtable(size, name, NULL);
 
-    ht->hash        = hasher;
+    ht->hash        = wordhasher;
     ht->emptytable  = emptyhashtable;
     ht->filltable   = NULL;
     ht->cmpnodes    = strcmp;
@@ -449,6 +462,11 @@ newparamtable(int size, char const *name)
     ht->enablenode  = NULL;
     ht->freenode    = freeparamnode;
     ht->printnode   = printparamnode;
+    /*
+     * The index makes lookups quicker, and means that associative
+     * arrays give their elements in the order they were added.
+     */
+    indexhashtable(ht);
 
     return ht;
 }
@@ -584,6 +602,18 @@ scanparamvals(HashNode hn, int flags)
     foundparam = NULL;
 }
 
+/* Count the elements paramvalarr() would return, without any matching */
+
+/**/
+mod_export int
+paramvalcount(HashTable ht, int flags)
+{
+    numparamvals = 0;
+    if (ht)
+	scanhashtable(ht, 0, 0, PM_UNSET, scancountparams, flags);
+    return numparamvals;
+}
+
 /**/
 char **
 paramvalarr(HashTable ht, int flags)
@@ -649,6 +679,57 @@ split_env_string(char *env, char **name, char **value)
 	return 0;
 }
     
+/*
+ * The environment strings the shell was started with that parameters
+ * were made for without copying them, sorted by address so they can
+ * be looked up.  These mustn't be freed.
+ */
+
+static char **envorig;
+static int envorigsz;
+
+/**/
+static int
+envorigcmp(const void *a, const void *b)
+{
+    char *x = *(char **)a, *y = *(char **)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Add a parameter for a variable from the environment the shell was
+ * started with.  As there may be a lot of them, most of which are
+ * never used, the value is only copied when it is first wanted:  until
+ * then the parameter uses lazyenv_gsu and u.str points into the
+ * environment string, which is also used as pm->env.
+ */
+
+/**/
+static void
+addlazyenvparam(char *name, char *env)
+{
+    Param pm = (Param) zshcalloc(sizeof *pm);
+
+    envorig[envorigsz++] = env;
+    pm->node.flags = PM_SCALAR | PM_EXPORTED;
+    pm->gsu.s = &lazyenv_gsu;
+    pm->u.str = env + strlen(name) + 1;
+    pm->env = env;
+    paramtab->addnode(paramtab, name, pm);
+}
+
+/* Free an environment string, unless it's one we started with. */
+
+/**/
+static void
+freeenvstr(char *x)
+{
+    if (!envorigsz ||
+	!bsearch(&x, envorig, envorigsz, sizeof(char *), envorigcmp))
+	zsfree(x);
+}
+
 /* Set up parameter hash table.  This will add predefined  *
  * parameter entries as well as setting up parameter table *
  * entries for environment variables we inherit.           */
@@ -666,7 +747,7 @@ createparamtable(void)
     char **envp;
 #endif
     char **envp2, **sigptr, **t;
-    char buf[50], *str, *iname, *ivalue, *hostnam;
+    char buf[50], *str, *iname, *ivalue, *hostnam, *eq;
     int  oae = opts[ALLEXPORT];
 #ifdef HAVE_UNAME
     struct utsname unamebuf;
@@ -731,13 +812,30 @@ createparamtable(void)
     pushheap();
 
     /* Now incorporate environment variables we are inheriting *
-     * into the parameter hash table. Copy them into dynamic   *
-     * memory so that we can free them if needed               */
+     * into the parameter hash table.  Ordinary variables are  *
+     * added without copying them, see addlazyenvparam().      */
+    envorig = (char **) zalloc((arrlen(environ) + 1) * sizeof(char *));
+    envorigsz = 0;
     for (
 #ifndef USE_SET_UNSET_ENV
 	envp = 
 #endif
 	    envp2 = environ; *envp2; envp2++) {
+	if ((eq = strchr(*envp2, '=')) && eq != *envp2) {
+	    iname = ztrduppfx(*envp2, eq - *envp2);
+	    if (idigit(*iname) || !isident(iname) || strchr(iname, '[')) {
+		zsfree(iname);
+		continue;
+	    }
+	    if (!paramtab->getnode(paramtab, iname)) {
+		addlazyenvparam(iname, *envp2);
+#ifndef USE_SET_UNSET_ENV
+		*envp++ = *envp2;
+#endif
+		continue;
+	    }
+	    zsfree(iname);
+	}
 	if (split_env_string(*envp2, &iname, &ivalue)) {
 	    if (!idigit(*iname) && isident(iname) && !strchr(iname, '[')) {
 		if ((!(pm = (Param) paramtab->getnode(paramtab, iname)) ||
@@ -760,6 +858,7 @@ createparamtable(void)
 #ifndef USE_SET_UNSET_ENV
     *envp = '\0';
 #endif
+    qsort(envorig, envorigsz, sizeof(char *), envorigcmp);
     opts[ALLEXPORT] = oae;
 
     if (EMULATION(EMULATE_ZSH))
@@ -926,7 +1025,7 @@ createspecialhash(char *name, GetNodeFunc get, ScanTabFunc scan, int flags)
     if (!(pm = createparam(name, PM_SPECIAL|PM_HASHED|flags)))
 	return NULL;
 
-    pm->level = pm->old ? locallevel : 0;
+    setparamlevel(pm, pm->old ? locallevel : 0);
     pm->gsu.h = (flags & PM_READONLY) ? &stdhash_gsu :
 	&nullsethash_gsu;
     pm->u.hash = ht = newhashtable(0, name, NULL);
@@ -1295,7 +1394,9 @@ getarg(char **str, int *inv, Value v, int a2, zlong *w,
 		*w = (zlong)(s - t);
 
 	    return (a2 ? s : d + 1) - t;
-	} else if (!v->isarr && !word) {
+	} else if (!v->isarr && !word &&
+		   /* a hash element doesn't need its value here */
+		   (r || !ishash)) {
 	    int lastcharlen = 1;
 	    s = getstrvalue(v);
 	    /*
@@ -1401,6 +1502,16 @@ getarg(char **str, int *inv, Value v, int a2, zlong *w,
 		ta = getarrvalue(v);
 	    if (!ta || !*ta)
 		return !down;
+	    /* An exact value may be found with an index. */
+	    if (pprog && num == 1 && !hasbeg && v->pm &&
+		ta == v->pm->u.arr && (pprog->flags & PAT_PURES) &&
+		!(pprog->flags & PAT_NOANCH) &&
+		!(pprog->globend & GF_MATCHREF)) {
+		char *str = dupstrpfx((char *)pprog + pprog->startoff,
+				      pprog->patmlen);
+		if ((r = arrindexlookup(v->pm, str, down)) >= 0)
+		    return r;
+	    }
 	    len = arrlen(ta);
 	    if (beg < 0)
 		beg += len;
@@ -2267,6 +2378,303 @@ export_param(Param pm)
     addenv(pm, val);
 }
 
+/*
+ * Appending with `+=' to an ordinary scalar would otherwise copy the
+ * whole value every time, so building up a long value in a loop takes
+ * quadratic time.  For the last few scalars appended to, remember the
+ * length of the value and how much space it has, and grow the space
+ * geometrically; an entry is only trusted while the parameter still
+ * has the same value, and strsetfn() drops the entries for any
+ * parameter it sets, which is also where such values are freed.
+ */
+
+#define STRAPPEND_CACHE 4
+
+static struct strappend {
+    Param pm;
+    char *str;			/* the value when last appended to */
+    size_t len;			/* its length */
+    size_t size;		/* and the space allocated for it */
+} strappends[STRAPPEND_CACHE];
+
+static int strappendnext;
+
+/*
+ * Append val to the value of the scalar pm in place, where that's
+ * possible: return 1 and free val if it was done, else return 0.
+ */
+
+/**/
+static int
+appendstrvalue(Param pm, char *val)
+{
+    struct strappend *sa;
+    size_t vlen;
+    int i;
+
+    if (pm->gsu.s != &stdscalar_gsu || !pm->u.str ||
+	(!(pm->node.flags & PM_HASHELEM) &&
+	 ((pm->node.flags & PM_NAMEDDIR) || isset(AUTONAMEDIRS))))
+	return 0;
+
+    for (i = 0, sa = strappends; i < STRAPPEND_CACHE; i++, sa++)
+	if (sa->pm == pm && sa->str == pm->u.str)
+	    break;
+    if (i == STRAPPEND_CACHE) {
+	sa = strappends + strappendnext;
+	strappendnext = (strappendnext + 1) % STRAPPEND_CACHE;
+	sa->pm = pm;
+	sa->len = strlen(pm->u.str);
+	sa->size = sa->len + 1;
+    }
+    vlen = strlen(val);
+    if (sa->len + vlen >= sa->size) {
+	sa->size = 2 * (sa->len + vlen + 1);
+	pm->u.str = (char *)zrealloc(pm->u.str, sa->size);
+    }
+    memcpy(pm->u.str + sa->len, val, vlen + 1);
+    sa->len += vlen;
+    sa->str = pm->u.str;
+    zsfree(val);
+    return 1;
+}
+
+/*
+ * Likewise for appending to ordinary arrays, which also copied every
+ * element.  Here the entry is also checked against the array: the
+ * element at the remembered length must be the terminating NULL and
+ * the one before not, which catches the array being shortened in
+ * place, as typeset -U does.
+ */
+
+#define ARRAPPEND_CACHE 4
+
+static struct arrappend {
+    Param pm;
+    char **arr;			/* the value when last appended to */
+    int len;			/* number of elements */
+    int size;			/* number of pointers allocated */
+} arrappends[ARRAPPEND_CACHE];
+
+static int arrappendnext;
+
+/*
+ * Find the entry for an ordinary array pm, which can be extended in
+ * place, or NULL.
+ */
+
+/**/
+static struct arrappend *
+getarrappend(Param pm)
+{
+    struct arrappend *aa;
+    int i;
+
+    if (pm->gsu.a != &stdarray_gsu || !pm->u.arr ||
+	(pm->node.flags & PM_UNIQUE) || pm->ename)
+	return NULL;
+    for (i = 0, aa = arrappends; i < ARRAPPEND_CACHE; i++, aa++)
+	if (aa->pm == pm && aa->arr == pm->u.arr) {
+	    if (!aa->arr[aa->len] && (!aa->len || aa->arr[aa->len - 1]))
+		return aa;
+	    break;
+	}
+    if (i == ARRAPPEND_CACHE) {
+	aa = arrappends + arrappendnext;
+	arrappendnext = (arrappendnext + 1) % ARRAPPEND_CACHE;
+    }
+    aa->pm = pm;
+    aa->arr = pm->u.arr;
+    aa->len = arrlen(pm->u.arr);
+    aa->size = aa->len + 1;
+    return aa;
+}
+
+/* Get the number of elements in the array pm, using the entry if any. */
+
+/**/
+static int
+arrvaluelen(Param pm)
+{
+    struct arrappend *aa = getarrappend(pm);
+
+    return aa ? aa->len : arrlen(pm->gsu.a->getfn(pm));
+}
+
+/*
+ * Put the elements of val, which is freed, into the array for aa
+ * starting at element start, which is not before the end, padding
+ * with empty elements.
+ */
+
+/**/
+static void
+appendarrvalue(struct arrappend *aa, int start, char **val)
+{
+    Param pm = aa->pm;
+    int vlen = arrlen(val), ll = start + vlen;
+
+    if (ll >= aa->size) {
+	aa->size = 2 * (ll + 1);
+	pm->u.arr = (char **)zrealloc(pm->u.arr, aa->size * sizeof(char *));
+    }
+    while (aa->len < start)
+	pm->u.arr[aa->len++] = ztrdup("");
+    memcpy(pm->u.arr + aa->len, val, (vlen + 1) * sizeof(char *));
+    aa->len = ll;
+    aa->arr = pm->u.arr;
+    free(val);
+    arrindexappend(pm);
+}
+
+/*
+ * Indexes from values to positions in ordinary arrays, for reverse
+ * subscripts such as $arr[(i)value] that look up an exact value.  An
+ * index is made the second time the same array is searched, so that
+ * a single search doesn't pay for it, and is kept up to date when
+ * the array is appended to in place; any other assignment discards it.
+ */
+
+#define ARRINDEX_CACHE 2
+
+struct arrindexnode {
+    struct hashnode node;	/* nam is the element itself */
+    int first, last;		/* positions of the first and last copy */
+};
+
+static struct arrindex {
+    Param pm;
+    char **arr;			/* the value when indexed */
+    int len;			/* number of elements */
+    HashTable ht;		/* NULL if only searched once so far */
+} arrindexes[ARRINDEX_CACHE];
+
+static int arrindexnext;
+
+/**/
+static void
+freearrindexnode(HashNode hn)
+{
+    zfree(hn, sizeof(struct arrindexnode));
+}
+
+static void
+freearrindex(struct arrindex *ai)
+{
+    if (ai->ht)
+	deletehashtable(ai->ht);
+    ai->ht = NULL;
+    ai->pm = NULL;
+}
+
+/* Add elements from start onwards to the index. */
+
+static void
+addarrindex(struct arrindex *ai, int start)
+{
+    struct arrindexnode *an;
+    int i;
+
+    for (i = start; i < ai->len; i++) {
+	if ((an = (struct arrindexnode *)gethashnode2(ai->ht, ai->arr[i])))
+	    an->last = i;
+	else {
+	    an = (struct arrindexnode *)zalloc(sizeof(*an));
+	    an->first = an->last = i;
+	    addhashnode2(ai->ht, ai->arr[i], an);
+	}
+    }
+}
+
+/* Array pm has been extended in place:  index the new elements. */
+
+/**/
+static void
+arrindexappend(Param pm)
+{
+    struct arrindex *ai;
+    int oldlen;
+
+    for (ai = arrindexes; ai < arrindexes + ARRINDEX_CACHE; ai++)
+	if (ai->pm == pm) {
+	    oldlen = ai->len;
+	    ai->arr = pm->u.arr;
+	    ai->len = arrlen(pm->u.arr);
+	    if (ai->ht)
+		addarrindex(ai, oldlen);
+	}
+}
+
+/* Array pm is being replaced:  forget any index. */
+
+/**/
+static void
+arrindexinvalidate(Param pm)
+{
+    struct arrindex *ai;
+
+    for (ai = arrindexes; ai < arrindexes + ARRINDEX_CACHE; ai++)
+	if (ai->pm == pm)
+	    freearrindex(ai);
+}
+
+/*
+ * Find the position, counting from 1, of the first element of the
+ * ordinary array pm that is exactly str, or the last if down is set.
+ * If there's no such element, returns 0 if down is set, else one more
+ * than the length, as for a search.  Returns -1 if the array isn't
+ * indexed and should be searched.
+ */
+
+/**/
+static int
+arrindexlookup(Param pm, char *str, int down)
+{
+    struct arrindex *ai;
+    struct arrindexnode *an;
+    char **arr = pm->u.arr;
+
+    if (pm->gsu.a != &stdarray_gsu || !arr || zheapptr(arr))
+	return -1;
+    for (ai = arrindexes; ai < arrindexes + ARRINDEX_CACHE; ai++)
+	if (ai->pm == pm && ai->arr == arr)
+	    break;
+    if (ai == arrindexes + ARRINDEX_CACHE ||
+	arr[ai->len] || (ai->len && !arr[ai->len - 1])) {
+	/* First search, or the array has changed under us. */
+	if (ai == arrindexes + ARRINDEX_CACHE) {
+	    ai = arrindexes + arrindexnext;
+	    arrindexnext = (arrindexnext + 1) % ARRINDEX_CACHE;
+	}
+	freearrindex(ai);
+	ai->pm = pm;
+	ai->arr = arr;
+	ai->len = arrlen(arr);
+	return -1;
+    }
+    if (!ai->ht) {
+	if (ai->len < 10)
+	    return -1;
+	ai->ht = newhashtable(ai->len, "arrindex", NULL);
+	ai->ht->hash        = hasher;
+	ai->ht->emptytable  = emptyhashtable;
+	ai->ht->filltable   = NULL;
+	ai->ht->cmpnodes    = strcmp;
+	ai->ht->addnode     = addhashnode;
+	ai->ht->getnode     = gethashnode2;
+	ai->ht->getnode2    = gethashnode2;
+	ai->ht->removenode  = removehashnode;
+	ai->ht->disablenode = NULL;
+	ai->ht->enablenode  = NULL;
+	ai->ht->freenode    = freearrindexnode;
+	ai->ht->printnode   = NULL;
+	addarrindex(ai, 0);
+    }
+    if (!(an = (struct arrindexnode *)gethashnode2(ai->ht, str)))
+	return down ? 0 : ai->len + 1;
+    return 1 + (down ? an->last : an->first);
+}
+
 /**/
 mod_export void
 setstrvalue(Value v, char *val)
@@ -2302,6 +2710,9 @@ setstrvalue(Value v, char *val)
 	    if ((v->pm->node.flags & (PM_LEFT | PM_RIGHT_B | PM_RIGHT_Z)) &&
 		!v->pm->width)
 		v->pm->width = strlen(val);
+	} else if (v->start == INT_MAX && v->end == -1 &&
+		   !(v->flags & VALFLAG_INV) && appendstrvalue(v->pm, val)) {
+	    /* appended in place */
 	} else {
 	    char *z, *x;
 	    int zlen;
@@ -2478,6 +2889,7 @@ setarrvalue(Value v, char **val)
     } else {
 	char **old, **new, **p, **q, **r;
 	int n, ll, i;
+	struct arrappend *aa;
 
 	if ((PM_TYPE(v->pm->node.flags) == PM_HASHED)) {
 	    freearray(val);
@@ -2490,8 +2902,9 @@ setarrvalue(Value v, char **val)
 		v->start--;
 	    v->end--;
 	}
+	aa = getarrappend(v->pm);
 	q = old = v->pm->gsu.a->getfn(v->pm);
-	n = arrlen(old);
+	n = aa ? aa->len : arrlen(old);
 	if (v->start < 0) {
 	    v->start += n;
 	    if (v->start < 0)
@@ -2505,6 +2918,12 @@ setarrvalue(Value v, char **val)
 	if (v->end < v->start)
 	    v->end = v->start;
 
+	if (aa && v->start >= n) {
+	    /* nothing to keep after the new elements */
+	    appendarrvalue(aa, v->start, val);
+	    return;
+	}
+
 	ll = v->start + arrlen(val);
 	if (v->end <= n)
 	    ll += n - v->end + 1;
@@ -2817,7 +3236,7 @@ assignaparam(char *s, char **val, int flags)
     if (flags & ASSPM_AUGMENT) {
     	if (v->start == 0 && v->end == -1) {
 	    if (PM_TYPE(v->pm->node.flags) & PM_ARRAY) {
-	    	v->start = arrlen(v->pm->gsu.a->getfn(v->pm));
+	    	v->start = arrvaluelen(v->pm);
 	    	v->end = v->start + 1;
 	    } else if (PM_TYPE(v->pm->node.flags) & PM_HASHED)
 	    	v->start = -1, v->end = 0;
@@ -3150,6 +3569,11 @@ strgetfn(Param pm)
 mod_export void
 strsetfn(Param pm, char *x)
 {
+    int i;
+
+    for (i = 0; i < STRAPPEND_CACHE; i++)
+	if (strappends[i].pm == pm)
+	    strappends[i].pm = NULL;
     zsfree(pm->u.str);
     pm->u.str = x;
     if (!(pm->node.flags & PM_HASHELEM) &&
@@ -3159,6 +3583,28 @@ strsetfn(Param pm, char *x)
     }
 }
 
+/* Get the value of an environment variable not yet used */
+
+/**/
+static char *
+lazyenvgetfn(Param pm)
+{
+    pm->u.str = metafy(pm->u.str, -1, META_DUP);
+    pm->gsu.s = &stdscalar_gsu;
+    return pm->u.str;
+}
+
+/* Set an environment variable whose old value was not used */
+
+/**/
+static void
+lazyenvsetfn(Param pm, char *x)
+{
+    pm->u.str = NULL;
+    pm->gsu.s = &stdscalar_gsu;
+    strsetfn(pm, x);
+}
+
 /* Function to get value of an array parameter */
 
 static char *nullarray = NULL;
@@ -3176,6 +3622,12 @@ arrgetfn(Param pm)
 mod_export void
 arrsetfn(Param pm, char **x)
 {
+    int i;
+
+    for (i = 0; i < ARRAPPEND_CACHE; i++)
+	if (arrappends[i].pm == pm)
+	    arrappends[i].pm = NULL;
+    arrindexinvalidate(pm);
     if (pm->u.arr && pm->u.arr != x)
 	freearray(pm->u.arr);
     if (pm->node.flags & PM_UNIQUE)
@@ -3372,8 +3824,12 @@ arrvarsetfn(Param pm, char **x)
 {
     char ***dptr = (char ***)pm->u.data;
 
-    if (*dptr != x)
-	freearray(*dptr);
+    if (*dptr != x) {
+	if (dptr == &pparams)
+	    freepparams();
+	else
+	    freearray(*dptr);
+    }
     if (pm->node.flags & PM_UNIQUE)
 	uniqarray(x);
     /*
@@ -3599,6 +4055,19 @@ zhuniqarray(char **x)
     arrayuniq(x, 0);
 }
 
+/* Free the positional parameters, which may not be ours */
+
+/**/
+mod_export void
+freepparams(void)
+{
+    if (pparamsheap) {
+	free(pparams);
+	pparamsheap = 0;
+    } else
+	freearray(pparams);
+}
+
 /* Function to get value of special parameter `#' and `ARGC' */
 
 /**/
@@ -4329,11 +4798,75 @@ arrfixenv(char *s, char **t)
 }
 
 
+/*
+ * The environment for external commands: the exported environment
+ * with the last element reserved for $_.  Running a command only
+ * fills in that element; the rest is made again only after the
+ * environment has changed.
+ */
+
+static char **execenv;
+static int execenvsize;		/* number of pointers allocated */
+static int execenvlen;		/* index of the element for $_ */
+static int execenvok;		/* set if execenv matches environ */
+
+/*
+ * Return the environment for an external command with $_ given by
+ * under (a complete "_=..." string).  If under is NULL, just bring
+ * the environment up to date, as is worth doing before forking.
+ */
+
+/**/
+mod_export char **
+getexecenv(char *under)
+{
+    char **ep, **dp;
+    int n;
+
+    if (!execenvok) {
+	for (ep = environ; *ep; ep++)
+	    ;
+	if ((n = ep - environ + 2) > execenvsize) {
+	    if (execenv)
+		zfree(execenv, execenvsize * sizeof(char *));
+	    execenvsize = n + 16;
+	    execenv = (char **) zalloc(execenvsize * sizeof(char *));
+	}
+	for (ep = environ, dp = execenv; *ep; ep++)
+	    if ((*ep)[0] != '_' || (*ep)[1] != '=')
+		*dp++ = *ep;
+	execenvlen = dp - execenv;
+	dp[1] = NULL;
+	execenvok = 1;
+    }
+    if (under)
+	execenv[execenvlen] = under;
+    return execenv;
+}
+
+/* Remove a variable not known as a parameter from the environment */
+
+/**/
+mod_export void
+zunsetenv(char *name)
+{
+#ifdef USE_SET_UNSET_ENV
+    unsetenv(name);
+#else
+    char *z = zgetenv(name);
+
+    if (z)
+	delenvvalue(z - strlen(name) - 1);
+#endif
+    execenvok = 0;
+}
+
 /**/
 int
 zputenv(char *str)
 {
     DPUTS(!str, "Attempt to put null string into environment.");
+    execenvok = 0;
 #ifdef USE_SET_UNSET_ENV
     /*
      * If we are using unsetenv() to remove values from the
@@ -4478,7 +5011,7 @@ addenv(Param pm, char *value)
       * store pm->env at all, just a flag that the value was set.
       */
      if (pm->env)
-         zsfree(pm->env);
+         freeenvstr(pm->env);
      pm->env = newenv;
 #else
     /*
@@ -4490,7 +5023,7 @@ addenv(Param pm, char *value)
     if (findenv(pm->node.nam, &pos)) {
 	env = environ[pos];
 	if (env != oldenv)
-	    zsfree(oldenv);
+	    freeenvstr(oldenv);
 	if (env != newenv)
 	    zsfree(newenv);
 	pm->node.flags |= PM_EXPORTED;
@@ -4538,6 +5071,7 @@ delenvvalue(char *x)
 {
     char **ep;
 
+    execenvok = 0;
     for (ep = environ; *ep; ep++) {
 	if (*ep == x)
 	    break;
@@ -4545,7 +5079,7 @@ delenvvalue(char *x)
     if (*ep) {
 	for (; (ep[0] = ep[1]); ep++);
     }
-    zsfree(x);
+    freeenvstr(x);
 }
 #endif
 
@@ -4559,7 +5093,8 @@ delenv(Param pm)
 {
 #ifdef USE_SET_UNSET_ENV
     unsetenv(pm->node.nam);
-    zsfree(pm->env);
+    freeenvstr(pm->env);
+    execenvok = 0;
 #else
     delenvvalue(pm->env);
 #endif
@@ -4817,6 +5352,55 @@ char *convfloat_underscore(double dval, int underscore)
     return retptr;
 }
 
+/*
+ * Parameters which have been made local, so that the end of a scope
+ * need only look at these rather than at the whole table.  Each entry
+ * is the name of a parameter with the level it was given.  localmarks
+ * records how many entries there were when each level was started:
+ * the entries for levels deeper than an earlier one come after its
+ * mark.  The exception is a parameter given a level deeper than the
+ * current one, as done for zle and completion; while there are any
+ * such entries, the whole log is examined.
+ */
+
+struct localent {
+    char *nam;
+    int level;
+    int ahead;
+};
+
+static struct localent *locallog;
+static int locallogct, locallogsize;
+static int *localmarks, localmarksize;
+static int localahead;
+
+/* Give a parameter its local level, recording it for endparamscope() */
+
+/**/
+mod_export void
+setparamlevel(Param pm, int level)
+{
+    struct localent *le;
+
+    if (pm->level == level) {
+	/* Already recorded if it needs to be */
+	return;
+    }
+    pm->level = level;
+    if (!level)
+	return;
+    if (locallogct == locallogsize) {
+	locallogsize = locallogsize ? 2 * locallogsize : 32;
+	locallog = (struct localent *)
+	    zrealloc(locallog, locallogsize * sizeof(struct localent));
+    }
+    le = locallog + locallogct++;
+    le->nam = ztrdup(pm->node.nam);
+    le->level = level;
+    if ((le->ahead = (level > locallevel)))
+	localahead++;
+}
+
 /* Start a parameter scope */
 
 /**/
@@ -4824,6 +5408,16 @@ mod_export void
 startparamscope(void)
 {
     locallevel++;
+    if (locallevel >= localmarksize) {
+	int oldsize = localmarksize;
+
+	localmarksize = locallevel + 16;
+	localmarks = (int *)
+	    zrealloc(localmarks, localmarksize * sizeof(int));
+	memset(localmarks + oldsize, 0,
+	       (localmarksize - oldsize) * sizeof(int));
+    }
+    localmarks[locallevel] = locallogct;
 }
 
 /* End a parameter scope: delete the parameters local to the scope. */
@@ -4832,11 +5426,39 @@ startparamscope(void)
 mod_export void
 endparamscope(void)
 {
+    struct localent *le;
+    int i, start, kept;
+
     queue_signals();
     locallevel--;
     /* This pops anything from a higher locallevel */
     saveandpophiststack(0, HFILE_USE_OPTIONS);
-    scanhashtable(paramtab, 0, 0, 0, scanendscope, 0);
+    if (localahead || locallevel < 0 || locallevel + 1 >= localmarksize ||
+	(start = localmarks[locallevel + 1]) > locallogct)
+	start = 0;
+    /*
+     * Work back from the most recent entry so that parameters made
+     * local more than once are restored in reverse order.  Entries
+     * for levels we are keeping are moved down to fill the gaps.
+     */
+    kept = locallogct;
+    for (i = locallogct - 1; i >= start; i--) {
+	le = locallog + i;
+	if (le->level > locallevel) {
+	    HashNode hn = gethashnode2(paramtab, le->nam);
+
+	    if (hn && ((Param) hn)->level > locallevel)
+		scanendscope(hn, 0);
+	    zsfree(le->nam);
+	    if (le->ahead)
+		localahead--;
+	} else
+	    locallog[--kept] = *le;
+    }
+    if (kept > start)
+	memmove(locallog + start, locallog + kept,
+		(locallogct - kept) * sizeof(struct localent));
+    locallogct = start + (locallogct - kept);
     unqueue_signals();
 }
 
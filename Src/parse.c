@@ -193,7 +193,9 @@ struct heredocs *hdocs;
  *     - followed by string (there's only one)
  *
  *   WC_AUTOFN
- *     - only used by the autoload builtin
+ *     - data is zero if used by the autoload builtin
+ *     - else the body of a function defined with LAZY_FUNCTIONS; data
+ *       is the line number plus one, followed by the text of the body
  *
  * Lists and sublists may also be simplified, indicated by the presence
  * of the Z_SIMPLE or WC_SUBLIST_SIMPLE flags. In this case they are only
@@ -237,6 +239,20 @@ Eccstr ecstrs;
 /**/
 int ecsoffs, ecssub, ecnfunc;
 
+/*
+ * Hash table of the strings in ecstrs, so that repeated strings can
+ * be found quickly.  String offsets are relative to the start of the
+ * enclosing function's strings, so a string is only shared within
+ * one function (entries with the same nfunc).
+ */
+
+/**/
+Eccstr *ecstrtab;
+/**/
+int ecstrtabsz, ecnstrs;
+
+#define ECSTRTAB_INIT_SIZE  64
+
 #define EC_INIT_SIZE         256
 #define EC_DOUBLE_THRESHOLD  32768
 #define EC_INCREMENT         1024
@@ -322,21 +338,40 @@ ecstrcode(char *s)
 	}
 	return c;
     } else {
-	Eccstr p, *pp;
-	int cmp;
+	Eccstr p;
+	unsigned hval = hasher(s) + (unsigned) ecnfunc * 65599U;
+
+	if (ecstrtab) {
+	    for (p = ecstrtab[hval & (ecstrtabsz - 1)]; p; p = p->hnext)
+		if (p->hval == hval && p->nfunc == ecnfunc &&
+		    !strcmp(p->str, s))
+		    return p->offs;
+	}
+	if (ecnstrs >= ecstrtabsz) {
+	    /* (Re)build the table with twice as many slots. */
+	    Eccstr q;
+
+	    ecstrtabsz = ecstrtabsz ? 2 * ecstrtabsz : ECSTRTAB_INIT_SIZE;
+	    ecstrtab = (Eccstr *) hcalloc(ecstrtabsz * sizeof(Eccstr));
+	    for (q = ecstrs; q; q = q->next) {
+		Eccstr *qq = ecstrtab + (q->hval & (ecstrtabsz - 1));
 
-	for (pp = &ecstrs; (p = *pp); ) {
-	    if (!(cmp = p->nfunc - ecnfunc) && !(cmp = strcmp(p->str, s)))
-		return p->offs;
-	    pp = (cmp < 0 ? &(p->left) : &(p->right));
+		q->hnext = *qq;
+		*qq = q;
+	    }
 	}
-	p = *pp = (Eccstr) zhalloc(sizeof(*p));
-	p->left = p->right = 0;
+	p = (Eccstr) zhalloc(sizeof(*p));
+	p->next = ecstrs;
+	ecstrs = p;
+	p->hnext = ecstrtab[hval & (ecstrtabsz - 1)];
+	ecstrtab[hval & (ecstrtabsz - 1)] = p;
+	p->hval = hval;
 	p->offs = ((ecsoffs - ecssub) << 2) | (t ? 1 : 0);
 	p->aoffs = ecsoffs;
 	p->str = s;
 	p->nfunc = ecnfunc;
 	ecsoffs += l;
+	ecnstrs++;
 
 	return p->offs;
     }
@@ -368,6 +403,8 @@ init_parse(void)
     ecbuf = (Wordcode) zalloc((eclen = EC_INIT_SIZE) * sizeof(wordcode));
     ecused = 0;
     ecstrs = NULL;
+    ecstrtab = NULL;
+    ecstrtabsz = ecnstrs = 0;
     ecsoffs = ecnpats = 0;
     ecssub = 0;
     ecnfunc = 0;
@@ -378,11 +415,8 @@ init_parse(void)
 static void
 copy_ecstr(Eccstr s, char *p)
 {
-    while (s) {
+    for (; s; s = s->next)
 	memcpy(p + s->aoffs, s->str, strlen(s->str) + 1);
-	copy_ecstr(s->left, p);
-	s = s->right;
-    }
 }
 
 static Eprog
@@ -403,6 +437,7 @@ bld_eprog(void)
     ret->prog = (Wordcode) (ret->pats + ecnpats);
     ret->strs = (char *) (ret->prog + ecused);
     ret->shf = NULL;
+    ret->text = NULL;
     ret->flags = EF_HEAP;
     ret->dump = NULL;
     for (l = 0; l < ecnpats; l++)
@@ -1413,6 +1448,39 @@ par_subsh(int *complex)
     }
 }
 
+/*
+ * With LAZY_FUNCTIONS, keep the body of a function with nam names, the
+ * opening brace of which has just been read, as text to be parsed when
+ * the function is first run.  This is only done when reading input
+ * directly and lexlazybody() can find the end of the body.  Returns 1
+ * if so, with the next token read.
+ */
+
+/**/
+static int
+par_lazybody(int nam)
+{
+    zlong bodyline = lineno;
+    char *body;
+    int sl;
+
+    if (!nam || unset(LAZYFUNCTIONS) || strin || hgetc != ingetc ||
+	lexflags || isset(IGNOREBRACES) || isset(IGNORECLOSEBRACES) ||
+	!(body = lexlazybody()))
+	return 0;
+
+    ecadd(WCB_LIST((Z_SYNC | Z_END), 0));
+    sl = ecadd(0);
+    ecadd(WCB_PIPE(WC_PIPE_END, 0));
+    ecadd(WCB_LAZYFN(bodyline));
+    ecstr(body);
+    ecbuf[sl] = WCB_SUBLIST(WC_SUBLIST_END, 0, ecused - 1 - sl);
+
+    incmdpos = 1;
+    zshlex();
+    return 1;
+}
+
 /*
  * funcdef	: FUNCTION wordlist [ INOUTPAR ] { SEPER }
  *					( list1 | INBRACE list OUTBRACE )
@@ -1459,7 +1527,9 @@ par_funcdef(int *complex)
     onp = ecnpats;
     ecnpats = 0;
 
-    if (tok == INBRACE) {
+    if (tok == INBRACE && par_lazybody(num)) {
+	/* body kept as text until the function is run */
+    } else if (tok == INBRACE) {
 	zshlex();
 	par_list(&c);
 	if (tok != OUTBRACE) {
@@ -1721,7 +1791,9 @@ par_simple(int *complex, int nr)
 	    onp = ecnpats;
 	    ecnpats = 0;
 
-	    if (tok == INBRACE) {
+	    if (tok == INBRACE && par_lazybody(argc)) {
+		/* body kept as text until the function is run */
+	    } else if (tok == INBRACE) {
 		int c = 0;
 
 		zshlex();
@@ -2346,6 +2418,7 @@ dupeprog(Eprog p, int heap)
     r->strs = ((char *) r->prog) + (p->strs - ((char *) p->prog));
     memcpy(r->prog, p->prog, r->len - (p->npats * sizeof(Patprog)));
     r->shf = NULL;
+    r->text = NULL;
 
     for (i = r->npats; i--; pp++)
 	*pp = dummy_patprog1;
@@ -2397,6 +2470,7 @@ freeeprog(Eprog p)
 		zfree(p->pats, p->npats * sizeof(Patprog));
 	    } else
 		zfree(p->pats, p->len);
+	    zsfree(p->text);
 	    zfree(p, sizeof(*p));
 	}
     }
@@ -2578,6 +2652,12 @@ init_eprog(void)
  *  - When incompatible changes are made, the FD_MAGIC and FD_OMAGIC
  *    numbers have to be changed.
  *
+ * The descriptions are preceded by the length of the whole header
+ * and a hash table used to find functions by name: the size of the
+ * table (a power of two) and for each slot the offset of a description
+ * from the start of the header, or zero for an empty slot.  Collisions
+ * are resolved by looking at the following slots.
+ *
  * Each description consists of a struct fdhead followed by the name,
  * aligned to sizeof(wordcode) (i.e. 4 bytes).
  */
@@ -2588,8 +2668,8 @@ init_eprog(void)
 #define FD_MINMAP 4096
 
 #define FD_PRELEN 12
-#define FD_MAGIC  0x04050607
-#define FD_OMAGIC 0x07060504
+#define FD_MAGIC  0x04050608
+#define FD_OMAGIC 0x08060504
 
 #define FDF_MAP   1
 #define FDF_OTHER 2
@@ -2606,6 +2686,8 @@ struct fdhead {
 };
 
 #define fdheaderlen(f) (((Wordcode) (f))[FD_PRELEN])
+#define fdhashsize(f)  (((Wordcode) (f))[FD_PRELEN + 1])
+#define fdhashtab(f)   (((Wordcode) (f)) + FD_PRELEN + 2)
 
 #define fdmagic(f)       (((Wordcode) (f))[0])
 #define fdsetbyte(f,i,v) \
@@ -2622,7 +2704,7 @@ struct fdhead {
     } while (0)
 #define fdversion(f)     ((char *) ((f) + 2))
 
-#define firstfdhead(f) ((FDHead) (((Wordcode) (f)) + FD_PRELEN))
+#define firstfdhead(f) ((FDHead) (fdhashtab(f) + fdhashsize(f)))
 #define nextfdhead(f)  ((FDHead) (((Wordcode) (f)) + (f)->hlen))
 
 #define fdhflags(f)      (((FDHead) (f))->flags)
@@ -2644,17 +2726,37 @@ struct wcfunc {
     int flags;
 };
 
+/*
+ * Hash a function name for the table in the header.  This must give
+ * the same result everywhere, so it doesn't depend on the signedness
+ * of char.
+ */
+
+static wordcode
+fdnamehash(char *name)
+{
+    wordcode h = 0;
+
+    while (*name)
+	h = h * 65599 + (unsigned char) *name++;
+
+    return h;
+}
+
 /* Try to find the description for the given function name. */
 
 static FDHead
 dump_find_func(Wordcode h, char *name)
 {
-    FDHead n, e = (FDHead) (h + fdheaderlen(h));
+    wordcode mask = fdhashsize(h) - 1, i, o;
+    FDHead n;
 
-    for (n = firstfdhead(h); n < e; n = nextfdhead(n))
+    for (i = fdnamehash(name) & mask; (o = fdhashtab(h)[i]);
+	 i = (i + 1) & mask) {
+	n = (FDHead) (h + o);
 	if (!strcmp(name, fdname(n) + fdhtail(n)))
 	    return n;
-
+    }
     return NULL;
 }
 
@@ -2816,12 +2918,40 @@ write_dump(int dfd, LinkList progs, int map, int hlen, int tlen)
 {
     LinkNode node;
     WCFunc wcf;
-    int other = 0, ohlen, tmp;
-    wordcode pre[FD_PRELEN];
+    int other = 0, ohlen, tmp, nfuncs = 0;
+    wordcode pre[FD_PRELEN + 2], hsize, hoff, i, *htab;
     char *tail, *n;
     struct fdhead head;
     Eprog prog;
 
+    /*
+     * The callers don't include the hash table in the lengths; it
+     * has at least twice as many slots as there are functions.
+     */
+    for (node = firstnode(progs); node; incnode(node))
+	nfuncs++;
+    for (hsize = 2; hsize < 2 * nfuncs; hsize <<= 1)
+	;
+    hlen += 2 + hsize;
+    tlen += (2 + hsize) * sizeof(wordcode);
+
+    htab = (wordcode *) zhalloc(hsize * sizeof(wordcode));
+    memset(htab, 0, hsize * sizeof(wordcode));
+    hoff = FD_PRELEN + 2 + hsize;
+    for (node = firstnode(progs); node; incnode(node)) {
+	n = ((WCFunc) getdata(node))->name;
+	if ((tail = strrchr(n, '/')))
+	    tail++;
+	else
+	    tail = n;
+	for (i = fdnamehash(tail) & (hsize - 1); htab[i];
+	     i = (i + 1) & (hsize - 1))
+	    ;
+	htab[i] = hoff;
+	hoff += (sizeof(struct fdhead) / sizeof(wordcode)) +
+	    (strlen(n) + sizeof(wordcode)) / sizeof(wordcode);
+    }
+
     if (map == 1)
 	map = (tlen >= FD_MINMAP);
 
@@ -2832,7 +2962,14 @@ write_dump(int dfd, LinkList progs, int map, int hlen, int tlen)
 	fdsetflags(pre, ((map ? FDF_MAP : 0) | other));
 	fdsetother(pre, tlen);
 	strcpy(fdversion(pre), ZSH_VERSION);
-	write_loop(dfd, (char *)pre, FD_PRELEN * sizeof(wordcode));
+	fdheaderlen(pre) = hlen;
+	fdhashsize(pre) = hsize;
+	if (other) {
+	    fdswap(pre + FD_PRELEN, 2);
+	    fdswap(htab, hsize);
+	}
+	write_loop(dfd, (char *)pre, (FD_PRELEN + 2) * sizeof(wordcode));
+	write_loop(dfd, (char *)htab, hsize * sizeof(wordcode));
 
 	for (node = firstnode(progs); node; incnode(node)) {
 	    wcf = (WCFunc) getdata(node);
@@ -2860,12 +2997,16 @@ write_dump(int dfd, LinkList progs, int map, int hlen, int tlen)
 		write_loop(dfd, (char *)&head, sizeof(wordcode) - tmp);
 	}
 	for (node = firstnode(progs); node; incnode(node)) {
+	    wordcode zero = 0;
+
 	    prog = ((WCFunc) getdata(node))->prog;
-	    tmp = (prog->len - (prog->npats * sizeof(Patprog)) +
-		   sizeof(wordcode) - 1) / sizeof(wordcode);
+	    tmp = prog->len - (prog->npats * sizeof(Patprog));
 	    if (other)
 		fdswap(prog->prog, (((Wordcode) prog->strs) - prog->prog));
-	    write_loop(dfd, (char *)prog->prog, tmp * sizeof(wordcode));
+	    /* Pad to whole wordcodes with zeros, not what follows. */
+	    write_loop(dfd, (char *)prog->prog, tmp);
+	    if ((tmp &= (sizeof(wordcode) - 1)))
+		write_loop(dfd, (char *)&zero, sizeof(wordcode) - tmp);
 	}
 	if (other)
 	    break;
@@ -2873,14 +3014,193 @@ write_dump(int dfd, LinkList progs, int map, int hlen, int tlen)
     }
 }
 
+/*
+ * Read and compile one of the files for build_dump().  Returns NULL
+ * after complaining, unless quiet is set, if that fails.
+ */
+
+static Eprog
+dump_parse_file(char *nam, char *fn, int quiet)
+{
+    int fd, flen, ne = noerrs;
+    char *file;
+    Eprog prog;
+
+    if ((fd = open(fn, O_RDONLY)) < 0 ||
+	(flen = lseek(fd, 0, 2)) == -1) {
+	if (fd >= 0)
+	    close(fd);
+	if (!quiet)
+	    zwarnnam(nam, "can't open file: %s", fn);
+	return NULL;
+    }
+    file = (char *) zalloc(flen + 1);
+    file[flen] = '\0';
+    lseek(fd, 0, 0);
+    if (read(fd, file, flen) != flen) {
+	close(fd);
+	zfree(file, flen);
+	if (!quiet)
+	    zwarnnam(nam, "can't read file: %s", fn);
+	return NULL;
+    }
+    close(fd);
+    file = metafy(file, flen, META_REALLOC);
+
+    if (quiet)
+	noerrs = 1;
+    prog = parse_string(file, 1);
+    noerrs = ne;
+    zfree(file, flen);
+    if (!prog || errflag) {
+	errflag = 0;
+	if (!quiet)
+	    zwarnnam(nam, "can't read file: %s", fn);
+	return NULL;
+    }
+    return prog;
+}
+
+/*
+ * Minimum number of files for each process when compiling in
+ * parallel; below this forking isn't worth it.  $ZCOMPILE_PROCESSES
+ * overrides the choice of the number of processes, mostly so that the
+ * tests can use this.
+ */
+
+#define DUMP_PAR_FILES 32
+
+/*
+ * Compile the files in several processes, each of which handles a
+ * contiguous range and sends back the parts of the eprogs that
+ * write_dump() uses.  progs[i] is left NULL if files[i] couldn't be
+ * compiled or something went wrong passing it back; the caller tries
+ * those itself, so that it reports errors just as when not working
+ * in parallel.
+ */
+
+static void
+dump_parse_parallel(char **files, int nfiles, Eprog *progs)
+{
+    long ncpu = 1;
+    int nw, w, i, p[2];
+    int *fds;
+    pid_t *pids;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (getsparam("ZCOMPILE_PROCESSES")) {
+	if ((nw = (int)getiparam("ZCOMPILE_PROCESSES")) > nfiles)
+	    nw = nfiles;
+    } else if ((nw = nfiles / DUMP_PAR_FILES) > ncpu)
+	nw = ncpu;
+    if (nw < 2)
+	return;
+
+    fds = (int *) zhalloc(nw * sizeof(int));
+    pids = (pid_t *) zhalloc(nw * sizeof(pid_t));
+    child_block();
+    for (w = 0; w < nw; w++) {
+	int beg = (int) ((long) w * nfiles / nw);
+	int end = (int) ((long) (w + 1) * nfiles / nw);
+
+	fds[w] = -1;
+	pids[w] = -1;
+	if (pipe(p) < 0)
+	    continue;
+	queue_signals();
+	pids[w] = fork();
+	unqueue_signals();
+	if (pids[w] == -1) {
+	    close(p[0]);
+	    close(p[1]);
+	} else if (!pids[w]) {
+	    /* Collect the results and write them in one go. */
+	    char *buf = NULL;
+	    size_t blen = 0, bsz = 0;
+
+	    close(p[0]);
+	    for (i = beg; i < end; i++) {
+		Eprog prog = dump_parse_file(NULL, files[i], 1);
+		wordcode hdr[5];
+		size_t dlen = 0, need;
+
+		hdr[0] = !!prog;
+		if (prog) {
+		    hdr[1] = prog->flags;
+		    hdr[2] = prog->len;
+		    hdr[3] = prog->npats;
+		    hdr[4] = prog->strs - ((char *) prog->prog);
+		    dlen = prog->len - prog->npats * sizeof(Patprog);
+		}
+		need = (prog ? sizeof(hdr) : sizeof(wordcode)) + dlen;
+		if (blen + need > bsz) {
+		    bsz = 2 * (blen + need);
+		    buf = (char *) realloc(buf, bsz);
+		    if (!buf)
+			_exit(1);
+		}
+		memcpy(buf + blen, hdr, need - dlen);
+		blen += need - dlen;
+		if (prog) {
+		    memcpy(buf + blen, prog->prog, dlen);
+		    blen += dlen;
+		}
+	    }
+	    _exit(write_loop(p[1], buf, blen) < 0);
+	} else {
+	    close(p[1]);
+	    fds[w] = p[0];
+	}
+    }
+    for (w = 0; w < nw; w++) {
+	int beg = (int) ((long) w * nfiles / nw);
+	int end = (int) ((long) (w + 1) * nfiles / nw);
+
+	if (fds[w] < 0)
+	    continue;
+	for (i = beg; i < end; i++) {
+	    wordcode hdr[5];
+	    size_t dlen;
+	    Eprog prog;
+
+	    if (read_loop(fds[w], (char *) hdr, sizeof(wordcode)) !=
+		sizeof(wordcode))
+		break;
+	    if (!hdr[0])
+		continue;
+	    if (read_loop(fds[w], (char *) (hdr + 1),
+			  sizeof(hdr) - sizeof(wordcode)) !=
+		sizeof(hdr) - sizeof(wordcode))
+		break;
+	    dlen = hdr[2] - hdr[3] * sizeof(Patprog);
+	    prog = (Eprog) hcalloc(sizeof(*prog));
+	    /* write_dump() writes whole wordcodes */
+	    prog->prog = (Wordcode) hcalloc(dlen + sizeof(wordcode));
+	    if (read_loop(fds[w], (char *) prog->prog, dlen) != (ssize_t) dlen)
+		break;
+	    prog->flags = hdr[1];
+	    prog->len = hdr[2];
+	    prog->npats = hdr[3];
+	    prog->strs = ((char *) prog->prog) + hdr[4];
+	    progs[i] = prog;
+	}
+	close(fds[w]);
+	waitpid(pids[w], NULL, 0);
+    }
+    child_unblock();
+}
+
 /**/
 static int
 build_dump(char *nam, char *dump, char **files, int ali, int map, int flags)
 {
-    int dfd, fd, hlen, tlen, flen, ona = noaliases;
+    int dfd, hlen, tlen, flen, nfiles, i, ona = noaliases;
+    int *fflags;
+    char **fnames;
     LinkList progs;
-    char *file;
-    Eprog prog;
+    Eprog prog, *fprogs;
     WCFunc wcf;
 
     if (!strsfx(FD_EXT, dump))
@@ -2894,7 +3214,12 @@ build_dump(char *nam, char *dump, char **files, int ali, int map, int flags)
     progs = newlinklist();
     noaliases = ali;
 
-    for (hlen = FD_PRELEN, tlen = 0; *files; files++) {
+    /* Sort out the -k and -z options first. */
+    nfiles = arrlen(files);
+    fnames = (char **) zhalloc((nfiles + 1) * sizeof(char *));
+    fflags = (int *) zhalloc((nfiles + 1) * sizeof(int));
+    fprogs = (Eprog *) hcalloc((nfiles + 1) * sizeof(Eprog));
+    for (nfiles = 0; *files; files++) {
 	if (!strcmp(*files, "-k")) {
 	    flags = (flags & ~(FDHF_KSHLOAD | FDHF_ZSHLOAD)) | FDHF_KSHLOAD;
 	    continue;
@@ -2902,49 +3227,26 @@ build_dump(char *nam, char *dump, char **files, int ali, int map, int flags)
 	    flags = (flags & ~(FDHF_KSHLOAD | FDHF_ZSHLOAD)) | FDHF_ZSHLOAD;
 	    continue;
 	}
-	if ((fd = open(*files, O_RDONLY)) < 0 ||
-	    (flen = lseek(fd, 0, 2)) == -1) {
-	    if (fd >= 0)
-		close(fd);
-	    close(dfd);
-	    zwarnnam(nam, "can't open file: %s", *files);
-	    noaliases = ona;
-	    unlink(dump);
-	    return 1;
-	}
-	file = (char *) zalloc(flen + 1);
-	file[flen] = '\0';
-	lseek(fd, 0, 0);
-	if (read(fd, file, flen) != flen) {
-	    close(fd);
-	    close(dfd);
-	    zfree(file, flen);
-	    zwarnnam(nam, "can't read file: %s", *files);
-	    noaliases = ona;
-	    unlink(dump);
-	    return 1;
-	}
-	close(fd);
-	file = metafy(file, flen, META_REALLOC);
+	fnames[nfiles] = *files;
+	fflags[nfiles++] = flags;
+    }
+    dump_parse_parallel(fnames, nfiles, fprogs);
 
-	if (!(prog = parse_string(file, 1)) || errflag) {
-	    errflag = 0;
+    for (hlen = FD_PRELEN, tlen = 0, i = 0; i < nfiles; i++) {
+	if (!(prog = fprogs[i]) &&
+	    !(prog = dump_parse_file(nam, fnames[i], 0))) {
 	    close(dfd);
-	    zfree(file, flen);
-	    zwarnnam(nam, "can't read file: %s", *files);
 	    noaliases = ona;
 	    unlink(dump);
 	    return 1;
 	}
-	zfree(file, flen);
-
 	wcf = (WCFunc) zhalloc(sizeof(*wcf));
-	wcf->name = *files;
+	wcf->name = fnames[i];
 	wcf->prog = prog;
-	wcf->flags = ((prog->flags & EF_RUN) ? FDHF_KSHLOAD : flags);
+	wcf->flags = ((prog->flags & EF_RUN) ? FDHF_KSHLOAD : fflags[i]);
 	addlinknode(progs, wcf);
 
-	flen = (strlen(*files) + sizeof(wordcode)) / sizeof(wordcode);
+	flen = (strlen(fnames[i]) + sizeof(wordcode)) / sizeof(wordcode);
 	hlen += (sizeof(struct fdhead) / sizeof(wordcode)) + flen;
 
 	tlen += (prog->len - (prog->npats * sizeof(Patprog)) +
@@ -3296,8 +3598,166 @@ try_source_file(char *file)
 	unqueue_signals();
 	return prog;
     }
+    prog = rn ? NULL : try_cache_file(file, &stn, NULL);
     unqueue_signals();
-    return NULL;
+    return prog;
+}
+
+/*
+ * Automatic wordcode cache for sourced and autoloaded files.
+ *
+ * If $ZWCDIR is set, it names a directory holding one wordcode file
+ * for each script file read, named after the full path of the script
+ * with `%' and `/' escaped.  The file contains a single entry whose
+ * name is made from the modification and change times, size and inode
+ * of the script, so if the script changes the entry is no longer found
+ * and the wordcode file is written afresh.
+ */
+
+/* Get the name of the cache file for file, or NULL. */
+
+static char *
+cache_file_name(char *file)
+{
+    char *dir = getsparam("ZWCDIR"), *base, *ptr, *name;
+    int len;
+
+    if (!dir || !*dir)
+	return NULL;
+    dir = dupstring(unmeta(dir));
+    while (file[0] == '.' && file[1] == '/')
+	file += 2;
+    if (*file == '/')
+	base = file;
+    else if (pwd && *pwd == '/')
+	base = zhtricat(unmeta(pwd), "/", file);
+    else
+	return NULL;
+    for (len = 0, ptr = base; *ptr; ptr++)
+	len += (*ptr == '/' || *ptr == '%') ? 3 : 1;
+    if (len + strlen(FD_EXT) > 255)
+	return NULL;
+    name = ptr = (char *) zhalloc(strlen(dir) + len + strlen(FD_EXT) + 2);
+    ptr += sprintf(ptr, "%s/", dir);
+    for (; *base; base++) {
+	if (*base == '/')
+	    ptr += sprintf(ptr, "%%2F");
+	else if (*base == '%')
+	    ptr += sprintf(ptr, "%%25");
+	else
+	    *ptr++ = *base;
+    }
+    strcpy(ptr, FD_EXT);
+    return name;
+}
+
+/* Write the cache file dump for file with the entry named key. */
+
+static int
+write_cache_file(char *dump, char *file, char *key, struct stat *sbuf)
+{
+    int fd, dfd, hlen, tlen, ne = noerrs;
+    char *buf, *tmp, *dir;
+    LinkList progs;
+    Eprog prog;
+    WCFunc wcf;
+
+    if ((fd = open(file, O_RDONLY | O_NOCTTY)) < 0)
+	return 1;
+    buf = (char *) zalloc(sbuf->st_size + 1);
+    if (read(fd, buf, sbuf->st_size) != sbuf->st_size) {
+	close(fd);
+	zfree(buf, sbuf->st_size + 1);
+	return 1;
+    }
+    close(fd);
+    buf[sbuf->st_size] = '\0';
+    buf = metafy(buf, sbuf->st_size, META_REALLOC);
+
+    noerrs = 1;
+    prog = parse_string(buf, 1);
+    noerrs = ne;
+    zfree(buf, sbuf->st_size + 1);
+    if (!prog || errflag) {
+	errflag = 0;
+	return 1;
+    }
+
+    dir = dupstring(dump);
+    *strrchr(dir, '/') = '\0';
+    if (mkdir(dir, 0700) && errno != EEXIST)
+	return 1;
+    tmp = (char *) zhalloc(strlen(dump) + DIGBUFSIZE + 2);
+    sprintf(tmp, "%s.%ld", dump, (long)getpid());
+    if ((dfd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+	return 1;
+
+    wcf = (WCFunc) zhalloc(sizeof(*wcf));
+    wcf->name = key;
+    wcf->prog = prog;
+    wcf->flags = 0;
+    progs = newlinklist();
+    addlinknode(progs, wcf);
+
+    hlen = FD_PRELEN + (sizeof(struct fdhead) / sizeof(wordcode)) +
+	(strlen(key) + sizeof(wordcode)) / sizeof(wordcode);
+    tlen = (prog->len - (prog->npats * sizeof(Patprog)) +
+	    sizeof(wordcode) - 1) / sizeof(wordcode);
+    tlen = (tlen + hlen) * sizeof(wordcode);
+
+    write_dump(dfd, progs, 1, hlen, tlen);
+
+    if (close(dfd) || rename(tmp, dump)) {
+	unlink(tmp);
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Look for file in the cache, adding it if it's not there.  The file
+ * name is unmetafied; sbuf is its status if the caller already has
+ * it, else NULL.  Returns NULL if the cache isn't in use or the file
+ * couldn't be compiled.
+ */
+
+/**/
+Eprog
+try_cache_file(char *file, struct stat *sbuf, int *ksh)
+{
+    char *dump, key[5 * DIGBUFSIZE + 8];
+    struct stat lsbuf;
+    Eprog prog;
+    long nsec = 0;
+
+    if (!(dump = cache_file_name(file)))
+	return NULL;
+    if (!sbuf) {
+	if (stat(file, &lsbuf))
+	    return NULL;
+	sbuf = &lsbuf;
+    }
+    /*
+     * A file changed again within the resolution of its timestamps
+     * could keep the same key, so leave recently changed files alone.
+     */
+    if (!S_ISREG(sbuf->st_mode) || sbuf->st_mtime >= time(NULL) - 1 ||
+	sbuf->st_ctime >= time(NULL) - 1)
+	return NULL;
+#ifdef GET_ST_MTIME_NSEC
+    nsec = (long)GET_ST_MTIME_NSEC(*sbuf);
+#endif
+    sprintf(key, "%ld.%ld-%ld-%ld-%ld%s", (long)sbuf->st_mtime, nsec,
+	    (long)sbuf->st_size, (long)sbuf->st_ino, (long)sbuf->st_ctime,
+	    noaliases ? "-U" : "");
+
+    queue_signals();
+    if (!(prog = check_dump_file(dump, NULL, key, ksh)) &&
+	!write_cache_file(dump, file, key, sbuf))
+	prog = check_dump_file(dump, NULL, key, ksh);
+    unqueue_signals();
+
+    return prog;
 }
 
 /* See if `file' names a wordcode dump file and that contains the
@@ -3363,6 +3823,7 @@ check_dump_file(char *file, struct stat *sbuf, char *name, int *ksh)
 	    prog->prog = f->map + h->start;
 	    prog->strs = ((char *) prog->prog) + h->strs;
 	    prog->shf = NULL;
+	    prog->text = NULL;
 	    prog->dump = f;
 
 	    incrdumpcount(f);
@@ -3415,6 +3876,7 @@ check_dump_file(char *file, struct stat *sbuf, char *name, int *ksh)
 	    prog->prog = (Wordcode) (((char *) d) + po);
 	    prog->strs = ((char *) prog->prog) + h->strs;
 	    prog->shf = NULL;
+	    prog->text = NULL;
 	    prog->dump = f;
 
 	    while (np--)
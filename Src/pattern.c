@@ -270,6 +270,12 @@ static struct zpc_disables_save *zpc_disables_stack;
 /**/
 char zpc_special[ZPC_COUNT];
 
+/*
+ * Globbing flags under which a literal in a pattern does not have to
+ * appear byte for byte in the string matched.
+ */
+#define GF_INEXACT (0xFF|GF_LCMATCHUC|GF_IGNCASE)
+
 /* Default size for pattern buffer */
 #define P_DEF_ALLOC 256
 
@@ -285,6 +291,39 @@ static long patalloc;		/* size allocated for same */
 static int patflags;		    /* flags passed down to patcompile */
 static int patglobflags;  /* globbing flags & approx */
 
+/*
+ * Cache of compiled non-file patterns.  The same pattern text is often
+ * compiled over and over again, for example in a [[ ... ]] test or a
+ * case arm inside a loop.  An entry is only reused if the flags and
+ * the set of active special characters (which is where the option
+ * state ends up) are the same as when it was compiled.  The cache
+ * has a fixed number of slots; when it is full, the least recently
+ * used entry is replaced.
+ */
+
+#define PATCACHE_SIZE    64
+#define PATCACHE_MAXPROG 4096	/* largest program worth keeping */
+
+struct patcache {
+    char *str;			/* pattern text, after remnulargs() */
+    unsigned hval;		/* hasher(str) */
+    int flags;			/* PAT_* flags relevant to compilation */
+    int globflags;		/* initial patglobflags */
+    char special[ZPC_COUNT];	/* zpc_special at compilation */
+    long endoff;		/* offset of end of compiled text in str */
+    long alloc;			/* size allocated for prog */
+    zlong used;			/* value of patcacheclock at last use */
+    Patprog prog;		/* the compiled program, zalloc()ed */
+};
+
+static struct patcache patcache[PATCACHE_SIZE];
+static zlong patcacheclock;
+
+/* Statistics for the pattern cache */
+
+/**/
+mod_export zlong patcachehits, patcachemisses;
+
 /*
  * Increment pointer to metafied multibyte string.
  */
@@ -499,6 +538,72 @@ patcompstart(void)
 	patglobflags |= GF_MULTIBYTE;
 }
 
+/*
+ * Flags which affect the result of compiling a pattern.  The
+ * allocation flags only affect where the result is put.
+ */
+#define PAT_CACHE_FLAGS \
+    (~(PAT_STATIC|PAT_ZDUP|PAT_PURES|PAT_HAS_EXCLUDP|PAT_LINEAR))
+
+/* Look for exp in the pattern cache with the current compilation state. */
+
+/**/
+static struct patcache *
+patcachefind(char *exp, unsigned hval)
+{
+    struct patcache *pc;
+    int flags = patflags & PAT_CACHE_FLAGS;
+
+    for (pc = patcache; pc < patcache + PATCACHE_SIZE; pc++)
+	if (pc->prog && pc->hval == hval && pc->flags == flags &&
+	    pc->globflags == patglobflags &&
+	    !memcmp(pc->special, zpc_special, ZPC_COUNT) &&
+	    !strcmp(pc->str, exp)) {
+	    pc->used = ++patcacheclock;
+	    return pc;
+	}
+    return NULL;
+}
+
+/*
+ * Remember a freshly compiled program for exp; prog has size bytes
+ * and the compiled part of exp ends at endexp.  flags and globflags
+ * are the compilation state before compiling.
+ */
+
+/**/
+static void
+patcacheadd(char *exp, unsigned hval, int flags, int globflags,
+	    Patprog prog, long size, char *endexp)
+{
+    struct patcache *pc, *old = patcache;
+
+    if (size > PATCACHE_MAXPROG)
+	return;
+    for (pc = patcache; pc < patcache + PATCACHE_SIZE; pc++) {
+	if (!pc->prog) {
+	    old = pc;
+	    break;
+	}
+	if (pc->used < old->used)
+	    old = pc;
+    }
+    if (old->prog) {
+	zsfree(old->str);
+	zfree(old->prog, old->alloc);
+    }
+    old->str = ztrdup(exp);
+    old->hval = hval;
+    old->flags = flags;
+    old->globflags = globflags;
+    memcpy(old->special, zpc_special, ZPC_COUNT);
+    old->endoff = endexp - exp;
+    old->alloc = size;
+    old->used = ++patcacheclock;
+    old->prog = (Patprog)zalloc(size);
+    memcpy((char *)old->prog, (char *)prog, size);
+}
+
 /*
  * Top level pattern compilation subroutine
  * exp is a null-terminated, metafied string.
@@ -519,7 +624,10 @@ patcompile(char *exp, int inflags, char **endexp)
     Upat pscan;
     char *lng, *strp = NULL;
     Patprog p;
+    unsigned hval = 0;
+    int cacheable = 0, flags0, globflags0;
 
+    runstats.pattern_compiles++;
     startoff = sizeof(struct patprog);
     /* Ensure alignment of start of program string */
     startoff = (startoff + sizeof(union upat) - 1) & ~(sizeof(union upat) - 1);
@@ -548,6 +656,38 @@ patcompile(char *exp, int inflags, char **endexp)
     }
     if (patflags & PAT_LCMATCHUC)
 	patglobflags |= GF_LCMATCHUC;
+    flags0 = patflags & PAT_CACHE_FLAGS;
+    globflags0 = patglobflags;
+
+    /*
+     * File patterns are compiled a segment at a time with state
+     * shared between segments, so only cache the others.
+     */
+    if (!(patflags & PAT_FILE)) {
+	struct patcache *pc;
+
+	cacheable = 1;
+	hval = hasher(exp);
+	if ((pc = patcachefind(exp, hval))) {
+	    patcachehits++;
+	    if (patflags & PAT_ZDUP)
+		p = (Patprog)zalloc(pc->alloc);
+	    else if (patflags & PAT_STATIC) {
+		if (patalloc < pc->alloc)
+		    patout = (char *)zrealloc(patout, patalloc = pc->alloc);
+		p = (Patprog)patout;
+	    } else
+		p = (Patprog)zhalloc(pc->alloc);
+	    memcpy((char *)p, (char *)pc->prog, pc->alloc);
+	    /* Same compilation state, different allocation flags */
+	    p->flags = (p->flags & ~(PAT_STATIC|PAT_ZDUP)) |
+		(patflags & (PAT_STATIC|PAT_ZDUP));
+	    if (endexp)
+		*endexp = exp + pc->endoff;
+	    return p;
+	}
+	patcachemisses++;
+    }
     /*
      * Have to be set now, since they get updated during compilation.
      */
@@ -671,23 +811,28 @@ patcompile(char *exp, int inflags, char **endexp)
 		p->patmlen = p->size - startoff;
 	    } else {
 		/* starting point info */
-		if (P_OP(pscan) == P_EXACTLY && !p->globflags &&
+		if (P_OP(pscan) == P_EXACTLY && !(p->globflags & GF_INEXACT) &&
 		    P_LS_LEN(pscan))
 		    p->patstartch = *P_LS_STR(pscan);
 		/*
 		 * Find the longest literal string in something expensive.
 		 * This is itself not all that cheap if we have
 		 * case-insensitive matching or approximation, so don't.
+		 * Stop looking if the flags change on the way.
 		 */
-		if ((flags & P_HSTART) && !p->globflags) {
+		if ((flags & P_HSTART) && !(p->globflags & GF_INEXACT)) {
 		    lng = NULL;
 		    len = 0;
-		    for (; pscan; pscan = PATNEXT(pscan))
+		    for (; pscan; pscan = PATNEXT(pscan)) {
+			if (P_OP(pscan) == P_GFLAGS &&
+			    (P_OPERAND(pscan)->l & GF_INEXACT))
+			    break;
 			if (P_OP(pscan) == P_EXACTLY &&
 			    P_LS_LEN(pscan) >= len) {
 			    lng = P_LS_STR(pscan);
 			    len = P_LS_LEN(pscan);
 			}
+		    }
 		    if (lng) {
 			p->mustoff = lng - patout;
 			p->patmlen = len;
@@ -695,6 +840,20 @@ patcompile(char *exp, int inflags, char **endexp)
 		}
 	    }
 	}
+	/*
+	 * Patterns with more than one closure can take a long time
+	 * to backtrack over; if patmatchlinear() can handle them, let it.
+	 */
+	if (!(patflags & (PAT_ANY|PAT_NOANCH)) && !(p->flags & PAT_PURES) &&
+	    !(p->globflags & (GF_INEXACT|GF_BACKREF))) {
+	    char *seen = (char *)zshcalloc(patsize);
+	    int loops = 0;
+
+	    if (patlinearok((Upat)(patout + startoff), seen, &loops) &&
+		loops > 1)
+		p->flags |= PAT_LINEAR;
+	    zfree(seen, patsize);
+	}
     }
 
     /*
@@ -703,6 +862,8 @@ patcompile(char *exp, int inflags, char **endexp)
      * for files where we will often be compiling multiple segments at once.
      * But if we get the ZDUP flag we always put it in zalloc()ed memory.
      */
+    if (cacheable)
+	patcacheadd(exp, hval, flags0, globflags0, p, patsize, patparse);
     if (patflags & PAT_ZDUP) {
 	Patprog newp = (Patprog)zalloc(patsize);
 	memcpy((char *)newp, (char *)p, patsize);
@@ -1833,6 +1994,14 @@ static int parsfound;			/* parentheses (with backrefs) found */
 
 static int globdots;			/* Glob initial dots? */
 
+/*
+ * If patsteplimit is non-zero, patmatch() fails once it has
+ * looked at that many nodes in all, counting in patsteps.
+ */
+static long patsteps, patsteplimit;
+
+#define PAT_STEP_LIMIT(len)	(1024 + 32 * (long)(len))
+
 /*
  * Character functions operating on unmetafied strings.
  */
@@ -1985,6 +2154,31 @@ pattrystart(void)
     errsfound = 0;
 }
 
+/*
+ * Look for the string str of length len in the len bytes at s,
+ * neither of which need be null-terminated.
+ */
+
+/**/
+static char *
+patfindstr(char *s, long slen, char *str, long len)
+{
+#ifdef HAVE_MEMMEM
+    return (char *)memmem(s, slen, str, len);
+#else
+    char *end = s + slen - len;
+
+    if (!len)
+	return s;
+    while (s <= end && (s = (char *)memchr(s, *str, end - s + 1))) {
+	if (!memcmp(s, str, len))
+	    return s;
+	s++;
+    }
+    return NULL;
+#endif
+}
+
 /*
  * Test prog against null-terminated, metafied string.
  */
@@ -2009,6 +2203,68 @@ pattrylen(Patprog prog, char *string, int len, int unmetalen, int offset)
     return pattryrefs(prog, string, len, unmetalen, offset, NULL, NULL, NULL);
 }
 
+/*
+ * Prepare to test prog many times against parts of string, which
+ * is metafied and null-terminated, with pattrylenalloc().  Any
+ * unmetafied copy is made on the heap.
+ */
+
+/**/
+mod_export void
+patallocstr(Patprog prog, char *string, Patstralloc psa)
+{
+    char *ptr, *dst;
+
+    psa->string = psa->mpos = string;
+    psa->upos = 0;
+    psa->alloced = NULL;
+    if (prog->flags & (PAT_PURES|PAT_ANY))
+	return;
+    for (ptr = string; *ptr && *ptr != Meta; ptr++)
+	;
+    if (!*ptr)
+	return;
+    psa->alloced = dst = (char *)zhalloc(ztrlen(string) + 1);
+    for (ptr = string; *ptr; ) {
+	if (*ptr == Meta) {
+	    ptr++;
+	    *dst++ = *ptr++ ^ 32;
+	} else
+	    *dst++ = *ptr++;
+    }
+}
+
+/*
+ * As pattrylen(), where string lies within the string passed to
+ * patallocstr() for psa.  Successive calls are cheapest if they move
+ * steadily through the string in one direction.
+ */
+
+/**/
+mod_export int
+pattrylenalloc(Patprog prog, Patstralloc psa, char *string, int len,
+	       int unmetalen, int offset)
+{
+    if (!psa->alloced)
+	return pattryrefs(prog, string, len, unmetalen, offset,
+			  NULL, NULL, NULL);
+    while (psa->mpos < string) {
+	if (*psa->mpos++ == Meta)
+	    psa->mpos++;
+	psa->upos++;
+    }
+    /* The byte after a Meta is never itself Meta. */
+    while (psa->mpos > string) {
+	psa->mpos -= (psa->mpos - psa->string >= 2 &&
+		      psa->mpos[-2] == Meta) ? 2 : 1;
+	psa->upos--;
+    }
+    if (unmetalen < 0)
+	unmetalen = ztrsub(string + len, string);
+    return pattrystr(prog, string, psa->alloced + psa->upos, len, unmetalen,
+		     offset, NULL, NULL, NULL);
+}
+
 /*
  * Test prog against string with given lengths.  The input
  * string is metafied; stringlen is the raw string length, and
@@ -2041,6 +2297,20 @@ mod_export int
 pattryrefs(Patprog prog, char *string, int stringlen, int unmetalen,
 	   int patoffset,
 	   int *nump, int *begp, int *endp)
+{
+    return pattrystr(prog, string, NULL, stringlen, unmetalen, patoffset,
+		     nump, begp, endp);
+}
+
+/*
+ * The work of pattryrefs().  If unmeta is not NULL, it is string
+ * already unmetafied, in which case unmetalen must be given.
+ */
+
+/**/
+static int
+pattrystr(Patprog prog, char *string, char *unmeta, int stringlen,
+	  int unmetalen, int patoffset, int *nump, int *begp, int *endp)
 {
     int i, maxnpos = 0, ret, needfullpath, unmetalenp;
     int origlen;
@@ -2054,6 +2324,8 @@ pattryrefs(Patprog prog, char *string, int stringlen, int unmetalen,
     /* inherited from domatch, but why, exactly? */
     if (*string == Nularg) {
 	string++;
+	if (unmeta)
+	    unmeta++;
 	unmetalen--;
     }
 
@@ -2084,7 +2356,12 @@ pattryrefs(Patprog prog, char *string, int stringlen, int unmetalen,
      * globbing, we don't unmetafy pure string patterns, and
      * there's no reason to if the pattern is just a *.
      */
-    if (!(patflags & (PAT_PURES|PAT_ANY))
+    if (unmeta && !needfullpath && !(patflags & (PAT_PURES|PAT_ANY))) {
+	/* The caller has done the unmetafying for us. */
+	patinstart = unmeta;
+	tryalloced = patinpath = NULL;
+	stringlen = unmetalen;
+    } else if (!(patflags & (PAT_PURES|PAT_ANY))
 	&& (needfullpath || unmetalen != stringlen)) {
 	/*
 	 * We need to copy if we need to prepend the path so far
@@ -2226,35 +2503,19 @@ pattryrefs(Patprog prog, char *string, int stringlen, int unmetalen,
 	int q = queue_signal_level();
 
 	/*
-	 * Test for a `must match' string, unless we're scanning for a match
-	 * in which case we don't need to do this each time.
+	 * An anchored match has to start with the first character
+	 * of an initial literal.  Otherwise, test for a `must match'
+	 * string, unless we're scanning for a match in which case we
+	 * don't need to do this each time.
 	 */
 	ret = 1;
-	if (!(prog->flags & PAT_SCAN) && prog->mustoff)
-	{
-	    char *testptr;	/* start pointer into test string */
-	    char *teststop;	/* last point from which we can match */
-	    char *patptr = (char *)prog + prog->mustoff;
-	    int patlen = prog->patmlen;
-	    int found = 0;
-
-	    if (patlen > stringlen) {
-		/* Too long, can't match. */
+	if (prog->patstartch) {
+	    if (patinstart == patinend || *patinstart != prog->patstartch)
+		ret = 0;
+	} else if (!(prog->flags & PAT_SCAN) && prog->mustoff) {
+	    if (!patfindstr(patinstart, stringlen,
+			    (char *)prog + prog->mustoff, prog->patmlen))
 		ret = 0;
-	    } else {
-		teststop = patinend - patlen;
-
-		for (testptr = patinstart; testptr <= teststop; testptr++)
-		{
-		    if (!memcmp(testptr, patptr, patlen)) {
-			found = 1;
-			break;
-		    }
-		}
-
-		if (!found)
-		    ret = 0;
-	    }
 	}
 	if (!ret) {
 	    if (tryalloced)
@@ -2274,7 +2535,25 @@ pattryrefs(Patprog prog, char *string, int stringlen, int unmetalen,
 
 	dont_queue_signals();
 
-	if (patmatch((Upat)progstr)) {
+	/*
+	 * If the pattern could take a long time to backtrack
+	 * over, only allow so many steps before switching to the
+	 * matcher that doesn't need to.
+	 */
+	if (prog->flags & PAT_LINEAR) {
+	    patsteps = 0;
+	    patsteplimit = PAT_STEP_LIMIT(stringlen);
+	    ret = patmatch((Upat)progstr);
+	    patsteplimit = 0;
+	    if (!ret && patsteps > PAT_STEP_LIMIT(stringlen)) {
+		patinput = patinstart;
+		parsfound = 0;
+		ret = patmatchlinear(prog);
+	    }
+	} else
+	    ret = patmatch((Upat)progstr);
+
+	if (ret) {
 	    /*
 	     * we were lazy and didn't save the globflags if an exclusion
 	     * failed, so set it now
@@ -2492,6 +2771,9 @@ patmatch(Upat prog)
     patint_t nextch;
 
     while  (scan && !errflag) {
+	/* We've been told to give up:  see pattryrefs() */
+	if (patsteplimit && ++patsteps > patsteplimit)
+	    return 0;
 	next = PATNEXT(scan);
 
 	if (!globdots && P_NOTDOT(scan) && patinput == patinstart &&
@@ -3845,6 +4127,278 @@ static int patrepeat(Upat p, char *charstart)
     return count;
 }
 
+/*
+ * Alternative matcher for patterns which need no backtracking to
+ * give the right answer, i.e. with no exclusions, backreferences,
+ * approximation or other changes of flags, and matched against the
+ * whole string.  Rather than trying each way through the pattern in
+ * turn, it keeps the set of nodes reached so far and moves the whole
+ * set along one character at a time, so the time taken is linear in
+ * the length of the string however many closures there are.
+ *
+ * A state is a node in the program together with, for P_EXACTLY,
+ * the byte offset into its string, or for P_TWOHASH, whether the
+ * operand was matched at least once.  Each state has an index, its
+ * byte offset in the program, which is used to make sure it only
+ * appears once in a list.
+ */
+
+struct patlstate {
+    Upat node;
+    long sub;
+};
+
+static struct patlstate *patlstates[2];	/* current and next lists */
+static int patlnstates[2];		/* number in each list */
+static zlong *patlmark;			/* step at which index last added */
+static long patlalloc;			/* number of indexes allocated */
+static zlong patlstep;			/* counts lists built */
+static char *patlbase;			/* start of program being matched */
+static char *patlpos;			/* input position of list built */
+static int patlmatched;			/* reached P_END at end of input */
+
+/*
+ * Check if the program from scan on can be matched by patmatchlinear(),
+ * counting closures in *loops.  seen marks the nodes already checked.
+ */
+
+/**/
+static int
+patlinearok(Upat scan, char *seen, int *loops)
+{
+    Upat opnd;
+
+    for (; scan; scan = PATNEXT(scan)) {
+	long off = (char *)scan - patout;
+
+	if (seen[off])
+	    return 1;
+	seen[off] = 1;
+
+	switch (P_OP(scan)) {
+	case P_END:
+	    return 1;
+	case P_BRANCH:
+	case P_WBRANCH:
+	    opnd = P_OPERAND(scan);
+	    if (P_OP(scan) == P_WBRANCH)
+		opnd++;
+	    if (!patlinearok(opnd, seen, loops))
+		return 0;
+	    break;
+	case P_ONEHASH:
+	case P_TWOHASH:
+	    opnd = P_OPERAND(scan);
+	    if (P_OP(opnd) != P_ANY && P_OP(opnd) != P_ANYOF &&
+		P_OP(opnd) != P_ANYBUT && P_OP(opnd) != P_EXACTLY)
+		return 0;
+	    /* FALLTHROUGH */
+	case P_STAR:
+	    (*loops)++;
+	    break;
+	case P_BACK:
+	    (*loops)++;
+	    break;
+	case P_ANY:
+	case P_ANYOF:
+	case P_ANYBUT:
+	case P_EXACTLY:
+	case P_NOTHING:
+	case P_ISSTART:
+	case P_ISEND:
+	    break;
+	default:
+	    if ((P_OP(scan) & ~0xf) == P_OPEN ||
+		(P_OP(scan) & ~0xf) == P_CLOSE)
+		break;
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* Test if the operand of a P_ONEHASH or P_TWOHASH matches a character */
+
+static int
+patlinearchar(Upat p, patint_t ch)
+{
+    char *opnd = (char *)P_OPERAND(p);
+
+    switch (P_OP(p)) {
+    case P_ANY:
+	return 1;
+    case P_EXACTLY:
+	return ch == CHARREF(P_LS_STR(p), P_LS_STR(p) + P_LS_LEN(p));
+    default:
+#ifdef MULTIBYTE_SUPPORT
+	if (patglobflags & GF_MULTIBYTE)
+	    return !(mb_patmatchrange(opnd, ch, NULL, NULL) ^
+		     (P_OP(p) == P_ANYOF));
+#endif
+	return !(patmatchrange(opnd, (int)ch, NULL, NULL) ^
+		 (P_OP(p) == P_ANYOF));
+    }
+}
+
+/*
+ * Add the state for node scan to list l, together with all the
+ * states reached from it without reading a character.
+ */
+
+/**/
+static void
+patlinearadd(int l, Upat scan, long sub)
+{
+    while (scan) {
+	long ind = (char *)scan - patlbase + sub;
+	struct patlstate *st;
+	Upat opnd;
+
+	if (P_OP(scan) == P_EXACTLY) {
+	    if (sub >= P_LS_LEN(scan)) {
+		/* Finished with the string */
+		scan = PATNEXT(scan);
+		sub = 0;
+		continue;
+	    }
+	    ind += P_LS_STR(scan) - (char *)scan;
+	}
+	if (patlmark[ind] == patlstep)
+	    return;
+	patlmark[ind] = patlstep;
+
+	if (!globdots && patlpos == patinstart && patlpos < patinend &&
+	    *patlpos == '.' &&
+	    (P_NOTDOT(scan) ||
+	     ((P_OP(scan) == P_ONEHASH || P_OP(scan) == P_TWOHASH) &&
+	      P_NOTDOT(P_OPERAND(scan)))))
+	    return;
+
+	switch (P_OP(scan)) {
+	case P_END:
+	    if (patlpos == patinend)
+		patlmatched = 1;
+	    return;
+	case P_BRANCH:
+	case P_WBRANCH:
+	    /* No need to guard a P_WBRANCH:  a state is only added once */
+	    for (; scan && P_ISBRANCH(scan); scan = PATNEXT(scan)) {
+		opnd = P_OPERAND(scan);
+		if (P_OP(scan) == P_WBRANCH)
+		    opnd++;
+		patlinearadd(l, opnd, 0);
+	    }
+	    return;
+	case P_ISSTART:
+	    if (patlpos != patinstart || (patflags & PAT_NOTSTART))
+		return;
+	    break;
+	case P_ISEND:
+	    if (patlpos < patinend || (patflags & PAT_NOTEND))
+		return;
+	    break;
+	case P_EXACTLY:
+	case P_ANY:
+	case P_ANYOF:
+	case P_ANYBUT:
+	case P_STAR:
+	case P_ONEHASH:
+	case P_TWOHASH:
+	    st = patlstates[l] + patlnstates[l]++;
+	    st->node = scan;
+	    st->sub = sub;
+	    /* Closures may also match nothing (more) */
+	    if (P_OP(scan) == P_STAR || P_OP(scan) == P_ONEHASH ||
+		(P_OP(scan) == P_TWOHASH && sub))
+		break;
+	    return;
+	}
+	scan = PATNEXT(scan);
+	sub = 0;
+    }
+}
+
+/*
+ * Match the program prog against the whole of the input string.
+ * On success, patinput is left at the end of the string.
+ */
+
+/**/
+static int
+patmatchlinear(Patprog prog)
+{
+    int cur = 0, i;
+
+    if (patlalloc < prog->size) {
+	if (patlalloc) {
+	    zfree(patlstates[0], patlalloc * sizeof(struct patlstate));
+	    zfree(patlstates[1], patlalloc * sizeof(struct patlstate));
+	    zfree(patlmark, patlalloc * sizeof(zlong));
+	}
+	patlalloc = prog->size;
+	patlstates[0] = (struct patlstate *)
+	    zalloc(patlalloc * sizeof(struct patlstate));
+	patlstates[1] = (struct patlstate *)
+	    zalloc(patlalloc * sizeof(struct patlstate));
+	patlmark = (zlong *)zshcalloc(patlalloc * sizeof(zlong));
+    }
+    patlbase = (char *)prog;
+    patlmatched = 0;
+
+    patlpos = patinput;
+    patlnstates[cur] = 0;
+    patlstep++;
+    patlinearadd(cur, (Upat)((char *)prog + prog->startoff), 0);
+
+    while (!patlmatched && patlnstates[cur] && patlpos < patinend) {
+	char *pos = patlpos;
+	int badin = 0, nxt = !cur;
+	patint_t chin = CHARREFINC(pos, patinend, &badin);
+
+	patlnstates[nxt] = 0;
+	patlstep++;
+	patlpos = pos;
+	for (i = 0; i < patlnstates[cur]; i++) {
+	    struct patlstate *st = patlstates[cur] + i;
+	    Upat scan = st->node;
+
+	    switch (P_OP(scan)) {
+	    case P_EXACTLY:
+		{
+		    char *str = P_LS_STR(scan), *chrop = str + st->sub;
+		    int badpa = 0;
+		    patint_t chpa = CHARREFINC(chrop, str + P_LS_LEN(scan),
+					       &badpa);
+
+		    if (chin == chpa && badin == badpa)
+			patlinearadd(nxt, scan, chrop - str);
+		}
+		break;
+	    case P_ANY:
+		patlinearadd(nxt, PATNEXT(scan), 0);
+		break;
+	    case P_ANYOF:
+	    case P_ANYBUT:
+		if (patlinearchar(scan, chin))
+		    patlinearadd(nxt, PATNEXT(scan), 0);
+		break;
+	    case P_STAR:
+		patlinearadd(nxt, scan, 0);
+		break;
+	    case P_ONEHASH:
+	    case P_TWOHASH:
+		if (patlinearchar(P_OPERAND(scan), chin))
+		    patlinearadd(nxt, scan, P_OP(scan) == P_TWOHASH);
+		break;
+	    }
+	}
+	cur = nxt;
+    }
+    if (patlmatched)
+	patinput = patinend;
+    return patlmatched;
+}
+
 /* Free a patprog. */
 
 /**/
@@ -110,6 +110,28 @@ typedef struct buf_vars *Buf_vars;
 /* The currently active prompt output variables */
 static Buf_vars bv;
 
+/*
+ * Prompts are expanded again for every redraw, but the directory
+ * rarely changes in between and abbreviating it means looking through
+ * all the named directories.  So the last few results of promptpath()
+ * are remembered together with everything they depend on:  the path,
+ * the arguments and, if abbreviating, the state of the named directory
+ * table as counted by finddirgen.  A zsh_directory_name hook could give
+ * a different answer at any time, so nothing is remembered while one
+ * is defined.
+ */
+
+#define PATHSEG_CACHE 4
+
+static struct pathseg {
+    char *path;			/* the directory expanded */
+    int npath, tilde;		/* the arguments */
+    int gen;			/* value of finddirgen, if tilde */
+    char *res;			/* the result, metafied */
+} pathsegs[PATHSEG_CACHE];
+
+static int pathsegnext;
+
 /*
  * Expand path p; maximum is npath segments where 0 means the whole path.
  * If tilde is 1, try and find a named directory to use.
@@ -118,8 +140,22 @@ static Buf_vars bv;
 static void
 promptpath(char *p, int npath, int tilde)
 {
-    char *modp = p;
+    char *modp = p, *res;
     Nameddir nd;
+    struct pathseg *ps;
+    int onpath = npath;
+    int cache = !tilde || (!getshfunc("zsh_directory_name") &&
+			   !getaparam("zsh_directory_name" HOOK_SUFFIX));
+
+    if (cache) {
+	for (ps = pathsegs; ps < pathsegs + PATHSEG_CACHE; ps++) {
+	    if (ps->path && ps->npath == onpath && ps->tilde == tilde &&
+		(!tilde || ps->gen == finddirgen) && !strcmp(ps->path, p)) {
+		stradd(ps->res);
+		return;
+	    }
+	}
+    }
 
     if (tilde && ((nd = finddir(p))))
 	modp = tricat("~", nd->node.nam, p + strlen(nd->dir));
@@ -135,22 +171,32 @@ promptpath(char *p, int npath, int tilde)
 	    }
 	    if (*sptr == '/' && sptr[1] && sptr != modp)
 		sptr++;
-	    stradd(sptr);
+	    res = ztrdup(sptr);
 	} else {
-	    char cbu;
 	    for (sptr = modp+1; *sptr; sptr++)
 		if (*sptr == '/' && !++npath)
 		    break;
-	    cbu = *sptr;
-	    *sptr = 0;
-	    stradd(modp);
-	    *sptr = cbu;
+	    res = ztrduppfx(modp, sptr - modp);
 	}
     } else
-	stradd(modp);
+	res = ztrdup(modp);
+    stradd(res);
 
     if (p != modp)
 	zsfree(modp);
+
+    if (cache) {
+	ps = pathsegs + pathsegnext;
+	pathsegnext = (pathsegnext + 1) % PATHSEG_CACHE;
+	zsfree(ps->path);
+	zsfree(ps->res);
+	ps->path = ztrdup(p);
+	ps->npath = onpath;
+	ps->tilde = tilde;
+	ps->gen = finddirgen;
+	ps->res = res;
+    } else
+	zsfree(res);
 }
 
 /*
@@ -1079,6 +1125,11 @@ countprompt(char *str, int *wp, int *hp, int overf)
 			continue;
 		    }
 #ifdef MULTIBYTE_SUPPORT
+		    else if (WC_ISASCIIPRINT(*str)) {
+			/* No need to ask the library about these. */
+			w++;
+			continue;
+		    }
 		}
 
 		inchar = *str;
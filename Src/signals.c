@@ -342,9 +342,56 @@ static int suspend_longjmp = 0;
 static signal_jmp_buf suspend_jmp_buf;
 #endif
 
+#if defined(POSIX_SIGNALS) && !defined(BROKEN_POSIX_SIGSUSPEND) && \
+    defined(HAVE_SYS_SIGNALFD_H) && defined(HAVE_SIGNALFD) && \
+    defined(HAVE_PPOLL) && defined(HAVE_POLL_H)
+#include <sys/signalfd.h>
+#include <poll.h>
+#define USE_SIGNALFD 1
+
+/*
+ * File descriptor from which SIGCHLD can be read while waiting for
+ * children, or -1 if not yet opened, or -2 if it can't be used.
+ *
+ * While waiting, SIGCHLD is blocked anyway, so rather than have the
+ * signal delivered to zhandler() we leave it pending and wait for it
+ * to become readable here.  That saves setting up the handler frame
+ * and the signal mask juggling for every wakeup, and all the children
+ * that have changed state are reaped in one go afterwards.
+ */
+static int chldfd = -1;
+
+/* Make sure chldfd is usable; return 0 if it isn't. */
+
+static int
+getchldfd(void)
+{
+    sigset_t set;
+    int fd;
+
+    if (chldfd >= 0 && chldfd <= max_zsh_fd &&
+	fdtable[chldfd] == FDT_SIGNALFD)
+	return 1;
+    if (chldfd == -2)
+	return 0;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    if ((fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+	chldfd = -2;
+	return 0;
+    }
+    if ((chldfd = movefd(fd)) < 0) {
+	chldfd = -2;
+	return 0;
+    }
+    fdtable[chldfd] = FDT_SIGNALFD;
+    return 1;
+}
+#endif
+
 /**/
 int
-signal_suspend(UNUSED(int sig), int wait_cmd)
+signal_suspend(int sig, int wait_cmd)
 {
     int ret;
 
@@ -366,6 +413,31 @@ signal_suspend(UNUSED(int sig), int wait_cmd)
 	sigaddset(&set, SIGINT);
 #endif /* POSIX_SIGNALS || BSD_SIGNALS */
 
+#ifdef USE_SIGNALFD
+    if (sig == SIGCHLD && !queueing_enabled && getchldfd()) {
+	struct pollfd pfd;
+
+	pfd.fd = chldfd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	sigaddset(&set, SIGCHLD);
+	ret = ppoll(&pfd, 1, NULL, &set);
+	if (ret > 0) {
+	    struct signalfd_siginfo si;
+
+	    /* Drain the SIGCHLD, then do what zhandler() would have. */
+	    while (read(chldfd, &si, sizeof(si)) == sizeof(si))
+		;
+	    last_signal = SIGCHLD;
+	    wait_for_processes();
+	    /* Look like sigsuspend() to the caller */
+	    errno = EINTR;
+	    ret = -1;
+	}
+	return ret;
+    }
+#endif
+
 #ifdef POSIX_SIGNALS
 # ifdef BROKEN_POSIX_SIGSUSPEND
     sigprocmask(SIG_SETMASK, &set, &oset);
@@ -919,8 +991,10 @@ removetrap(int sig)
 	 * As in dosavetrap(), don't call removeshfuncnode() because
 	 * that calls back into unsettrap();
 	 */
-	if (node)
+	if (node) {
 	    removehashnode(shfunctab, node->nam);
+	    cmdgen++;
+	}
 	unqueue_signals();
 
 	return node;
@@ -976,6 +1050,7 @@ endtrapscope(void)
 	!isset(POSIXTRAPS) && (exittr = sigtrapped[SIGEXIT])) {
 	if (exittr & ZSIG_FUNC) {
 	    exitfn = removehashnode(shfunctab, "TRAPEXIT");
+	    cmdgen++;
 	} else {
 	    exitfn = siglists[SIGEXIT];
 	    siglists[SIGEXIT] = NULL;
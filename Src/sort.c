@@ -36,6 +36,9 @@ static int sortdir;
 /* Flag that sort is numeric */
 static int sortnumeric;
 
+/* Flag that strings have been replaced by keys from zcollkey() */
+static int sortkeys;
+
 /**/
 static int
 eltpcmp(const void *a, const void *b)
@@ -114,7 +117,7 @@ eltpcmp(const void *a, const void *b)
 	as += (laststarta - as);
     }
 #ifdef HAVE_STRCOLL
-    cmp = strcoll(as, bs);
+    cmp = sortkeys ? strcmp(as, bs) : strcoll(as, bs);
 #endif
     if (sortnumeric) {
 	for (; *as == *bs && *as; as++, bs++);
@@ -163,6 +166,7 @@ zstrcmp(const char *as, const char *bs, int sortflags)
 {
     struct sortelt ae, be, *aeptr, *beptr;
     int oldsortdir = sortdir, oldsortnumeric = sortnumeric, ret;
+    int oldsortkeys = sortkeys;
 
     ae.cmp = as;
     be.cmp = bs;
@@ -174,17 +178,72 @@ zstrcmp(const char *as, const char *bs, int sortflags)
 
     sortdir = 1;
     sortnumeric = (sortflags & SORTIT_NUMERICALLY) ? 1 : 0;
+    sortkeys = 0;
 
     ret = eltpcmp(&aeptr, &beptr);
 
     /* Paranoia: I don't think we ever need to restore these. */
     sortnumeric = oldsortnumeric;
     sortdir = oldsortdir;
+    sortkeys = oldsortkeys;
 
     return ret;
 }
 
 
+/*
+ * Test if strings collate in the order of their bytes, in which
+ * case strcmp() gives the same results as strcoll().
+ */
+
+/**/
+mod_export int
+collatebytes(void)
+{
+#ifdef HAVE_STRCOLL
+# if defined(HAVE_SETLOCALE) && defined(LC_COLLATE)
+    const char *loc = setlocale(LC_COLLATE, NULL);
+
+    return loc && (!strcmp(loc, "C") || !strcmp(loc, "POSIX"));
+# else
+    return 0;
+# endif
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Return a string which compares with strcmp() as s does with the
+ * collation used by zstrcmp() when not sorting numerically, so that
+ * the work of collating can be done once for each string instead of
+ * once for each comparison.  This is s itself if collation is by
+ * bytes, else a string on the heap.  Returns NULL if there's no way
+ * of getting such a string.
+ */
+
+/**/
+mod_export char *
+zcollkey(char *s)
+{
+    if (collatebytes())
+	return s;
+#if defined(HAVE_STRCOLL) && defined(HAVE_STRXFRM)
+    {
+	size_t len = 4 * strlen(s) + 1, n;
+	char *key = (char *)zhalloc(len);
+
+	if ((n = strxfrm(key, s, len)) >= len) {
+	    key = (char *)zhalloc(n + 1);
+	    strxfrm(key, s, n + 1);
+	}
+	return key;
+    }
+#else
+    return NULL;
+#endif
+}
+
 /*
  * Sort an array of metafied strings.  Use an "or" of bit flags
  * to decide how to sort.  See the SORTIT_* flags in zsh.h.
@@ -207,7 +266,7 @@ strmetasort(char **array, int sortwhat, int *unmetalenp)
      */
     SortElt *sortptrarr, *sortptrarrptr;
     SortElt sortarr, sortarrptr;
-    int oldsortdir, oldsortnumeric, nsort;
+    int oldsortdir, oldsortnumeric, oldsortkeys, nsort, haslen = 0;
 
     nsort = arrlen(array);
     if (nsort < 2)
@@ -358,20 +417,38 @@ strmetasort(char **array, int sortwhat, int *unmetalenp)
 	    sortarrptr->cmp = *arrptr;
 	    sortarrptr->len = needlen ? unmetalenp[arrptr-array] : -1;
 	}
+	if (sortarrptr->len != -1)
+	    haslen = 1;
     }
     /*
      * We probably don't need to restore the following, but it's pretty cheap.
      */
     oldsortdir = sortdir;
     oldsortnumeric = sortnumeric;
+    oldsortkeys = sortkeys;
 
     sortdir = (sortwhat & SORTIT_BACKWARDS) ? -1 : 1;
     sortnumeric = (sortwhat & SORTIT_NUMERICALLY) ? 1 : 0;
+    sortkeys = 0;
+
+    /*
+     * Collating is expensive in most locales, so unless the numeric
+     * comparison needs the strings themselves do it just once for
+     * each string.  Strings with embedded nulls are compared a piece
+     * at a time, which keys can't do.  zcollkey("") tests if there
+     * are keys to be had.
+     */
+    if (!sortnumeric && !haslen && zcollkey("")) {
+	for (sortarrptr = sortarr; sortarrptr < sortarr + nsort; sortarrptr++)
+	    sortarrptr->cmp = zcollkey((char *)sortarrptr->cmp);
+	sortkeys = 1;
+    }
 
     qsort(sortptrarr, nsort, sizeof(SortElt *), eltpcmp);
 
     sortnumeric = oldsortnumeric;
     sortdir = oldsortdir;
+    sortkeys = oldsortkeys;
     for (arrptr = array, sortptrarrptr = sortptrarr; nsort--; ) {
 	if (unmetalenp)
 	    unmetalenp[arrptr-array] = (*sortptrarrptr)->origlen;
@@ -91,6 +91,15 @@ prefork(LinkList list, int flags)
 	    if (unset(IGNOREBRACES) && !(flags & PREFORK_SINGLE)) {
 		if (!keep)
 		    stop = nextnode(node);
+		if (isbracerange(getdata(node))) {
+		    /* Skip the numbers produced, there's nothing to do. */
+		    LinkNode next = nextnode(node);
+
+		    keep = 1;
+		    xpandbraces(list, &node);
+		    node = next ? prevnode(next) : lastnode(list);
+		    continue;
+		}
 		while (hasbraces(getdata(node))) {
 		    keep = 1;
 		    xpandbraces(list, &node);
@@ -1513,6 +1522,11 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
      */
     int getlen = 0;
     int whichlen = 0;
+    /*
+     * Set if there were any flags in parentheses; only a plain
+     * ${#hash} can count the elements without fetching them.
+     */
+    int anyflags = 0;
     /*
      * Indicates ${+pm}: a simple boolean for once.
      */
@@ -1725,6 +1739,8 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 	    char *t, sav;
 	    int tt = 0;
 	    zlong num;
+
+	    anyflags = 1;
 	    /*
 	     * The (p) flag is only remembered within
 	     * this block.  It says we do print-style handling
@@ -2213,6 +2229,14 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 	    aspar = 0;
 	} else if (aspar)
 	    idbeg = val;
+	/*
+	 * The words of an array passed up are new heap strings, so
+	 * later stages can work on them directly: a chain of nested
+	 * expansions then copies each word once when it is passed up,
+	 * not again at every step.
+	 */
+	if (!aspar && isarr)
+	    copied = 1;
 	*s = sav;
 	/*
 	 * This tests for the second double quote in an expression
@@ -2396,6 +2420,22 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 	    if (v->isarr == SCANPM_WANTINDEX) {
 		isarr = v->isarr = 0;
 		val = dupstring(v->pm->node.nam);
+	    } else if (getlen == 1 && !anyflags && !spbreak && !v->arr &&
+		       PM_TYPE(v->pm->node.flags) == PM_HASHED &&
+		       !(v->isarr & (SCANPM_MATCHKEY|SCANPM_MATCHVAL|
+				     SCANPM_KEYMATCH)) &&
+		       (inbrace ? *s == Outbrace : *s != ':')) {
+		/*
+		 * Only the number of elements is wanted, so
+		 * don't make the values of a special hash only
+		 * to count them.  Empty strings stand in for them.
+		 */
+		int n = paramvalcount(v->pm->gsu.h->getfn(v->pm), v->isarr);
+
+		aval = (char **) zhalloc((n + 1) * sizeof(char *));
+		aval[n] = NULL;
+		while (n--)
+		    aval[n] = nulstring;
 	    } else
 		aval = getarrvalue(v);
 	} else {
@@ -2419,7 +2459,13 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 		    (v->start >= tmplen || v->start < 0))
 		    vunset = 1;
 	    }
-	    if (!vunset) {
+	    if (!vunset && chkset && inbrace && *s == Outbrace) {
+		/*
+		 * ${+...} only needs to know there is a value,
+		 * which may be expensive to get, as with $mapfile.
+		 */
+		val = dupstring("");
+	    } else if (!vunset) {
 		/*
 		 * There really is a value.  Padding and case
 		 * transformations used to be handled here, but
@@ -2747,7 +2793,8 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 		    if (arrasg > 1) {
 			Param pm = sethparam(idbeg, a);
 			if (pm)
-			    aval = paramvalarr(pm->gsu.h->getfn(pm), hkeys|hvals);
+			    aval = arrdup(paramvalarr(pm->gsu.h->getfn(pm),
+						      hkeys|hvals));
 		    } else
 			setaparam(idbeg, a);
 		} else {
@@ -3245,9 +3292,15 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 	if (isarr) {
 	    val = sepjoin(aval, sep, 1);
 	    isarr = 0;
+	    copied = 1;
 	}
 	if (!ssub && (spbreak || spsep)) {
-	    aval = sepsplit(val, spsep, 0, 1);
+	    /*
+	     * Split a private copy in place, so the words share its
+	     * memory rather than each being copied separately.
+	     */
+	    aval = sepsplit(copied ? val : dupstring(val), spsep, 0, 2);
+	    copied = 1;
 	    if (!aval || !aval[0])
 		val = dupstring("");
 	    else if (!aval[1])
@@ -3526,8 +3579,9 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 
 	/* Handle the (u) flag; we need this before the next test */
 	if (unique) {
+	    /* Only the array is changed, not the words in it. */
 	    if(!copied)
-		aval = arrdup(aval);
+		aval = arrdupptrs(aval);
 
 	    i = arrlen(aval);
 	    if (i > 1)
@@ -3564,7 +3618,7 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 	/* Handle (o) and (O) and their variants */
 	if (sortit != SORTIT_ANYOLDHOW) {
 	    if (!copied)
-		aval = arrdup(aval);
+		aval = arrdupptrs(aval);
 	    if (indord) {
 		if (sortit & SORTIT_BACKWARDS) {
 		    char *copy;
@@ -3679,7 +3733,7 @@ paramsubst(LinkList l, LinkNode n, char **str, int qt, int pf_flags)
 		if (qt && !*x && isarr != 2)
 		    y = dupstring(nulstring);
 		else {
-		    y = dupstring(x);
+		    y = copied ? x : dupstring(x);
 		    if (globsubst)
 			shtokenize(y);
 		}
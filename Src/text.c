@@ -165,14 +165,25 @@ taddnl(int no_semicolon)
     }
 }
 
-/* get a permanent textual representation of n */
+/*
+ * get a permanent textual representation of n
+ *
+ * The text of a whole function body is kept with the eprog, since
+ * things like the functions parameter may ask for it often; the
+ * eprog isn't changed once it's made, and redefining the function
+ * gives it a new one.
+ */
 
 /**/
 mod_export char *
 getpermtext(Eprog prog, Wordcode c, int start_indent)
 {
     struct estate s;
+    int cache = (!c && start_indent == 1 && !(prog->flags & EF_HEAP) &&
+		 prog != &dummy_eprog);
 
+    if (cache && prog->text)
+	return ztrdup(prog->text);
     if (!c)
 	c = prog->prog;
 
@@ -191,8 +202,10 @@ getpermtext(Eprog prog, Wordcode c, int start_indent)
     if (prog->len)
 	gettext2(&s);
     *tptr = '\0';
-    freeeprog(prog);		/* mark as unused */
     untokenize(tbuf);
+    if (cache)
+	prog->text = ztrdup(tbuf);
+    freeeprog(prog);		/* mark as unused */
     return tbuf;
 }
 
@@ -834,6 +847,20 @@ gettext2(Estate state)
 	    taddstr("))");
 	    stack = 1;
 	    break;
+	case WC_AUTOFN:
+	    if (wc_data(code)) {
+		/* Function body not yet parsed: show it as written */
+		char *t = dupstring(ecgetstr(state, EC_NODUP, NULL)), *e;
+
+		while (inblank(*t))
+		    t++;
+		for (e = t + strlen(t); e > t && inblank(e[-1]); e--)
+		    ;
+		*e = '\0';
+		taddstr(t);
+	    }
+	    stack = 1;
+	    break;
 	case WC_TRY:
 	    if (!s) {
 		taddstr("{");
@@ -40,6 +40,15 @@ mod_export char *scriptname;     /* is sometimes a function name */
 /**/
 mod_export char *scriptfilename;
 
+/*
+ * Counts of how often some of the more expensive things are done,
+ * shown by the $sysstats parameter of the zsh/system module.  These
+ * are only ever incremented, which costs little enough to do always.
+ */
+
+/**/
+mod_export struct runstats runstats;
+
 /* != 0 if we are in a new style completion function */
 
 /**/
@@ -869,6 +878,15 @@ get_username(void)
     return cached_username;
 }
 
+/*
+ * Incremented whenever finddir()'s cache is invalidated, i.e. whenever
+ * the named directories or $HOME change, for anything else that keeps
+ * results derived from finddir().
+ */
+
+/**/
+int finddirgen;
+
 /* static variables needed by finddir(). */
 
 static char *finddir_full;
@@ -918,6 +936,7 @@ finddir(char *s)
 	if(!finddir_full)
 	    finddir_full = zalloc(ffsz = PATH_MAX);
 	finddir_full[0] = 0;
+	finddirgen++;
 	return finddir_last = NULL;
     }
 
@@ -1123,7 +1142,9 @@ delprepromptfn(voidvoidfnptr_t func)
  * Functions to call at a particular time even if not at
  * the prompt.  This is handled by zle.  The data is a
  * Timedfn.  The functions must be in time order, but this
- * is enforced by addtimedfn().
+ * is enforced by addtimedfn().  Times are on the clock
+ * given by zgettime_monotonic(), so aren't upset if someone
+ * sets the system time.
  *
  * Note on debugging:  the code in sched.c currently assumes it's
  * the only user of timedfns for the purposes of checking whether
@@ -1138,11 +1159,11 @@ mod_export LinkList timedfns;
 
 /**/
 mod_export void
-addtimedfn(voidvoidfnptr_t func, time_t when)
+addtimedfn(voidvoidfnptr_t func, struct timespec *when)
 {
     Timedfn tfdat = (Timedfn)zalloc(sizeof(struct timedfn));
     tfdat->func = func;
-    tfdat->when = when;
+    tfdat->when = *when;
 
     if (!timedfns) {
 	timedfns = znewlinklist();
@@ -1173,7 +1194,7 @@ addtimedfn(voidvoidfnptr_t func, time_t when)
 		return;
 	    }
 	    tfdat2 = (Timedfn)getdata(next);
-	    if (when < tfdat2->when) {
+	    if (ztimespeccmp(when, &tfdat2->when) < 0) {
 		zinsertlinknode(timedfns, ln, tfdat);
 		return;
 	    }
@@ -2285,6 +2306,41 @@ read_poll(int fd, int *readchar, int polltty, zlong microseconds)
     return (ret > 0);
 }
 
+/*
+ * Sleep for the given number of microseconds, carrying on after
+ * signals.  Only meant for short internal delays.  Returns 1 if
+ * the sleep worked, else 0.
+ */
+
+/**/
+int
+zsleep(long us)
+{
+#ifdef HAVE_NANOSLEEP
+    struct timespec sleeptime, rem;
+
+    sleeptime.tv_sec = (time_t)(us / 1000000L);
+    sleeptime.tv_nsec = (us % 1000000L) * 1000L;
+    while (nanosleep(&sleeptime, &rem) < 0) {
+	if (errno != EINTR)
+	    return 0;
+	sleeptime = rem;
+    }
+    return 1;
+#else
+# ifdef HAVE_SELECT
+    struct timeval tv;
+
+    tv.tv_sec = (int)(us / 1000000L);
+    tv.tv_usec = us % 1000000L;
+    return select(0, NULL, NULL, NULL, &tv) >= 0;
+# else
+    sleep((unsigned)((us + 999999L) / 1000000L));
+    return 1;
+# endif
+#endif
+}
+
 /**/
 int
 checkrmall(char *s)
@@ -2971,19 +3027,24 @@ skipwsep(char **s)
  *   allownull's value is associated with whether we are using
  *   metafied strings.
  * see findsep() below for handling of `quote' argument
+ *
+ * heap is 0 for permanent allocation of the words and the array, 1 for
+ * heap allocation, and 2 if s is a modifiable heap string that may be
+ * split in place:  the words are then terminated where they lie in s
+ * and only the array is allocated.
  */
 
 /**/
 mod_export char **
 spacesplit(char *s, int allownull, int heap, int quote)
 {
-    char *t, **ret, **ptr;
+    char *t, **ret, **ptr, *wend = NULL;
     int l = sizeof(*ret) * (wordcount(s, NULL, -!allownull) + 1);
     char *(*dup)(const char *) = (heap ? dupstring : ztrdup);
 
     ptr = ret = (heap ? (char **) hcalloc(l) : (char **) zshcalloc(l));
 
-    if (quote) {
+    if (quote && heap != 2) {
 	/*
 	 * we will be stripping quoted separators by hacking string,
 	 * so make sure it's hackable.
@@ -3008,9 +3069,18 @@ spacesplit(char *s, int allownull, int heap, int quote)
 	    s++;
 	    skipwsep(&s);
 	}
+	/* Only terminate the last word once we're past its separator. */
+	if (wend) {
+	    *wend = '\0';
+	    wend = NULL;
+	}
 	t = s;
 	(void)findsep(&s, NULL, quote);
-	if (s > t || allownull) {
+	if (heap == 2 && s > t) {
+	    *ptr++ = t;
+	    if (*s)
+		wend = s;
+	} else if (s > t || allownull) {
 	    *ptr = (heap ? (char *) hcalloc((s - t) + 1) :
 		    (char *) zshcalloc((s - t) + 1));
 	    ztrncpy(*ptr++, t, s - t);
@@ -3019,6 +3089,8 @@ spacesplit(char *s, int allownull, int heap, int quote)
 	t = s;
 	skipwsep(&s);
     }
+    if (wend)
+	*wend = '\0';
     if (!allownull && t != s)
 	*ptr++ = dup("");
     *ptr = NULL;
@@ -3213,6 +3285,11 @@ sepjoin(char **s, char *sep, int heap)
     return r;
 }
 
+/*
+ * Split s at each occurrence of sep, or as for spacesplit() if sep
+ * is NULL.  heap is as for spacesplit().
+ */
+
 /**/
 char **
 sepsplit(char *s, char *sep, int allownull, int heap)
@@ -3232,13 +3309,22 @@ sepsplit(char *s, char *sep, int allownull, int heap)
     r = p = (heap ? (char **) hcalloc((n + 1) * sizeof(char *)) :
 	     (char **) zshcalloc((n + 1) * sizeof(char *)));
 
+    /* Splitting between characters leaves nowhere to put a NULL. */
+    if (heap == 2 && !sl)
+	heap = 1;
     for (t = s; n--;) {
 	tt = t;
 	(void)findsep(&t, sep, 0);
-	*p = (heap ? (char *) hcalloc(t - tt + 1) :
-	      (char *) zshcalloc(t - tt + 1));
-	strncpy(*p, tt, t - tt);
-	(*p)[t - tt] = '\0';
+	if (heap == 2) {
+	    *p = tt;
+	    if (*t)
+		*t = '\0';
+	} else {
+	    *p = (heap ? (char *) hcalloc(t - tt + 1) :
+		  (char *) zshcalloc(t - tt + 1));
+	    strncpy(*p, tt, t - tt);
+	    (*p)[t - tt] = '\0';
+	}
 	p++;
 	t += sl;
     }
@@ -3678,6 +3764,17 @@ arrdup(char **s)
     return y;
 }
 
+/* Copy an array on the heap, sharing the elements with the original */
+
+/**/
+mod_export char **
+arrdupptrs(char **s)
+{
+    int l = sizeof(char *) * (arrlen(s) + 1);
+
+    return (char **) memcpy(zhalloc(l), s, l);
+}
+
 /**/
 mod_export char **
 zarrdup(char **s)
@@ -4270,6 +4367,196 @@ ztrsub(char const *t, char const *s)
 /**/
 mod_export char *
 zreaddir(DIR *dir, int ignoredots)
+{
+    return zreaddirtype(dir, ignoredots, NULL);
+}
+
+/*
+ * Directory listings are kept for the rest of a command line or a
+ * completion attempt, so that the several globs completion functions
+ * run over one directory only read it once.  A listing is reused only
+ * if the directory's modification time is unchanged, and was old
+ * enough when the directory was read that a change made in the same
+ * clock tick can't have been missed.
+ */
+
+struct dircache {
+    Dircache next;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mnsec;
+    int refs;			/* readers, plus one while cached    */
+    int count;			/* number of names                   */
+    int size;			/* total length of names             */
+    int namesz, modesz;		/* space allocated for the arrays    */
+    char *names;		/* metafied, each NUL-terminated     */
+    int *modes;			/* file types as from zreaddirtype() */
+};
+
+#define DIRCACHE_MAXDIRS 64
+#define DIRCACHE_MAXSIZE (1 << 20)
+
+static Dircache dircache;
+static int dircachect, dircachesize;
+
+/**/
+static void
+unrefdircache(Dircache dc)
+{
+    if (!--dc->refs) {
+	zfree(dc->names, dc->namesz);
+	zfree(dc->modes, dc->modesz * sizeof(int));
+	zfree(dc, sizeof(*dc));
+    }
+}
+
+/* Forget all cached directory listings. */
+
+/**/
+mod_export void
+freedircache(void)
+{
+    Dircache dc, next;
+
+    for (dc = dircache; dc; dc = next) {
+	next = dc->next;
+	unrefdircache(dc);
+    }
+    dircache = NULL;
+    dircachect = dircachesize = 0;
+}
+
+/*
+ * Start reading the directory with the unmetafied name path, ignoring
+ * `.' and `..'.  Returns non-zero if it can't be read.  The names
+ * returned by readdirlist() stay valid until closedirlist().
+ */
+
+/**/
+mod_export int
+opendirlist(char *path, Dirlist dl)
+{
+    struct stat st;
+    int statted = !stat(path, &st), mode;
+    Dircache dc, *dp;
+    DIR *dir;
+    char *fn;
+
+    if (statted) {
+	for (dp = &dircache; (dc = *dp); dp = &dc->next) {
+	    if (dc->dev != st.st_dev || dc->ino != st.st_ino)
+		continue;
+	    *dp = dc->next;
+	    if (dc->mtime == st.st_mtime
+#ifdef GET_ST_MTIME_NSEC
+		&& dc->mnsec == GET_ST_MTIME_NSEC(st)
+#endif
+		) {
+		/* Still good: move it to the front. */
+		dc->next = dircache;
+		dircache = dc;
+		dc->refs++;
+		dl->dc = dc;
+		dl->pos = dc->names;
+		dl->ent = 0;
+		return 0;
+	    }
+	    dircachect--;
+	    dircachesize -= dc->namesz;
+	    unrefdircache(dc);
+	    break;
+	}
+    }
+    if (!(dir = opendir(path)))
+	return -1;
+    dc = (Dircache) zshcalloc(sizeof(*dc));
+    dc->refs = 1;
+    while ((fn = zreaddirtype(dir, 1, &mode))) {
+	int len = strlen(fn) + 1;
+
+	if (dc->size + len > dc->namesz)
+	    dc->names = zrealloc(dc->names,
+				 dc->namesz = 2 * dc->namesz + len + 256);
+	memcpy(dc->names + dc->size, fn, len);
+	dc->size += len;
+	if (dc->count == dc->modesz)
+	    dc->modes = (int *)zrealloc(dc->modes,
+					(dc->modesz = 2 * dc->modesz + 16) *
+					sizeof(int));
+	dc->modes[dc->count++] = mode;
+    }
+    closedir(dir);
+    dl->dc = dc;
+    dl->pos = dc->names;
+    dl->ent = 0;
+
+    /*
+     * The stat() was before the directory was read, so anything
+     * changed since will show up as a new modification time.
+     */
+    if (statted && st.st_mtime < time(NULL) - 1 &&
+	dc->namesz <= DIRCACHE_MAXSIZE / 4) {
+	dc->dev = st.st_dev;
+	dc->ino = st.st_ino;
+	dc->mtime = st.st_mtime;
+#ifdef GET_ST_MTIME_NSEC
+	dc->mnsec = GET_ST_MTIME_NSEC(st);
+#endif
+	dc->refs++;
+	dc->next = dircache;
+	dircache = dc;
+	dircachect++;
+	dircachesize += dc->namesz;
+	while (dircachect > DIRCACHE_MAXDIRS ||
+	       dircachesize > DIRCACHE_MAXSIZE) {
+	    Dircache last;
+
+	    for (dp = &dircache; (*dp)->next; dp = &(*dp)->next)
+		;
+	    last = *dp;
+	    *dp = NULL;
+	    dircachect--;
+	    dircachesize -= last->namesz;
+	    unrefdircache(last);
+	}
+    }
+    return 0;
+}
+
+/* Return the next name from a directory, or NULL at the end. */
+
+/**/
+mod_export char *
+readdirlist(Dirlist dl, int *modep)
+{
+    char *name = dl->pos;
+
+    if (dl->ent == dl->dc->count)
+	return NULL;
+    if (modep)
+	*modep = dl->dc->modes[dl->ent];
+    dl->ent++;
+    dl->pos += strlen(name) + 1;
+    return name;
+}
+
+/**/
+mod_export void
+closedirlist(Dirlist dl)
+{
+    unrefdircache(dl->dc);
+}
+
+/*
+ * As zreaddir(), but if modep is not NULL set *modep to the file type
+ * bits (S_IFDIR etc.) if the directory entry says what type of file it
+ * is, else 0.  This saves a stat() when the type is all that's needed.
+ */
+
+/**/
+mod_export char *
+zreaddirtype(DIR *dir, int ignoredots, int *modep)
 {
     struct dirent *de;
 #if defined(HAVE_ICONV) && defined(__APPLE__)
@@ -4286,6 +4573,45 @@ zreaddir(DIR *dir, int ignoredots)
     } while(ignoredots && de->d_name[0] == '.' &&
 	(!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])));
 
+    if (modep) {
+	*modep = 0;
+#if defined(HAVE_STRUCT_DIRENT_D_TYPE) && defined(DT_UNKNOWN)
+	switch (de->d_type) {
+	case DT_REG:
+	    *modep = S_IFREG;
+	    break;
+	case DT_DIR:
+	    *modep = S_IFDIR;
+	    break;
+# if defined(DT_LNK) && defined(S_IFLNK)
+	case DT_LNK:
+	    *modep = S_IFLNK;
+	    break;
+# endif
+# if defined(DT_FIFO) && defined(S_IFIFO)
+	case DT_FIFO:
+	    *modep = S_IFIFO;
+	    break;
+# endif
+# if defined(DT_SOCK) && defined(S_IFSOCK)
+	case DT_SOCK:
+	    *modep = S_IFSOCK;
+	    break;
+# endif
+# if defined(DT_CHR) && defined(S_IFCHR)
+	case DT_CHR:
+	    *modep = S_IFCHR;
+	    break;
+# endif
+# if defined(DT_BLK) && defined(S_IFBLK)
+	case DT_BLK:
+	    *modep = S_IFBLK;
+	    break;
+# endif
+	}
+#endif
+    }
+
 #if defined(HAVE_ICONV) && defined(__APPLE__)
     if (!conv_ds)
 	conv_ds = iconv_open("UTF-8", "UTF-8-MAC");
@@ -4449,6 +4775,16 @@ mb_niceformat(const char *s, FILE *stream, char **outstrp, int heap)
     char *ums, *ptr, *fmt, *outstr, *outptr;
     mbstate_t mbs;
 
+    if (!stream && !outstrp) {
+	/* Only the width is wanted:  printable ASCII needs no formatting */
+	const char *sptr = s;
+
+	while (WC_ISASCIIPRINT(*sptr))
+	    sptr++;
+	if (!*sptr)
+	    return sptr - s;
+    }
+
     if (outstrp) {
 	outleft = outalloc = 5 * strlen(s);
 	outptr = outstr = zalloc(outalloc);
@@ -4558,6 +4894,13 @@ mb_metacharlenconv_r(const char *s, wint_t *wcp, mbstate_t *mbsp)
     const char *ptr;
     wchar_t wc;
 
+    /* ASCII converts to itself outside a shift sequence */
+    if ((unsigned char)*s < 0x80 && *s && mbsinit(mbsp)) {
+	if (wcp)
+	    *wcp = (wint_t)*s;
+	return 1;
+    }
+
     for (ptr = s; *ptr; ) {
 	if (*ptr == Meta) {
 	    inchar = *++ptr ^ 32;
@@ -4649,9 +4992,17 @@ mb_metastrlen(char *ptr, int width)
     if (!isset(MULTIBYTE))
 	return ztrlen(ptr);
 
+    /*
+     * Printable ASCII characters are each one character and one
+     * column whatever width asks for, so count a leading run of
+     * them directly.
+     */
+    for (num = 0; WC_ISASCIIPRINT(*ptr); ptr++)
+	num++;
+
     laststart = ptr;
     ret = MB_INVALID;
-    num = num_in_char = 0;
+    num_in_char = 0;
 
     memset(&mb_shiftstate, 0, sizeof(mb_shiftstate));
     while (*ptr) {
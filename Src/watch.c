@@ -141,9 +141,35 @@ char const * const default_watchfmt = DEFAULT_WATCHFMT;
 #  define WATCH_WTMP_FILE "/dev/null"
 # endif
 
+# if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+#  include <sys/inotify.h>
+#  define WATCH_INOTIFY 1
+# endif
+
+/*
+ * The records in the utmp file when we last looked, in the order
+ * they are in the file, including ones that aren't logins.
+ * Logins and logouts are found by comparing this with the file
+ * record by record, since a record is changed in place.
+ */
 static int wtabsz;
 static WATCH_STRUCT_UTMP *wtab;
+
+/* the state of the file when we last read it */
 static time_t lastutmpcheck;
+static long lastutmpnsec;
+static off_t lastutmpsize;
+
+# ifdef WATCH_INOTIFY
+/*
+ * Where the system can tell us when the file changes, we don't need
+ * to look at it otherwise.  utmpifd is -1 if we haven't tried, or
+ * -2 if it didn't work.  The watch is set up again in a subshell,
+ * which mustn't take the events meant for the parent.
+ */
+static int utmpifd = -1, utmpwd = -1;
+static pid_t utmpipid;
+# endif
 
 /* get the time of login/logout for WATCH */
 
@@ -446,37 +472,183 @@ ucmp(WATCH_STRUCT_UTMP *u, WATCH_STRUCT_UTMP *v)
     return u->ut_time - v->ut_time;
 }
 
-/* initialize the user List */
+/* whether a utmp entry is a login */
 
 /**/
-static void
-readwtab(void)
+static int
+ulogin(WATCH_STRUCT_UTMP *u)
 {
-    WATCH_STRUCT_UTMP *uptr;
-    int wtabmax = 32;
-    FILE *in;
-
-    wtabsz = 0;
-    if (!(in = fopen(WATCH_UTMP_FILE, "r")))
-	return;
-    uptr = wtab = (WATCH_STRUCT_UTMP *)zalloc(wtabmax * sizeof(WATCH_STRUCT_UTMP));
-    while (fread(uptr, sizeof(WATCH_STRUCT_UTMP), 1, in))
 # ifdef USER_PROCESS
-	if   (uptr->ut_type == USER_PROCESS)
+    return u->ut_type == USER_PROCESS;
 # else /* !USER_PROCESS */
-	if   (uptr->ut_name[0])
+    return u->ut_name[0];
 # endif /* !USER_PROCESS */
-	{
-	    uptr++;
-	    if (++wtabsz == wtabmax)
-		uptr = (wtab = (WATCH_STRUCT_UTMP *)realloc((void *) wtab, (wtabmax *= 2) *
-						      sizeof(WATCH_STRUCT_UTMP))) + wtabsz;
-	}
+}
+
+/*
+ * Read all the records of the utmp file into a new array, setting
+ * *szp to the number of them.  Returns NULL if the file can't be read.
+ */
+
+/**/
+static WATCH_STRUCT_UTMP *
+readutmp(int *szp)
+{
+    WATCH_STRUCT_UTMP *utab;
+    int max = 32, sz = 0;
+    FILE *in;
+
+    if (!(in = fopen(WATCH_UTMP_FILE, "r")))
+	return NULL;
+    utab = (WATCH_STRUCT_UTMP *)zalloc(max * sizeof(WATCH_STRUCT_UTMP));
+    while ((sz += fread(utab + sz, sizeof(WATCH_STRUCT_UTMP), max - sz, in))
+	   == max)
+	utab = (WATCH_STRUCT_UTMP *)realloc((void *) utab, (max *= 2) *
+					   sizeof(WATCH_STRUCT_UTMP));
     fclose(in);
+    *szp = sz;
+    return utab;
+}
+
+/*
+ * See if the utmp file might have changed since we last read it.
+ * If the system notifies us of changes, this costs nothing more
+ * than a read that returns straight away; otherwise we compare the
+ * size and modification time.
+ */
+
+/**/
+static int
+utmpchanged(void)
+{
+    struct stat st;
+    long nsec = 0;
+
+# ifdef WATCH_INOTIFY
+    if (utmpifd >= 0 && utmpipid != getpid()) {
+	zclose(utmpifd);
+	utmpifd = -1;
+    }
+    if (utmpifd == -1) {
+	utmpipid = getpid();
+	if ((utmpifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0 ||
+	    (utmpifd = movefd(utmpifd)) < 0)
+	    utmpifd = -2;
+	else
+	    utmpwd = -1;
+    }
+    if (utmpifd >= 0) {
+	char buf[sizeof(struct inotify_event) + PATH_MAX + 1];
+	struct inotify_event *ev;
+	int changed = 0, n;
+
+	if (utmpwd < 0) {
+	    /* watching from now on, so look at the file as it stands */
+	    utmpwd = inotify_add_watch(utmpifd, WATCH_UTMP_FILE,
+				       IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|
+				       IN_DELETE_SELF|IN_MOVE_SELF);
+	    return 1;
+	}
+	while ((n = read(utmpifd, buf, sizeof(buf))) > 0) {
+	    char *ptr;
+
+	    changed = 1;
+	    for (ptr = buf; ptr < buf + n;
+		 ptr += sizeof(struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *)ptr;
+		if (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED)) {
+		    /* the file was replaced; watch the new one */
+		    if (utmpwd >= 0)
+			inotify_rm_watch(utmpifd, utmpwd);
+		    utmpwd = -1;
+		}
+	    }
+	}
+	return changed;
+    }
+# endif /* WATCH_INOTIFY */
+
+    if (stat(WATCH_UTMP_FILE, &st) == -1)
+	return 0;
+# ifdef GET_ST_MTIME_NSEC
+    nsec = GET_ST_MTIME_NSEC(st);
+# endif
+    if (st.st_mtime == lastutmpcheck && nsec == lastutmpnsec &&
+	st.st_size == lastutmpsize)
+	return 0;
+    lastutmpcheck = st.st_mtime;
+    lastutmpnsec = nsec;
+    lastutmpsize = st.st_size;
+    return 1;
+}
+
+/* initialize the user List */
+
+/**/
+static void
+readwtab(void)
+{
+    (void)utmpchanged();
+    if (!(wtab = readutmp(&wtabsz)))
+	wtabsz = 0;
+}
+
+/* qsort() comparison for login and logout events to report */
+
+/**/
+static int
+wcmp(const void *p1, const void *p2)
+{
+    return ucmp(*(WATCH_STRUCT_UTMP **)p1, *(WATCH_STRUCT_UTMP **)p2);
+}
+
+/*
+ * Report the differences between the records utab just read from the
+ * utmp file and the ones from last time, then keep utab for next time.
+ */
+
+/**/
+static void
+watchreport(WATCH_STRUCT_UTMP *utab, int utabsz)
+{
+    WATCH_STRUCT_UTMP **evs, *uptr, *wptr;
+    char **s = watch;
+    char *fmt;
+    int nevs = 0, i;
+
+    /*
+     * Compare the file record by record with the last time:  a login
+     * that has gone from a record is a logout, and one that has
+     * appeared is a login.  The events are reported in time order.
+     */
+    evs = (WATCH_STRUCT_UTMP **)zhalloc(2 * (utabsz > wtabsz ? utabsz : wtabsz)
+					* sizeof(WATCH_STRUCT_UTMP *));
+    for (i = 0; i < utabsz || i < wtabsz; i++) {
+	uptr = (i < utabsz && ulogin(utab + i)) ? utab + i : NULL;
+	wptr = (i < wtabsz && ulogin(wtab + i)) ? wtab + i : NULL;
+	if (uptr && wptr && !ucmp(uptr, wptr) &&
+	    !strncmp(uptr->ut_name, wptr->ut_name, sizeof(uptr->ut_name)))
+	    continue;
+	if (wptr)
+	    evs[nevs++] = wptr;
+	if (uptr)
+	    evs[nevs++] = uptr;
+    }
+    if (nevs > 1)
+	qsort((void *) evs, nevs, sizeof(WATCH_STRUCT_UTMP *), wcmp);
 
-    if (wtabsz)
-	qsort((void *) wtab, wtabsz, sizeof(WATCH_STRUCT_UTMP),
-	           (int (*) _((const void *, const void *)))ucmp);
+    queue_signals();
+    if (!(fmt = getsparam("WATCHFMT")))
+	fmt = DEFAULT_WATCHFMT;
+    for (i = 0; i < nevs && !errflag; i++) {
+	int inout = (evs[i] >= utab && evs[i] < utab + utabsz);
+	watchlog(inout, evs[i], s, fmt);
+    }
+    unqueue_signals();
+    free(wtab);
+    wtab = utab;
+    wtabsz = utabsz;
+    fflush(stdout);
 }
 
 /* Check for login/logout events; executed before *
@@ -486,15 +658,8 @@ readwtab(void)
 void
 dowatch(void)
 {
-    FILE *in;
-    WATCH_STRUCT_UTMP *utab, *uptr, *wptr;
-    struct stat st;
-    char **s;
-    char *fmt;
-    int utabsz = 0, utabmax = wtabsz + 4;
-    int uct, wct;
-
-    s = watch;
+    WATCH_STRUCT_UTMP *utab;
+    int utabsz;
 
     holdintr();
     if (!wtab) {
@@ -502,77 +667,35 @@ dowatch(void)
 	noholdintr();
 	return;
     }
-    if ((stat(WATCH_UTMP_FILE, &st) == -1) || (st.st_mtime <= lastutmpcheck)) {
-	noholdintr();
-	return;
-    }
-    lastutmpcheck = st.st_mtime;
-    uptr = utab = (WATCH_STRUCT_UTMP *) zalloc(utabmax * sizeof(WATCH_STRUCT_UTMP));
-
-    if (!(in = fopen(WATCH_UTMP_FILE, "r"))) {
-	free(utab);
+    if (!utmpchanged() || !(utab = readutmp(&utabsz))) {
 	noholdintr();
 	return;
     }
-    while (fread(uptr, sizeof *uptr, 1, in))
-# ifdef USER_PROCESS
-	if (uptr->ut_type == USER_PROCESS)
-# else /* !USER_PROCESS */
-	if (uptr->ut_name[0])
-# endif /* !USER_PROCESS */
-	{
-	    uptr++;
-	    if (++utabsz == utabmax)
-		uptr = (utab = (WATCH_STRUCT_UTMP *)realloc((void *) utab, (utabmax *= 2) *
-						      sizeof(WATCH_STRUCT_UTMP))) + utabsz;
-	}
-    fclose(in);
     noholdintr();
     if (errflag) {
 	free(utab);
 	return;
     }
-    if (utabsz)
-	qsort((void *) utab, utabsz, sizeof(WATCH_STRUCT_UTMP),
-	           (int (*) _((const void *, const void *)))ucmp);
-
-    wct = wtabsz;
-    uct = utabsz;
-    uptr = utab;
-    wptr = wtab;
-    if (errflag) {
-	free(utab);
-	return;
-    }
-    queue_signals();
-    if (!(fmt = getsparam("WATCHFMT")))
-	fmt = DEFAULT_WATCHFMT;
-    while ((uct || wct) && !errflag)
-	if (!uct || (wct && ucmp(uptr, wptr) > 0))
-	    wct--, watchlog(0, wptr++, s, fmt);
-	else if (!wct || (uct && ucmp(uptr, wptr) < 0))
-	    uct--, watchlog(1, uptr++, s, fmt);
-	else
-	    uptr++, wptr++, wct--, uct--;
-    unqueue_signals();
-    free(wtab);
-    wtab = utab;
-    wtabsz = utabsz;
-    fflush(stdout);
+    watchreport(utab, utabsz);
 }
 
 /**/
 int
 bin_log(UNUSED(char *nam), UNUSED(char **argv), UNUSED(Options ops), UNUSED(int func))
 {
+    WATCH_STRUCT_UTMP *utab;
+    int utabsz;
+
     if (!watch)
 	return 1;
+    /* report everyone as logging in from nothing */
+    if (!(utab = readutmp(&utabsz)))
+	return 0;
     if (wtab)
 	free(wtab);
     wtab = (WATCH_STRUCT_UTMP *)zalloc(1);
     wtabsz = 0;
-    lastutmpcheck = 0;
-    dowatch();
+    watchreport(utab, utabsz);
     return 0;
 }
 
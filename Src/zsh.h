@@ -394,6 +394,11 @@ enum {
  * so the shell can still exec the last process.
  */
 #define FDT_FLOCK_EXEC		5
+/*
+ * Entry used by the shell for collecting SIGCHLD while waiting
+ * for child processes, see signal_suspend().
+ */
+#define FDT_SIGNALFD		7
 #ifdef PATH_DEV_FD
 /*
  * Entry used by a process substition.
@@ -411,6 +416,13 @@ enum {
 #define INP_ALCONT    (1<<4)	/* stack is continued from alias expn.     */
 #define INP_LINENO    (1<<5)    /* update line number                      */
 
+/* Whole-file input for a sourced script, see shinfileopen() */
+struct shinfile {
+    char *buf;			/* metafied contents, NUL after each line  */
+    char *ptr;			/* next line to be read                    */
+    char *end;			/* final NUL of buf                        */
+};
+
 /* Flags for metafy */
 #define META_REALLOC	0
 #define META_USEHEAP	1
@@ -432,6 +444,8 @@ typedef struct builtin   *Builtin;
 typedef struct cmdnam    *Cmdnam;
 typedef struct complist  *Complist;
 typedef struct conddef   *Conddef;
+typedef struct dircache  *Dircache;
+typedef struct dirlist   *Dirlist;
 typedef struct dirsav    *Dirsav;
 typedef struct emulation_options *Emulation_options;
 typedef struct features  *Features;
@@ -456,6 +470,7 @@ typedef struct optname   *Optname;
 typedef struct param     *Param;
 typedef struct paramdef  *Paramdef;
 typedef struct patprog   *Patprog;
+typedef struct patstralloc *Patstralloc;
 typedef struct prepromptfn *Prepromptfn;
 typedef struct process   *Process;
 typedef struct redir     *Redir;
@@ -549,7 +564,7 @@ struct prepromptfn {
  */
 struct timedfn {
     voidvoidfnptr_t func;
-    time_t when;
+    struct timespec when;	/* from zgettime_monotonic() */
 };
 
 /********************************/
@@ -724,6 +739,7 @@ struct eprog {
     char *strs;			/* memory block ctd, the strings */
     Shfunc shf;			/* shell function for autoload */
     FuncDump dump;		/* dump file this is in */
+    char *text;			/* cached function text, see getpermtext() */
 };
 
 #define EF_REAL 1
@@ -742,10 +758,12 @@ struct estate {
 typedef struct eccstr *Eccstr;
 
 struct eccstr {
-    Eccstr left, right;
+    Eccstr next;		/* all strings, most recently added first */
+    Eccstr hnext;		/* next in hash chain */
     char *str;
     wordcode offs, aoffs;
     int nfunc;
+    unsigned hval;
 };
 
 #define EC_NODUP  0
@@ -896,6 +914,8 @@ struct eccstr {
 #define WCB_ARITH()         wc_bld(WC_ARITH, 0)
 
 #define WCB_AUTOFN()        wc_bld(WC_AUTOFN, 0)
+#define WC_LAZYFN_LINENO(C) (wc_data(C) - 1)
+#define WCB_LAZYFN(L)       wc_bld(WC_AUTOFN, (L) + 1)
 
 /********************************************/
 /* Definitions for job table and job control */
@@ -1017,6 +1037,14 @@ struct dirsav {
     ino_t ino;
 };
 
+/* A directory being read with opendirlist() */
+
+struct dirlist {
+    Dircache dc;		/* the listing                       */
+    char *pos;			/* next name to return               */
+    int ent;			/* index of next name                */
+};
+
 #define MAX_PIPESTATS 256
 
 /*******************************/
@@ -1173,6 +1201,14 @@ struct funcstack {
     int tp;     		/* type of entry: sourced file, func, eval */
 };
 
+/* start of a step traced while the shell is starting, see init.c */
+
+struct inittrace {
+    struct timespec wall;	/* when it started */
+    clock_t cpu;		/* processor time used by then */
+    int active;			/* whether it is being traced */
+};
+
 /* node in list of function call wrappers */
 
 typedef int (*WrapFunc) _((Eprog, FuncWrap, char *));
@@ -1398,6 +1434,18 @@ struct patprog {
     char		patstartch;
 };
 
+/*
+ * An unmetafied copy of a string which is to be tested at many
+ * offsets, so that pattrylenalloc() needn't make one every time.
+ */
+
+struct patstralloc {
+    char		*string;   /* the metafied string */
+    char		*alloced;  /* unmetafied copy, if one is needed */
+    char		*mpos;	   /* last position looked up in string */
+    int			upos;	   /* corresponding offset in copy */
+};
+
 /* Flags used in pattern matchers (Patprog) and passed down to patcompile */
 
 #define PAT_FILE	0x0001	/* Pattern is a file name */
@@ -1413,6 +1461,7 @@ struct patprog {
 #define PAT_NOTEND	0x0400	/* End of string is not real end */
 #define PAT_HAS_EXCLUDP	0x0800	/* (internal): top-level path1~path2. */
 #define PAT_LCMATCHUC   0x1000  /* equivalent to setting (#l) */
+#define PAT_LINEAR	0x2000	/* (internal): no need to backtrack */
 
 /**
  * Indexes into the array of active pattern characters.
@@ -1913,6 +1962,7 @@ struct histent {
 				/*   line:  as pairs of start, end  */
     int nwords;			/* Number of words in history line  */
     zlong histnum;		/* A sequential history number      */
+    zulong sig;			/* Character pairs: see histentsig  */
 };
 
 #define HIST_MAKEUNIQUE	0x00000001	/* Kill this new entry if not unique */
@@ -1922,6 +1972,8 @@ struct histent {
 #define HIST_FOREIGN	0x00000010	/* Command came from another shell */
 #define HIST_TMPSTORE	0x00000020	/* Kill when user enters another cmd */
 #define HIST_NOWRITE	0x00000040	/* Keep internally but don't write */
+#define HIST_NOWORDS	0x00000080	/* Words not yet split: see histentwords */
+#define HIST_HASSIG	0x00000100	/* sig is valid for the entry */
 
 #define GETHIST_UPWARD  (-1)
 #define GETHIST_DOWNWARD  1
@@ -2071,6 +2123,7 @@ enum {
     CSHJUNKIEQUOTES,
     CSHNULLCMD,
     CSHNULLGLOB,
+    CURRENTSHELLSUBST,
     DEBUGBEFORECMD,
     EMACSMODE,
     EQUALS,
@@ -2124,6 +2177,7 @@ enum {
     KSHOPTIONPRINT,
     KSHTYPESET,
     KSHZEROSUBSCRIPT,
+    LAZYFUNCTIONS,
     LISTAMBIGUOUS,
     LISTBEEP,
     LISTPACKED,
@@ -2559,6 +2613,31 @@ struct heap {
 #endif
 ;
 
+/* Statistics about heap arenas, see mem.c */
+
+struct heapstats {
+    zlong arenas;		/* arenas currently in use                   */
+    zlong bytes;		/* bytes in those arenas                     */
+    zlong peak_bytes;		/* highest value of bytes                    */
+    zlong created;		/* arenas obtained from the system           */
+    zlong reused;		/* arenas taken from the retained ones       */
+    zlong retained;		/* arenas currently kept for reuse           */
+    zlong retained_bytes;	/* bytes in those arenas                     */
+};
+
+/* Counts of how often some expensive things are done, see utils.c */
+
+struct runstats {
+    zlong forks;		/* processes forked by zfork()               */
+    zlong pattern_compiles;	/* calls to patcompile()                     */
+    zlong heap_pushes;		/* calls to pushheap()                       */
+    zlong heap_pops;		/* calls to popheap()                        */
+    zlong hash_lookups;		/* lookups with gethashnode[2]()             */
+    zlong hash_expansions;	/* times a hash table was made bigger        */
+    zlong output_bytes;		/* bytes read from command substitutions     */
+    zlong refreshes;		/* calls to zrefresh()                       */
+};
+
 # define NEWHEAPS(h)    do { Heap _switch_oldheaps = h = new_heaps(); do
 # define OLDHEAPS       while (0); old_heaps(_switch_oldheaps); } while (0);
 
@@ -2817,10 +2896,18 @@ typedef wint_t convchar_t;
  * works on MacOS which doesn't define that.
  */
 #if defined(BROKEN_WCWIDTH) && (defined(__STDC_ISO_10646__) || defined(__APPLE__))
-#define WCWIDTH(wc)	mk_wcwidth(wc)
+#define LIB_WCWIDTH(wc)	mk_wcwidth(wc)
 #else
-#define WCWIDTH(wc)	wcwidth(wc)
+#define LIB_WCWIDTH(wc)	wcwidth(wc)
 #endif
+/*
+ * Printable ASCII looks the same and takes a single column in any
+ * character set we can handle, and is by far the commonest case, so
+ * it's tested inline before calling the library.  The argument is
+ * evaluated more than once.
+ */
+#define WC_ISASCIIPRINT(wc)	((wc) >= 0x20 && (wc) < 0x7f)
+#define WCWIDTH(wc)	(WC_ISASCIIPRINT(wc) ? 1 : LIB_WCWIDTH(wc))
 /*
  * Note WCWIDTH_WINT() takes wint_t, typically as a convchar_t.
  * It's written to use the wint_t from mb_metacharlenconv() without
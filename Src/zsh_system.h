@@ -349,6 +349,10 @@ struct timezone {
 # undef WSTOPSIG
 #endif
 
+#ifdef HAVE_SPAWN_H
+# include <spawn.h>
+#endif
+
 /* missing macros for wait/waitpid/wait3 */
 #ifndef WIFEXITED
 # define WIFEXITED(X) (((X)&0377)==0)